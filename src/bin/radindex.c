@@ -0,0 +1,333 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file radindex.c
+ * @brief Build memory mapped indexes of CSV and passwd style files.
+ *
+ * The indexes can be used in place of the original files by rlm_csv
+ * and rlm_passwd.
+ *
+ * @copyright 2019 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/util/base.h>
+#include <freeradius-devel/util/file_index.h>
+
+#ifdef HAVE_GETOPT_H
+#  include <getopt.h>
+#endif
+
+DIAG_OFF(unused-macros)
+#define INFO(fmt, ...)		if (fr_log_fp && (fr_debug_lvl > 0)) fprintf(fr_log_fp , fmt "\n", ## __VA_ARGS__)
+DIAG_ON(unused-macros)
+
+typedef enum {
+	RADINDEX_CSV = 0,
+	RADINDEX_PASSWD
+} radindex_type_t;
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: radindex [OPTS] <input> <output>\n");
+	fprintf(stderr, "  -t <type>        Input type, 'csv' (default) or 'passwd'.\n");
+	fprintf(stderr, "  -d <delimiter>   Field delimiter.  Defaults to ',' for csv, and ':' for passwd.\n");
+	fprintf(stderr, "  -k <field>       Field containing the key, counting from 0 (default 0).\n");
+	fprintf(stderr, "  -f <fields>      Number of fields in each line.  Required for passwd.\n");
+	fprintf(stderr, "                   Defaults to the number of fields in the first line for csv.\n");
+	fprintf(stderr, "  -l               The key field is a comma separated list of keys (passwd only).\n");
+	fprintf(stderr, "  -n               Ignore NIS-like lines beginning with '+' or '-' (passwd only).\n");
+	fprintf(stderr, "  -x               Print what's being done.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Build an index which rlm_csv or rlm_passwd can use in place of the input file\n");
+}
+
+/** Split a CSV line into fields
+ *
+ * @return the number of fields, or -1 on error.
+ */
+static int csv_split(char const **fields, int max_fields, char delimiter, char *buffer)
+{
+	char	*p, *q;
+	int	i;
+
+	for (p = buffer, i = 0; p != NULL; p = q, i++) {
+		if (!fr_csv_field(&q, p, delimiter)) return -1;
+
+		if (q) *(q++) = '\0';
+
+		if (i >= max_fields) return max_fields + 1;
+
+		fields[i] = p;
+	}
+
+	return i;
+}
+
+/** Split a passwd line into fields
+ *
+ * The same rules as rlm_passwd uses.  The last field gets the remainder of
+ * the line, and missing fields are NULL.
+ *
+ * @return the number of fields, or 0 for an empty line.
+ */
+static int passwd_split(char const **fields, int num_fields, char delimiter, char *buffer)
+{
+	size_t	len = strlen(buffer);
+	char	*p;
+	int	i = 0;
+
+	if (len && (buffer[len - 1] == '\n')) buffer[--len] = '\0';
+	if (len && (buffer[len - 1] == '\r')) buffer[--len] = '\0';
+	if (!len) return 0;
+
+	fields[i++] = buffer;
+	for (p = buffer; *p && (i < num_fields); p++) {
+		if (*p != delimiter) continue;
+
+		*p = '\0';
+		fields[i++] = p + 1;
+	}
+
+	for (; i < num_fields; i++) fields[i] = NULL;
+
+	return num_fields;
+}
+
+int main(int argc, char *argv[])
+{
+	int			c;
+	int			ret = EXIT_SUCCESS;
+	radindex_type_t		type = RADINDEX_CSV;
+	char			delimiter = '\0';
+	long			key_field = 0;
+	long			num_fields = 0;
+	bool			is_list = false;
+	bool			ignore_nis = false;
+	char const		*input, *output;
+
+	FILE			*fp = NULL;
+	char			buffer[8192];
+	int			lineno = 0;
+	uint64_t		num_records = 0, num_keys = 0;
+	char const		**fields = NULL;
+	fr_file_index_writer_t	*w = NULL;
+
+	TALLOC_CTX		*autofree = talloc_autofree_context();
+
+#ifndef NDEBUG
+	if (fr_fault_setup(autofree, getenv("PANIC_ACTION"), argv[0]) < 0) {
+		fr_perror("radindex");
+		exit(EXIT_FAILURE);
+	}
+#endif
+
+	while ((c = getopt(argc, argv, "t:d:k:f:lnxh")) != -1) switch (c) {
+		case 't':
+			if (strcmp(optarg, "csv") == 0) {
+				type = RADINDEX_CSV;
+			} else if (strcmp(optarg, "passwd") == 0) {
+				type = RADINDEX_PASSWD;
+			} else {
+				fprintf(stderr, "radindex: Unknown type '%s'\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case 'd':
+			if (!optarg[0] || optarg[1]) {
+				fprintf(stderr, "radindex: Delimiter must be one character long\n");
+				exit(EXIT_FAILURE);
+			}
+			delimiter = optarg[0];
+			break;
+
+		case 'k':
+			key_field = strtol(optarg, NULL, 10);
+			break;
+
+		case 'f':
+			num_fields = strtol(optarg, NULL, 10);
+			break;
+
+		case 'l':
+			is_list = true;
+			break;
+
+		case 'n':
+			ignore_nis = true;
+			break;
+
+		case 'x':
+			fr_log_fp = stdout;
+			fr_debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+			exit(EXIT_FAILURE);
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 2) {
+		usage();
+		exit(EXIT_FAILURE);
+	}
+	input = argv[0];
+	output = argv[1];
+
+	if (!delimiter) delimiter = (type == RADINDEX_CSV) ? ',' : ':';
+
+	if ((type == RADINDEX_PASSWD) && (num_fields <= 0)) {
+		fprintf(stderr, "radindex: The number of fields (-f) must be given for passwd files\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if ((type == RADINDEX_CSV) && (is_list || ignore_nis)) {
+		fprintf(stderr, "radindex: -l and -n are only valid for passwd files\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if ((num_fields < 0) || (num_fields > 1024) || (key_field < 0) || (num_fields && (key_field >= num_fields))) {
+		fprintf(stderr, "radindex: Invalid field numbers\n");
+		exit(EXIT_FAILURE);
+	}
+
+	fp = fopen(input, "r");
+	if (!fp) {
+		fprintf(stderr, "radindex: Failed opening %s: %s\n", input, fr_syserror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	while (fgets(buffer, sizeof(buffer), fp)) {
+		int		count;
+		int64_t		record;
+		char		*list, *next;
+
+		lineno++;
+
+		if (!strchr(buffer, '\n') && !feof(fp)) {
+			fprintf(stderr, "radindex: Line %d of %s is too long\n", lineno, input);
+			goto error;
+		}
+
+		if (type == RADINDEX_CSV) {
+			/*
+			 *	Size the records using the first line.
+			 */
+			if (!fields) {
+				char	copy[sizeof(buffer)];
+				char	const *tmp[1025];
+
+				if (!num_fields) {
+					strlcpy(copy, buffer, sizeof(copy));
+					num_fields = csv_split(tmp, 1024, delimiter, copy);
+					if (num_fields < 2) {
+						fprintf(stderr, "radindex: Line %d of %s must have at least a key "
+							"field and a data field\n", lineno, input);
+						goto error;
+					}
+					if (key_field >= num_fields) {
+						fprintf(stderr, "radindex: Invalid key field\n");
+						goto error;
+					}
+				}
+			}
+
+			if (!fields) fields = talloc_zero_array(autofree, char const *, num_fields + 1);
+
+			count = csv_split(fields, num_fields, delimiter, buffer);
+			if (count < 0) {
+				fprintf(stderr, "radindex: Malformed entry at line %d of %s\n", lineno, input);
+				goto error;
+			}
+			if (count != num_fields) {
+				fprintf(stderr, "radindex: Line %d of %s has %s fields\n", lineno, input,
+					count < num_fields ? "too few" : "too many");
+				goto error;
+			}
+		} else {
+			if (!fields) fields = talloc_zero_array(autofree, char const *, num_fields);
+
+			if (!*buffer || (*buffer == '\n')) continue;
+			if (ignore_nis && ((*buffer == '+') || (*buffer == '-'))) continue;
+
+			count = passwd_split(fields, num_fields, delimiter, buffer);
+			if (!count || !fields[key_field] || !*fields[key_field]) continue;
+		}
+
+		if (!w) {
+			w = fr_file_index_writer_alloc(autofree, num_fields, key_field);
+			if (!w) goto perror;
+		}
+
+		/*
+		 *	The key field in the record contains the whole
+		 *	list, each key is added separately.
+		 */
+		record = fr_file_index_record_add(w, fields);
+		if (record < 0) goto perror;
+		num_records++;
+
+		if (!is_list) {
+			if (fr_file_index_key_add(w, fields[key_field], record) < 0) goto perror;
+			num_keys++;
+			continue;
+		}
+
+		list = talloc_typed_strdup(autofree, fields[key_field]);
+		for (next = list; next; ) {
+			char *key = next;
+
+			next = strchr(key, ',');
+			if (next) *(next++) = '\0';
+
+			if (fr_file_index_key_add(w, key, record) < 0) goto perror;
+			num_keys++;
+		}
+		talloc_free(list);
+	}
+
+	if (ferror(fp)) {
+		fprintf(stderr, "radindex: Failed reading %s: %s\n", input, fr_syserror(errno));
+		goto error;
+	}
+
+	if (!w) {
+		fprintf(stderr, "radindex: %s contains no entries\n", input);
+		goto error;
+	}
+
+	if (fr_file_index_write(w, output) < 0) {
+	perror:
+		fr_perror("radindex");
+	error:
+		ret = EXIT_FAILURE;
+		goto finish;
+	}
+
+	INFO("Wrote %" PRIu64 " records, with %" PRIu64 " keys to %s", num_records, num_keys, output);
+
+finish:
+	if (fp) fclose(fp);
+
+	return ret;
+}
@@ -0,0 +1,5 @@
+TARGET		:= radindex
+SOURCES		:= radindex.c
+
+TGT_PREREQS	:= libfreeradius-util.a
+TGT_LDLIBS	:= $(LIBS)
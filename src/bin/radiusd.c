@@ -712,6 +712,15 @@ int main(int argc, char *argv[])
 	 */
 	if (log_global_init(&default_log, config->daemonize) < 0) EXIT_WITH_FAILURE;
 
+	/*
+	 *  Start the log writer thread.  This has to be done
+	 *  post-fork, as threads aren't inherited by the child.
+	 */
+	if (config->log_async && (fr_log_async_start(config->log_async_buffer_size) < 0)) {
+		PERROR("Failed starting log writer");
+		EXIT_WITH_FAILURE;
+	}
+
 	/*
 	 *	Start the network / worker threads.
 	 */
@@ -719,6 +728,12 @@ int main(int argc, char *argv[])
 		int networks = config->num_networks;
 		int workers = config->num_workers;
 		fr_event_list_t *el = NULL;
+		fr_network_overload_t overload = {
+			.shed = config->overload_shed,
+			.target = (config->overload_target.tv_sec * NANOSEC) + (config->overload_target.tv_usec * 1000),
+			.interval = (config->overload_interval.tv_sec * NANOSEC) + (config->overload_interval.tv_usec * 1000),
+			.priority = config->overload_priority
+		};
 
 		/*
 		 *	Single server mode: use the global event list.
@@ -732,7 +747,7 @@ int main(int argc, char *argv[])
 		}
 
 		sc = fr_schedule_create(NULL, el, &default_log, rad_debug_lvl,
-					networks, workers,
+					networks, workers, &overload,
 					thread_instantiate,
 					config->root_cs);
 		if (!sc) {
@@ -924,6 +939,11 @@ int main(int argc, char *argv[])
 	radius_event_free();		/* Free the requests */
 
 cleanup:
+	/*
+	 *  Flush any queued log messages, and stop the writer.
+	 */
+	fr_log_async_stop();
+
 	/*
 	 *  Frees request specific logging resources which is OK
 	 *  because all the requests will have been stopped.
@@ -31,8 +31,10 @@ RCSID("$Id$")
 #include <freeradius-devel/server/radmin.h>
 
 #include <freeradius-devel/util/dict.h>
+#include <freeradius-devel/util/metrics.h>
 #include <freeradius-devel/util/misc.h>
 #include <freeradius-devel/util/socket.h>
+#include <freeradius-devel/util/trace.h>
 
 #ifdef HAVE_LIBREADLINE
 
@@ -490,6 +492,95 @@ static int cmd_stats_memory(FILE *fp, FILE *fp_err, UNUSED void *ctx, fr_cmd_inf
 	return -1;
 }
 
+static int cmd_stats_metrics(FILE *fp, FILE *fp_err, UNUSED void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	char *text;
+
+	text = fr_metrics_openmetrics(NULL, "freeradius_");
+	if (!text) {
+		fprintf(fp_err, "Failed printing metrics - %s\n", fr_strerror());
+		return -1;
+	}
+
+	fputs(text, fp);
+	talloc_free(text);
+
+	return 0;
+}
+
+static void stats_latency_print(char const *set_name, char const *labels, fr_metric_def_t const *def,
+				uint64_t const *value, void *uctx)
+{
+	FILE		*fp = uctx;
+	uint64_t	count;
+	double		q[] = { 0.5, 0.9, 0.99 };
+	size_t		i;
+
+	if (def->type != FR_METRIC_HISTOGRAM) return;
+
+	count = value[FR_METRICS_HIST_BUCKETS];
+	if (!count) return;
+
+	fprintf(fp, "%s_%s{%s}\tcount %" PRIu64 "\tmean %" PRIu64 "us",
+		set_name, def->name, labels ? labels : "", count,
+		value[FR_METRICS_HIST_BUCKETS + 1] / count / 1000);
+
+	/*
+	 *	Quantiles are the upper bounds of their buckets.
+	 */
+	for (i = 0; i < NUM_ELEMENTS(q); i++) {
+		uint64_t bound = fr_metrics_quantile(value, q[i]);
+
+		if (bound == UINT64_MAX) {
+			fprintf(fp, "\tp%g >%" PRIu64 "us", q[i] * 100,
+				fr_metrics_bucket_bound(FR_METRICS_HIST_BUCKETS - 2) / 1000);
+		} else {
+			fprintf(fp, "\tp%g <=%" PRIu64 "us", q[i] * 100, bound / 1000);
+		}
+	}
+	fprintf(fp, "\n");
+}
+
+static int cmd_stats_latency(FILE *fp, UNUSED FILE *fp_err, UNUSED void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	fr_metrics_walk(stats_latency_print, fp);
+
+	return 0;
+}
+
+static int cmd_trace_start(UNUSED FILE *fp, FILE *fp_err, UNUSED void *ctx, fr_cmd_info_t const *info)
+{
+	int rate = atoi(info->argv[0]);
+
+	if (rate < 0) {
+		fprintf(fp_err, "Invalid sampling rate '%s'\n", info->argv[0]);
+		return -1;
+	}
+
+	fr_trace_start(fr_time(), rate);
+	return 0;
+}
+
+static int cmd_trace_stop(UNUSED FILE *fp, UNUSED FILE *fp_err, UNUSED void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	fr_trace_stop();
+	return 0;
+}
+
+static int cmd_trace_dump(FILE *fp, FILE *fp_err, UNUSED void *ctx, fr_cmd_info_t const *info)
+{
+	fr_trace_format_t format = FR_TRACE_FORMAT_CHROME;
+
+	if (strcmp(info->argv[0], "perf") == 0) format = FR_TRACE_FORMAT_PERF;
+
+	if (fr_trace_dump(fp, format) < 0) {
+		fprintf(fp_err, "Failed printing trace - %s\n", fr_strerror());
+		return -1;
+	}
+
+	return 0;
+}
+
 static int cmd_set_debug_level(UNUSED FILE *fp, FILE *fp_err, UNUSED void *ctx, fr_cmd_info_t const *info)
 {
 	int level = atoi(info->argv[0]);
@@ -903,6 +994,54 @@ static fr_cmd_table_t cmd_table[] = {
 		.read_only = true,
 	},
 
+	{
+		.parent = "stats",
+		.name = "metrics",
+		.func = cmd_stats_metrics,
+		.help = "Show the counters, gauges, and histograms of all threads, in the OpenMetrics format.",
+		.read_only = true,
+	},
+
+	{
+		.parent = "stats",
+		.name = "latency",
+		.func = cmd_stats_latency,
+		.help = "Show the count, mean, and p50 / p90 / p99 of each latency histogram, e.g. per worker stage, and per module.",
+		.read_only = true,
+	},
+
+	{
+		.name = "trace",
+		.help = "Record timestamped events for a sample of requests.",
+		.read_only = true
+	},
+
+	{
+		.parent = "trace",
+		.name = "start",
+		.syntax = "INTEGER",
+		.func = cmd_trace_start,
+		.help = "Trace one in every INTEGER requests.  If 0, only requests which call %{trace:yes} are traced.",
+		.read_only = false,
+	},
+
+	{
+		.parent = "trace",
+		.name = "stop",
+		.func = cmd_trace_stop,
+		.help = "Stop tracing new requests.  The recorded events are kept.",
+		.read_only = false,
+	},
+
+	{
+		.parent = "trace",
+		.name = "dump",
+		.syntax = "(chrome|perf)",
+		.func = cmd_trace_dump,
+		.help = "Show the recorded events as Chrome trace JSON, or in the same format as 'perf script'.",
+		.read_only = true,
+	},
+
 	{
 		.parent = "set",
 		.name = "debug",
@@ -86,6 +86,10 @@ struct eap_session_s {
 
 	bool		tls;				//!< Whether EAP method uses TLS.
 	bool		finished;			//!< Whether we consider this session complete.
+
+	bool		process_pending;		//!< The submodule yielded without pushing anything
+							///< onto the stack, and must be called again to
+							///< continue processing this round.
 };
 
 /** Interface exported by EAP submodules
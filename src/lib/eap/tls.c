@@ -79,6 +79,7 @@ FR_NAME_NUMBER const eap_tls_status_table[] = {
 	{ "established",		EAP_TLS_ESTABLISHED },
 	{ "fail",			EAP_TLS_FAIL },
 	{ "handled",			EAP_TLS_HANDLED },
+	{ "yield",			EAP_TLS_YIELD },
 
 	{ "start",			EAP_TLS_START_SEND },
 	{ "request",			EAP_TLS_RECORD_SEND },
@@ -808,6 +809,7 @@ ignore_length:
  *	- EAP_TLS_HANDLED if we need to send an additional request to the peer.
  *	- EAP_TLS_ESTABLISHED if the handshake completed successfully, and there's
  *	  no more data to send.
+ *	- EAP_TLS_YIELD if an async engine is processing a handshake step.
  */
 static eap_tls_status_t eap_tls_handshake(eap_session_t *eap_session)
 {
@@ -824,6 +826,15 @@ static eap_tls_status_t eap_tls_handshake(eap_session_t *eap_session)
 		return EAP_TLS_FAIL;
 	}
 
+	/*
+	 *	The handshake step was paused, rlm_eap will
+	 *	call the submodule again when it completes.
+	 */
+	if (tls_session_async_pending(tls_session)) {
+		eap_session->process_pending = true;
+		return EAP_TLS_YIELD;
+	}
+
 	/*
 	 *	FIXME: return success/fail.
 	 *
@@ -881,6 +892,7 @@ static eap_tls_status_t eap_tls_handshake(eap_session_t *eap_session)
  * @return
  *	- EAP_TLS_ESTABLISHED
  *	- EAP_TLS_HANDLED
+ *	- EAP_TLS_YIELD
  */
 eap_tls_status_t eap_tls_process(eap_session_t *eap_session)
 {
@@ -897,6 +909,19 @@ eap_tls_status_t eap_tls_process(eap_session_t *eap_session)
 
 	if (!request) return EAP_TLS_FAIL;
 
+#ifdef SSL_MODE_ASYNC
+	/*
+	 *	We were resumed after an async handshake step
+	 *	completed.  The record has already been fed to
+	 *	OpenSSL, so just continue the handshake.
+	 */
+	if (SSL_waiting_for_async(tls_session->ssl)) {
+		RDEBUG2("Continuing EAP-TLS after async handshake step");
+		status = eap_tls_handshake(eap_session);
+		goto done;
+	}
+#endif
+
 	RDEBUG2("Continuing EAP-TLS");
 
 	/*
@@ -948,13 +973,12 @@ eap_tls_status_t eap_tls_process(eap_session_t *eap_session)
 		}
 
 		/*
-		 *	Update the dirty_in buffer (data for reading by OpenSSL)
+		 *	Write the fragment directly to OpenSSL's input BIO
 		 *
-		 *	This buffer will contain partial data when M bit is set, and should
-		 * 	should only be reinitialized when M bit is not set.
+		 *	The BIO will contain partial data when M bit is set.  OpenSSL
+		 *	isn't asked to read it until we have the complete record.
 		 */
-		if ((tls_session->record_from_buff)(&tls_session->dirty_in, data, data_len) != data_len) {
-			REDEBUG("Exceeded maximum record size");
+		if (tls_session_recv_fragment(request, tls_session, data, data_len) < 0) {
 			status = EAP_TLS_FAIL;
 			goto done;
 		}
@@ -87,6 +87,23 @@ typedef void (*fr_app_entry_point_set_t)(void const *instance, REQUEST *request)
  */
 typedef int (*fr_app_priority_get_t)(void const *instance, uint8_t const *buffer, size_t buflen);
 
+/** Find the value used to send related packets to the same worker
+ *
+ * Called by the network thread for packets read from the network, and for
+ * replies received from workers.  If a reply has an affinity key, subsequent
+ * packets with the same key are sent to the worker which produced the reply.
+ *
+ * @param[in] instance	of the #fr_app_t.
+ * @param[out] key	Where to write a pointer to the key.  Must point into buffer.
+ * @param[in] buffer	raw packet
+ * @param[in] buflen	length of the packet
+ * @return
+ *	- 0 if the packet has no affinity.
+ *	- >0 the length of the key.
+ */
+typedef size_t (*fr_app_affinity_get_t)(void const *instance, uint8_t const **key,
+					uint8_t const *buffer, size_t buflen);
+
 /** Called by the network thread to pass an event list for the module to use for timer events
  */
 typedef void (*fr_app_event_list_set_t)(fr_listen_t *li, fr_event_list_t *el, void *nr);
@@ -128,6 +145,9 @@ typedef struct {
 							///< change based on the packet we received.
 
 	fr_app_priority_get_t		priority;	//!< Assign a priority to the packet.
+
+	fr_app_affinity_get_t		affinity;	//!< Find the value used to send related packets
+							///< to the same worker.  May be NULL.
 } fr_app_t;
 
 /** Public structure describing an application (protocol) specialisation
@@ -27,6 +27,7 @@ RCSID("$Id$")
 #include <freeradius-devel/io/channel.h>
 #include <freeradius-devel/io/control.h>
 #include <freeradius-devel/util/log.h>
+#include <freeradius-devel/util/probe.h>
 #include <freeradius-devel/server/rad_assert.h>
 
 /*
@@ -143,14 +144,6 @@ struct fr_channel_s {
 	fr_channel_end_t	end[2];		//!< Two ends of the channel.
 };
 
-const FR_NAME_NUMBER channel_packet_priority[] = {
-	{ "now",	PRIORITY_NOW },
-	{ "high",	PRIORITY_HIGH },
-	{ "normal",	PRIORITY_NORMAL },
-	{ "low",	PRIORITY_LOW },
-	{ NULL,		-1 }
-};
-
 
 /** Create a new channel
  *
@@ -313,6 +306,7 @@ int fr_channel_send_request(fr_channel_t *ch, fr_channel_data_t *cd)
 
 	master->sequence = sequence;
 	message_interval = when - master->last_write;
+	FR_PROBE4(channel_send_request, ch, sequence, cd->m.data_size, cd->priority);
 
 	if (!master->message_interval) {
 		master->message_interval = message_interval;
@@ -51,6 +51,7 @@ typedef struct fr_listen fr_listen_t;
 #include <freeradius-devel/io/message.h>
 #include <freeradius-devel/io/control.h>
 #include <freeradius-devel/io/base.h>
+#include <freeradius-devel/server/request.h>
 #include <freeradius-devel/util/dlist.h>
 
 #include <sys/types.h>
@@ -112,6 +113,8 @@ typedef struct {
 			fr_time_t		cpu_time;	//!<  total CPU time, including predicted work, (only worker -> network)
 			fr_time_t		processing_time;  //!< actual processing time for this packet (only worker -> network)
 			fr_time_t		request_time;	//!< timestamp of the request packet
+			fr_time_t		queue_time;	//!< how long the request waited before the worker
+								//!< started on it (only worker -> network)
 	        } reply;
 	};
 
@@ -124,13 +127,6 @@ typedef struct {
 	fr_listen_t	*listen;				//!< for tracking packet transport, etc.
 } fr_channel_data_t;
 
-#define PRIORITY_NOW    (1 << 16)
-#define PRIORITY_HIGH   (1 << 15)
-#define PRIORITY_NORMAL (1 << 14)
-#define PRIORITY_LOW    (1 << 13)
-
-extern const FR_NAME_NUMBER channel_packet_priority[];
-
 fr_channel_t *fr_channel_create(TALLOC_CTX *ctx, fr_control_t *master, fr_control_t *worker, bool same) CC_HINT(nonnull);
 
 int fr_channel_send_request(fr_channel_t *ch, fr_channel_data_t *cm) CC_HINT(nonnull);
@@ -49,6 +49,7 @@ struct fr_async_t {
 
 	fr_time_t		recv_time;
 	fr_time_t		*original_recv_time;
+	fr_time_t		queue_time;	//!< how long the request waited for the worker
 	fr_event_list_t		*el;
 
 	fr_time_tracking_t	tracking;
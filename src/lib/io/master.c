@@ -344,6 +344,8 @@ static RADCLIENT *radclient_clone(TALLOC_CTX *ctx, RADCLIENT const *parent)
 	COPY_FIELD(tls_required);
 #endif
 
+	if (client_secret_precompute(c) < 0) goto error;
+
 	return c;
 
 	/*
@@ -1641,8 +1643,9 @@ static void mod_event_list_set(fr_listen_t *li, fr_event_list_t *el, void *nr)
 	fr_io_instance_t const *inst;
 	fr_io_connection_t *connection;
 	fr_io_thread_t *thread;
+	fr_listen_t *child;
 
-	get_inst(li, &inst, &thread, &connection, NULL);
+	get_inst(li, &inst, &thread, &connection, &child);
 
 	/*
 	 *	We're not doing IO, so there are no timers for
@@ -1650,6 +1653,12 @@ static void mod_event_list_set(fr_listen_t *li, fr_event_list_t *el, void *nr)
 	 */
 	if (!inst->submodule) return;
 
+	/*
+	 *	The child may need its own events, e.g. to write
+	 *	replies which it doesn't send to the workers.
+	 */
+	if (inst->app_io->event_list_set) inst->app_io->event_list_set(child, el, nr);
+
 	/*
 	 *	No dynamic clients AND no packet cleanups?  We don't
 	 *	need timers.
@@ -26,8 +26,13 @@ RCSID("$Id$")
 
 #include <talloc.h>
 
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
 #include <freeradius-devel/util/event.h>
+#include <freeradius-devel/util/hash.h>
+#include <freeradius-devel/util/metrics.h>
 #include <freeradius-devel/util/misc.h>
+#include <freeradius-devel/util/probe.h>
 #include <freeradius-devel/util/rand.h>
 #include <freeradius-devel/util/rbtree.h>
 #include <freeradius-devel/util/thread_local.h>
@@ -55,6 +60,19 @@ RCSID("$Id$")
 
 #define MAX_WORKERS 64
 
+/*
+ *	Limits for the table mapping affinity keys (e.g. State) to workers.
+ */
+#define MAX_AFFINITY_KEY	64
+#define MAX_AFFINITY_ENTRIES	65536
+#define AFFINITY_LIFETIME	(30 * (fr_time_t) NANOSEC)
+
+/*
+ *	Default overload detection, from CoDel.
+ */
+#define OVERLOAD_TARGET		(5 * (fr_time_t) (NANOSEC / 1000))
+#define OVERLOAD_INTERVAL	(100 * (fr_time_t) (NANOSEC / 1000))
+
 fr_thread_local_setup(fr_ring_buffer_t *, fr_network_rb)	/* macro */
 
 typedef struct {
@@ -69,11 +87,28 @@ typedef struct {
 	fr_time_t		cpu_time;		//!< how much CPU time this worker has spent
 	fr_time_t		predicted;		//!< predicted processing time for one packet
 
+	fr_network_overload_state_t	overload;	//!< whether the worker is overloaded
+
 	fr_channel_t		*channel;		//!< channel to the worker
 	fr_worker_t		*worker;		//!< worker pointer
 	fr_io_stats_t		stats;
 } fr_network_worker_t;
 
+/** Which worker handled the previous packet with a given affinity key
+ *
+ * This only keeps a conversation on one worker, so its data stays in that
+ * worker's CPU cache.  Session data (e.g. EAP sessions) is still frozen into
+ * and thawed from the shared state tree, which is locked on every round.
+ */
+typedef struct {
+	fr_network_worker_t	*worker;		//!< which produced the reply carrying the key
+	fr_time_t		expires;		//!< when the entry is no longer used
+	fr_dlist_t		entry;			//!< in the LRU list
+
+	size_t			key_len;
+	uint8_t			key[MAX_AFFINITY_KEY];
+} fr_network_affinity_t;
+
 typedef struct {
 	fr_network_t		*nr;			//!< O(N) issues in talloc
 	int			number;			//!< unique ID
@@ -128,6 +163,9 @@ struct fr_network_t {
 	fr_heap_t		*replies;		//!< replies from the worker, ordered by priority / origin time
 
 	fr_io_stats_t		stats;
+	fr_metrics_shard_t	*metrics;		//!< this network thread's copy of the "network" metrics
+
+	fr_network_overload_t	overload;		//!< when workers are overloaded, and what to discard
 
 	rbtree_t		*sockets;		//!< list of sockets we're managing, ordered by the listener
 	rbtree_t		*sockets_by_num;       	//!< ordered by number;
@@ -137,9 +175,33 @@ struct fr_network_t {
 	int			num_sockets;		//!< actually a counter...
 
 	fr_network_worker_t	*workers[MAX_WORKERS]; 	//!< each worker
+
+	fr_hash_table_t		*affinity;		//!< affinity keys, mapped to workers
+	fr_dlist_head_t		affinity_lru;		//!< most recently used entries at the head
 };
 
 static void fr_network_post_event(fr_event_list_t *el, struct timeval *now, void *uctx);
+
+/*
+ *	Indexes into network_metrics[]
+ */
+enum {
+	NETWORK_METRIC_IN = 0,
+	NETWORK_METRIC_OUT,
+	NETWORK_METRIC_DROPPED,
+	NETWORK_METRIC_SHED,
+	NETWORK_METRIC_OVERLOADS,
+	NETWORK_METRIC_OVERLOADED
+};
+
+static fr_metric_def_t const network_metrics[] = {
+	[NETWORK_METRIC_IN]		= { .name = "packets_in", .help = "Packets read from the network", .type = FR_METRIC_COUNTER },
+	[NETWORK_METRIC_OUT]		= { .name = "packets_out", .help = "Packets written to the network", .type = FR_METRIC_COUNTER },
+	[NETWORK_METRIC_DROPPED]	= { .name = "dropped", .help = "Packets which could not be sent to a worker", .type = FR_METRIC_COUNTER },
+	[NETWORK_METRIC_SHED]		= { .name = "shed", .help = "Low priority packets discarded because the worker was overloaded", .type = FR_METRIC_COUNTER },
+	[NETWORK_METRIC_OVERLOADS]	= { .name = "overloads", .help = "Times a worker became overloaded", .type = FR_METRIC_COUNTER },
+	[NETWORK_METRIC_OVERLOADED]	= { .name = "overloaded_workers", .help = "Workers which are currently overloaded", .type = FR_METRIC_GAUGE },
+};
 static int fr_network_pre_event(void *ctx, struct timeval *wake);
 
 static int reply_cmp(void const *one, void const *two)
@@ -147,7 +209,11 @@ static int reply_cmp(void const *one, void const *two)
 	fr_channel_data_t const *a = one, *b = two;
 	int ret;
 
-	ret = (a->priority > b->priority) - (a->priority < b->priority);
+	/*
+	 *	The heap returns the smallest entry first, so larger
+	 *	priorities have to sort first.
+	 */
+	ret = (a->priority < b->priority) - (a->priority > b->priority);
 	if (ret != 0) return ret;
 
 	return (a->m.when > b->m.when) - (a->m.when < b->m.when);
@@ -158,7 +224,11 @@ static int waiting_cmp(void const *one, void const *two)
 	fr_channel_data_t const *a = one, *b = two;
 	int ret;
 
-	ret = (a->priority > b->priority) - (a->priority < b->priority);
+	/*
+	 *	The heap returns the smallest entry first, so larger
+	 *	priorities have to sort first.
+	 */
+	ret = (a->priority < b->priority) - (a->priority > b->priority);
 	if (ret != 0) return ret;
 
 	return (a->reply.request_time > b->reply.request_time) - (a->reply.request_time < b->reply.request_time);
@@ -210,9 +280,222 @@ static inline fr_ring_buffer_t *fr_network_rb_init(void)
 	return rb;
 }
 
+static uint32_t affinity_hash(void const *data)
+{
+	fr_network_affinity_t const *a = data;
+
+	return fr_hash(a->key, a->key_len);
+}
+
+static int affinity_cmp(void const *one, void const *two)
+{
+	fr_network_affinity_t const *a = one;
+	fr_network_affinity_t const *b = two;
+
+	if (a->key_len < b->key_len) return -1;
+	if (a->key_len > b->key_len) return +1;
+
+	return memcmp(a->key, b->key, a->key_len);
+}
+
+static void affinity_free(fr_network_t *nr, fr_network_affinity_t *a)
+{
+	fr_hash_table_delete(nr->affinity, a);
+	fr_dlist_remove(&nr->affinity_lru, a);
+	talloc_free(a);
+}
+
+/** Get the affinity key for a packet, if the application supports it
+ *
+ */
+static size_t affinity_key(fr_network_affinity_t *find, fr_channel_data_t *cd)
+{
+	fr_listen_t const *li = cd->listen;
+	uint8_t const *key;
+	size_t key_len;
+
+	if (!li || !li->app || !li->app->affinity) return 0;
+
+	key_len = li->app->affinity(li->app_instance, &key, cd->m.data, cd->m.data_size);
+	if (!key_len || (key_len > MAX_AFFINITY_KEY)) return 0;
+
+	memcpy(find->key, key, key_len);
+	find->key_len = key_len;
+
+	return key_len;
+}
+
+/** Find the worker which handled the previous packet in a conversation
+ *
+ *  Packets in a multi-round conversation (e.g. EAP) are sent to the
+ *  same worker, so that the session state is hot in that worker's
+ *  cache.  If the worker is gone, or the entry has expired, we fall
+ *  back to normal load balancing.
+ */
+static fr_network_worker_t *affinity_find(fr_network_t *nr, fr_channel_data_t *cd)
+{
+	fr_network_affinity_t find, *a;
+	fr_network_worker_t *worker;
+
+	if (!affinity_key(&find, cd)) return NULL;
+
+	a = fr_hash_table_finddata(nr->affinity, &find);
+	if (!a) return NULL;
+
+	/*
+	 *	The entry is only used once.  The reply to this
+	 *	packet will carry a new key.
+	 */
+	worker = (a->expires > fr_time()) ? a->worker : NULL;
+	affinity_free(nr, a);
+
+	return worker;
+}
+
+/** Remember which worker produced a reply
+ *
+ */
+static void affinity_update(fr_network_t *nr, fr_network_worker_t *worker, fr_channel_data_t *cd)
+{
+	fr_network_affinity_t find, *a;
+	fr_time_t now;
+
+	if (!affinity_key(&find, cd)) return;
+
+	now = fr_time();
+
+	a = fr_hash_table_finddata(nr->affinity, &find);
+	if (a) {
+		a->worker = worker;
+		a->expires = now + AFFINITY_LIFETIME;
+		fr_dlist_remove(&nr->affinity_lru, a);
+		fr_dlist_insert_head(&nr->affinity_lru, a);
+		return;
+	}
+
+	/*
+	 *	Expire old entries, and make room for the new one.
+	 */
+	while ((a = fr_dlist_tail(&nr->affinity_lru)) &&
+	       ((a->expires <= now) || (fr_hash_table_num_elements(nr->affinity) >= MAX_AFFINITY_ENTRIES))) {
+		affinity_free(nr, a);
+	}
+
+	a = talloc_zero(nr, fr_network_affinity_t);
+	if (!a) return;
+
+	memcpy(a->key, find.key, find.key_len);
+	a->key_len = find.key_len;
+	a->worker = worker;
+	a->expires = now + AFFINITY_LIFETIME;
+
+	if (!fr_hash_table_insert(nr->affinity, a)) {
+		talloc_free(a);
+		return;
+	}
+	fr_dlist_insert_head(&nr->affinity_lru, a);
+}
+
 #define IALPHA (8)
 #define RTT(_old, _new) ((_new + ((IALPHA - 1) * _old)) / IALPHA)
 
+/** Update the overload state of a worker, using the time a packet waited in its queue
+ *
+ *  This is the CoDel test.  A worker is overloaded when the queue time
+ *  stays above target for an interval, i.e. when there is a standing
+ *  queue, rather than a short burst.  It stops being overloaded as soon
+ *  as a packet gets through the queue in less than target.
+ *
+ *  Higher priority packets jump the queue, so their queue times don't
+ *  show the backlog.  Only packets which may be shed should be passed
+ *  to this function.
+ *
+ * @param[in] state	of the worker.
+ * @param[in] overload	configuration.
+ * @param[in] queue_time of the packet.
+ * @param[in] now	the current time.
+ * @return
+ *	- 1 if the worker has become overloaded.
+ *	- -1 if the worker is no longer overloaded.
+ *	- 0 if nothing has changed.
+ */
+int fr_network_overload_update(fr_network_overload_state_t *state, fr_network_overload_t const *overload,
+			       fr_time_t queue_time, fr_time_t now)
+{
+	state->last_sample = now;
+
+	if (queue_time < overload->target) {
+		state->first_above = 0;
+		if (!state->overloaded) return 0;
+
+		state->overloaded = false;
+		return -1;
+	}
+
+	if (state->overloaded) return 0;
+
+	if (!state->first_above) {
+		state->first_above = now + overload->interval;
+		return 0;
+	}
+
+	if (now < state->first_above) return 0;
+
+	state->overloaded = true;
+	return 1;
+}
+
+/** See if a packet should be discarded instead of being sent to an overloaded worker
+ *
+ * @param[in] state	of the worker.
+ * @param[in] overload	configuration.
+ * @param[in] priority	of the packet.
+ * @param[in] now	the current time.
+ * @return true if the packet should be discarded.
+ */
+bool fr_network_overload_shed(fr_network_overload_state_t *state, fr_network_overload_t const *overload,
+			      uint32_t priority, fr_time_t now)
+{
+	if (!state->overloaded || !overload->shed) return false;
+
+	if (priority > overload->priority) return false;
+
+	/*
+	 *	We're shedding everything which would tell us that
+	 *	the queue has drained.  If we haven't heard anything
+	 *	for an interval, let a packet through to find out.
+	 */
+	if ((state->last_sample + overload->interval) < now) {
+		state->last_sample = now;
+		return false;
+	}
+
+	return true;
+}
+
+/** Update the overload state of a worker, and log any change
+ *
+ */
+static void overload_update(fr_network_t *nr, fr_network_worker_t *worker, fr_time_t queue_time)
+{
+	switch (fr_network_overload_update(&worker->overload, &nr->overload, queue_time, fr_time())) {
+	case 1:
+		fr_metrics_inc(nr->metrics, NETWORK_METRIC_OVERLOADS);
+		fr_metrics_inc(nr->metrics, NETWORK_METRIC_OVERLOADED);
+		fr_log(nr->log, L_WARN, "Worker is overloaded, packets have waited more than %" PRIu64 "us in its queue",
+		       nr->overload.target / 1000);
+		break;
+
+	case -1:
+		fr_metrics_dec(nr->metrics, NETWORK_METRIC_OVERLOADED);
+		fr_log(nr->log, L_INFO, "Worker is no longer overloaded");
+		break;
+
+	default:
+		break;
+	}
+}
+
 /** Callback which handles a message being received on the network side.
  *
  * @param[in] ctx the network
@@ -238,6 +521,10 @@ static void fr_network_recv_reply(void *ctx, fr_channel_t *ch, fr_channel_data_t
 		worker->predicted = RTT(worker->predicted, cd->reply.processing_time);
 	}
 
+	if (cd->priority <= nr->overload.priority) overload_update(nr, worker, cd->reply.queue_time);
+
+	affinity_update(nr, worker, cd);
+
 	(void) fr_heap_insert(nr->replies, cd);
 }
 
@@ -297,8 +584,12 @@ static void fr_network_channel_callback(void *ctx, void const *data, size_t data
  *
  * @param nr the network
  * @param cd the message we've received
+ * @return
+ *	- 0 on success.
+ *	- 1 if the message was discarded, because the worker is overloaded.
+ *	- -1 on failure.
  */
-static bool fr_network_send_request(fr_network_t *nr, fr_channel_data_t *cd)
+static int fr_network_send_request(fr_network_t *nr, fr_channel_data_t *cd)
 {
 	fr_network_worker_t *worker;
 
@@ -307,6 +598,9 @@ static bool fr_network_send_request(fr_network_t *nr, fr_channel_data_t *cd)
 	if (nr->num_workers == 1) {
 		worker = nr->workers[0];
 
+	} else if ((worker = affinity_find(nr, cd)) != NULL) {
+		/* send it to the same worker as the previous packet */
+
 	} else {
 		uint32_t one, two;
 
@@ -320,7 +614,13 @@ static bool fr_network_send_request(fr_network_t *nr, fr_channel_data_t *cd)
 			} while (two == one);
 		}
 
-		if (nr->workers[one]->cpu_time < nr->workers[two]->cpu_time) {
+		/*
+		 *	Avoid overloaded workers, and then pick the
+		 *	one with the least work.
+		 */
+		if (nr->workers[one]->overload.overloaded != nr->workers[two]->overload.overloaded) {
+			worker = nr->workers[one]->overload.overloaded ? nr->workers[two] : nr->workers[one];
+		} else if (nr->workers[one]->cpu_time < nr->workers[two]->cpu_time) {
 			worker = nr->workers[one];
 		} else {
 			worker = nr->workers[two];
@@ -329,6 +629,16 @@ static bool fr_network_send_request(fr_network_t *nr, fr_channel_data_t *cd)
 
 	(void) talloc_get_type_abort(worker, fr_network_worker_t);
 
+	/*
+	 *	Discard low priority packets early, instead of letting
+	 *	them wait until the NAS has given up on them, and
+	 *	delay the high priority packets.
+	 */
+	if (fr_network_overload_shed(&worker->overload, &nr->overload, cd->priority, fr_time())) {
+		worker->stats.dropped++;
+		return 1;
+	}
+
 	/*
 	 *	Send the message to the channel.  If we fail, drop the
 	 *	packet.  The only reason for failure is that the
@@ -338,7 +648,7 @@ static bool fr_network_send_request(fr_network_t *nr, fr_channel_data_t *cd)
 	 */
 	if (fr_channel_send_request(worker->channel, cd) < 0) {
 		worker->stats.dropped++;
-		return false;
+		return -1;
 	}
 
 	worker->stats.in++;
@@ -351,7 +661,7 @@ static bool fr_network_send_request(fr_network_t *nr, fr_channel_data_t *cd)
 	 */
 	worker->cpu_time += worker->predicted;
 
-	return true;
+	return 0;
 }
 
 
@@ -472,6 +782,7 @@ next_message:
 
 	DEBUG3("Network received packet size %zd", data_size);
 	nr->stats.in++;
+	fr_metrics_inc(nr->metrics, NETWORK_METRIC_IN);
 	s->stats.in++;
 
 	/*
@@ -484,6 +795,7 @@ next_message:
 	cd->m.when = fr_time();
 	cd->listen = s->listen;
 	cd->request.recv_time = recv_time;
+	FR_PROBE4(network_read, sockfd, data_size, cd->m.data, cd->priority);
 
 	/*
 	 *	Nothing in the buffer yet.  Allocate room for one
@@ -508,16 +820,28 @@ next_message:
 		}
 	}
 
-	if (!fr_network_send_request(nr, cd)) {
+	switch (fr_network_send_request(nr, cd)) {
+	case -1:
 		fr_log(nr->log, L_ERR, "Failed sending packet to worker");
 		fr_message_done(&cd->m);
 		nr->stats.dropped++;
+		fr_metrics_inc(nr->metrics, NETWORK_METRIC_DROPPED);
 		s->stats.dropped++;
-	} else {
+		break;
+
+	case 1:
+		DEBUG3("Discarding low priority packet, the worker is overloaded");
+		fr_message_done(&cd->m);
+		fr_metrics_inc(nr->metrics, NETWORK_METRIC_SHED);
+		s->stats.dropped++;
+		break;
+
+	default:
 		/*
 		 *	One more packet sent to a worker.
 		 */
 		s->outstanding++;
+		break;
 	}
 
 	/*
@@ -665,6 +989,7 @@ static void fr_network_write(UNUSED fr_event_list_t *el, UNUSED int sockfd, UNUS
 		 */
 		fr_message_done(&cd->m);
 		nr->stats.out++;
+		fr_metrics_inc(nr->metrics, NETWORK_METRIC_OUT);
 		s->stats.out++;
 
 		/*
@@ -977,11 +1302,14 @@ static void fr_network_evfilt_user(UNUSED int kq, UNUSED struct kevent const *ke
  * @param[in] el the event list
  * @param[in] logger the destination for all logging messages
  * @param[in] lvl log level
+ * @param[in] overload when workers are overloaded, and what to discard.  Zero
+ *	fields get the defaults.
  * @return
  *	- NULL on error
  *	- fr_network_t on success
  */
-fr_network_t *fr_network_create(TALLOC_CTX *ctx, fr_event_list_t *el, fr_log_t const *logger, fr_log_lvl_t lvl)
+fr_network_t *fr_network_create(TALLOC_CTX *ctx, fr_event_list_t *el, fr_log_t const *logger, fr_log_lvl_t lvl,
+				fr_network_overload_t const *overload)
 {
 	fr_network_t *nr;
 
@@ -997,6 +1325,17 @@ fr_network_t *fr_network_create(TALLOC_CTX *ctx, fr_event_list_t *el, fr_log_t c
 	nr->max_workers = MAX_WORKERS;
 	nr->num_workers = 0;
 
+	if (overload) nr->overload = *overload;
+	if (!nr->overload.target) nr->overload.target = OVERLOAD_TARGET;
+	if (!nr->overload.interval) nr->overload.interval = OVERLOAD_INTERVAL;
+	if (!nr->overload.priority) nr->overload.priority = PRIORITY_LOW;
+
+	nr->metrics = fr_metrics_shard_alloc(nr, "network", NULL, network_metrics, NUM_ELEMENTS(network_metrics));
+	if (!nr->metrics) {
+		talloc_free(nr);
+		return NULL;
+	}
+
 	nr->kq = fr_event_list_kq(nr->el);
 	rad_assert(nr->kq >= 0);
 
@@ -1082,6 +1421,13 @@ fr_network_t *fr_network_create(TALLOC_CTX *ctx, fr_event_list_t *el, fr_log_t c
 		goto fail2;
 	}
 
+	nr->affinity = fr_hash_table_create(nr, affinity_hash, affinity_cmp, NULL);
+	if (!nr->affinity) {
+		fr_strerror_printf_push("Failed creating affinity table");
+		goto fail2;
+	}
+	fr_dlist_talloc_init(&nr->affinity_lru, fr_network_affinity_t, entry);
+
 	if (fr_event_pre_insert(nr->el, fr_network_pre_event, nr) < 0) {
 		fr_strerror_printf("Failed adding pre-check to event list");
 		goto fail2;
@@ -1517,6 +1863,8 @@ static int cmd_stats_self(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cm
 	fprintf(fp, "count.out\t%" PRIu64 "\n", nr->stats.out);
 	fprintf(fp, "count.dup\t%" PRIu64 "\n", nr->stats.dup);
 	fprintf(fp, "count.dropped\t%" PRIu64 "\n", nr->stats.dropped);
+	fprintf(fp, "count.shed\t%" PRIu64 "\n", fr_metrics_value(nr->metrics, NETWORK_METRIC_SHED));
+	fprintf(fp, "count.overloaded\t%" PRIu64 "\n", fr_metrics_value(nr->metrics, NETWORK_METRIC_OVERLOADED));
 	fprintf(fp, "count.sockets\t%u\n", rbtree_num_elements(nr->sockets));
 
 	return 0;
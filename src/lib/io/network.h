@@ -25,12 +25,28 @@
  */
 RCSIDH(network_h, "$Id$")
 
+#include <freeradius-devel/io/time.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 typedef struct fr_network_t fr_network_t;
 
+/** When a worker is overloaded, and what to do about it
+ *
+ *  A worker is overloaded when the time packets wait in its queue
+ *  stays above "target" for "interval".
+ *
+ *  Defined before the includes below, as schedule.h needs it.
+ */
+typedef struct {
+	bool		shed;			//!< Discard packets sent to overloaded workers.
+	fr_time_t	target;			//!< Acceptable time in the worker queue.
+	fr_time_t	interval;		//!< How long the queue time must be above target.
+	uint32_t	priority;		//!< Packets with this priority or lower may be discarded.
+} fr_network_overload_t;
+
 #ifdef __cplusplus
 }
 #endif
@@ -42,7 +58,23 @@ typedef struct fr_network_t fr_network_t;
 extern "C" {
 #endif
 
-fr_network_t *fr_network_create(TALLOC_CTX *ctx, fr_event_list_t *el, fr_log_t const *logger, fr_log_lvl_t lvl) CC_HINT(nonnull(2,3));
+/** Overload state of one worker
+ *
+ */
+typedef struct {
+	fr_time_t	first_above;		//!< When the queue time will have been above
+						//!< target for an interval, or 0.
+	fr_time_t	last_sample;		//!< When we last saw the queue time of a sheddable packet.
+	bool		overloaded;		//!< Queue time has stayed above target.
+} fr_network_overload_state_t;
+
+int fr_network_overload_update(fr_network_overload_state_t *state, fr_network_overload_t const *overload,
+			       fr_time_t queue_time, fr_time_t now) CC_HINT(nonnull);
+bool fr_network_overload_shed(fr_network_overload_state_t *state, fr_network_overload_t const *overload,
+			      uint32_t priority, fr_time_t now) CC_HINT(nonnull);
+
+fr_network_t *fr_network_create(TALLOC_CTX *ctx, fr_event_list_t *el, fr_log_t const *logger, fr_log_lvl_t lvl,
+				fr_network_overload_t const *overload) CC_HINT(nonnull(2,3));
 void fr_network_exit(fr_network_t *nr) CC_HINT(nonnull);
 int fr_network_destroy(fr_network_t *nr) CC_HINT(nonnull);
 void fr_network(fr_network_t *nr) CC_HINT(nonnull);
@@ -129,6 +129,8 @@ struct fr_schedule_t {
 	int		max_networks;		//!< number of network threads
 	int		max_workers;		//!< max number of worker threads
 
+	fr_network_overload_t	overload;	//!< overload detection for the network threads
+
 	int		num_workers;		//!< number of worker threads
 	int		num_workers_exited;	//!< number of exited workers
 
@@ -274,7 +276,7 @@ static void *fr_schedule_network_thread(void *arg)
 		goto fail;
 	}
 
-	sn->nr = fr_network_create(ctx, el, sc->log, sc->lvl);
+	sn->nr = fr_network_create(ctx, el, sc->log, sc->lvl, &sc->overload);
 	if (!sn->nr) {
 		fr_log(sc->log, L_ERR, "Network %d - Failed creating network: %s", sn->id, fr_strerror());
 		goto fail;
@@ -354,6 +356,8 @@ int fr_schedule_pthread_create(pthread_t *thread, void *(*func)(void *), void *a
  * @param[in] lvl		log level.
  * @param[in] max_networks	number of network threads.
  * @param[in] max_workers	number of worker threads.
+ * @param[in] overload		when workers are overloaded, and what to discard.
+ *				NULL to detect overload, without discarding packets.
  * @param[in] worker_thread_instantiate		callback for new worker threads.
  * @param[in] worker_thread_ctx	context for callback.
  * @return
@@ -362,7 +366,7 @@ int fr_schedule_pthread_create(pthread_t *thread, void *(*func)(void *), void *a
  */
 fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el,
 				  fr_log_t *logger, fr_log_lvl_t lvl,
-				  int max_networks, int max_workers,
+				  int max_networks, int max_workers, fr_network_overload_t const *overload,
 				  fr_schedule_thread_instantiate_t worker_thread_instantiate,
 				  void *worker_thread_ctx)
 {
@@ -398,6 +402,7 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el,
 	sc->el = el;
 	sc->max_networks = max_networks;
 	sc->max_workers = max_workers;
+	if (overload) sc->overload = *overload;
 	sc->num_workers = 0;
 	sc->log = logger;
 	sc->lvl = lvl;
@@ -411,7 +416,7 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el,
 	 *	If we're single-threaded, create network / worker, and insert them into the event loop.
 	 */
 	if (el) {
-		sc->single_network = fr_network_create(sc, el, sc->log, sc->lvl);
+		sc->single_network = fr_network_create(sc, el, sc->log, sc->lvl, &sc->overload);
 		if (!sc->single_network) {
 			fr_log(sc->log, L_ERR, "Failed creating network: %s", fr_strerror());
 		st_fail:
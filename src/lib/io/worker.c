@@ -67,6 +67,16 @@ RCSID("$Id$")
 #include <freeradius-devel/io/listen.h>
 #include <freeradius-devel/io/schedule.h>
 #include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/metrics.h>
+#include <freeradius-devel/util/probe.h>
+#include <freeradius-devel/util/trace.h>
+
+/*
+ *	Record an event, if the request is being traced.
+ */
+#define WORKER_TRACE(_request, _when, _phase, _name) do { \
+	if ((_request)->traced) fr_trace_event((_request)->number, _when, _phase, "worker", _name); \
+} while (0)
 
 /**
  *  Track things by priority and time.
@@ -150,6 +160,8 @@ struct fr_worker_t {
 	uint64_t    		num_timeouts;	//!< number of messages which timed out
 	uint64_t    		num_active;	//!< number of active requests
 
+	fr_metrics_shard_t	*metrics;	//!< this worker's copy of the "worker" metrics
+
 	fr_time_tracking_t	tracking;	//!< how much time the worker has spent doing things.
 
 	bool			was_sleeping;	//!< used to suppress multiple sleep signals in a row
@@ -166,6 +178,39 @@ struct fr_worker_t {
 
 static void fr_worker_post_event(fr_event_list_t *el, struct timeval *now, void *uctx);
 
+/*
+ *	Indexes into worker_metrics[]
+ */
+enum {
+	WORKER_METRIC_IN = 0,
+	WORKER_METRIC_OUT,
+	WORKER_METRIC_DUP,
+	WORKER_METRIC_DROPPED,
+	WORKER_METRIC_TIMEOUTS,
+	WORKER_METRIC_ACTIVE,
+	WORKER_METRIC_CPU_TIME,
+	WORKER_METRIC_WALL_CLOCK,
+	WORKER_METRIC_QUEUE_TIME,
+	WORKER_METRIC_DECODE_TIME,
+	WORKER_METRIC_WAITING_TIME,
+	WORKER_METRIC_ENCODE_TIME
+};
+
+static fr_metric_def_t const worker_metrics[] = {
+	[WORKER_METRIC_IN]		= { .name = "requests_in", .help = "Requests received by the workers", .type = FR_METRIC_COUNTER },
+	[WORKER_METRIC_OUT]		= { .name = "replies_out", .help = "Replies sent by the workers", .type = FR_METRIC_COUNTER },
+	[WORKER_METRIC_DUP]		= { .name = "dup", .help = "Duplicate requests", .type = FR_METRIC_COUNTER },
+	[WORKER_METRIC_DROPPED]		= { .name = "dropped", .help = "Requests stopped by a conflicting request", .type = FR_METRIC_COUNTER },
+	[WORKER_METRIC_TIMEOUTS]	= { .name = "timeouts", .help = "Requests which timed out", .type = FR_METRIC_COUNTER },
+	[WORKER_METRIC_ACTIVE]		= { .name = "active", .help = "Requests being processed", .type = FR_METRIC_GAUGE },
+	[WORKER_METRIC_CPU_TIME]	= { .name = "cpu_time", .help = "CPU time spent processing each request", .type = FR_METRIC_HISTOGRAM },
+	[WORKER_METRIC_WALL_CLOCK]	= { .name = "wall_clock", .help = "Time from receiving each request to replying", .type = FR_METRIC_HISTOGRAM },
+	[WORKER_METRIC_QUEUE_TIME]	= { .name = "queue_time", .help = "Time from the network thread reading each request to the worker decoding it", .type = FR_METRIC_HISTOGRAM },
+	[WORKER_METRIC_DECODE_TIME]	= { .name = "decode_time", .help = "Time spent decoding each request", .type = FR_METRIC_HISTOGRAM },
+	[WORKER_METRIC_WAITING_TIME]	= { .name = "waiting_time", .help = "Time each request spent yielded, e.g. waiting for I/O", .type = FR_METRIC_HISTOGRAM },
+	[WORKER_METRIC_ENCODE_TIME]	= { .name = "encode_time", .help = "Time spent encoding each reply", .type = FR_METRIC_HISTOGRAM },
+};
+
 /*
  *	We need wrapper macros because we have multiple instances of
  *	the same code.
@@ -207,6 +252,7 @@ static void fr_worker_recv_request(void *ctx, fr_channel_t *ch, fr_channel_data_
 	fr_worker_t *worker = ctx;
 
 	worker->stats.in++;
+	fr_metrics_inc(worker->metrics, WORKER_METRIC_IN);
 	DEBUG3("\t%sreceived request %" PRIu64 "", worker->name, worker->stats.in);
 	cd->channel.ch = ch;
 	WORKER_HEAP_INSERT(to_decode, cd);
@@ -374,6 +420,7 @@ static void fr_worker_nak(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t
 	fr_listen_t		*listen;
 
 	worker->num_timeouts++;
+	fr_metrics_inc(worker->metrics, WORKER_METRIC_TIMEOUTS);
 
 	/*
 	 *	Cache the outbound channel.  We'll need it later.
@@ -429,6 +476,7 @@ static void fr_worker_nak(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t
 	}
 
 	worker->stats.out++;
+	fr_metrics_inc(worker->metrics, WORKER_METRIC_OUT);
 }
 
 static void worker_reset_timer(fr_worker_t *worker);
@@ -485,7 +533,9 @@ static void fr_worker_send_reply(fr_worker_t *worker, REQUEST *request, size_t s
 	if (size) {
 		ssize_t slen = 0;
 		fr_listen_t const *listen = request->async->listen;
+		fr_time_t start = fr_time();
 
+		WORKER_TRACE(request, start, FR_TRACE_BEGIN, "encode");
 		if (listen->app->encode) {
 			slen = listen->app->encode(listen->app_instance, request,
 						   reply->m.data, reply->m.rb_size);
@@ -498,6 +548,8 @@ static void fr_worker_send_reply(fr_worker_t *worker, REQUEST *request, size_t s
 			*reply->m.data = 0;
 			slen = 1;
 		}
+		fr_metrics_observe(worker->metrics, WORKER_METRIC_ENCODE_TIME, fr_time() - start);
+		WORKER_TRACE(request, fr_time(), FR_TRACE_END, "encode");
 
 		/*
 		 *	Shrink the buffer to the actual packet size.
@@ -514,6 +566,8 @@ static void fr_worker_send_reply(fr_worker_t *worker, REQUEST *request, size_t s
 	fr_time_tracking_end(&request->async->tracking, now, &worker->tracking);
 	rad_assert(worker->num_active > 0);
 	worker->num_active--;
+	fr_metrics_dec(worker->metrics, WORKER_METRIC_ACTIVE);
+	fr_metrics_observe(worker->metrics, WORKER_METRIC_WAITING_TIME, request->async->tracking.waiting);
 
 	/*
 	 *	Nothing to do, delete max_request_time timers.
@@ -532,6 +586,8 @@ static void fr_worker_send_reply(fr_worker_t *worker, REQUEST *request, size_t s
 	reply->reply.cpu_time = worker->tracking.running;
 	reply->reply.processing_time = request->async->tracking.running;
 	reply->reply.request_time = request->async->recv_time;
+	reply->reply.queue_time = request->async->queue_time;
+	reply->priority = request->async->priority;
 
 	reply->listen = request->async->listen;
 	reply->packet_ctx = request->async->packet_ctx;
@@ -541,6 +597,10 @@ static void fr_worker_send_reply(fr_worker_t *worker, REQUEST *request, size_t s
 	 */
 	fr_time_elapsed_update(&worker->cpu_time, now, now + reply->reply.processing_time);
 	fr_time_elapsed_update(&worker->wall_clock, reply->reply.request_time, now);
+	fr_metrics_observe(worker->metrics, WORKER_METRIC_CPU_TIME, reply->reply.processing_time);
+	fr_metrics_observe(worker->metrics, WORKER_METRIC_WALL_CLOCK, now - reply->reply.request_time);
+	FR_PROBE4(worker_send_reply, request->number, request->reply->code,
+		  reply->reply.processing_time, now - reply->reply.request_time);
 
 	RDEBUG("finished request.");
 
@@ -552,6 +612,8 @@ static void fr_worker_send_reply(fr_worker_t *worker, REQUEST *request, size_t s
 	}
 
 	worker->stats.out++;
+	fr_metrics_inc(worker->metrics, WORKER_METRIC_OUT);
+	WORKER_TRACE(request, fr_time(), FR_TRACE_INSTANT, "reply");
 
 	/*
 	 *	@todo Use a talloc pool for the request.  Clean it up,
@@ -563,6 +625,7 @@ static void fr_worker_send_reply(fr_worker_t *worker, REQUEST *request, size_t s
 finished:
 	rad_assert(request->time_order_id < 0);
 	rad_assert(request->runnable_id < 0);
+	WORKER_TRACE(request, fr_time(), FR_TRACE_END, "request");
 
 #ifndef NDEBUG
 	request->async->original_recv_time = NULL;
@@ -770,6 +833,7 @@ static REQUEST *fr_worker_get_request(fr_worker_t *worker, fr_time_t now)
 	fr_channel_data_t	*cd;
 	REQUEST			*request;
 	fr_listen_t const	*listen;
+	fr_time_t		decode_start, decode_end;
 #ifndef HAVE_TALLOC_POOLED_OBJECT
 	TALLOC_CTX		*ctx;
 #endif
@@ -783,6 +847,7 @@ static REQUEST *fr_worker_get_request(fr_worker_t *worker, fr_time_t now)
 		REQUEST_VERIFY(request);
 		rad_assert(request->runnable_id < 0);
 		fr_time_tracking_resume(&request->async->tracking, now, &worker->tracking);
+		WORKER_TRACE(request, now, FR_TRACE_INSTANT, "resume");
 		return request;
 	}
 
@@ -841,8 +906,19 @@ static REQUEST *fr_worker_get_request(fr_worker_t *worker, fr_time_t now)
 	request->number = worker->number++;
 	request->name = talloc_typed_asprintf(request, "%" PRIu64 , request->number);
 
+	/*
+	 *	The network side doesn't know which requests are
+	 *	traced, so record its events here, with its times.
+	 */
+	request->traced = fr_trace_sample();
+	WORKER_TRACE(request, request->async->recv_time, FR_TRACE_BEGIN, "request");
+	WORKER_TRACE(request, request->async->recv_time, FR_TRACE_INSTANT, "recv");
+	WORKER_TRACE(request, cd->m.when, FR_TRACE_INSTANT, "enqueue");
+	WORKER_TRACE(request, now, FR_TRACE_INSTANT, "dequeue");
+
 	request->async->listen = cd->listen;
 	request->async->packet_ctx = cd->packet_ctx;
+	request->async->priority = cd->priority;
 	listen = request->async->listen;
 
 	/*
@@ -850,13 +926,23 @@ static REQUEST *fr_worker_get_request(fr_worker_t *worker, fr_time_t now)
 	 *
 	 *	Note that this also sets the "async process" function.
 	 */
+	decode_start = fr_time();
+	WORKER_TRACE(request, decode_start, FR_TRACE_BEGIN, "decode");
+	if (decode_start > cd->m.when) request->async->queue_time = decode_start - cd->m.when;
+	fr_metrics_observe(worker->metrics, WORKER_METRIC_QUEUE_TIME, request->async->queue_time);
 	if (listen->app->decode) {
 		ret = listen->app->decode(listen->app_instance, request, cd->m.data, cd->m.data_size);
 	} else if (listen->app_io->decode) {
 		ret = listen->app_io->decode(listen->app_io_instance, request, cd->m.data, cd->m.data_size);
 	}
+	decode_end = fr_time();
+	fr_metrics_observe(worker->metrics, WORKER_METRIC_DECODE_TIME, decode_end - decode_start);
+	WORKER_TRACE(request, decode_end, FR_TRACE_END, "decode");
+	FR_PROBE4(worker_get_request, request->number, request->packet->code,
+		  request->async->queue_time, decode_end - decode_start);
 
 	if (ret < 0) {
+		WORKER_TRACE(request, fr_time(), FR_TRACE_END, "request");
 		talloc_free(ctx);
 nak:
 		fr_worker_nak(worker, cd, now);
@@ -926,6 +1012,7 @@ nak:
 			RWARN("Discarding duplicate of request (%"PRIu64")", old->number);
 
 			fr_channel_null_reply(request->async->channel);
+			WORKER_TRACE(request, now, FR_TRACE_END, "request");
 			talloc_free(request);
 
 			/*
@@ -941,6 +1028,7 @@ nak:
 			 */
 			(void) old->async->process(request->async->process_inst, old, FR_IO_ACTION_DUP);
 			worker->stats.dup++;
+			fr_metrics_inc(worker->metrics, WORKER_METRIC_DUP);
 			return NULL;
 		}
 
@@ -954,6 +1042,9 @@ nak:
 		rad_assert(worker->num_active > 0);
 		worker->num_active--;
 		worker->stats.dropped++;
+		fr_metrics_dec(worker->metrics, WORKER_METRIC_ACTIVE);
+		fr_metrics_inc(worker->metrics, WORKER_METRIC_DROPPED);
+		WORKER_TRACE(old, now, FR_TRACE_END, "request");
 		talloc_free(old);
 
 	insert_new:
@@ -974,6 +1065,7 @@ nak:
 	 */
 	fr_time_tracking_start(&request->async->tracking, now, &worker->tracking);
 	worker->num_active++;
+	fr_metrics_inc(worker->metrics, WORKER_METRIC_ACTIVE);
 	rad_assert(request->runnable_id < 0);
 
 	worker_reset_timer(worker);
@@ -1038,6 +1130,7 @@ static void fr_worker_run_request(fr_worker_t *worker, REQUEST *request)
 
 	case FR_IO_YIELD:
 		fr_time_tracking_yield(&request->async->tracking, fr_time(), &worker->tracking);
+		WORKER_TRACE(request, fr_time(), FR_TRACE_INSTANT, "yield");
 		return;
 
 	case FR_IO_REPLY:
@@ -1154,7 +1247,11 @@ static int worker_message_cmp(void const *one, void const *two)
 	fr_channel_data_t const *a = one, *b = two;
 	int ret;
 
-	ret = (a->priority > b->priority) - (a->priority < b->priority);
+	/*
+	 *	The heap returns the smallest entry first, so larger
+	 *	priorities have to sort first.
+	 */
+	ret = (a->priority < b->priority) - (a->priority > b->priority);
 	if (ret != 0) return ret;
 
 	return (a->m.when > b->m.when) - (a->m.when < b->m.when);
@@ -1168,7 +1265,7 @@ static int worker_runnable_cmp(void const *one, void const *two)
 	REQUEST const *a = one, *b = two;
 	int ret;
 
-	ret = (a->async->priority > b->async->priority) - (a->async->priority < b->async->priority);
+	ret = (a->async->priority < b->async->priority) - (a->async->priority > b->async->priority);
 	if (ret != 0) return ret;
 
 	return (a->async->recv_time > b->async->recv_time) - (a->async->recv_time < b->async->recv_time);
@@ -1296,6 +1393,12 @@ nomem:
 		goto nomem;
 	}
 
+	worker->metrics = fr_metrics_shard_alloc(worker, "worker", NULL, worker_metrics, NUM_ELEMENTS(worker_metrics));
+	if (!worker->metrics) {
+		talloc_free(worker);
+		return NULL;
+	}
+
 	worker->id = pthread_self();
 	worker->el = el;
 	worker->log = logger;
@@ -12,9 +12,11 @@ SOURCES	:= \
 	connection.c \
 	crypt.c \
 	dependency.c \
+	detail.c \
 	dl.c \
 	exec.c \
 	exfile.c \
+	exfile_batch.c \
 	log.c \
 	main_config.c \
 	map_proc.c \
@@ -26,6 +28,7 @@ SOURCES	:= \
 	process.c \
 	rcode.c \
 	regex.c \
+	reload.c \
 	request.c \
 	snmp.c \
 	state.c \
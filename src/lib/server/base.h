@@ -55,6 +55,7 @@ RCSIDH(base_h, "$Id$")
 #include <freeradius-devel/server/process.h>
 #include <freeradius-devel/server/protocol.h>
 #include <freeradius-devel/server/regex.h>
+#include <freeradius-devel/server/reload.h>
 #include <freeradius-devel/server/rcode.h>
 #include <freeradius-devel/server/realms.h>
 #include <freeradius-devel/server/request.h>
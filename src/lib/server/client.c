@@ -868,6 +868,11 @@ RADCLIENT *client_afrom_cs(TALLOC_CTX *ctx, CONF_SECTION *cs, CONF_SECTION *serv
 	}
 #endif
 
+	if (client_secret_precompute(c) < 0) {
+		cf_log_err(cs, "Failed pre-computing shared secret");
+		goto error;
+	}
+
 	if ((c->proto == IPPROTO_TCP) || (c->proto == IPPROTO_IP)) {
 		if ((c->limit.idle_timeout > 0) && (c->limit.idle_timeout < 5))
 			c->limit.idle_timeout = 5;
@@ -880,6 +885,37 @@ RADCLIENT *client_afrom_cs(TALLOC_CTX *ctx, CONF_SECTION *cs, CONF_SECTION *serv
 	return c;
 }
 
+/** Pre-compute the HMAC-MD5 state for a client's shared secret
+ *
+ * Every Message-Authenticator calculated with the secret would otherwise
+ * hash the padded secret twice.  Must be called again if the secret
+ * changes.
+ *
+ * @param[in] client	to pre-compute the secret for.
+ * @return
+ *	- 0 on success, or if the client has no secret.
+ *	- -1 on failure.
+ */
+int client_secret_precompute(RADCLIENT *client)
+{
+	fr_hmac_md5_key_t *hmac;
+
+	talloc_const_free(client->secret_hmac);
+	client->secret_hmac = NULL;
+
+	if (!client->secret) return 0;
+
+	hmac = fr_hmac_md5_key_alloc(client, (uint8_t const *) client->secret,
+				     talloc_array_length(client->secret) - 1);
+	if (!hmac) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+	client->secret_hmac = hmac;
+
+	return 0;
+}
+
 /** Add a client from a result set (SQL)
  *
  * @todo This function should die. SQL should use client_afrom_cs.
@@ -922,6 +958,13 @@ RADCLIENT *client_afrom_query(TALLOC_CTX *ctx, char const *identifier, char cons
 	if (server) c->server = talloc_typed_strdup(c, server);
 	c->message_authenticator = require_ma;
 
+	if (client_secret_precompute(c) < 0) {
+		PERROR("Failed pre-computing shared secret");
+		talloc_free(c);
+
+		return NULL;
+	}
+
 	return c;
 }
 
@@ -70,6 +70,7 @@ typedef int (*client_value_cb_t)(char **out, CONF_PAIR const *cp, void *data);
 #include <freeradius-devel/server/socket.h>
 #include <freeradius-devel/server/stats.h>
 #include <freeradius-devel/util/inet.h>
+#include <freeradius-devel/util/md5.h>
 
 /** Describes a host allowed to send packets to the server
  *
@@ -83,6 +84,9 @@ struct rad_client {
 	char const		*shortname;		//!< Client nickname.
 
 	char const		*secret;		//!< Secret PSK.
+	fr_hmac_md5_key_t const	*secret_hmac;		//!< Secret pre-computed for the Message-Authenticator
+							///< HMAC.  May be NULL, in which case the HMAC is
+							///< calculated from the secret.
 
 	bool			message_authenticator;	//!< Require RADIUS message authenticator in requests.
 	bool			dynamic;		//!< Whether the client was dynamically defined.
@@ -139,6 +143,8 @@ int		client_map_section(CONF_SECTION *out, CONF_SECTION const *map, client_value
 
 RADCLIENT	*client_afrom_cs(TALLOC_CTX *ctx, CONF_SECTION *cs, CONF_SECTION *server_cs);
 
+int		client_secret_precompute(RADCLIENT *client);
+
 RADCLIENT	*client_afrom_query(TALLOC_CTX *ctx, char const *identifier, char const *secret, char const *shortname,
 				    char const *type, char const *server, bool require_ma)
 		CC_HINT(nonnull(2, 3));
@@ -0,0 +1,331 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * $Id$
+ *
+ * @file detail.c
+ * @brief Binary detail file records.
+ *
+ * A binary record is a fixed header, followed by the attributes.  All
+ * integers are in network byte order.
+ *
+ *	offset	length	field
+ *	0	4	magic (#FR_DETAIL_BINARY_MAGIC)
+ *	4	4	state, zero, or "Done" once a reader has processed it
+ *	8	4	length of the whole record, including the header
+ *	12	4	CRC-32 of everything after this field
+ *	16	1	version (#FR_DETAIL_BINARY_VERSION)
+ *	17	1	address family of the addresses below, 4, 6 or 0
+ *	18	2	source port
+ *	20	2	destination port
+ *	22	2	reserved, zero
+ *	24	4	seconds of the original packet timestamp
+ *	28	4	microseconds of the original packet timestamp
+ *	32	16	source address
+ *	48	16	destination address
+ *
+ * Each attribute is a one byte name length, the attribute name, a two byte
+ * value length, and the value in the same format used by
+ * fr_value_box_to_network().
+ *
+ * Attributes are stored by name rather than by number, so records can be
+ * read with a different (but compatible) dictionary than they were written
+ * with.
+ *
+ * @copyright 2019  The FreeRADIUS server project
+ */
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/detail.h>
+#include <freeradius-devel/util/crc32.h>
+
+/** Return the length of the binary record at the start of data
+ *
+ * @param[in] data	The start of a binary record.
+ * @param[in] data_len	How much data is available.
+ * @return
+ *	- 0 if the header is incomplete.
+ *	- >0 the length of the record, which may be larger than data_len.
+ *	- <0 if the header is malformed.
+ */
+ssize_t fr_detail_binary_length(uint8_t const *data, size_t data_len)
+{
+	uint32_t len;
+
+	if (data_len < FR_DETAIL_BINARY_HDR_LEN) return 0;
+
+	if (memcmp(data, FR_DETAIL_BINARY_MAGIC, 4) != 0) {
+		fr_strerror_printf("Invalid magic");
+		return -1;
+	}
+
+	len = ((uint32_t) data[8] << 24) | (data[9] << 16) | (data[10] << 8) | data[11];
+	if (len < FR_DETAIL_BINARY_HDR_LEN) {
+		fr_strerror_printf("Invalid record length %u", len);
+		return -1;
+	}
+
+	return len;
+}
+
+/** Allocate a binary record, and fill in the header from a packet
+ *
+ * @param[in] ctx	to allocate the record in.
+ * @param[out] len	how much of the record is used.
+ * @param[in] packet	to take the addresses from.
+ * @param[in] timestamp	of the original packet.
+ * @return the record, to be passed to fr_detail_binary_encode_pair().
+ */
+uint8_t *fr_detail_binary_alloc(TALLOC_CTX *ctx, size_t *len, RADIUS_PACKET const *packet,
+				struct timeval const *timestamp)
+{
+	uint8_t *record;
+
+	record = talloc_zero_array(ctx, uint8_t, 1024);
+	if (!record) return NULL;
+
+	memcpy(record, FR_DETAIL_BINARY_MAGIC, 4);
+	record[16] = FR_DETAIL_BINARY_VERSION;
+
+	switch (packet->src_ipaddr.af) {
+	case AF_INET:
+		record[17] = 4;
+		memcpy(record + 32, &packet->src_ipaddr.addr.v4, 4);
+		memcpy(record + 48, &packet->dst_ipaddr.addr.v4, 4);
+		break;
+
+	case AF_INET6:
+		record[17] = 6;
+		memcpy(record + 32, &packet->src_ipaddr.addr.v6, 16);
+		memcpy(record + 48, &packet->dst_ipaddr.addr.v6, 16);
+		break;
+
+	default:
+		break;
+	}
+
+	record[18] = packet->src_port >> 8;
+	record[19] = packet->src_port & 0xff;
+	record[20] = packet->dst_port >> 8;
+	record[21] = packet->dst_port & 0xff;
+
+	record[24] = (timestamp->tv_sec >> 24) & 0xff;
+	record[25] = (timestamp->tv_sec >> 16) & 0xff;
+	record[26] = (timestamp->tv_sec >> 8) & 0xff;
+	record[27] = timestamp->tv_sec & 0xff;
+	record[28] = (timestamp->tv_usec >> 24) & 0xff;
+	record[29] = (timestamp->tv_usec >> 16) & 0xff;
+	record[30] = (timestamp->tv_usec >> 8) & 0xff;
+	record[31] = timestamp->tv_usec & 0xff;
+
+	*len = FR_DETAIL_BINARY_HDR_LEN;
+
+	return record;
+}
+
+/** Append an attribute to a binary record
+ *
+ * @param[in,out] record	from fr_detail_binary_alloc().  May be reallocated.
+ * @param[in,out] len		how much of the record is used.
+ * @param[in] vp		to append.
+ * @return
+ *	- 0 on success, or if the attribute can't be stored in a binary record.
+ *	- -1 on allocation failure.
+ */
+int fr_detail_binary_encode_pair(uint8_t **record, size_t *len, VALUE_PAIR const *vp)
+{
+	size_t		name_len = strlen(vp->da->name);
+	size_t		hdr_len = 1 + name_len + 2;
+	size_t		size, need;
+	ssize_t		slen = 0;
+	uint8_t		*p;
+
+	if (name_len > UINT8_MAX) return 0;
+
+	switch (vp->vp_type) {
+	case FR_TYPE_STRING:
+	case FR_TYPE_OCTETS:
+		if (vp->vp_length > UINT16_MAX) return 0;
+		break;
+
+	default:
+		break;
+	}
+
+	/*
+	 *	Encode the value, growing the record until it fits.
+	 */
+	for (;;) {
+		size = talloc_array_length(*record);
+		need = hdr_len;
+
+		if ((size - *len) > hdr_len) {
+			need = 0;
+			slen = fr_value_box_to_network(&need, *record + *len + hdr_len, size - *len - hdr_len, &vp->data);
+			if (slen < 0) return 0;	/* Structural, or otherwise unsupported types */
+			if (!need) break;
+		}
+
+		p = talloc_realloc(NULL, *record, uint8_t, (size + hdr_len + need) * 2);
+		if (!p) return -1;
+		*record = p;
+	}
+
+	p = *record + *len;
+	p[0] = name_len;
+	memcpy(p + 1, vp->da->name, name_len);
+	p[1 + name_len] = slen >> 8;
+	p[1 + name_len + 1] = slen & 0xff;
+
+	*len += hdr_len + slen;
+
+	return 0;
+}
+
+/** Fill in the length and CRC of a binary record
+ *
+ */
+void fr_detail_binary_finalise(uint8_t *record, size_t len)
+{
+	uint32_t crc;
+
+	record[8] = (len >> 24) & 0xff;
+	record[9] = (len >> 16) & 0xff;
+	record[10] = (len >> 8) & 0xff;
+	record[11] = len & 0xff;
+
+	crc = fr_crc32(0, record + 16, len - 16);
+	record[12] = crc >> 24;
+	record[13] = (crc >> 16) & 0xff;
+	record[14] = (crc >> 8) & 0xff;
+	record[15] = crc & 0xff;
+}
+
+/** Decode a binary record into request->packet
+ *
+ * @param[in] request	to decode into.  The addresses of request->packet are
+ *			set from the header.
+ * @param[in] cursor	to append the decoded attributes to.
+ * @param[out] timestamp	of the original packet.
+ * @param[in] data	the record.
+ * @param[in] data_len	length of the record.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the record is malformed, or fails the CRC check.
+ */
+int fr_detail_binary_decode(REQUEST *request, fr_cursor_t *cursor, time_t *timestamp,
+			    uint8_t const *data, size_t data_len)
+{
+	RADIUS_PACKET	*packet = request->packet;
+	uint8_t const	*p, *end;
+	ssize_t		len;
+	uint32_t	crc;
+
+	len = fr_detail_binary_length(data, data_len);
+	if (len <= 0) {
+		if (len == 0) fr_strerror_printf("Record too short");
+		return -1;
+	}
+
+	if ((size_t) len > data_len) {
+		fr_strerror_printf("Record is truncated");
+		return -1;
+	}
+
+	crc = ((uint32_t) data[12] << 24) | (data[13] << 16) | (data[14] << 8) | data[15];
+	if (fr_crc32(0, data + 16, len - 16) != crc) {
+		fr_strerror_printf("CRC check failed");
+		return -1;
+	}
+
+	if (data[16] != FR_DETAIL_BINARY_VERSION) {
+		fr_strerror_printf("Unsupported version %u", data[16]);
+		return -1;
+	}
+
+	switch (data[17]) {
+	case 4:
+		packet->src_ipaddr.af = packet->dst_ipaddr.af = AF_INET;
+		packet->src_ipaddr.prefix = packet->dst_ipaddr.prefix = 32;
+		memcpy(&packet->src_ipaddr.addr.v4, data + 32, 4);
+		memcpy(&packet->dst_ipaddr.addr.v4, data + 48, 4);
+		break;
+
+	case 6:
+		packet->src_ipaddr.af = packet->dst_ipaddr.af = AF_INET6;
+		packet->src_ipaddr.prefix = packet->dst_ipaddr.prefix = 128;
+		memcpy(&packet->src_ipaddr.addr.v6, data + 32, 16);
+		memcpy(&packet->dst_ipaddr.addr.v6, data + 48, 16);
+		break;
+
+	default:
+		break;
+	}
+
+	packet->src_port = (data[18] << 8) | data[19];
+	packet->dst_port = (data[20] << 8) | data[21];
+
+	*timestamp = ((uint32_t) data[24] << 24) | (data[25] << 16) | (data[26] << 8) | data[27];
+
+	p = data + FR_DETAIL_BINARY_HDR_LEN;
+	end = data + len;
+
+	while (p < end) {
+		fr_dict_attr_t const	*da;
+		VALUE_PAIR		*vp;
+		char			name[UINT8_MAX + 1];
+		size_t			name_len, value_len;
+
+		name_len = p[0];
+		if ((size_t) (end - p) < (1 + name_len + 2)) {
+		truncated:
+			fr_strerror_printf("Attribute at offset %zu overflows the record", (size_t) (p - data));
+			return -1;
+		}
+
+		memcpy(name, p + 1, name_len);
+		name[name_len] = '\0';
+		p += 1 + name_len;
+
+		value_len = (p[0] << 8) | p[1];
+		p += 2;
+		if ((size_t) (end - p) < value_len) goto truncated;
+
+		da = fr_dict_attr_by_name(request->dict, name);
+		if (!da) da = fr_dict_attr_by_name(NULL, name);
+		if (!da) {
+			RWDEBUG("Ignoring unknown attribute %s", name);
+			goto next;
+		}
+
+		vp = fr_pair_afrom_da(packet, da);
+		if (!vp) return -1;
+
+		if (fr_value_box_from_network(vp, &vp->data, da->type, da, p, value_len, true) < 0) {
+			RPWDEBUG("Ignoring attribute %s", name);
+			talloc_free(vp);
+			goto next;
+		}
+		vp->type = VT_DATA;
+
+		fr_cursor_append(cursor, vp);
+
+	next:
+		p += value_len;
+	}
+
+	return 0;
+}
@@ -0,0 +1,73 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file lib/server/detail.h
+ * @brief Binary detail file records, shared by rlm_detail and proto_detail.
+ *
+ * @copyright 2019 The FreeRADIUS server project
+ */
+RCSIDH(server_detail_h, "$Id$")
+
+#include <freeradius-devel/server/request.h>
+#include <freeradius-devel/util/cursor.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FR_DETAIL_BINARY_MAGIC		"\xfd" "FRD"	//!< First bytes of every binary record.
+#define FR_DETAIL_BINARY_VERSION	1		//!< Incremented whenever the format changes.
+#define FR_DETAIL_BINARY_HDR_LEN	64		//!< Fixed header, before the attributes.
+
+/** Where readers write "Done", once the record has been processed
+ *
+ * These bytes are excluded from the CRC.
+ */
+#define FR_DETAIL_BINARY_DONE_OFFSET	4
+
+/** Check whether data starts with a binary detail record
+ *
+ * Text records start with a printable date, so one byte is enough.
+ */
+static inline bool fr_detail_binary_check(uint8_t const *data, size_t data_len)
+{
+	return (data_len > 0) && (data[0] == (uint8_t) FR_DETAIL_BINARY_MAGIC[0]);
+}
+
+static inline bool fr_detail_binary_is_done(uint8_t const *data)
+{
+	return (memcmp(data + FR_DETAIL_BINARY_DONE_OFFSET, "Done", 4) == 0);
+}
+
+ssize_t		fr_detail_binary_length(uint8_t const *data, size_t data_len);
+
+uint8_t		*fr_detail_binary_alloc(TALLOC_CTX *ctx, size_t *len, RADIUS_PACKET const *packet,
+				       struct timeval const *timestamp);
+
+int		fr_detail_binary_encode_pair(uint8_t **record, size_t *len, VALUE_PAIR const *vp);
+
+void		fr_detail_binary_finalise(uint8_t *record, size_t len);
+
+int		fr_detail_binary_decode(REQUEST *request, fr_cursor_t *cursor, time_t *timestamp,
+					uint8_t const *data, size_t data_len);
+
+#ifdef __cplusplus
+}
+#endif
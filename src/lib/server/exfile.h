@@ -25,8 +25,11 @@
  */
 RCSIDH(exfile_h, "$Id$")
 
+#include <freeradius-devel/server/cf_parse.h>
 #include <freeradius-devel/server/request.h>
 
+#include <sys/uio.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -45,6 +48,33 @@ int		exfile_open(exfile_t *lf, REQUEST *request, char const *filename,
 
 int		exfile_close(exfile_t *lf, REQUEST *request, int fd);
 
+/*
+ *	Multiple threads queueing records, which are written to
+ *	the files in batches by a dedicated thread.
+ */
+typedef struct exfile_batch_s exfile_batch_t;
+typedef struct exfile_batch_entry_s exfile_batch_entry_t;
+
+typedef struct {
+	bool		enabled;		//!< Whether records should be written by the batch writer.
+	bool		wait;			//!< Yield until the record has been written.
+	bool		sync;			//!< fdatasync() the files after every batch.
+	uint32_t	sync_interval;		//!< fdatasync() the files at most this often (seconds).
+	uint32_t	max_queued;		//!< Records queued before requests wait for the writer.
+} exfile_batch_conf_t;
+
+extern const CONF_PARSER exfile_batch_config[];
+
+exfile_batch_t	*exfile_batch_alloc(TALLOC_CTX *ctx, exfile_t *ef, exfile_batch_conf_t const *conf);
+
+int		exfile_batch_writev(exfile_batch_entry_t **wait, exfile_batch_t *eb, REQUEST *request,
+				    char const *filename, mode_t permissions, gid_t group,
+				    struct iovec const *vector, int iovcnt);
+
+int		exfile_batch_wait_result(REQUEST *request, exfile_batch_entry_t *entry);
+
+void		exfile_batch_wait_cancel(REQUEST *request, exfile_batch_entry_t *entry);
+
 #ifdef __cplusplus
 }
 #endif
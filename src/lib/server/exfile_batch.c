@@ -0,0 +1,584 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * $Id$
+ *
+ * @file exfile_batch.c
+ * @brief Group commit of records written to exfile managed files.
+ *
+ * Workers push formatted records onto a lock-free stack.  A writer
+ * thread takes everything which has been queued, groups the records by
+ * filename, and writes each group with one exfile_open() / writev() /
+ * exfile_close() cycle.  The file lock (if any) is taken once per batch,
+ * instead of once per record.
+ *
+ * If configured to, requests yield until the batch containing their record
+ * has been written (and synced), so that the request is only acknowledged
+ * once the record is on disk.  The writer thread wakes the worker with a
+ * user event on the request's event list, so the worker carries on
+ * processing other requests in the meantime.
+ *
+ * @copyright 2019  The FreeRADIUS server project
+ */
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/rad_assert.h>
+#include <freeradius-devel/server/exfile.h>
+#include <freeradius-devel/unlang/base.h>
+
+#include <pthread.h>
+#include <sys/event.h>
+#include <sys/uio.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+#define EXFILE_BATCH_MAX_IOV	1024
+
+/** Who owns an entry which a request is waiting for
+ *
+ * The writer thread and the worker both try to move the entry out of
+ * #EXFILE_BATCH_WAITING.  Whichever loses the race frees it.
+ */
+typedef enum {
+	EXFILE_BATCH_WAITING = 0,			//!< Queued, and the request is waiting.
+	EXFILE_BATCH_DONE,				//!< Written.  The worker frees the entry.
+	EXFILE_BATCH_CANCELLED				//!< The request went away.  The writer frees the entry.
+} exfile_batch_state_t;
+
+/** A record waiting to be written
+ *
+ * The data and filename are allocated in the same chunk as the entry.
+ */
+struct exfile_batch_entry_s {
+	exfile_batch_entry_t	*next;			//!< Next entry in the stack, or in the batch.
+
+	char const		*filename;		//!< File to write to.
+	mode_t			permissions;		//!< Permissions to use if the file is created.
+	gid_t			group;			//!< Group to give the file, or -1.
+
+	bool			wait;			//!< A request is waiting for the write to complete.
+	bool			grouped;		//!< Already written with an earlier entry for the same file.
+	int			error;			//!< errno from the write, or 0.
+
+	_Atomic(exfile_batch_state_t) state;		//!< Only used if wait is true.
+	REQUEST			*request;		//!< Waiting for the entry to be written.
+	fr_event_list_t		*el;			//!< The user event was inserted into.
+	int			kq;			//!< of el.  Used by the writer to signal the worker.
+	uintptr_t		ident;			//!< of the user event.
+
+	size_t			len;			//!< Length of the data.
+	uint8_t			data[];
+};
+
+struct exfile_batch_s {
+	exfile_t				*ef;		//!< Handles opening, locking and rotating files.
+	exfile_batch_conf_t			conf;
+
+	pthread_t				thread;
+	pthread_mutex_t				mutex;
+	pthread_cond_t				wakeup;		//!< Signalled when records are queued.
+	bool					running;	//!< Protected by the mutex.
+
+	_Atomic(exfile_batch_entry_t *)		head;		//!< Stack of queued records.
+	_Atomic(uint32_t)			queued;		//!< Number of records queued or being written.
+	_Atomic(bool)				sleeping;	//!< Whether the writer is waiting for records.
+
+	time_t					last_sync;	//!< When we last synced the files.
+};
+
+/** Configuration for the batch writer, for use as a subsection of a module's configuration
+ */
+const CONF_PARSER exfile_batch_config[] = {
+	{ FR_CONF_OFFSET("enable", FR_TYPE_BOOL, exfile_batch_conf_t, enabled), .dflt = "no" },
+	{ FR_CONF_OFFSET("wait", FR_TYPE_BOOL, exfile_batch_conf_t, wait), .dflt = "yes" },
+	{ FR_CONF_OFFSET("sync", FR_TYPE_BOOL, exfile_batch_conf_t, sync), .dflt = "no" },
+	{ FR_CONF_OFFSET("sync_interval", FR_TYPE_UINT32, exfile_batch_conf_t, sync_interval), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_queued", FR_TYPE_UINT32, exfile_batch_conf_t, max_queued), .dflt = "65536" },
+	CONF_PARSER_TERMINATOR
+};
+
+/** Write a complete iovec array, dealing with short writes
+ *
+ * @return
+ *	- 0 on success.
+ *	- errno on failure.
+ */
+static int exfile_batch_writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt > 0) {
+		ssize_t ret;
+
+		ret = writev(fd, iov, iovcnt);
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			return errno;
+		}
+
+		while ((iovcnt > 0) && ((size_t) ret >= iov->iov_len)) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+
+		if (iovcnt > 0) {
+			iov->iov_base = (uint8_t *) iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return 0;
+}
+
+/** Write all of the records for one file
+ *
+ * @param[in] eb	the batch writer.
+ * @param[in] first	entry for the file.  All entries for the same file
+ *			which follow it in the batch are written too.
+ * @param[in] do_sync	whether we should fdatasync() the file.
+ */
+static void exfile_batch_write_file(exfile_batch_t *eb, exfile_batch_entry_t *first, bool do_sync)
+{
+	struct iovec		iov[EXFILE_BATCH_MAX_IOV];
+	exfile_batch_entry_t	*entry;
+	int			fd, iovcnt, error = 0;
+
+	/*
+	 *	Find the other entries for this file.
+	 */
+	for (entry = first->next; entry; entry = entry->next) {
+		if (entry->grouped || (strcmp(entry->filename, first->filename) != 0)) continue;
+		entry->filename = first->filename;
+		entry->grouped = true;
+	}
+
+	fd = exfile_open(eb->ef, NULL, first->filename, first->permissions);
+	if (fd < 0) {
+		ERROR("Failed opening %s: %s", first->filename, fr_strerror());
+		error = EIO;
+		goto done;
+	}
+
+	/*
+	 *	Only the writer knows when the file has been created.
+	 */
+	if ((first->group != (gid_t) -1) && (fchown(fd, -1, first->group) < 0)) {
+		DEBUG2("Unable to change system group of %s: %s", first->filename, fr_syserror(errno));
+	}
+
+	/*
+	 *	Gather the records into as few writes as possible.
+	 */
+	entry = first;
+	while (entry && !error) {
+		iovcnt = 0;
+
+		for (; entry && (iovcnt < EXFILE_BATCH_MAX_IOV); entry = entry->next) {
+			if (entry->filename != first->filename) continue;
+
+			iov[iovcnt].iov_base = entry->data;
+			iov[iovcnt].iov_len = entry->len;
+			iovcnt++;
+		}
+
+		error = exfile_batch_writev_all(fd, iov, iovcnt);
+		if (error) ERROR("Failed writing to %s: %s", first->filename, fr_syserror(error));
+	}
+
+	if (!error && do_sync) {
+#ifdef HAVE_FDATASYNC
+		if (fdatasync(fd) < 0) {
+#else
+		if (fsync(fd) < 0) {
+#endif
+			error = errno;
+			ERROR("Failed syncing %s: %s", first->filename, fr_syserror(error));
+		}
+	}
+
+	exfile_close(eb->ef, NULL, fd);
+
+done:
+	for (entry = first; entry; entry = entry->next) {
+		if (entry->filename == first->filename) entry->error = error;
+	}
+}
+
+/** Write one batch of records
+ *
+ * @param[in] eb	the batch writer.
+ * @param[in] batch	list of entries, in the order they were queued.
+ */
+static void exfile_batch_write(exfile_batch_t *eb, exfile_batch_entry_t *batch)
+{
+	exfile_batch_entry_t	*entry, *next;
+	time_t			now;
+	bool			do_sync;
+	uint32_t		count = 0;
+
+	/*
+	 *	Sync after every batch, or if it's been long enough
+	 *	since the last one.
+	 */
+	now = time(NULL);
+	do_sync = eb->conf.sync ||
+		  (eb->conf.sync_interval && ((now - eb->last_sync) >= (time_t) eb->conf.sync_interval));
+	if (do_sync) eb->last_sync = now;
+
+	for (entry = batch; entry; entry = entry->next) {
+		if (entry->grouped) continue;
+
+		exfile_batch_write_file(eb, entry, do_sync);
+	}
+
+	/*
+	 *	Wake up the requests which are waiting for their
+	 *	records, and free the ones nobody is waiting for.
+	 */
+	for (entry = batch; entry; entry = next) {
+		next = entry->next;
+		count++;
+
+		if (entry->wait) {
+			exfile_batch_state_t	state = EXFILE_BATCH_WAITING;
+			struct kevent		kev;
+			int			kq;
+
+			/*
+			 *	Once the state is changed, the worker
+			 *	may free the entry, so get everything
+			 *	we need first.
+			 */
+			EV_SET(&kev, entry->ident, EVFILT_USER, 0, NOTE_TRIGGER | NOTE_FFNOP, 0, NULL);
+			kq = entry->kq;
+			if (atomic_compare_exchange_strong_explicit(&entry->state, &state, EXFILE_BATCH_DONE,
+								    memory_order_acq_rel, memory_order_acquire)) {
+				(void) kevent(kq, &kev, 1, NULL, 0, NULL);
+				continue;
+			}
+		}
+		free(entry);
+	}
+
+	atomic_fetch_sub_explicit(&eb->queued, count, memory_order_relaxed);
+}
+
+/** Take all queued records, in the order they were queued
+ *
+ */
+static exfile_batch_entry_t *exfile_batch_take(exfile_batch_t *eb)
+{
+	exfile_batch_entry_t *list, *batch = NULL, *next;
+
+	list = atomic_exchange_explicit(&eb->head, NULL, memory_order_acquire);
+
+	/*
+	 *	The stack is LIFO, reverse it.
+	 */
+	while (list) {
+		next = list->next;
+		list->next = batch;
+		batch = list;
+		list = next;
+	}
+
+	return batch;
+}
+
+static void *exfile_batch_thread(void *arg)
+{
+	exfile_batch_t		*eb = arg;
+	exfile_batch_entry_t	*batch;
+
+	pthread_mutex_lock(&eb->mutex);
+	for (;;) {
+		struct timespec when;
+
+		batch = exfile_batch_take(eb);
+		if (batch) {
+			pthread_mutex_unlock(&eb->mutex);
+			exfile_batch_write(eb, batch);
+			pthread_mutex_lock(&eb->mutex);
+			continue;
+		}
+
+		if (!eb->running) break;
+
+		/*
+		 *	Nothing to do.  Check again after announcing that
+		 *	we're going to sleep, so that we don't miss a
+		 *	record which was queued in between.
+		 */
+		atomic_store_explicit(&eb->sleeping, true, memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+		if (atomic_load_explicit(&eb->head, memory_order_relaxed)) {
+			atomic_store_explicit(&eb->sleeping, false, memory_order_relaxed);
+			continue;
+		}
+
+		clock_gettime(CLOCK_REALTIME, &when);
+		when.tv_sec++;
+		pthread_cond_timedwait(&eb->wakeup, &eb->mutex, &when);
+		atomic_store_explicit(&eb->sleeping, false, memory_order_relaxed);
+	}
+	pthread_mutex_unlock(&eb->mutex);
+
+	return NULL;
+}
+
+/** Called in the worker when the writer thread has written a record
+ *
+ */
+static void _exfile_batch_written(UNUSED int kq, UNUSED struct kevent const *kev, void *uctx)
+{
+	exfile_batch_entry_t *entry = uctx;
+
+	/*
+	 *	Ignore stale triggers.
+	 */
+	if (atomic_load_explicit(&entry->state, memory_order_acquire) != EXFILE_BATCH_DONE) return;
+
+	unlang_resumable(entry->request);
+}
+
+/** Stop listening for the writer thread to tell us the record has been written
+ *
+ */
+static void exfile_batch_unwatch(exfile_batch_entry_t *entry)
+{
+	struct kevent kev;
+
+	EV_SET(&kev, entry->ident, EVFILT_USER, EV_DELETE, NOTE_FFNOP, 0, NULL);
+	(void) kevent(entry->kq, &kev, 1, NULL, 0, NULL);
+	fr_event_user_delete(entry->el, _exfile_batch_written, entry);
+}
+
+/** Queue a record to be written to a file
+ *
+ * If *wait is set on return, the caller must yield, and call
+ * #exfile_batch_wait_result when the request is resumed, or
+ * #exfile_batch_wait_cancel if the request is cancelled.
+ *
+ * @param[out] wait		Set to the entry to wait for, or NULL if the caller
+ *				can continue immediately.
+ * @param[in] eb		the batch writer.
+ * @param[in] request		The current request.
+ * @param[in] filename		the file to write to.
+ * @param[in] permissions	to use if the file is created.
+ * @param[in] group		to give the file, or -1 to leave it unchanged.
+ * @param[in] vector		data to write.
+ * @param[in] iovcnt		number of elements in vector.
+ * @return
+ *	- 0 if the record was queued.
+ *	- -1 if the record couldn't be queued.
+ */
+int exfile_batch_writev(exfile_batch_entry_t **wait, exfile_batch_t *eb, REQUEST *request,
+			char const *filename, mode_t permissions, gid_t group,
+			struct iovec const *vector, int iovcnt)
+{
+	exfile_batch_entry_t	*entry;
+	size_t			len = 0, filename_len;
+	uint8_t			*p;
+	uint32_t		queued;
+	int			i;
+
+	*wait = NULL;
+
+	for (i = 0; i < iovcnt; i++) len += vector[i].iov_len;
+	filename_len = strlen(filename) + 1;
+
+	entry = malloc(sizeof(*entry) + len + filename_len);
+	if (!entry) {
+		REDEBUG("Out of memory");
+		return -1;
+	}
+
+	p = entry->data;
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(p, vector[i].iov_base, vector[i].iov_len);
+		p += vector[i].iov_len;
+	}
+	memcpy(p, filename, filename_len);
+
+	entry->filename = (char const *) p;
+	entry->permissions = permissions;
+	entry->group = group;
+	entry->len = len;
+	entry->grouped = false;
+	entry->error = 0;
+	atomic_init(&entry->state, EXFILE_BATCH_WAITING);
+
+	/*
+	 *	If the writer is falling behind, wait for our record
+	 *	to be written, so that the queue doesn't grow without
+	 *	bounds.
+	 */
+	queued = atomic_fetch_add_explicit(&eb->queued, 1, memory_order_relaxed) + 1;
+	entry->wait = eb->conf.wait || (eb->conf.max_queued && (queued > eb->conf.max_queued));
+
+	/*
+	 *	Listen for the writer thread telling us that the
+	 *	record has been written.
+	 */
+	if (entry->wait) {
+		struct kevent kev;
+
+		entry->request = request;
+		entry->el = request->el;
+		entry->kq = fr_event_list_kq(entry->el);
+		entry->ident = fr_event_user_insert(entry->el, _exfile_batch_written, entry);
+		if (!entry->ident) {
+		error:
+			REDEBUG("Failed adding event for %s", filename);
+			atomic_fetch_sub_explicit(&eb->queued, 1, memory_order_relaxed);
+			free(entry);
+			return -1;
+		}
+
+		EV_SET(&kev, entry->ident, EVFILT_USER, EV_ADD | EV_CLEAR, NOTE_FFNOP, 0, NULL);
+		if (kevent(entry->kq, &kev, 1, NULL, 0, NULL) < 0) {
+			fr_event_user_delete(entry->el, _exfile_batch_written, entry);
+			goto error;
+		}
+
+		*wait = entry;
+	}
+
+	entry->next = atomic_load_explicit(&eb->head, memory_order_relaxed);
+	while (!atomic_compare_exchange_weak_explicit(&eb->head, &entry->next, entry,
+						      memory_order_release, memory_order_relaxed));
+
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&eb->sleeping, memory_order_relaxed)) {
+		pthread_mutex_lock(&eb->mutex);
+		pthread_cond_signal(&eb->wakeup);
+		pthread_mutex_unlock(&eb->mutex);
+	}
+
+	/*
+	 *	If we're not waiting, the writer owns the entry now,
+	 *	and may already have freed it.
+	 */
+	return 0;
+}
+
+/** Get the result of writing a record, once the request has been resumed
+ *
+ * @param[in] request	The current request.
+ * @param[in] entry	returned by #exfile_batch_writev.  Is freed.
+ * @return
+ *	- 0 if the record was written.
+ *	- -1 if writing the record failed.
+ */
+int exfile_batch_wait_result(REQUEST *request, exfile_batch_entry_t *entry)
+{
+	int error;
+
+	exfile_batch_unwatch(entry);
+
+	if (!fr_cond_assert(atomic_load_explicit(&entry->state, memory_order_acquire) == EXFILE_BATCH_DONE)) {
+		exfile_batch_wait_cancel(request, entry);
+		return -1;
+	}
+
+	error = entry->error;
+	if (error) REDEBUG("Failed writing to %s: %s", entry->filename, fr_syserror(error));
+	free(entry);
+
+	return error ? -1 : 0;
+}
+
+/** Stop waiting for a record, because the request is being cancelled
+ *
+ * The record is still written.
+ *
+ * @param[in] request	The current request.
+ * @param[in] entry	returned by #exfile_batch_writev.
+ */
+void exfile_batch_wait_cancel(UNUSED REQUEST *request, exfile_batch_entry_t *entry)
+{
+	exfile_batch_state_t state = EXFILE_BATCH_WAITING;
+
+	exfile_batch_unwatch(entry);
+
+	/*
+	 *	If the writer still has the entry, it frees it.
+	 */
+	if (atomic_compare_exchange_strong_explicit(&entry->state, &state, EXFILE_BATCH_CANCELLED,
+						    memory_order_acq_rel, memory_order_acquire)) return;
+
+	free(entry);
+}
+
+static int _exfile_batch_free(exfile_batch_t *eb)
+{
+	pthread_mutex_lock(&eb->mutex);
+	eb->running = false;
+	pthread_cond_signal(&eb->wakeup);
+	pthread_mutex_unlock(&eb->mutex);
+
+	/*
+	 *	The writer drains the queue before exiting.
+	 */
+	pthread_join(eb->thread, NULL);
+
+	pthread_cond_destroy(&eb->wakeup);
+	pthread_mutex_destroy(&eb->mutex);
+
+	return 0;
+}
+
+/** Start a writer thread for records written to files managed by an exfile handle
+ *
+ * @param[in] ctx	to allocate the writer in.
+ * @param[in] ef	used to open, lock and close the files.
+ * @param[in] conf	parsed using #exfile_batch_config.
+ * @return
+ *	- new batch writer.
+ *	- NULL on error.
+ */
+exfile_batch_t *exfile_batch_alloc(TALLOC_CTX *ctx, exfile_t *ef, exfile_batch_conf_t const *conf)
+{
+	exfile_batch_t	*eb;
+	int		ret;
+
+	eb = talloc_zero(ctx, exfile_batch_t);
+	if (!eb) return NULL;
+
+	eb->ef = ef;
+	eb->conf = *conf;
+	eb->running = true;
+	eb->last_sync = time(NULL);
+
+	pthread_mutex_init(&eb->mutex, NULL);
+	pthread_cond_init(&eb->wakeup, NULL);
+
+	ret = pthread_create(&eb->thread, NULL, exfile_batch_thread, eb);
+	if (ret != 0) {
+		fr_strerror_printf("Failed creating writer thread: %s", fr_syserror(ret));
+		pthread_cond_destroy(&eb->wakeup);
+		pthread_mutex_destroy(&eb->mutex);
+		talloc_free(eb);
+		return NULL;
+	}
+
+	talloc_set_destructor(eb, _exfile_batch_free);
+
+	return eb;
+}
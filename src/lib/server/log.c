@@ -242,6 +242,7 @@ void vlog_request(fr_log_type_t type, fr_log_lvl_t lvl, REQUEST *request, char c
 {
 	char const	*filename;
 	FILE		*fp = NULL;
+	int		fd = -1;
 
 	char		*p;
 	char const	*extra = "";
@@ -270,13 +271,18 @@ void vlog_request(fr_log_type_t type, fr_log_lvl_t lvl, REQUEST *request, char c
 		/*
 		 *	If we're debugging to a file, then use that.
 		 *
-		 *	@todo: have fr_vlog() take a fr_log_t*, so
-		 *	that we can cache the opened descriptor, and
-		 *	we don't need to re-open it on every log
-		 *	message.
+		 *	Use the descriptor the log was opened with, so
+		 *	that we don't need to re-open the file on every
+		 *	log message.
 		 */
 		switch (log_dst->dst) {
 		case L_DST_FILES:
+			if (log_dst->fd >= 0) {
+				fd = log_dst->fd;
+				break;
+			}
+
+			if (!log_dst->file) goto finish;
 			fp = fopen(log_dst->file, "a");
 			if (!fp) goto finish;
 			break;
@@ -403,7 +409,7 @@ print_msg:
 	/*
 	 *	Logging to a file descriptor
 	 */
-	if (fp) {
+	if (fp || (fd >= 0)) {
 		char time_buff[64];	/* The current timestamp */
 
 		time_t timeval;
@@ -426,14 +432,32 @@ print_msg:
 		p = strrchr(time_buff, '\n');
 		if (p) p[0] = '\0';
 
-		fprintf(fp, "%s" "%s : " "%s" "%.*s" "%s" "%s" "\n",
-			msg_prefix ? msg_prefix : "",
-			time_buff,
-			fr_int2str(fr_log_levels, type, ""),
-			unlang_indent, spaces,
-			msg_module ? msg_module : "",
-			msg_exp);
-		fclose(fp);
+		if (fp) {
+			fprintf(fp, "%s" "%s : " "%s" "%.*s" "%s" "%s" "\n",
+				msg_prefix ? msg_prefix : "",
+				time_buff,
+				fr_int2str(fr_log_levels, type, ""),
+				unlang_indent, spaces,
+				msg_module ? msg_module : "",
+				msg_exp);
+			fclose(fp);
+			goto finish;
+		}
+
+		/*
+		 *	Format the whole line, so that it's written with
+		 *	one call.  If the log writer thread is running
+		 *	this just copies the line into its ring buffer.
+		 */
+		p = talloc_typed_asprintf(request, "%s" "%s : " "%s" "%.*s" "%s" "%s" "\n",
+					  msg_prefix ? msg_prefix : "",
+					  time_buff,
+					  fr_int2str(fr_log_levels, type, ""),
+					  unlang_indent, spaces,
+					  msg_module ? msg_module : "",
+					  msg_exp);
+		(void) fr_log_async_write(log_dst, p, talloc_array_length(p) - 1);
+		talloc_free(p);
 		goto finish;
 	}
 
@@ -72,6 +72,8 @@ static int hostname_lookups_parse(TALLOC_CTX *ctx, void *out, void *parent, CONF
 
 static int num_networks_parse(TALLOC_CTX *ctx, void *out, void *parent, CONF_ITEM *ci, CONF_PARSER const *rule);
 static int num_workers_parse(TALLOC_CTX *ctx, void *out, void *parent, CONF_ITEM *ci, CONF_PARSER const *rule);
+static int overload_target_parse(TALLOC_CTX *ctx, void *out, void *parent, CONF_ITEM *ci, CONF_PARSER const *rule);
+static int overload_interval_parse(TALLOC_CTX *ctx, void *out, void *parent, CONF_ITEM *ci, CONF_PARSER const *rule);
 
 static int talloc_memory_limit_parse(TALLOC_CTX *ctx, void *out, void *parent, CONF_ITEM *ci, CONF_PARSER const *rule);
 static int talloc_pool_size_parse(TALLOC_CTX *ctx, void *out, void *parent, CONF_ITEM *ci, CONF_PARSER const *rule);
@@ -122,18 +124,34 @@ static const CONF_PARSER log_config[] = {
 	{ FR_CONF_OFFSET("colourise", FR_TYPE_BOOL, main_config_t, do_colourise) },
 	{ FR_CONF_OFFSET("timestamp", FR_TYPE_BOOL, main_config_t, log_timestamp) },
 	{ FR_CONF_OFFSET("use_utc", FR_TYPE_BOOL, main_config_t, log_dates_utc) },
+	{ FR_CONF_OFFSET("async", FR_TYPE_BOOL, main_config_t, log_async), .dflt = "no" },
+	{ FR_CONF_OFFSET("async_buffer_size", FR_TYPE_UINT32, main_config_t, log_async_buffer_size), .dflt = "1048576" },
 #ifdef WITH_CONF_WRITE
 	{ FR_CONF_OFFSET("write_dir", FR_TYPE_STRING, main_config_t, write_dir), .dflt = NULL },
 #endif
 	CONF_PARSER_TERMINATOR
 };
 
+static const CONF_PARSER overload_config[] = {
+	{ FR_CONF_OFFSET("shed", FR_TYPE_BOOL, main_config_t, overload_shed), .dflt = "no" },
+	{ FR_CONF_OFFSET("target", FR_TYPE_TIMEVAL, main_config_t, overload_target), .dflt = "0.005",
+	  .func = overload_target_parse },
+	{ FR_CONF_OFFSET("interval", FR_TYPE_TIMEVAL, main_config_t, overload_interval), .dflt = "0.1",
+	  .func = overload_interval_parse },
+	{ FR_CONF_OFFSET("priority", FR_TYPE_UINT32, main_config_t, overload_priority),
+	  .func = cf_table_parse_uint32, .uctx = request_priority_table, .dflt = "low" },
+
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER thread_config[] = {
 	{ FR_CONF_OFFSET("num_networks", FR_TYPE_UINT32, main_config_t, num_networks), .dflt = STRINGIFY(1),
 	  .func = num_networks_parse },
 	{ FR_CONF_OFFSET("num_workers", FR_TYPE_UINT32, main_config_t, num_workers), .dflt = STRINGIFY(4),
 	  .func = num_workers_parse },
 
+	{ FR_CONF_POINTER("overload", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) overload_config },
+
 	CONF_PARSER_TERMINATOR
 };
 
@@ -369,6 +387,42 @@ static int num_workers_parse(TALLOC_CTX *ctx, void *out, void *parent,
 	return 0;
 }
 
+static int overload_target_parse(TALLOC_CTX *ctx, void *out, void *parent,
+				 CONF_ITEM *ci, CONF_PARSER const *rule)
+{
+	int		ret;
+	struct timeval	value;
+
+	if ((ret = cf_pair_parse_value(ctx, out, parent, ci, rule)) < 0) return ret;
+
+	memcpy(&value, out, sizeof(value));
+
+	FR_TIMEVAL_BOUND_CHECK("thread.overload.target", &value, >=, 0, 100);
+	FR_TIMEVAL_BOUND_CHECK("thread.overload.target", &value, <=, 5, 0);
+
+	memcpy(out, &value, sizeof(value));
+
+	return 0;
+}
+
+static int overload_interval_parse(TALLOC_CTX *ctx, void *out, void *parent,
+				   CONF_ITEM *ci, CONF_PARSER const *rule)
+{
+	int		ret;
+	struct timeval	value;
+
+	if ((ret = cf_pair_parse_value(ctx, out, parent, ci, rule)) < 0) return ret;
+
+	memcpy(&value, out, sizeof(value));
+
+	FR_TIMEVAL_BOUND_CHECK("thread.overload.interval", &value, >=, 0, 1000);
+	FR_TIMEVAL_BOUND_CHECK("thread.overload.interval", &value, <=, 30, 0);
+
+	memcpy(out, &value, sizeof(value));
+
+	return 0;
+}
+
 /** Configured server name takes precedence over default values
  *
  */
@@ -64,6 +64,11 @@ struct main_config_s {
 	uint32_t	num_networks;			//!< number of network threads
 	uint32_t	num_workers;			//!< number of network threads
 
+	bool		overload_shed;			//!< Discard low priority packets when a worker is overloaded.
+	struct timeval	overload_target;		//!< Acceptable time for a packet to wait for a worker.
+	struct timeval	overload_interval;		//!< How long the wait must be above target.
+	uint32_t	overload_priority;		//!< Packets with this priority or lower may be discarded.
+
 	bool		drop_requests;			//!< Administratively disable request processing.
 
 	char const	*log_dir;
@@ -93,6 +98,9 @@ struct main_config_s {
 	bool		*log_timestamp;
 	bool		log_timestamp_is_set;
 
+	bool		log_async;			//!< Write log messages from a dedicated thread.
+	uint32_t	log_async_buffer_size;		//!< Size of each thread's log buffer.
+
 	int32_t		syslog_facility;
 
 	char const	*dict_dir;			//!< Where to load dictionaries from.
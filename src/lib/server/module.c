@@ -562,6 +562,12 @@ static int _module_thread_inst_array_free(module_thread_instance_t **array)
 }
 
 
+static fr_metric_def_t const module_metrics[] = {
+	[MODULE_METRIC_CALLS]		= { .name = "calls", .help = "Calls to the module", .type = FR_METRIC_COUNTER },
+	[MODULE_METRIC_RUN_TIME]	= { .name = "run_time", .help = "Time spent running the module, per call", .type = FR_METRIC_HISTOGRAM },
+	[MODULE_METRIC_ELAPSED_TIME]	= { .name = "elapsed_time", .help = "Time from calling the module to its result, including waiting for I/O", .type = FR_METRIC_HISTOGRAM },
+};
+
 typedef struct {
 	module_thread_instance_t **array; //!< Containing the thread instances.
 	fr_event_list_t *el;		//!< Event list for this thread.
@@ -587,6 +593,18 @@ static int _module_thread_instantiate(void *instance, void *ctx)
 	ti->module = mi->module;
 	ti->mod_inst = mi->dl_inst->data;	/* For efficient lookups */
 
+	{
+		char *labels;
+
+		MEM(labels = talloc_typed_asprintf(NULL, "instance=\"%s\"", mi->name));
+		ti->metrics = fr_metrics_shard_alloc(ti, "module", labels, module_metrics, NUM_ELEMENTS(module_metrics));
+		talloc_free(labels);
+		if (!ti->metrics) {
+			PERROR("Failed allocating metrics for module \"%s\"", mi->name);
+			return -1;
+		}
+	}
+
 	if (mi->module->thread_inst_size) {
 		char *type_name;
 
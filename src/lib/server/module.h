@@ -50,6 +50,7 @@ typedef struct module_thread_instance_s  module_thread_instance_t;
 #include <freeradius-devel/unlang/base.h>
 
 #include <freeradius-devel/features.h>
+#include <freeradius-devel/util/metrics.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -201,8 +202,20 @@ struct module_thread_instance_s {
 
 	uint64_t			total_calls;	//! total number of times we've been called
 	uint64_t			active_callers; //! number of active callers.  i.e. number of current yields
+
+	fr_metrics_shard_t		*metrics;	//!< Call counts and times, see #module_metric_t.
 };
 
+/** Indexes into the "module" metrics of each module instance
+ *
+ */
+typedef enum {
+	MODULE_METRIC_CALLS = 0,			//!< Calls which have returned a result.
+	MODULE_METRIC_RUN_TIME,				//!< Time spent running the module, per call.
+	MODULE_METRIC_ELAPSED_TIME			//!< Time from the call to the result, including
+							///< time spent yielded, e.g. waiting for I/O.
+} module_metric_t;
+
 /*
  *	Share connection pool instances between modules
  */
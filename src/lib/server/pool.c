@@ -34,6 +34,7 @@ RCSID("$Id$")
 
 #include <freeradius-devel/util/heap.h>
 #include <freeradius-devel/util/misc.h>
+#include <freeradius-devel/util/probe.h>
 
 #include <time.h>
 
@@ -820,6 +821,8 @@ static void *connection_get_internal(fr_pool_t *pool, REQUEST *request, bool spa
 
 	if (!pool) return NULL;
 
+	FR_PROBE2(pool_get_start, pool->log_prefix, request ? request->number : 0);
+
 	pthread_mutex_lock(&pool->mutex);
 
 	now = time(NULL);
@@ -864,12 +867,16 @@ static void *connection_get_internal(fr_pool_t *pool, REQUEST *request, bool spa
 			fr_pool_trigger_exec(pool, request, "none");
 		}
 
+		FR_PROBE3(pool_get_done, pool->log_prefix, request ? request->number : 0, NULL);
 		return NULL;
 	}
 
 	pthread_mutex_unlock(&pool->mutex);
 
-	if (!spawn) return NULL;
+	if (!spawn) {
+		FR_PROBE3(pool_get_done, pool->log_prefix, request ? request->number : 0, NULL);
+		return NULL;
+	}
 
 	ROPTIONAL(RDEBUG2, DEBUG2, "%i of %u connections in use.  You  may need to increase \"spare\"",
 	       pool->state.active, pool->state.num);
@@ -878,7 +885,10 @@ static void *connection_get_internal(fr_pool_t *pool, REQUEST *request, bool spa
 	 *	Returns unlocked on failure, or locked on success
 	 */
 	this = connection_spawn(pool, request, now, true, false);
-	if (!this) return NULL;
+	if (!this) {
+		FR_PROBE3(pool_get_done, pool->log_prefix, request ? request->number : 0, NULL);
+		return NULL;
+	}
 
 do_return:
 	pool->state.active++;
@@ -892,6 +902,7 @@ do_return:
 	pthread_mutex_unlock(&pool->mutex);
 
 	ROPTIONAL(RDEBUG2, DEBUG2, "Reserved connection (%" PRIu64 ")", this->number);
+	FR_PROBE3(pool_get_done, pool->log_prefix, request ? request->number : 0, this->connection);
 
 	return this->connection;
 }
@@ -0,0 +1,359 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file reload.c
+ * @brief Data built from files, which is rebuilt when the file changes.
+ *
+ * A background thread polls the file, and when it changes, builds a new
+ * copy of the data.  The new copy is published by swapping a pointer, so
+ * readers never take a lock, and never see partially built data.
+ *
+ * The old copy is freed once every thread which might still be using it
+ * has left its read section.  Each reading thread has a slot recording the
+ * epoch it entered its read section at, and the background thread waits
+ * until no slot holds an epoch from before the swap.
+ *
+ * @copyright 2019 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/rad_assert.h>
+#include <freeradius-devel/server/reload.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/thread_local.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+#include <pthread.h>
+#include <sys/stat.h>
+
+/** Per-thread read state, shared by all reloadable data
+ */
+typedef struct {
+	_Atomic(uint64_t)	epoch;			//!< Epoch the thread entered its read section at.
+							///< 0 if the thread isn't reading.
+	unsigned int		depth;			//!< How many read sections the thread is in.
+	fr_dlist_t		entry;			//!< Entry in the list of readers.
+} fr_reload_reader_t;
+
+struct fr_reload_s {
+	char const		*name;			//!< Of the module instance using the data.
+	char const		*filename;		//!< File the data is built from.
+	uint32_t		interval;		//!< How often to check if the file has changed.
+
+	fr_reload_build_t	build;			//!< Callback to build the data.
+	void			*uctx;			//!< Passed to the build callback.
+
+	_Atomic(void *)		data;			//!< The current data.
+
+	struct stat		st;			//!< Of the file when it was last read.
+	bool			missing;		//!< The file couldn't be found on the last check.
+
+	pthread_t		thread;			//!< Which checks for changes.
+	bool			running;		//!< Whether the thread was started.
+	bool			stop;			//!< Tell the thread to exit.
+	pthread_mutex_t		mutex;			//!< Protects stop, and serialises checks.
+	pthread_cond_t		cond;			//!< Wakes the thread when it's told to stop.
+};
+
+static _Atomic(uint64_t)	reload_epoch = ATOMIC_VAR_INIT(1);
+
+static pthread_mutex_t		reader_mutex = PTHREAD_MUTEX_INITIALIZER;
+static fr_dlist_head_t		reader_list;
+static bool			reader_list_init;
+
+fr_thread_local_setup(fr_reload_reader_t *, reload_reader)	/* macro */
+
+/** Remove a reader when its thread exits
+ *
+ */
+static void _reload_reader_free(void *arg)
+{
+	fr_reload_reader_t *reader = arg;
+
+	pthread_mutex_lock(&reader_mutex);
+	fr_dlist_remove(&reader_list, reader);
+	pthread_mutex_unlock(&reader_mutex);
+
+	talloc_free(reader);
+}
+
+static fr_reload_reader_t *reload_reader_get(void)
+{
+	fr_reload_reader_t *reader;
+
+	reader = reload_reader;
+	if (reader) return reader;
+
+	MEM(reader = talloc_zero(NULL, fr_reload_reader_t));
+	atomic_init(&reader->epoch, 0);
+
+	pthread_mutex_lock(&reader_mutex);
+	if (!reader_list_init) {
+		fr_dlist_init(&reader_list, fr_reload_reader_t, entry);
+		reader_list_init = true;
+	}
+	fr_dlist_insert_tail(&reader_list, reader);
+	pthread_mutex_unlock(&reader_mutex);
+
+	fr_thread_local_set_destructor(reload_reader, _reload_reader_free, reader);
+
+	return reader;
+}
+
+/** Wait until no thread can be using data which was swapped out
+ *
+ */
+static void reload_synchronize(void)
+{
+	uint64_t epoch;
+
+	epoch = atomic_fetch_add(&reload_epoch, 1) + 1;
+
+	for (;;) {
+		fr_reload_reader_t	*reader = NULL;
+		bool			busy = false;
+
+		pthread_mutex_lock(&reader_mutex);
+		if (!reader_list_init) {
+			pthread_mutex_unlock(&reader_mutex);
+			return;
+		}
+
+		while ((reader = fr_dlist_next(&reader_list, reader))) {
+			uint64_t entered = atomic_load(&reader->epoch);
+
+			if (entered && (entered < epoch)) {
+				busy = true;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&reader_mutex);
+
+		if (!busy) return;
+
+		usleep(1000);
+	}
+}
+
+/** Rebuild the data if the file has changed
+ *
+ * Must be called with the mutex held.
+ *
+ * @return
+ *	- 1 if the data was rebuilt.
+ *	- 0 if the file hasn't changed.
+ *	- -1 if the file couldn't be checked, or the data couldn't be rebuilt.
+ */
+static int reload_check(fr_reload_t *reload)
+{
+	struct stat	st;
+	void		*data, *old;
+
+	if (stat(reload->filename, &st) < 0) {
+		if (!reload->missing) {
+			ERROR("%s - Failed checking %s: %s", reload->name, reload->filename, fr_syserror(errno));
+			reload->missing = true;
+		}
+		return -1;
+	}
+	reload->missing = false;
+
+	if ((st.st_ino == reload->st.st_ino) && (st.st_dev == reload->st.st_dev) &&
+	    (st.st_size == reload->st.st_size) && (st.st_mtime == reload->st.st_mtime)) return 0;
+
+	/*
+	 *	Only try once per change, even if the build fails.
+	 */
+	reload->st = st;
+
+	DEBUG("%s - %s has changed, reloading", reload->name, reload->filename);
+
+	data = reload->build(reload->filename, reload->uctx);
+	if (!data) {
+		PERROR("%s - Failed reloading %s, continuing with the previous data", reload->name, reload->filename);
+		return -1;
+	}
+
+	old = atomic_exchange(&reload->data, data);
+	reload_synchronize();
+	talloc_free(old);
+
+	INFO("%s - Reloaded %s", reload->name, reload->filename);
+
+	return 1;
+}
+
+static void *reload_thread(void *arg)
+{
+	fr_reload_t	*reload = arg;
+
+	pthread_mutex_lock(&reload->mutex);
+	while (!reload->stop) {
+		struct timespec ts;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += reload->interval;
+
+		pthread_cond_timedwait(&reload->cond, &reload->mutex, &ts);
+		if (reload->stop) break;
+
+		(void) reload_check(reload);
+	}
+	pthread_mutex_unlock(&reload->mutex);
+
+	return NULL;
+}
+
+static int _reload_free(fr_reload_t *reload)
+{
+	if (reload->running) {
+		pthread_mutex_lock(&reload->mutex);
+		reload->stop = true;
+		pthread_cond_signal(&reload->cond);
+		pthread_mutex_unlock(&reload->mutex);
+
+		pthread_join(reload->thread, NULL);
+	}
+
+	pthread_cond_destroy(&reload->cond);
+	pthread_mutex_destroy(&reload->mutex);
+
+	talloc_free(atomic_load(&reload->data));
+
+	return 0;
+}
+
+/** Build data from a file, and rebuild it whenever the file changes
+ *
+ * @param[in] ctx	to allocate the #fr_reload_t in.  The data is freed,
+ *			and the background thread stopped when it is freed.
+ * @param[in] name	of the module instance using the data, for log messages.
+ * @param[in] filename	to build the data from.
+ * @param[in] interval	How often to check the file for changes, in seconds.
+ *			0 means the data is built once, and never rebuilt.
+ * @param[in] build	Callback to build the data.
+ * @param[in] uctx	to pass to the build callback.
+ * @return
+ *	- A new #fr_reload_t on success.
+ *	- NULL if the data couldn't be built.
+ */
+fr_reload_t *fr_reload_alloc(TALLOC_CTX *ctx, char const *name, char const *filename, uint32_t interval,
+			     fr_reload_build_t build, void *uctx)
+{
+	fr_reload_t	*reload;
+	void		*data;
+	int		ret;
+
+	MEM(reload = talloc_zero(ctx, fr_reload_t));
+	reload->name = name;
+	reload->filename = filename;
+	reload->interval = interval;
+	reload->build = build;
+	reload->uctx = uctx;
+
+	pthread_mutex_init(&reload->mutex, NULL);
+	pthread_cond_init(&reload->cond, NULL);
+	talloc_set_destructor(reload, _reload_free);
+
+	/*
+	 *	Record the state of the file before reading it, so
+	 *	changes made whilst it's being read aren't missed.
+	 */
+	if (stat(filename, &reload->st) < 0) {
+		fr_strerror_printf("Failed checking %s: %s", filename, fr_syserror(errno));
+	error:
+		talloc_free(reload);
+		return NULL;
+	}
+
+	data = build(filename, uctx);
+	if (!data) goto error;
+	atomic_init(&reload->data, data);
+
+	if (!interval) return reload;
+
+	ret = pthread_create(&reload->thread, NULL, reload_thread, reload);
+	if (ret != 0) {
+		fr_strerror_printf("Failed creating thread: %s", fr_syserror(ret));
+		goto error;
+	}
+	reload->running = true;
+
+	return reload;
+}
+
+/** Check whether the file has changed now, and rebuild the data if it has
+ *
+ * This doesn't wait for the background thread, and works even if the data
+ * was allocated with an interval of 0.  It must not be called from inside
+ * a read section, as it waits for all read sections which might be using
+ * the old data to finish.
+ *
+ * @param[in] reload	to check.
+ * @return
+ *	- 1 if the data was rebuilt.
+ *	- 0 if the file hasn't changed.
+ *	- -1 if the file couldn't be checked, or the data couldn't be rebuilt.
+ */
+int fr_reload_check(fr_reload_t *reload)
+{
+	int ret;
+
+	pthread_mutex_lock(&reload->mutex);
+	ret = reload_check(reload);
+	pthread_mutex_unlock(&reload->mutex);
+
+	return ret;
+}
+
+/** Enter a read section, and return the current data
+ *
+ * The data remains valid until #fr_reload_release is called.  Read sections
+ * must be short, and must not span yields.
+ *
+ * @param[in] reload	to get the data from.
+ * @return the current data.
+ */
+void *fr_reload_acquire(fr_reload_t *reload)
+{
+	fr_reload_reader_t *reader = reload_reader_get();
+
+	if (reader->depth++ == 0) atomic_store(&reader->epoch, atomic_load(&reload_epoch));
+
+	return atomic_load(&reload->data);
+}
+
+/** Leave a read section
+ *
+ * @param[in] reload	the data was acquired from.
+ */
+void fr_reload_release(UNUSED fr_reload_t *reload)
+{
+	fr_reload_reader_t *reader = reload_reader_get();
+
+	rad_assert(reader->depth > 0);
+
+	if (--reader->depth == 0) atomic_store(&reader->epoch, 0);
+}
@@ -0,0 +1,60 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file lib/server/reload.h
+ * @brief API for data built from files, which is rebuilt when the file changes.
+ *
+ * @copyright 2019 The FreeRADIUS server project
+ */
+RCSIDH(reload_h, "$Id$")
+
+#include <stdint.h>
+#include <talloc.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+typedef struct fr_reload_s fr_reload_t;
+
+/** Build data from a file
+ *
+ * Called once when the data is first loaded, and then whenever the file
+ * changes, usually from a background thread.
+ *
+ * @param[in] filename	to read.
+ * @param[in] uctx	passed to #fr_reload_alloc.
+ * @return
+ *	- The new data, allocated in the NULL ctx.  It will be freed with talloc_free().
+ *	- NULL on error.
+ */
+typedef void *(*fr_reload_build_t)(char const *filename, void *uctx);
+
+fr_reload_t	*fr_reload_alloc(TALLOC_CTX *ctx, char const *name, char const *filename, uint32_t interval,
+				 fr_reload_build_t build, void *uctx);
+
+int		fr_reload_check(fr_reload_t *reload);
+
+void		*fr_reload_acquire(fr_reload_t *reload);
+
+void		fr_reload_release(fr_reload_t *reload);
+
+#ifdef __cplusplus
+}
+#endif
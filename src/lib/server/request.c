@@ -28,6 +28,14 @@ RCSID("$Id$")
 #include <freeradius-devel/server/rad_assert.h>
 #include <freeradius-devel/unlang/base.h>
 
+const FR_NAME_NUMBER request_priority_table[] = {
+	{ "now",	PRIORITY_NOW },
+	{ "high",	PRIORITY_HIGH },
+	{ "normal",	PRIORITY_NORMAL },
+	{ "low",	PRIORITY_LOW },
+	{ NULL,		-1 }
+};
+
 /** Per-request opaque data, added by modules
  *
  */
@@ -66,6 +66,16 @@ typedef enum {
 } rad_master_state_t;
 #define REQUEST_MASTER_NUM_STATES (REQUEST_COUNTED + 1)
 
+/*
+ *	Packet priorities.  Higher priority packets are processed first.
+ */
+#define PRIORITY_NOW    (1 << 16)
+#define PRIORITY_HIGH   (1 << 15)
+#define PRIORITY_NORMAL (1 << 14)
+#define PRIORITY_LOW    (1 << 13)
+
+extern const FR_NAME_NUMBER request_priority_table[];
+
 typedef enum fr_request_state_t {
 	REQUEST_INIT = 0,
 	REQUEST_RECV,
@@ -152,6 +162,8 @@ struct rad_request {
 
 	uint32_t		options;	//!< mainly for proxying EAP-MSCHAPv2.
 
+	bool			traced;		//!< Record events for this request with fr_trace_event().
+
 	fr_async_t		*async;		//!< for new async listeners
 };				/* REQUEST typedef */
 
@@ -30,6 +30,7 @@ RCSID("$Id$")
 #include <freeradius-devel/server/parser.h>
 #include <freeradius-devel/server/rad_assert.h>
 #include <freeradius-devel/server/regex.h>
+#include <freeradius-devel/io/listen.h>
 
 #include <freeradius-devel/util/base64.h>
 #include <freeradius-devel/util/md5.h>
@@ -749,6 +750,58 @@ done:
 	return strlen(*out);
 }
 
+/** Record events for the current request, if the tracer is running
+ *
+ * Example %{trace:yes}
+ */
+static ssize_t xlat_func_trace(UNUSED TALLOC_CTX *ctx, char **out, size_t outlen,
+			       UNUSED void const *mod_inst, UNUSED void const *xlat_inst,
+			       REQUEST *request, char const *fmt)
+{
+	/*
+	 *  Expand to whether or not the request is being traced
+	 */
+	snprintf(*out, outlen, "%s", request->traced ? "yes" : "no");
+
+	if (!*fmt) goto done;
+
+	if (strcmp(fmt, "yes") == 0) {
+		if (!request->traced && fr_trace_running()) {
+			fr_time_t now = fr_time();
+
+			request->traced = true;
+
+			/*
+			 *	The worker ends the request span when
+			 *	the request is done, so begin it now,
+			 *	from when the request was received.
+			 */
+			fr_trace_event(request->number, request->async ? request->async->recv_time : now,
+				       FR_TRACE_BEGIN, "worker", "request");
+			fr_trace_event(request->number, now, FR_TRACE_INSTANT, "unlang", "trace");
+		}
+	} else if (strcmp(fmt, "no") == 0) {
+		if (request->traced) {
+			fr_time_t now = fr_time();
+
+			/*
+			 *	The worker won't record anything
+			 *	else for this request, so end the
+			 *	request span here.
+			 */
+			fr_trace_event(request->number, now, FR_TRACE_INSTANT, "unlang", "trace");
+			fr_trace_event(request->number, now, FR_TRACE_END, "worker", "request");
+		}
+		request->traced = false;
+	} else {
+		REDEBUG("Invalid argument \"%s\", expected \"yes\" or \"no\"", fmt);
+		return -1;
+	}
+
+done:
+	return strlen(*out);
+}
+
 /** Generate a random integer value
  *
  */
@@ -2988,6 +3041,11 @@ int xlat_init(void)
 	rad_assert(c != NULL);
 	c->internal = true;
 
+	xlat_register(NULL, "trace", xlat_func_trace, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN, true);
+	c = xlat_func_find("trace");
+	rad_assert(c != NULL);
+	c->internal = true;
+
 	xlat_async_register(NULL, "base64", xlat_func_base64_encode);
 	xlat_async_register(NULL, "base64decode", xlat_func_base64_decode);
 	xlat_async_register(NULL, "bin", xlat_func_bin);
@@ -12,6 +12,7 @@ SOURCES	:= \
 	id.c \
 	milenage.c \
 	vector.c \
+	vector_cache.c \
 	xlat.c
 
 SRC_INCDIRS	:= . ${top_srcdir}/src/modules/rlm_eap/lib/base ${top_srcdir}/src/modules/rlm_eap/
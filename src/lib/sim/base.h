@@ -269,14 +269,33 @@ int		fr_sim_crypto_kdf_1_reauth(fr_sim_keys_t *keys);
 
 void		fr_sim_crypto_keys_log(REQUEST *request, fr_sim_keys_t *keys);
 
+/*
+ *	vector_cache.c
+ */
+typedef struct fr_sim_vector_cache_s fr_sim_vector_cache_t;
+
+fr_sim_vector_cache_t *fr_sim_vector_cache_alloc(TALLOC_CTX *ctx, uint32_t batch_size,
+						 uint32_t max_entries, uint32_t lifetime);
+
+int		fr_sim_vector_cache_gsm(fr_sim_vector_gsm_t *out, fr_sim_vector_cache_t *vc, uint32_t version,
+					uint8_t const *ki, uint8_t const *opc);
+
+int		fr_sim_vector_cache_umts(fr_sim_vector_umts_t *out, uint64_t *sqn_out, fr_sim_vector_cache_t *vc,
+					 uint8_t const *ki, uint8_t const *opc, uint8_t const *amf, uint64_t sqn);
+
+void		fr_sim_vector_cache_stats(fr_sim_vector_cache_t *vc, uint64_t *entries,
+					  uint64_t *hits, uint64_t *misses, uint64_t *evictions);
+
 /*
  *	vector.c
  */
 int		fr_sim_vector_gsm_from_attrs(eap_session_t *eap_session, VALUE_PAIR *vps,
-					     int idx, fr_sim_keys_t *keys, fr_sim_vector_src_t *src);
+					     int idx, fr_sim_keys_t *keys, fr_sim_vector_src_t *src,
+					     fr_sim_vector_cache_t *cache);
 
 int		fr_sim_vector_umts_from_attrs(eap_session_t *eap_session, VALUE_PAIR *vps,
-					      fr_sim_keys_t *keys, fr_sim_vector_src_t *src);
+					      fr_sim_keys_t *keys, fr_sim_vector_src_t *src,
+					      fr_sim_vector_cache_t *cache);
 
 /*
  *	fips186prf.c
@@ -28,11 +28,13 @@
 #define MILENAGE_MAC_A_SIZE	8
 #define MILENAGE_MAC_S_SIZE	8
 
-static inline int aes_128_encrypt_block(EVP_CIPHER_CTX *evp_ctx,
-					uint8_t const key[16], uint8_t const in[16], uint8_t out[16])
+/** Key an AES-128-ECB context for use by the Milenage functions
+ *
+ * The key schedule is computed once, and reused for every block the
+ * context encrypts.
+ */
+static int milenage_key(EVP_CIPHER_CTX *evp_ctx, uint8_t const key[16])
 {
-	size_t len;
-
 	if (unlikely(EVP_EncryptInit_ex(evp_ctx, EVP_aes_128_ecb(), NULL, key, NULL) != 1)) {
 		tls_strerror_printf("Failed initialising AES-128-ECB context");
 		return -1;
@@ -49,8 +51,20 @@ static inline int aes_128_encrypt_block(EVP_CIPHER_CTX *evp_ctx,
 	 *	when decrypting.
 	 */
 	EVP_CIPHER_CTX_set_padding(evp_ctx, 0);
-	if (unlikely(EVP_EncryptUpdate(evp_ctx, out, (int *)&len, in, 16) != 1) ||
-	    unlikely(EVP_EncryptFinal_ex(evp_ctx, out + len, (int *)&len) != 1)) {
+
+	return 0;
+}
+
+static inline int aes_128_encrypt_block(EVP_CIPHER_CTX *evp_ctx, uint8_t const in[16], uint8_t out[16])
+{
+	int len;
+
+	/*
+	 *	ECB with no padding produces a block of output for
+	 *	every block of input, so there's no need to finalise
+	 *	the context, and the key can be reused.
+	 */
+	if (unlikely(EVP_EncryptUpdate(evp_ctx, out, &len, in, 16) != 1) || unlikely(len != 16)) {
 		tls_strerror_printf("Failed encrypting data");
 		return -1;
 	}
@@ -60,8 +74,8 @@ static inline int aes_128_encrypt_block(EVP_CIPHER_CTX *evp_ctx,
 
 /** milenage_f1 - Milenage f1 and f1* algorithms
  *
+ * @param[in] evp_ctx	AES-128-ECB context, keyed with the 128-bit subscriber key.
  * @param[in] opc	128-bit value derived from OP and K.
- * @param[in] k		128-bit subscriber key.
  * @param[in] rand	128-bit random challenge.
  * @param[in] sqn	48-bit sequence number.
  * @param[in] amf	16-bit authentication management field.
@@ -71,32 +85,21 @@ static inline int aes_128_encrypt_block(EVP_CIPHER_CTX *evp_ctx,
  *	- 0 on success.
  *	- -1 on failure.
  */
-static int milenage_f1(uint8_t mac_a[MILENAGE_MAC_A_SIZE],
+static int milenage_f1(EVP_CIPHER_CTX *evp_ctx,
+		       uint8_t mac_a[MILENAGE_MAC_A_SIZE],
 		       uint8_t mac_s[MILENAGE_MAC_S_SIZE],
 		       uint8_t const opc[MILENAGE_OPC_SIZE],
-		       uint8_t const k[MILENAGE_KI_SIZE],
 		       uint8_t const rand[MILENAGE_RAND_SIZE],
 		       uint8_t const sqn[MILENAGE_SQN_SIZE],
 		       uint8_t const amf[MILENAGE_AMF_SIZE])
 {
 	uint8_t		tmp1[16], tmp2[16], tmp3[16];
 	int		i;
-	EVP_CIPHER_CTX	*evp_ctx;
 
 	/* tmp1 = TEMP = E_K(RAND XOR OP_C) */
 	for (i = 0; i < 16; i++) tmp1[i] = rand[i] ^ opc[i];
 
-	evp_ctx = EVP_CIPHER_CTX_new();
-	if (!evp_ctx) {
-		tls_strerror_printf("Failed allocating EVP context");
-		return -1;
-	}
-
- 	if (aes_128_encrypt_block(evp_ctx, k, tmp1, tmp1) < 0) {
- 	error:
-		EVP_CIPHER_CTX_free(evp_ctx);
-		return -1;
- 	}
+ 	if (aes_128_encrypt_block(evp_ctx, tmp1, tmp1) < 0) return -1;
 
 	/* tmp2 = IN1 = SQN || AMF || SQN || AMF */
 	memcpy(tmp2, sqn, 6);
@@ -119,59 +122,46 @@ static int milenage_f1(uint8_t mac_a[MILENAGE_MAC_A_SIZE],
 	/*
 	 *	f1 || f1* = E_K(tmp3) XOR OP_c
 	 */
- 	if (aes_128_encrypt_block(evp_ctx, k, tmp3, tmp1) < 0) goto error; /* Reuses existing key */
+ 	if (aes_128_encrypt_block(evp_ctx, tmp3, tmp1) < 0) return -1;
 
 	for (i = 0; i < 16; i++) tmp1[i] ^= opc[i];
 
 	if (mac_a) memcpy(mac_a, tmp1, 8);	/* f1 */
 	if (mac_s) memcpy(mac_s, tmp1 + 8, 8);	/* f1* */
 
-	EVP_CIPHER_CTX_free(evp_ctx);
-
 	return 0;
 }
 
 /** milenage_f2345 - Milenage f2, f3, f4, f5, f5* algorithms
  *
+ * @param[in] evp_ctx		AES-128-ECB context, keyed with the 128-bit subscriber key.
  * @param[out] res		Buffer for RES = 64-bit signed response (f2), or NULL
  * @param[out] ck		Buffer for CK = 128-bit confidentiality key (f3), or NULL
  * @param[out] ik		Buffer for IK = 128-bit integrity key (f4), or NULL
  * @param[out] ak		Buffer for AK = 48-bit anonymity key (f5), or NULL
  * @param[out] ak_resync	Buffer for AK = 48-bit anonymity key (f5*), or NULL
  * @param[in] opc		128-bit value derived from OP and K.
- * @param[in] k			128-bit subscriber key
  * @param[in] rand		128-bit random challenge
  * @return
  *	- 0 on success.
  *	- -1 on failure.
  */
-static int milenage_f2345(uint8_t res[MILENAGE_RES_SIZE],
+static int milenage_f2345(EVP_CIPHER_CTX *evp_ctx,
+			  uint8_t res[MILENAGE_RES_SIZE],
 			  uint8_t ik[MILENAGE_IK_SIZE],
 			  uint8_t ck[MILENAGE_CK_SIZE],
 			  uint8_t ak[MILENAGE_AK_SIZE],
 			  uint8_t ak_resync[MILENAGE_AK_SIZE],
 			  uint8_t const opc[MILENAGE_OPC_SIZE],
-			  uint8_t const k[MILENAGE_KI_SIZE],
 			  uint8_t const rand[MILENAGE_RAND_SIZE])
 {
 	uint8_t			tmp1[16], tmp2[16], tmp3[16];
 	int			i;
-	EVP_CIPHER_CTX		*evp_ctx;
 
 	/* tmp2 = TEMP = E_K(RAND XOR OP_C) */
 	for (i = 0; i < 16; i++) tmp1[i] = rand[i] ^ opc[i];
 
-	evp_ctx = EVP_CIPHER_CTX_new();
-	if (!evp_ctx) {
-		tls_strerror_printf("Failed allocating EVP context");
-		return -1;
-	}
-
-	if (aes_128_encrypt_block(evp_ctx, k, tmp1, tmp2) < 0) {
-	error:
-		EVP_CIPHER_CTX_free(evp_ctx);
-		return -1;
-	}
+	if (aes_128_encrypt_block(evp_ctx, tmp1, tmp2) < 0) return -1;
 
 	/* OUT2 = E_K(rot(TEMP XOR OP_C, r2) XOR c2) XOR OP_C */
 	/* OUT3 = E_K(rot(TEMP XOR OP_C, r3) XOR c3) XOR OP_C */
@@ -184,7 +174,7 @@ static int milenage_f2345(uint8_t res[MILENAGE_RES_SIZE],
 	tmp1[15] ^= 1; /* XOR c2 (= ..01) */
 	/* f5 || f2 = E_K(tmp1) XOR OP_c */
 
-	if (aes_128_encrypt_block(evp_ctx, k, tmp1, tmp3) < 0) goto error;
+	if (aes_128_encrypt_block(evp_ctx, tmp1, tmp3) < 0) return -1;
 
 	for (i = 0; i < 16; i++) tmp3[i] ^= opc[i];
 	if (res) memcpy(res, tmp3 + 8, 8); /* f2 */
@@ -196,7 +186,7 @@ static int milenage_f2345(uint8_t res[MILENAGE_RES_SIZE],
 		for (i = 0; i < 16; i++) tmp1[(i + 12) % 16] = tmp2[i] ^ opc[i];
 		tmp1[15] ^= 2; /* XOR c3 (= ..02) */
 
-		if (aes_128_encrypt_block(evp_ctx, k, tmp1, ck) < 0) goto error;
+		if (aes_128_encrypt_block(evp_ctx, tmp1, ck) < 0) return -1;
 
 		for (i = 0; i < 16; i++) ck[i] ^= opc[i];
 	}
@@ -207,7 +197,7 @@ static int milenage_f2345(uint8_t res[MILENAGE_RES_SIZE],
 		for (i = 0; i < 16; i++) tmp1[(i + 8) % 16] = tmp2[i] ^ opc[i];
 		tmp1[15] ^= 4; /* XOR c4 (= ..04) */
 
-		if (aes_128_encrypt_block(evp_ctx, k, tmp1, ik) < 0) goto error;
+		if (aes_128_encrypt_block(evp_ctx, tmp1, ik) < 0) return -1;
 
 		for (i = 0; i < 16; i++) ik[i] ^= opc[i];
 	}
@@ -218,15 +208,43 @@ static int milenage_f2345(uint8_t res[MILENAGE_RES_SIZE],
 		for (i = 0; i < 16; i++) tmp1[(i + 4) % 16] = tmp2[i] ^ opc[i];
 		tmp1[15] ^= 8; /* XOR c5 (= ..08) */
 
-		if (aes_128_encrypt_block(evp_ctx, k, tmp1, tmp1) < 0) goto error;
+		if (aes_128_encrypt_block(evp_ctx, tmp1, tmp1) < 0) return -1;
 
 		for (i = 0; i < 6; i++) ak_resync[i] = tmp1[i] ^ opc[i];
 	}
-	EVP_CIPHER_CTX_free(evp_ctx);
 
 	return 0;
 }
 
+/** Allocate an AES context keyed with a subscriber key
+ *
+ * The context can be passed to the *_ctx functions to generate multiple
+ * vectors for the same subscriber, without recomputing the AES key
+ * schedule for every block.
+ *
+ * @param[in] ki	128-bit subscriber key.
+ * @return
+ *	- A keyed context, to be freed with EVP_CIPHER_CTX_free().
+ *	- NULL on failure.
+ */
+EVP_CIPHER_CTX *milenage_ctx_alloc(uint8_t const ki[MILENAGE_KI_SIZE])
+{
+	EVP_CIPHER_CTX	*evp_ctx;
+
+	evp_ctx = EVP_CIPHER_CTX_new();
+	if (!evp_ctx) {
+		tls_strerror_printf("Failed allocating EVP context");
+		return NULL;
+	}
+
+	if (milenage_key(evp_ctx, ki) < 0) {
+		EVP_CIPHER_CTX_free(evp_ctx);
+		return NULL;
+	}
+
+	return evp_ctx;
+}
+
 /** Derive OPc from OP and Ki
  *
  * @param[out] opc	The derived Operator Code used as an input to other Milenage
@@ -246,12 +264,10 @@ int milenage_opc_generate(uint8_t opc[MILENAGE_OPC_SIZE],
 	EVP_CIPHER_CTX	*evp_ctx;
 	size_t		i;
 
-	evp_ctx = EVP_CIPHER_CTX_new();
-	if (!evp_ctx) {
-		tls_strerror_printf("Failed allocating EVP context");
-		return -1;
-	}
- 	ret = aes_128_encrypt_block(evp_ctx, ki, op, tmp);
+	evp_ctx = milenage_ctx_alloc(ki);
+	if (!evp_ctx) return -1;
+
+ 	ret = aes_128_encrypt_block(evp_ctx, op, tmp);
  	EVP_CIPHER_CTX_free(evp_ctx);
 	if (ret < 0) return ret;
 
@@ -260,8 +276,9 @@ int milenage_opc_generate(uint8_t opc[MILENAGE_OPC_SIZE],
  	return 0;
 }
 
-/** Generate AKA AUTN, IK, CK, RES
+/** Generate AKA AUTN, IK, CK, RES using a keyed context
  *
+ * @param[in] evp_ctx	Context from #milenage_ctx_alloc.
  * @param[out] autn	Buffer for AUTN = 128-bit authentication token.
  * @param[out] ik	Buffer for IK = 128-bit integrity key (f4), or NULL.
  * @param[out] ck	Buffer for CK = 128-bit confidentiality key (f3), or NULL.
@@ -269,32 +286,31 @@ int milenage_opc_generate(uint8_t opc[MILENAGE_OPC_SIZE],
  * @param[out] res	Buffer for RES = 64-bit signed response (f2), or NULL.
  * @param[in] opc	128-bit operator variant algorithm configuration field (encr.).
  * @param[in] amf	16-bit authentication management field.
- * @param[in] ki	128-bit subscriber key.
  * @param[in] sqn	48-bit sequence number (host byte order).
  * @param[in] rand	128-bit random challenge.
  * @return
  *	- 0 on success.
  *	- -1 on failure.
  */
-int milenage_umts_generate(uint8_t autn[MILENAGE_AUTN_SIZE],
-			   uint8_t ik[MILENAGE_IK_SIZE],
-			   uint8_t ck[MILENAGE_CK_SIZE],
-			   uint8_t ak[MILENAGE_AK_SIZE],
-			   uint8_t res[MILENAGE_RES_SIZE],
-			   uint8_t const opc[MILENAGE_OPC_SIZE],
-			   uint8_t const amf[MILENAGE_AMF_SIZE],
-			   uint8_t const ki[MILENAGE_KI_SIZE],
-			   uint64_t sqn,
-			   uint8_t const rand[MILENAGE_RAND_SIZE])
+int milenage_umts_generate_ctx(EVP_CIPHER_CTX *evp_ctx,
+			       uint8_t autn[MILENAGE_AUTN_SIZE],
+			       uint8_t ik[MILENAGE_IK_SIZE],
+			       uint8_t ck[MILENAGE_CK_SIZE],
+			       uint8_t ak[MILENAGE_AK_SIZE],
+			       uint8_t res[MILENAGE_RES_SIZE],
+			       uint8_t const opc[MILENAGE_OPC_SIZE],
+			       uint8_t const amf[MILENAGE_AMF_SIZE],
+			       uint64_t sqn,
+			       uint8_t const rand[MILENAGE_RAND_SIZE])
 {
 	uint8_t		mac_a[8], ak_buff[MILENAGE_AK_SIZE];
 	uint8_t		sqn_buff[MILENAGE_SQN_SIZE];
 	uint8_t		*p = autn;
 	size_t		i;
 
-	if ((milenage_f1(mac_a, NULL, opc, ki, rand,
+	if ((milenage_f1(evp_ctx, mac_a, NULL, opc, rand,
 			 uint48_to_buff(sqn_buff, sqn), amf) < 0) ||
-	    (milenage_f2345(res, ik, ck, ak_buff, NULL, opc, ki, rand) < 0)) return -1;
+	    (milenage_f2345(evp_ctx, res, ik, ck, ak_buff, NULL, opc, rand) < 0)) return -1;
 
 	/*
 	 *	AUTN = (SQN ^ AK) || AMF || MAC_A
@@ -312,6 +328,45 @@ int milenage_umts_generate(uint8_t autn[MILENAGE_AUTN_SIZE],
 	return 0;
 }
 
+/** Generate AKA AUTN, IK, CK, RES
+ *
+ * @param[out] autn	Buffer for AUTN = 128-bit authentication token.
+ * @param[out] ik	Buffer for IK = 128-bit integrity key (f4), or NULL.
+ * @param[out] ck	Buffer for CK = 128-bit confidentiality key (f3), or NULL.
+ * @param[out] ak	Buffer for AK = 48-bit anonymity key (f5), or NULL
+ * @param[out] res	Buffer for RES = 64-bit signed response (f2), or NULL.
+ * @param[in] opc	128-bit operator variant algorithm configuration field (encr.).
+ * @param[in] amf	16-bit authentication management field.
+ * @param[in] ki	128-bit subscriber key.
+ * @param[in] sqn	48-bit sequence number (host byte order).
+ * @param[in] rand	128-bit random challenge.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int milenage_umts_generate(uint8_t autn[MILENAGE_AUTN_SIZE],
+			   uint8_t ik[MILENAGE_IK_SIZE],
+			   uint8_t ck[MILENAGE_CK_SIZE],
+			   uint8_t ak[MILENAGE_AK_SIZE],
+			   uint8_t res[MILENAGE_RES_SIZE],
+			   uint8_t const opc[MILENAGE_OPC_SIZE],
+			   uint8_t const amf[MILENAGE_AMF_SIZE],
+			   uint8_t const ki[MILENAGE_KI_SIZE],
+			   uint64_t sqn,
+			   uint8_t const rand[MILENAGE_RAND_SIZE])
+{
+	EVP_CIPHER_CTX	*evp_ctx;
+	int		ret;
+
+	evp_ctx = milenage_ctx_alloc(ki);
+	if (!evp_ctx) return -1;
+
+	ret = milenage_umts_generate_ctx(evp_ctx, autn, ik, ck, ak, res, opc, amf, sqn, rand);
+	EVP_CIPHER_CTX_free(evp_ctx);
+
+	return ret;
+}
+
 /** Milenage AUTS validation
  *
  * @param[out] sqn	Buffer for SQN = 48-bit sequence number (host byte order).
@@ -334,13 +389,24 @@ int milenage_auts(uint64_t sqn,
 	uint8_t		sqn_buff[MILENAGE_SQN_SIZE];
 	size_t		i;
 
+	EVP_CIPHER_CTX	*evp_ctx;
+	int		ret = -1;
+
 	uint48_to_buff(sqn_buff, sqn);
 
-	if (milenage_f2345(NULL, NULL, NULL, NULL, ak, opc, ki, rand)) return -1;
+	evp_ctx = milenage_ctx_alloc(ki);
+	if (!evp_ctx) return -1;
+
+	if (milenage_f2345(evp_ctx, NULL, NULL, NULL, NULL, ak, opc, rand)) goto finish;
 	for (i = 0; i < sizeof(sqn_buff); i++) sqn_buff[i] = auts[i] ^ ak[i];
 
-	if (milenage_f1(NULL, mac_s, opc, ki, rand, sqn_buff, amf) || CRYPTO_memcmp(mac_s, auts + 6, 8) != 0) return -1;
-	return 0;
+	if (milenage_f1(evp_ctx, NULL, mac_s, opc, rand, sqn_buff, amf) || CRYPTO_memcmp(mac_s, auts + 6, 8) != 0) goto finish;
+
+	ret = 0;
+
+finish:
+	EVP_CIPHER_CTX_free(evp_ctx);
+	return ret;
 }
 
 /** Generate GSM-Milenage (3GPP TS 55.205) authentication triplet from a quintuplet
@@ -384,10 +450,39 @@ int milenage_gsm_generate(uint8_t sres[MILENAGE_SRES_SIZE],
 			  uint8_t const opc[MILENAGE_OPC_SIZE],
 			  uint8_t const ki[MILENAGE_KI_SIZE],
 			  uint8_t const rand[MILENAGE_RAND_SIZE])
+{
+	EVP_CIPHER_CTX	*evp_ctx;
+	int		ret;
+
+	evp_ctx = milenage_ctx_alloc(ki);
+	if (!evp_ctx) return -1;
+
+	ret = milenage_gsm_generate_ctx(evp_ctx, sres, kc, opc, rand);
+	EVP_CIPHER_CTX_free(evp_ctx);
+
+	return ret;
+}
+
+/** Generate GSM-Milenage (3GPP TS 55.205) authentication triplet using a keyed context
+ *
+ * @param[in] evp_ctx	Context from #milenage_ctx_alloc.
+ * @param[out] sres	Buffer for SRES = 32-bit SRES.
+ * @param[out] kc	64-bit Kc.
+ * @param[in] opc	128-bit operator variant algorithm configuration field (encr.).
+ * @param[in] rand	128-bit random challenge.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int milenage_gsm_generate_ctx(EVP_CIPHER_CTX *evp_ctx,
+			      uint8_t sres[MILENAGE_SRES_SIZE],
+			      uint8_t kc[MILENAGE_KC_SIZE],
+			      uint8_t const opc[MILENAGE_OPC_SIZE],
+			      uint8_t const rand[MILENAGE_RAND_SIZE])
 {
 	uint8_t		res[MILENAGE_RES_SIZE], ck[MILENAGE_CK_SIZE], ik[MILENAGE_IK_SIZE];
 
-	if (milenage_f2345(res, ik, ck, NULL, NULL, opc, ki, rand)) return -1;
+	if (milenage_f2345(evp_ctx, res, ik, ck, NULL, NULL, opc, rand)) return -1;
 
 	milenage_gsm_from_umts(sres, kc, ik, ck, res);
 
@@ -425,13 +520,18 @@ int milenage_check(uint8_t ik[MILENAGE_IK_SIZE],
 	uint8_t sqn_buff[MILENAGE_SQN_SIZE];
 	const uint8_t *amf;
 	size_t i;
+	EVP_CIPHER_CTX *evp_ctx;
+	int ret = -1;
 
 	uint48_to_buff(sqn_buff, sqn);
 
+	evp_ctx = milenage_ctx_alloc(ki);
+	if (!evp_ctx) return -1;
+
 	FR_PROTO_HEX_DUMP(autn, MILENAGE_AUTN_SIZE, "AUTN");
 	FR_PROTO_HEX_DUMP(rand, MILENAGE_RAND_SIZE, "RAND");
 
-	if (milenage_f2345(res, ck, ik, ak, NULL, opc, ki, rand)) return -1;
+	if (milenage_f2345(evp_ctx, res, ck, ik, ak, NULL, opc, rand)) goto finish;
 
 	FR_PROTO_HEX_DUMP(res, MILENAGE_RES_SIZE, "RES");
 	FR_PROTO_HEX_DUMP(ck, MILENAGE_CK_SIZE, "CK");
@@ -445,29 +545,34 @@ int milenage_check(uint8_t ik[MILENAGE_IK_SIZE],
 	if (CRYPTO_memcmp(rx_sqn, sqn_buff, sizeof(rx_sqn)) <= 0) {
 		uint8_t auts_amf[MILENAGE_AMF_SIZE] = { 0x00, 0x00 }; /* TS 33.102 v7.0.0, 6.3.3 */
 
-		if (milenage_f2345(NULL, NULL, NULL, NULL, ak, opc, ki, rand)) return -1;
+		if (milenage_f2345(evp_ctx, NULL, NULL, NULL, NULL, ak, opc, rand)) goto finish;
 
 		FR_PROTO_HEX_DUMP(ak, sizeof(ak), "AK*");
 		for (i = 0; i < 6; i++) auts[i] = sqn_buff[i] ^ ak[i];
 
-		if (milenage_f1(NULL, auts + 6, opc, ki, rand, sqn_buff, auts_amf) < 0) return -1;
+		if (milenage_f1(evp_ctx, NULL, auts + 6, opc, rand, sqn_buff, auts_amf) < 0) goto finish;
 		FR_PROTO_HEX_DUMP(auts, 14, "AUTS");
-		return -2;
+		ret = -2;
+		goto finish;
 	}
 
 	amf = autn + 6;
 	FR_PROTO_HEX_DUMP(amf, MILENAGE_AMF_SIZE, "AMF");
-	if (milenage_f1(mac_a, NULL, opc, ki, rand, rx_sqn, amf) < 0) return -1;
+	if (milenage_f1(evp_ctx, mac_a, NULL, opc, rand, rx_sqn, amf) < 0) goto finish;
 
 	FR_PROTO_HEX_DUMP(mac_a, MILENAGE_MAC_A_SIZE, "MAC_A");
 
 	if (CRYPTO_memcmp(mac_a, autn + 8, 8) != 0) {
 		FR_PROTO_HEX_DUMP(autn + 8, 8, "Received MAC_A");
 		fr_strerror_printf("MAC mismatch");
-		return -1;
+		goto finish;
 	}
 
-	return 0;
+	ret = 0;
+
+finish:
+	EVP_CIPHER_CTX_free(evp_ctx);
+	return ret;
 }
 
 #ifdef TESTING_MILENAGE
@@ -522,6 +627,7 @@ void test_set_1(void)
 	uint8_t ak_resync[]	= { 0x45, 0x1e, 0x8b, 0xec, 0xa4, 0x3b };
 
 	int ret = 0;
+	EVP_CIPHER_CTX *evp_ctx;
 
 /*
 	fr_log_fp = stdout;
@@ -534,8 +640,12 @@ void test_set_1(void)
 
 	TEST_CHECK(memcmp(opc_out, opc, sizeof(opc_out)) == 0);
 
-	if ((milenage_f1(mac_a_out, mac_s_out, opc, ki, rand, sqn, amf) < 0) ||
-	    (milenage_f2345(res_out, ik_out, ck_out, ak_out, ak_resync_out, opc, ki, rand) < 0)) ret = -1;
+	evp_ctx = milenage_ctx_alloc(ki);
+	TEST_CHECK(evp_ctx != NULL);
+
+	if ((milenage_f1(evp_ctx, mac_a_out, mac_s_out, opc, rand, sqn, amf) < 0) ||
+	    (milenage_f2345(evp_ctx, res_out, ik_out, ck_out, ak_out, ak_resync_out, opc, rand) < 0)) ret = -1;
+	EVP_CIPHER_CTX_free(evp_ctx);
 
 	FR_PROTO_HEX_DUMP(mac_a, sizeof(mac_a_out), "mac_a");
 	FR_PROTO_HEX_DUMP(mac_s, sizeof(mac_s_out), "mac_s");
@@ -601,6 +711,7 @@ void test_set_19(void)
 	uint8_t ak_resync[]	= { 0xd4, 0x61, 0xbc, 0x15, 0x47, 0x5d };
 
 	int ret = 0;
+	EVP_CIPHER_CTX *evp_ctx;
 
 /*
 	fr_log_fp = stdout;
@@ -614,8 +725,12 @@ void test_set_19(void)
 
 	TEST_CHECK(memcmp(opc_out, opc, sizeof(opc_out)) == 0);
 
-	if ((milenage_f1(mac_a_out, mac_s_out, opc, ki, rand, sqn, amf) < 0) ||
-	    (milenage_f2345(res_out, ik_out, ck_out, ak_out, ak_resync_out, opc, ki, rand) < 0)) ret = -1;
+	evp_ctx = milenage_ctx_alloc(ki);
+	TEST_CHECK(evp_ctx != NULL);
+
+	if ((milenage_f1(evp_ctx, mac_a_out, mac_s_out, opc, rand, sqn, amf) < 0) ||
+	    (milenage_f2345(evp_ctx, res_out, ik_out, ck_out, ak_out, ak_resync_out, opc, rand) < 0)) ret = -1;
+	EVP_CIPHER_CTX_free(evp_ctx);
 
 	FR_PROTO_HEX_DUMP(mac_a, sizeof(mac_a_out), "mac_a");
 	FR_PROTO_HEX_DUMP(mac_s, sizeof(mac_s_out), "mac_s");
@@ -18,6 +18,7 @@
  * @copyright 2006-2007 <j@w1.fi>
  */
 #include <stddef.h>
+#include <openssl/evp.h>
 
 /*
  *	Inputs
@@ -88,6 +89,19 @@ int	milenage_opc_generate(uint8_t opc[MILENAGE_OPC_SIZE],
 			      uint8_t const op[MILENAGE_OP_SIZE],
 			      uint8_t const ki[MILENAGE_KI_SIZE]);
 
+EVP_CIPHER_CTX	*milenage_ctx_alloc(uint8_t const ki[MILENAGE_KI_SIZE]);
+
+int	milenage_umts_generate_ctx(EVP_CIPHER_CTX *evp_ctx,
+				   uint8_t autn[MILENAGE_AUTN_SIZE],
+				   uint8_t ik[MILENAGE_IK_SIZE],
+				   uint8_t ck[MILENAGE_CK_SIZE],
+				   uint8_t ak[MILENAGE_AK_SIZE],
+				   uint8_t res[MILENAGE_RES_SIZE],
+				   uint8_t const opc[MILENAGE_OPC_SIZE],
+				   uint8_t const amf[MILENAGE_AMF_SIZE],
+				   uint64_t sqn,
+				   uint8_t const rand[MILENAGE_RAND_SIZE]);
+
 int	milenage_umts_generate(uint8_t autn[MILENAGE_AUTN_SIZE],
 			       uint8_t ik[MILENAGE_IK_SIZE],
 			       uint8_t ck[MILENAGE_CK_SIZE],
@@ -116,6 +130,11 @@ int	milenage_gsm_generate(uint8_t sres[MILENAGE_SRES_SIZE], uint8_t kc[MILENAGE_
 			      uint8_t const ki[MILENAGE_KI_SIZE],
 			      uint8_t const rand[MILENAGE_RAND_SIZE]);
 
+int	milenage_gsm_generate_ctx(EVP_CIPHER_CTX *evp_ctx,
+				  uint8_t sres[MILENAGE_SRES_SIZE], uint8_t kc[MILENAGE_KC_SIZE],
+				  uint8_t const opc[MILENAGE_OPC_SIZE],
+				  uint8_t const rand[MILENAGE_RAND_SIZE]);
+
 int	milenage_check(uint8_t ik[MILENAGE_IK_SIZE],
 		       uint8_t ck[MILENAGE_CK_SIZE],
 		       uint8_t res[MILENAGE_RES_SIZE],
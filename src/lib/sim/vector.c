@@ -71,7 +71,8 @@ static int vector_opc_from_op(REQUEST *request, uint8_t const **out, uint8_t opc
 	return 1;
 }
 
-static int vector_gsm_from_ki(eap_session_t *eap_session, VALUE_PAIR *vps, int idx, fr_sim_keys_t *keys)
+static int vector_gsm_from_ki(eap_session_t *eap_session, VALUE_PAIR *vps, int idx, fr_sim_keys_t *keys,
+			      fr_sim_vector_cache_t *cache)
 {
 	REQUEST		*request = eap_session->request;
 	VALUE_PAIR	*ki_vp, *version_vp;
@@ -117,6 +118,17 @@ static int vector_gsm_from_ki(eap_session_t *eap_session, VALUE_PAIR *vps, int i
 		}
 	}
 
+	/*
+	 *	Serve the triplet from a pre-generated batch
+	 */
+	if (cache) {
+		if (fr_sim_vector_cache_gsm(&keys->gsm.vector[idx], cache, version, ki_vp->vp_octets, opc_p) < 0) {
+			RPEDEBUG2("Failed deriving GSM triplet");
+			return -1;
+		}
+		return 0;
+	}
+
 	for (i = 0; i < SIM_VECTOR_GSM_RAND_SIZE; i += sizeof(uint32_t)) {
 		uint32_t rand = fr_rand();
 		memcpy(&keys->gsm.vector[idx].rand[i], &rand, sizeof(rand));
@@ -309,13 +321,16 @@ static int vector_gsm_from_quintuplets(eap_session_t *eap_session, VALUE_PAIR *v
  * @param src			Forces triplets to be retrieved from a particular src
  *				and ensures if multiple triplets are being retrieved
  *				that they all come from the same src.
+ * @param cache			If not NULL, and the triplet is being generated from
+ *				a Ki, serve it from a batch of pre-generated triplets.
  * @return
  *	- 1	Vector could not be retrieved from the specified src.
  *	- 0	Vector was retrieved OK and written to the specified index.
  *	- -1	Error retrieving vector from the specified src.
  */
 int fr_sim_vector_gsm_from_attrs(eap_session_t *eap_session, VALUE_PAIR *vps,
-				 int idx, fr_sim_keys_t *keys, fr_sim_vector_src_t *src)
+				 int idx, fr_sim_keys_t *keys, fr_sim_vector_src_t *src,
+				 fr_sim_vector_cache_t *cache)
 {
 	REQUEST		*request = eap_session->request;
 	int		ret;
@@ -326,7 +341,7 @@ int fr_sim_vector_gsm_from_attrs(eap_session_t *eap_session, VALUE_PAIR *vps,
 	switch (*src) {
 	default:
 	case SIM_VECTOR_SRC_KI:
-		ret = vector_gsm_from_ki(eap_session, vps, idx, keys);
+		ret = vector_gsm_from_ki(eap_session, vps, idx, keys, cache);
 		if (ret == 0) {
 			*src = SIM_VECTOR_SRC_KI;
 			break;
@@ -384,7 +399,8 @@ int fr_sim_vector_gsm_from_attrs(eap_session_t *eap_session, VALUE_PAIR *vps,
 	return 0;
 }
 
-static int vector_umts_from_ki(eap_session_t *eap_session, VALUE_PAIR *vps, fr_sim_keys_t *keys)
+static int vector_umts_from_ki(eap_session_t *eap_session, VALUE_PAIR *vps, fr_sim_keys_t *keys,
+			       fr_sim_vector_cache_t *cache)
 {
 	REQUEST		*request = eap_session->request;
 	VALUE_PAIR	*ki_vp, *amf_vp, *sqn_vp, *version_vp;
@@ -459,6 +475,20 @@ static int vector_umts_from_ki(eap_session_t *eap_session, VALUE_PAIR *vps, fr_s
 				"AMF          :");
 		REXDENT();
 
+		/*
+		 *	Serve the quintuplet from a pre-generated batch.
+		 *	The SQN may have advanced past the one provided.
+		 */
+		if (cache) {
+			if (fr_sim_vector_cache_umts(&keys->umts.vector, &keys->sqn, cache,
+						     ki_vp->vp_octets, opc_p, amf_buff, sqn) < 0) {
+				RPEDEBUG2("Failed deriving UMTS Quintuplet");
+				return -1;
+			}
+			RDEBUG3("Using quintuplet with SQN %" PRIu64, keys->sqn);
+			return 0;
+		}
+
 		if (milenage_umts_generate(keys->umts.vector.autn,
 					   keys->umts.vector.ik,
 					   keys->umts.vector.ck,
@@ -648,6 +678,8 @@ static int vector_umts_from_quintuplets(eap_session_t *eap_session, VALUE_PAIR *
  * @param vps			List to hunt for triplets in.
  * @param keys			UMTS keys.
  * @param src			Forces quintuplets to be retrieved from a particular src.
+ * @param cache			If not NULL, and the quintuplet is being generated from
+ *				a Ki, serve it from a batch of pre-generated quintuplets.
  *
  * @return
  *	- 1	Vector could not be retrieved from the specified src.
@@ -655,7 +687,8 @@ static int vector_umts_from_quintuplets(eap_session_t *eap_session, VALUE_PAIR *
  *	- -1	Error retrieving vector from the specified src.
  */
 int fr_sim_vector_umts_from_attrs(eap_session_t *eap_session, VALUE_PAIR *vps,
-				  fr_sim_keys_t *keys, fr_sim_vector_src_t *src)
+				  fr_sim_keys_t *keys, fr_sim_vector_src_t *src,
+				  fr_sim_vector_cache_t *cache)
 {
 	REQUEST		*request = eap_session->request;
 	int		ret;
@@ -665,7 +698,7 @@ int fr_sim_vector_umts_from_attrs(eap_session_t *eap_session, VALUE_PAIR *vps,
 	switch (*src) {
 	default:
 	case SIM_VECTOR_SRC_KI:
-		ret = vector_umts_from_ki(eap_session, vps, keys);
+		ret = vector_umts_from_ki(eap_session, vps, keys, cache);
 		if (ret == 0) {
 			*src = SIM_VECTOR_SRC_KI;
 			break;
@@ -0,0 +1,536 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file src/lib/sim/vector_cache.c
+ * @brief Cache of pre-generated GSM triplets and UMTS quintuplets.
+ *
+ * When vectors are generated locally from a Ki, the expensive part of
+ * the operation is setting up the AES key schedule (Milenage), and
+ * fetching the subscriber's credentials.  Rather than generating
+ * a single vector each time one is needed, we generate a batch of
+ * vectors with a single keyed context, hand out the first one, and
+ * store the rest, keyed by the subscriber's credentials.
+ *
+ * Each vector is only ever handed out once.  When the batch is
+ * exhausted, or the entry expires, a new batch is generated.
+ *
+ * UMTS entries are keyed on the credentials only, not on the SQN.  They
+ * track the sequence number of the last vector generated, so that
+ * subsequent batches continue the SQN sequence instead of regenerating
+ * vectors the SIM would reject as replays.
+ *
+ * @copyright 2019 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/eap/base.h>
+#include <freeradius-devel/util/hash.h>
+#include <freeradius-devel/util/dlist.h>
+#include "base.h"
+#include "comp128.h"
+#include "milenage.h"
+
+#include <pthread.h>
+
+/** Maximum length of the credentials we key entries on
+ *
+ * version || Ki || OPc || AMF
+ */
+#define SIM_VECTOR_CACHE_KEY_MAX	(sizeof(uint32_t) + MILENAGE_KI_SIZE + MILENAGE_OPC_SIZE + MILENAGE_AMF_SIZE)
+
+/** A batch of vectors for a single subscriber
+ *
+ */
+typedef struct {
+	uint8_t			key[SIM_VECTOR_CACHE_KEY_MAX];	//!< Subscriber credentials.
+	size_t			key_len;			//!< Length of the key.
+
+	fr_sim_vector_type_t	type;				//!< GSM or UMTS.
+	time_t			expires;			//!< When the remaining vectors
+								///< should no longer be used.
+
+	uint32_t		num;				//!< Number of vectors in the batch.
+	uint32_t		next;				//!< Index of the next vector to hand out.
+
+	uint64_t		sqn;				//!< SQN of the first vector in the batch.
+	uint64_t		next_sqn;			//!< SQN to use for the first vector
+								///< of the next batch.
+
+	union {
+		fr_sim_vector_gsm_t	*gsm;			//!< Array of triplets.
+		fr_sim_vector_umts_t	*umts;			//!< Array of quintuplets.
+	};
+
+	fr_dlist_t		entry;				//!< Entry in the LRU list.
+} sim_vector_cache_entry_t;
+
+struct fr_sim_vector_cache_s {
+	pthread_mutex_t		mutex;
+	fr_hash_table_t		*ht;				//!< Entries keyed by credentials.
+	fr_dlist_head_t		lru;				//!< Most recently used entries at the head.
+
+	uint32_t		batch_size;			//!< How many vectors to generate at once.
+	uint32_t		max_entries;			//!< Maximum number of subscribers to cache.
+	uint32_t		lifetime;			//!< How long generated vectors remain valid.
+
+	uint64_t		hits;				//!< Vectors served from the cache.
+	uint64_t		misses;				//!< Batches generated.
+	uint64_t		evictions;			//!< Entries removed to make space.
+};
+
+static uint32_t sim_vector_cache_hash(void const *data)
+{
+	sim_vector_cache_entry_t const *c = data;
+
+	return fr_hash(c->key, c->key_len);
+}
+
+static int sim_vector_cache_cmp(void const *one, void const *two)
+{
+	sim_vector_cache_entry_t const *a = one, *b = two;
+
+	if (a->key_len < b->key_len) return -1;
+	if (a->key_len > b->key_len) return +1;
+
+	return memcmp(a->key, b->key, a->key_len);
+}
+
+/** Remove an entry from the cache
+ *
+ * Vectors contain key material, so we scrub them before freeing.
+ */
+static void sim_vector_cache_entry_free(fr_sim_vector_cache_t *vc, sim_vector_cache_entry_t *c)
+{
+	fr_hash_table_delete(vc->ht, c);
+	fr_dlist_remove(&vc->lru, c);
+
+	switch (c->type) {
+	case SIM_VECTOR_GSM:
+		memset(c->gsm, 0, talloc_get_size(c->gsm));
+		break;
+
+	case SIM_VECTOR_UMTS:
+		if (c->umts) memset(c->umts, 0, talloc_get_size(c->umts));
+		break;
+
+	default:
+		break;
+	}
+	memset(c->key, 0, sizeof(c->key));
+
+	talloc_free(c);
+}
+
+/** Build a lookup key from the subscriber's credentials
+ *
+ */
+static size_t sim_vector_cache_key(uint8_t out[SIM_VECTOR_CACHE_KEY_MAX],
+				   uint32_t version, uint8_t const *ki, uint8_t const *opc,
+				   uint8_t const *amf)
+{
+	uint8_t *p = out;
+
+	memcpy(p, &version, sizeof(version));
+	p += sizeof(version);
+
+	memcpy(p, ki, MILENAGE_KI_SIZE);
+	p += MILENAGE_KI_SIZE;
+
+	if (opc) {
+		memcpy(p, opc, MILENAGE_OPC_SIZE);
+		p += MILENAGE_OPC_SIZE;
+	}
+
+	if (amf) {
+		memcpy(p, amf, MILENAGE_AMF_SIZE);
+		p += MILENAGE_AMF_SIZE;
+	}
+
+	return p - out;
+}
+
+/** Find the entry for a subscriber, marking it as most recently used
+ *
+ * Must be called with the mutex held.
+ */
+static sim_vector_cache_entry_t *sim_vector_cache_find(fr_sim_vector_cache_t *vc,
+						       uint8_t const *key, size_t key_len)
+{
+	sim_vector_cache_entry_t	find, *c;
+
+	memcpy(find.key, key, key_len);
+	find.key_len = key_len;
+
+	c = fr_hash_table_finddata(vc->ht, &find);
+	if (!c) return NULL;
+
+	fr_dlist_remove(&vc->lru, c);
+	fr_dlist_insert_head(&vc->lru, c);
+
+	return c;
+}
+
+/** Whether an entry has unused, unexpired vectors of the right type
+ *
+ */
+static inline bool sim_vector_cache_usable(sim_vector_cache_entry_t const *c, fr_sim_vector_type_t type)
+{
+	return (c->type == type) && (c->next < c->num) && (c->expires > time(NULL));
+}
+
+/** Insert a new batch, replacing any existing entry
+ *
+ * Must be called with the mutex held.
+ */
+static void sim_vector_cache_insert(fr_sim_vector_cache_t *vc, sim_vector_cache_entry_t *c)
+{
+	sim_vector_cache_entry_t *old;
+
+	old = fr_hash_table_finddata(vc->ht, c);
+	if (old) {
+		/*
+		 *	Another caller may have reserved a later
+		 *	SQN range while we were generating.  Never
+		 *	move the sequence backwards.
+		 */
+		if ((old->type == SIM_VECTOR_UMTS) && (c->type == SIM_VECTOR_UMTS) &&
+		    (old->next_sqn > c->next_sqn)) c->next_sqn = old->next_sqn;
+		sim_vector_cache_entry_free(vc, old);
+	}
+
+	if (!fr_hash_table_insert(vc->ht, c)) {
+		talloc_free(c);
+		return;
+	}
+	fr_dlist_insert_head(&vc->lru, c);
+
+	while ((uint32_t)fr_hash_table_num_elements(vc->ht) > vc->max_entries) {
+		sim_vector_cache_entry_free(vc, fr_dlist_tail(&vc->lru));
+		vc->evictions++;
+	}
+}
+
+static void sim_vector_rand(uint8_t *rand, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i += sizeof(uint32_t)) {
+		uint32_t r = fr_rand();
+		memcpy(&rand[i], &r, sizeof(r));
+	}
+}
+
+/** Generate a batch of GSM triplets
+ *
+ */
+static int sim_vector_gsm_batch(fr_sim_vector_gsm_t *out, uint32_t num, uint32_t version,
+				uint8_t const *ki, uint8_t const *opc)
+{
+	EVP_CIPHER_CTX	*evp_ctx = NULL;
+	uint32_t	i;
+	int		ret = 0;
+
+	if (version == 4) {
+		evp_ctx = milenage_ctx_alloc(ki);
+		if (!evp_ctx) return -1;
+	}
+
+	for (i = 0; i < num; i++) {
+		sim_vector_rand(out[i].rand, sizeof(out[i].rand));
+
+		switch (version) {
+		case 1:
+			comp128v1(out[i].sres, out[i].kc, ki, out[i].rand);
+			break;
+
+		case 2:
+		case 3:
+			comp128v23(out[i].sres, out[i].kc, ki, out[i].rand, (version == 2));
+			break;
+
+		case 4:
+			if (milenage_gsm_generate_ctx(evp_ctx, out[i].sres, out[i].kc, opc, out[i].rand) < 0) {
+				ret = -1;
+				goto finish;
+			}
+			break;
+
+		default:
+			fr_strerror_printf("Unknown/unsupported algorithm %u", version);
+			ret = -1;
+			goto finish;
+		}
+	}
+
+finish:
+	if (evp_ctx) EVP_CIPHER_CTX_free(evp_ctx);
+
+	return ret;
+}
+
+/** Retrieve a GSM triplet from the cache, generating a new batch if required
+ *
+ * @param[out] out	Where to write the triplet.
+ * @param[in] vc	Vector cache.
+ * @param[in] version	COMP128 version (1-3), or 4 for GSM-Milenage.
+ * @param[in] ki	Subscriber key.
+ * @param[in] opc	Derived operator code.  Must be provided if version is 4.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_sim_vector_cache_gsm(fr_sim_vector_gsm_t *out, fr_sim_vector_cache_t *vc, uint32_t version,
+			    uint8_t const *ki, uint8_t const *opc)
+{
+	uint8_t				key[SIM_VECTOR_CACHE_KEY_MAX];
+	size_t				key_len;
+	sim_vector_cache_entry_t	*c;
+
+	key_len = sim_vector_cache_key(key, version, ki, (version == 4) ? opc : NULL, NULL);
+
+	pthread_mutex_lock(&vc->mutex);
+	c = sim_vector_cache_find(vc, key, key_len);
+	if (c && sim_vector_cache_usable(c, SIM_VECTOR_GSM)) {
+		memcpy(out, &c->gsm[c->next], sizeof(*out));
+		memset(&c->gsm[c->next], 0, sizeof(c->gsm[c->next]));
+		c->next++;
+		vc->hits++;
+		pthread_mutex_unlock(&vc->mutex);
+		return 0;
+	}
+	if (c) sim_vector_cache_entry_free(vc, c);
+	vc->misses++;
+	pthread_mutex_unlock(&vc->mutex);
+
+	/*
+	 *	Generate outside of the lock so other
+	 *	subscribers aren't blocked.
+	 */
+	MEM(c = talloc_zero(NULL, sim_vector_cache_entry_t));
+	MEM(c->gsm = talloc_zero_array(c, fr_sim_vector_gsm_t, vc->batch_size));
+	memcpy(c->key, key, key_len);
+	c->key_len = key_len;
+	c->type = SIM_VECTOR_GSM;
+	c->num = vc->batch_size;
+	c->expires = time(NULL) + vc->lifetime;
+
+	if (sim_vector_gsm_batch(c->gsm, c->num, version, ki, opc) < 0) {
+		memset(c->gsm, 0, talloc_get_size(c->gsm));
+		talloc_free(c);
+		return -1;
+	}
+
+	memcpy(out, &c->gsm[0], sizeof(*out));
+	memset(&c->gsm[0], 0, sizeof(c->gsm[0]));
+	c->next = 1;
+
+	if (c->next >= c->num) {
+		talloc_free(c);
+		return 0;
+	}
+
+	pthread_mutex_lock(&vc->mutex);
+	talloc_steal(vc, c);
+	sim_vector_cache_insert(vc, c);
+	pthread_mutex_unlock(&vc->mutex);
+
+	return 0;
+}
+
+/** Retrieve a UMTS quintuplet from the cache, generating a new batch if required
+ *
+ * Vectors in a batch are generated with consecutive sequence numbers, starting
+ * at the SQN provided, or where the previous batch for the same subscriber left
+ * off, whichever is higher.
+ *
+ * Cached vectors are only handed out if their SQN is at least the one provided.
+ * If the SQN has moved past them, e.g. after a resynchronisation, the SIM would
+ * reject them, so a new batch is generated.
+ *
+ * @param[out] out	Where to write the quintuplet.
+ * @param[out] sqn_out	The sequence number used to generate the quintuplet.
+ * @param[in] vc	Vector cache.
+ * @param[in] ki	Subscriber key.
+ * @param[in] opc	Derived operator code.
+ * @param[in] amf	Authentication management field.
+ * @param[in] sqn	Sequence number to start from.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_sim_vector_cache_umts(fr_sim_vector_umts_t *out, uint64_t *sqn_out, fr_sim_vector_cache_t *vc,
+			     uint8_t const *ki, uint8_t const *opc, uint8_t const *amf, uint64_t sqn)
+{
+	uint8_t				key[SIM_VECTOR_CACHE_KEY_MAX];
+	size_t				key_len;
+	sim_vector_cache_entry_t	*c;
+	EVP_CIPHER_CTX			*evp_ctx;
+	uint64_t			start = sqn;
+	uint32_t			i;
+
+	key_len = sim_vector_cache_key(key, 4, ki, opc, amf);
+
+	pthread_mutex_lock(&vc->mutex);
+	c = sim_vector_cache_find(vc, key, key_len);
+	if (c && sim_vector_cache_usable(c, SIM_VECTOR_UMTS) && ((c->sqn + c->next) >= sqn)) {
+		memcpy(out, &c->umts[c->next], sizeof(*out));
+		memset(&c->umts[c->next], 0, sizeof(c->umts[c->next]));
+		*sqn_out = c->sqn + c->next;
+		c->next++;
+		vc->hits++;
+		pthread_mutex_unlock(&vc->mutex);
+		return 0;
+	}
+	if (c && (c->type != SIM_VECTOR_UMTS)) {
+		sim_vector_cache_entry_free(vc, c);
+		c = NULL;
+	}
+
+	/*
+	 *	Reserve the SQN range for the new batch before
+	 *	releasing the lock, so that concurrent misses for
+	 *	the same subscriber generate from different ranges.
+	 *	If there's no entry yet, insert an empty one to hold
+	 *	the reservation.
+	 */
+	if (c) {
+		if (c->next_sqn > start) start = c->next_sqn;
+		if (c->umts) memset(c->umts, 0, talloc_get_size(c->umts));
+		c->next = c->num;
+		c->next_sqn = start + vc->batch_size;
+	} else {
+		MEM(c = talloc_zero(vc, sim_vector_cache_entry_t));
+		memcpy(c->key, key, key_len);
+		c->key_len = key_len;
+		c->type = SIM_VECTOR_UMTS;
+		c->next_sqn = start + vc->batch_size;
+		sim_vector_cache_insert(vc, c);
+	}
+	vc->misses++;
+	pthread_mutex_unlock(&vc->mutex);
+
+	MEM(c = talloc_zero(NULL, sim_vector_cache_entry_t));
+	MEM(c->umts = talloc_zero_array(c, fr_sim_vector_umts_t, vc->batch_size));
+	memcpy(c->key, key, key_len);
+	c->key_len = key_len;
+	c->type = SIM_VECTOR_UMTS;
+	c->num = vc->batch_size;
+	c->expires = time(NULL) + vc->lifetime;
+	c->sqn = start;
+	c->next_sqn = start + c->num;
+
+	evp_ctx = milenage_ctx_alloc(ki);
+	if (!evp_ctx) {
+	error:
+		memset(c->umts, 0, talloc_get_size(c->umts));
+		talloc_free(c);
+		return -1;
+	}
+
+	for (i = 0; i < c->num; i++) {
+		fr_sim_vector_umts_t *v = &c->umts[i];
+
+		sim_vector_rand(v->rand, sizeof(v->rand));
+		if (milenage_umts_generate_ctx(evp_ctx, v->autn, v->ik, v->ck, v->ak, v->xres,
+					       opc, amf, c->sqn + i, v->rand) < 0) {
+			EVP_CIPHER_CTX_free(evp_ctx);
+			goto error;
+		}
+		v->xres_len = 8;
+	}
+	EVP_CIPHER_CTX_free(evp_ctx);
+
+	memcpy(out, &c->umts[0], sizeof(*out));
+	memset(&c->umts[0], 0, sizeof(c->umts[0]));
+	*sqn_out = c->sqn;
+	c->next = 1;
+
+	/*
+	 *	Even if there are no vectors left, we keep
+	 *	the entry so the next batch continues the
+	 *	SQN sequence.
+	 */
+	pthread_mutex_lock(&vc->mutex);
+	talloc_steal(vc, c);
+	sim_vector_cache_insert(vc, c);
+	pthread_mutex_unlock(&vc->mutex);
+
+	return 0;
+}
+
+/** Return statistics for the vector cache
+ *
+ */
+void fr_sim_vector_cache_stats(fr_sim_vector_cache_t *vc, uint64_t *entries,
+			       uint64_t *hits, uint64_t *misses, uint64_t *evictions)
+{
+	pthread_mutex_lock(&vc->mutex);
+	*entries = fr_hash_table_num_elements(vc->ht);
+	*hits = vc->hits;
+	*misses = vc->misses;
+	*evictions = vc->evictions;
+	pthread_mutex_unlock(&vc->mutex);
+}
+
+static int _sim_vector_cache_free(fr_sim_vector_cache_t *vc)
+{
+	sim_vector_cache_entry_t *c;
+
+	while ((c = fr_dlist_head(&vc->lru))) sim_vector_cache_entry_free(vc, c);
+	pthread_mutex_destroy(&vc->mutex);
+
+	return 0;
+}
+
+/** Allocate a new vector cache
+ *
+ * @param[in] ctx		to allocate the cache in.
+ * @param[in] batch_size	How many vectors to generate for a subscriber at once.
+ * @param[in] max_entries	Maximum number of subscribers to hold vectors for.
+ * @param[in] lifetime		How long (in seconds) generated vectors may be used for.
+ * @return
+ *	- A new vector cache.
+ *	- NULL on error.
+ */
+fr_sim_vector_cache_t *fr_sim_vector_cache_alloc(TALLOC_CTX *ctx, uint32_t batch_size,
+						 uint32_t max_entries, uint32_t lifetime)
+{
+	fr_sim_vector_cache_t *vc;
+
+	if (!batch_size || !max_entries || !lifetime) {
+		fr_strerror_printf("Vector cache batch_size, max_entries and lifetime must be non-zero");
+		return NULL;
+	}
+
+	MEM(vc = talloc_zero(ctx, fr_sim_vector_cache_t));
+	vc->ht = fr_hash_table_create(vc, sim_vector_cache_hash, sim_vector_cache_cmp, NULL);
+	if (!vc->ht) {
+		talloc_free(vc);
+		return NULL;
+	}
+	fr_dlist_talloc_init(&vc->lru, sim_vector_cache_entry_t, entry);
+
+	vc->batch_size = batch_size;
+	vc->max_entries = max_entries;
+	vc->lifetime = lifetime;
+
+	pthread_mutex_init(&vc->mutex, NULL);
+	talloc_set_destructor(vc, _sim_vector_cache_free);
+
+	return vc;
+}
@@ -12,6 +12,7 @@ SOURCES	:= \
 	log.c \
 	ocsp.c \
 	session.c \
+	ticket.c \
 	utils.c \
 	validate.c \
 
@@ -33,10 +33,49 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/server/rad_assert.h>
 
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/hash.h>
+
+#include <pthread.h>
+
 #include "base.h"
 #include "missing.h"
 #include "attrs.h"
 
+/** A serialised session held in the memory cache
+ *
+ */
+typedef struct {
+	uint8_t			*id;			//!< Session ID.
+	uint8_t			*blob;			//!< Serialised SSL_SESSION.
+	time_t			expires;		//!< When the entry can no longer be used.
+	fr_dlist_t		entry;			//!< Entry in the shard's LRU list.
+} tls_cache_memory_entry_t;
+
+/** One shard of the memory cache
+ *
+ * Each shard has its own lock, so workers only contend when they
+ * access sessions which hash to the same shard.
+ */
+typedef struct {
+	pthread_mutex_t		mutex;
+	fr_hash_table_t		*ht;			//!< Entries keyed by session ID.
+	fr_dlist_head_t		lru;			//!< Most recently used entries at the head.
+	uint32_t		max_entries;		//!< Evict the least recently used entry above this.
+
+	uint64_t		hits;
+	uint64_t		misses;
+	uint64_t		stores;
+	uint64_t		evictions;		//!< Entries removed to make space for new ones.
+	uint64_t		expired;		//!< Entries removed because their lifetime passed.
+} tls_cache_memory_shard_t;
+
+struct fr_tls_cache_memory_s {
+	tls_cache_memory_shard_t **shards;
+	uint32_t		num_shards;
+	uint32_t		lifetime;		//!< How long entries remain valid.
+};
+
 /** Add attributes identifying the TLS session to be acted upon, and the action to be performed
  *
  * Adds the following attributes to the request:
@@ -153,6 +192,263 @@ do { \
 	return 0;
 }
 
+static uint32_t tls_cache_memory_hash(void const *data)
+{
+	tls_cache_memory_entry_t const *c = data;
+
+	return fr_hash(c->id, talloc_array_length(c->id));
+}
+
+static int tls_cache_memory_cmp(void const *one, void const *two)
+{
+	tls_cache_memory_entry_t const *a = one, *b = two;
+	size_t a_len = talloc_array_length(a->id), b_len = talloc_array_length(b->id);
+
+	if (a_len != b_len) return (a_len < b_len) - (a_len > b_len);
+
+	return memcmp(a->id, b->id, a_len);
+}
+
+static inline tls_cache_memory_shard_t *tls_cache_memory_shard(fr_tls_cache_memory_t *mc,
+								uint8_t const *key, size_t key_len)
+{
+	return mc->shards[fr_hash(key, key_len) % mc->num_shards];
+}
+
+/** Remove an entry from a shard, and free it
+ *
+ * @note Must be called with the shard's mutex held.
+ */
+static void tls_cache_memory_entry_free(tls_cache_memory_shard_t *shard, tls_cache_memory_entry_t *c)
+{
+	fr_hash_table_delete(shard->ht, c);
+	fr_dlist_remove(&shard->lru, c);
+	talloc_free(c);
+}
+
+/** Write a serialised session to the memory cache
+ *
+ * @param[in] mc		to write the session to.
+ * @param[in] key		Session ID.
+ * @param[in] key_len		Length of the session ID.
+ * @param[in] blob		Serialised session.
+ * @param[in] blob_len		Length of the serialised session.
+ */
+static void tls_cache_memory_store(fr_tls_cache_memory_t *mc, uint8_t const *key, size_t key_len,
+				   uint8_t const *blob, size_t blob_len)
+{
+	tls_cache_memory_shard_t	*shard = tls_cache_memory_shard(mc, key, key_len);
+	tls_cache_memory_entry_t	find, *c;
+
+	memcpy(&find.id, &key, sizeof(find.id));	/* const issues */
+
+	pthread_mutex_lock(&shard->mutex);
+
+	/*
+	 *	Allocations are done under the lock, as the
+	 *	entries are children of the shard.
+	 */
+	c = fr_hash_table_finddata(shard->ht, &find);
+	if (c) {
+		talloc_free(c->blob);
+		fr_dlist_remove(&shard->lru, c);
+	} else {
+		MEM(c = talloc_zero(shard, tls_cache_memory_entry_t));
+		MEM(c->id = talloc_memdup(c, key, key_len));
+		if (!fr_hash_table_insert(shard->ht, c)) {
+			talloc_free(c);
+			pthread_mutex_unlock(&shard->mutex);
+			return;
+		}
+	}
+	MEM(c->blob = talloc_memdup(c, blob, blob_len));
+	c->expires = time(NULL) + mc->lifetime;
+	fr_dlist_insert_head(&shard->lru, c);
+	shard->stores++;
+
+	while ((uint32_t)fr_hash_table_num_elements(shard->ht) > shard->max_entries) {
+		tls_cache_memory_entry_free(shard, fr_dlist_tail(&shard->lru));
+		shard->evictions++;
+	}
+
+	pthread_mutex_unlock(&shard->mutex);
+}
+
+/** Read a serialised session from the memory cache
+ *
+ * @param[in] ctx		to allocate the copy of the session in.
+ * @param[in] mc		to read the session from.
+ * @param[in] key		Session ID.
+ * @param[in] key_len		Length of the session ID.
+ * @return
+ *	- A copy of the serialised session.
+ *	- NULL if no session was found, or it had expired.
+ */
+static uint8_t *tls_cache_memory_load(TALLOC_CTX *ctx, fr_tls_cache_memory_t *mc, uint8_t const *key, size_t key_len)
+{
+	tls_cache_memory_shard_t	*shard = tls_cache_memory_shard(mc, key, key_len);
+	tls_cache_memory_entry_t	find, *c;
+	uint8_t				*blob = NULL;
+
+	memcpy(&find.id, &key, sizeof(find.id));	/* const issues */
+
+	pthread_mutex_lock(&shard->mutex);
+	c = fr_hash_table_finddata(shard->ht, &find);
+	if (!c) {
+		shard->misses++;
+		goto done;
+	}
+
+	if (c->expires <= time(NULL)) {
+		tls_cache_memory_entry_free(shard, c);
+		shard->expired++;
+		shard->misses++;
+		goto done;
+	}
+
+	fr_dlist_remove(&shard->lru, c);
+	fr_dlist_insert_head(&shard->lru, c);
+	shard->hits++;
+
+	MEM(blob = talloc_memdup(ctx, c->blob, talloc_array_length(c->blob)));
+
+done:
+	pthread_mutex_unlock(&shard->mutex);
+
+	return blob;
+}
+
+/** Remove a session from the memory cache
+ *
+ * @param[in] mc		to remove the session from.
+ * @param[in] key		Session ID.
+ * @param[in] key_len		Length of the session ID.
+ */
+static void tls_cache_memory_delete(fr_tls_cache_memory_t *mc, uint8_t const *key, size_t key_len)
+{
+	tls_cache_memory_shard_t	*shard = tls_cache_memory_shard(mc, key, key_len);
+	tls_cache_memory_entry_t	find, *c;
+
+	memcpy(&find.id, &key, sizeof(find.id));	/* const issues */
+
+	pthread_mutex_lock(&shard->mutex);
+	c = fr_hash_table_finddata(shard->ht, &find);
+	if (c) tls_cache_memory_entry_free(shard, c);
+	pthread_mutex_unlock(&shard->mutex);
+}
+
+static int cmd_stats_tls_cache(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	fr_tls_cache_memory_t const	*mc = ctx;
+	uint64_t			entries = 0, hits = 0, misses = 0, stores = 0, evictions = 0, expired = 0;
+	uint32_t			i;
+
+	for (i = 0; i < mc->num_shards; i++) {
+		tls_cache_memory_shard_t *shard = mc->shards[i];
+
+		pthread_mutex_lock(&shard->mutex);
+		entries += fr_hash_table_num_elements(shard->ht);
+		hits += shard->hits;
+		misses += shard->misses;
+		stores += shard->stores;
+		evictions += shard->evictions;
+		expired += shard->expired;
+		pthread_mutex_unlock(&shard->mutex);
+	}
+
+	fprintf(fp, "entries			%" PRIu64 "\n", entries);
+	fprintf(fp, "hits			%" PRIu64 "\n", hits);
+	fprintf(fp, "misses			%" PRIu64 "\n", misses);
+	fprintf(fp, "hit_rate		%.2f%%\n", (hits + misses) ? ((double)hits * 100) / (hits + misses) : 0.0);
+	fprintf(fp, "stores			%" PRIu64 "\n", stores);
+	fprintf(fp, "evictions		%" PRIu64 "\n", evictions);
+	fprintf(fp, "expired			%" PRIu64 "\n", expired);
+
+	return 0;
+}
+
+static fr_cmd_table_t cmd_tls_cache_table[] = {
+	{
+		.parent = "stats",
+		.name = "tls",
+		.help = "Statistics for TLS.",
+		.read_only = true
+	},
+
+	{
+		.parent = "stats tls",
+		.add_name = true,
+		.name = "cache",
+		.func = cmd_stats_tls_cache,
+		.help = "Show statistics for an in-memory TLS session cache.",
+		.read_only = true
+	},
+
+	CMD_TABLE_END
+};
+
+static int _tls_cache_memory_shard_free(tls_cache_memory_shard_t *shard)
+{
+	pthread_mutex_destroy(&shard->mutex);
+
+	return 0;
+}
+
+/** Allocate a memory cache for serialised sessions
+ *
+ * @param[in] ctx		to allocate the cache in.
+ * @param[in] name		to register radmin commands under.
+ * @param[in] max_entries	Maximum number of sessions to hold across all shards.
+ * @param[in] num_shards	Number of independently locked shards.
+ * @param[in] lifetime		How long sessions remain valid.
+ * @return
+ *	- The new cache on success.
+ *	- NULL on error.
+ */
+fr_tls_cache_memory_t *tls_cache_memory_alloc(TALLOC_CTX *ctx, char const *name,
+					      uint32_t max_entries, uint32_t num_shards, uint32_t lifetime)
+{
+	fr_tls_cache_memory_t	*mc;
+	uint32_t		i;
+
+	if (!num_shards) num_shards = 1;
+	if (max_entries < num_shards) max_entries = num_shards;
+
+	MEM(mc = talloc_zero(ctx, fr_tls_cache_memory_t));
+	MEM(mc->shards = talloc_zero_array(mc, tls_cache_memory_shard_t *, num_shards));
+	mc->num_shards = num_shards;
+	mc->lifetime = lifetime;
+
+	for (i = 0; i < num_shards; i++) {
+		tls_cache_memory_shard_t *shard;
+
+		/*
+		 *	Each shard is a separate talloc context,
+		 *	so workers can allocate entries in different
+		 *	shards concurrently.
+		 */
+		MEM(shard = mc->shards[i] = talloc_zero(mc, tls_cache_memory_shard_t));
+		pthread_mutex_init(&shard->mutex, NULL);
+		talloc_set_destructor(shard, _tls_cache_memory_shard_free);
+
+		shard->ht = fr_hash_table_create(shard, tls_cache_memory_hash, tls_cache_memory_cmp, NULL);
+		if (!shard->ht) {
+			ERROR("Failed creating TLS session cache");
+			talloc_free(mc);
+			return NULL;
+		}
+		fr_dlist_talloc_init(&shard->lru, tls_cache_memory_entry_t, entry);
+		shard->max_entries = (max_entries + num_shards - 1) / num_shards;
+	}
+
+	if (fr_command_register_hook(NULL, name, mc, cmd_tls_cache_table) < 0) {
+		WARN("Failed registering radmin commands for TLS session cache \"%s\" - %s",
+		     name, fr_strerror());
+	}
+
+	return mc;
+}
+
 /** Retrieve session ID (in binary form) from the session
  *
  * @param[out] out Where to write the session ID pointer.
@@ -273,6 +569,14 @@ int tls_cache_write(REQUEST *request, tls_session_t *tls_session)
 		return 1;
 	}
 
+	if (conf->session_memory_cache) {
+		RDEBUG2("Writing session to the memory cache");
+		tls_cache_memory_store(conf->session_memory_cache,
+				       tls_session->session_id, talloc_array_length(tls_session->session_id),
+				       tls_session->session_blob, talloc_array_length(tls_session->session_blob));
+		return 0;
+	}
+
 	if (tls_cache_session_id_to_vp(request, tls_session->session_id,
 				       talloc_array_length(tls_session->session_id)) < 0) {
 		RWDEBUG("Failed adding session key to the request");
@@ -340,19 +644,36 @@ static SSL_SESSION *tls_cache_read(SSL *ssl,
 	REQUEST			*request;
 	unsigned char const	**p;
 	uint8_t const		*q;
+	uint8_t			*blob = NULL;
+	size_t			len;
 	VALUE_PAIR		*vp;
 	SSL_SESSION		*sess;
 
 	request = SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_REQUEST);
 	conf = SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_CONF);
 
+	*copy = 0;
+
+	/*
+	 *	Read the session directly from the memory cache
+	 */
+	if (conf->session_memory_cache) {
+		blob = tls_cache_memory_load(request, conf->session_memory_cache, key, key_len);
+		if (!blob) {
+			RDEBUG2("No cached session found");
+			return NULL;
+		}
+
+		q = blob;
+		len = talloc_array_length(blob);
+		goto deserialize;
+	}
+
 	if (tls_cache_session_id_to_vp(request, key, key_len) < 0) {
 		RWDEBUG("Failed adding session key to the request");
 		return NULL;
 	}
 
-	*copy = 0;
-
 	/*
 	 *	Call the virtual server to read the session
 	 */
@@ -373,14 +694,18 @@ static SSL_SESSION *tls_cache_read(SSL *ssl,
 	}
 
 	q = vp->vp_octets;	/* openssl will mutate q, so we can't use vp_octets directly */
+	len = vp->vp_length;
+
+deserialize:
 	p = (unsigned char const **)&q;
 
-	sess = d2i_SSL_SESSION(NULL, p, vp->vp_length);
+	sess = d2i_SSL_SESSION(NULL, p, len);
+	talloc_free(blob);
 	if (!sess) {
 		RWDEBUG("Failed loading persisted session: %s", ERR_error_string(ERR_get_error(), NULL));
 		return NULL;
 	}
-	RDEBUG3("Read %zu bytes of session data.  Session deserialized successfully", vp->vp_length);
+	RDEBUG3("Read %zu bytes of session data.  Session deserialized successfully", len);
 
 	/*
 	 *	OpenSSL's API is very inconsistent.
@@ -448,6 +773,11 @@ static void tls_cache_delete(SSL_CTX *ctx, SSL_SESSION *sess)
 		return;
 	}
 
+	if (conf->session_memory_cache) {
+		tls_cache_memory_delete(conf->session_memory_cache, key, (size_t)key_len);
+		return;
+	}
+
 	if (tls_cache_session_id_to_vp(request, key, (size_t)key_len) < 0) {
 		RWDEBUG("Failed adding session key to the request");
 		goto error;
@@ -72,6 +72,12 @@ static CONF_PARSER cache_config[] = {
 			 .dflt = "%{EAP-Type}%{Virtual-Server}", .quote = T_DOUBLE_QUOTED_STRING },
 	{ FR_CONF_OFFSET("lifetime", FR_TYPE_UINT32, fr_tls_conf_t, session_cache_lifetime), .dflt = "86400" },
 	{ FR_CONF_OFFSET("verify", FR_TYPE_BOOL, fr_tls_conf_t, session_cache_verify), .dflt = "no" },
+	{ FR_CONF_OFFSET("memory", FR_TYPE_BOOL, fr_tls_conf_t, session_cache_memory), .dflt = "no" },
+	{ FR_CONF_OFFSET("memory_max_entries", FR_TYPE_UINT32, fr_tls_conf_t, session_cache_max_entries), .dflt = "65536" },
+	{ FR_CONF_OFFSET("memory_shards", FR_TYPE_UINT32, fr_tls_conf_t, session_cache_shards), .dflt = "16" },
+	{ FR_CONF_OFFSET("stateless", FR_TYPE_BOOL, fr_tls_conf_t, session_cache_stateless), .dflt = "no" },
+	{ FR_CONF_OFFSET("ticket_key_file", FR_TYPE_FILE_INPUT, fr_tls_conf_t, session_ticket_key_file) },
+	{ FR_CONF_OFFSET("ticket_key_rotation", FR_TYPE_UINT32, fr_tls_conf_t, session_ticket_key_rotation), .dflt = "3600" },
 
 #if OPENSSL_VERSION_NUMBER >= 0x10100000L
 	{ FR_CONF_OFFSET("require_extended_master_secret", FR_TYPE_BOOL, fr_tls_conf_t, session_cache_require_extms), .dflt = "yes" },
@@ -144,6 +150,7 @@ CONF_PARSER tls_server_config[] = {
 	{ FR_CONF_OFFSET("fragment_size", FR_TYPE_UINT32, fr_tls_conf_t, fragment_size), .dflt = "1024" },
 
 	{ FR_CONF_OFFSET("disable_single_dh_use", FR_TYPE_BOOL, fr_tls_conf_t, disable_single_dh_use) },
+	{ FR_CONF_OFFSET("async_handshake", FR_TYPE_BOOL, fr_tls_conf_t, async_handshake), .dflt = "no" },
 	{ FR_CONF_OFFSET("check_crl", FR_TYPE_BOOL, fr_tls_conf_t, check_crl), .dflt = "no" },
 #ifdef X509_V_FLAG_CRL_CHECK_ALL
 	{ FR_CONF_DEPRECATED("check_all_crl", FR_TYPE_BOOL, fr_tls_conf_t, NULL) },
@@ -433,6 +440,42 @@ fr_tls_conf_t *tls_conf_parse_server(CONF_SECTION *cs)
 	if (conf_cert_admin_password(conf) < 0) goto error;
 #endif
 
+	/*
+	 *	The memory cache and the ticket keys are shared by
+	 *	all the contexts, so they must exist before we create
+	 *	any.
+	 */
+	if (conf->session_cache_memory) {
+		if (conf->session_cache_server) {
+			ERROR("The memory session cache can't be used with a cache virtual_server");
+			goto error;
+		}
+
+		FR_INTEGER_BOUND_CHECK("memory_shards", conf->session_cache_shards, >=, 1);
+		FR_INTEGER_BOUND_CHECK("memory_shards", conf->session_cache_shards, <=, 1024);
+		FR_INTEGER_BOUND_CHECK("memory_max_entries", conf->session_cache_max_entries, >=, 1);
+
+		conf->session_memory_cache = tls_cache_memory_alloc(conf,
+								    cf_section_name2(cs) ? cf_section_name2(cs) :
+								    cf_section_name1(cs),
+								    conf->session_cache_max_entries,
+								    conf->session_cache_shards,
+								    conf->session_cache_lifetime);
+		if (!conf->session_memory_cache) goto error;
+	}
+
+	if (conf->session_cache_stateless) {
+		if (conf->session_cache_server || conf->session_cache_memory) {
+			ERROR("Stateless session resumption can't be used with a session cache");
+			goto error;
+		}
+
+		conf->session_ticket_keys = tls_ticket_keys_alloc(conf, conf->session_ticket_key_file,
+								  conf->session_ticket_key_rotation,
+								  conf->session_cache_lifetime);
+		if (!conf->session_ticket_keys) goto error;
+	}
+
 	conf->ctx_count = fr_tls_max_threads * 2; /* Reduce contention */
 	if (!conf->ctx_count) conf->ctx_count = 1;
 
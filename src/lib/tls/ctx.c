@@ -424,6 +424,21 @@ SSL_CTX *tls_ctx_alloc(fr_tls_conf_t const *conf, bool client)
 			mode |= SSL_MODE_AUTO_RETRY;
 		}
 
+		/*
+		 *	Let an async capable engine pause the
+		 *	handshake whilst it performs expensive
+		 *	private key operations.  The request
+		 *	yields, and the worker can process other
+		 *	requests until the operation completes.
+		 */
+		if (conf->async_handshake) {
+#ifdef SSL_MODE_ASYNC
+			mode |= SSL_MODE_ASYNC;
+#else
+			WARN("async_handshake requires OpenSSL >= 1.1.0, ignoring");
+#endif
+		}
+
 		if (mode) SSL_CTX_set_mode(ctx, mode);
 	}
 
@@ -673,7 +688,7 @@ post_ca:
 #endif
 
 #ifdef SSL_OP_NO_TICKET
-	ctx_options |= SSL_OP_NO_TICKET;
+	if (!conf->session_cache_stateless) ctx_options |= SSL_OP_NO_TICKET;
 #endif
 
 	if (!conf->disable_single_dh_use) {
@@ -836,7 +851,12 @@ post_ca:
 	/*
 	 *	Setup session caching
 	 */
-	tls_cache_init(ctx, conf->session_cache_server ? true : false, conf->session_cache_lifetime);
+	if (conf->session_cache_stateless) {
+		tls_ticket_init(ctx, conf);
+	} else {
+		tls_cache_init(ctx, (conf->session_cache_server || conf->session_cache_memory),
+			       conf->session_cache_lifetime);
+	}
 
 	return ctx;
 }
@@ -30,7 +30,9 @@
 
 #include <freeradius-devel/server/rad_assert.h>
 #include <freeradius-devel/server/pair.h>
+#include <freeradius-devel/unlang/base.h>
 
+#include <freeradius-devel/util/event.h>
 #include <freeradius-devel/util/misc.h>
 
 #include <freeradius-devel/protocol/freeradius/freeradius.internal.h>
@@ -201,6 +203,7 @@ static char const *tls_handshake_type_str[] = {
  */
 inline static void record_init(tls_record_t *record)
 {
+	record->start = 0;
 	record->used = 0;
 }
 
@@ -210,6 +213,7 @@ inline static void record_init(tls_record_t *record)
  */
 inline static void record_close(tls_record_t *record)
 {
+	record->start = 0;
 	record->used = 0;
 }
 
@@ -222,12 +226,22 @@ inline static void record_close(tls_record_t *record)
  */
 inline static unsigned int record_from_buff(tls_record_t *record, void const *in, unsigned int inlen)
 {
-	unsigned int added = FR_TLS_MAX_RECORD_SIZE - record->used;
+	unsigned int added;
 
+	/*
+	 *	Only shift the unread data down when there isn't
+	 *	enough room at the end of the buffer.
+	 */
+	if ((record->start > 0) && ((FR_TLS_MAX_RECORD_SIZE - (record->start + record->used)) < inlen)) {
+		if (record->used > 0) memmove(record->data, record->data + record->start, record->used);
+		record->start = 0;
+	}
+
+	added = FR_TLS_MAX_RECORD_SIZE - (record->start + record->used);
 	if (added > inlen) added = inlen;
 	if (added == 0) return 0;
 
-	memcpy(record->data + record->used, in, added);
+	memcpy(record->data + record->start + record->used, in, added);
 	record->used += added;
 
 	return added;
@@ -246,14 +260,14 @@ inline static unsigned int record_to_buff(tls_record_t *record, void *out, unsig
 
 	if (taken > outlen) taken = outlen;
 	if (taken == 0) return 0;
-	if (out) memcpy(out, record->data, taken);
-
-	record->used -= taken;
+	if (out) memcpy(out, record->data + record->start, taken);
 
 	/*
-	 *	This is pretty bad...
+	 *	Advance the read offset instead of moving the
+	 *	remaining data down to the start of the buffer.
 	 */
-	if (record->used > 0) memmove(record->data, record->data + taken, record->used);
+	record->used -= taken;
+	record->start = (record->used > 0) ? record->start + taken : 0;
 
 	return taken;
 }
@@ -1108,6 +1122,39 @@ int tls_session_pairs_from_x509_cert(fr_cursor_t *cursor, TALLOC_CTX *ctx,
 	return 0;
 }
 
+/** Pass a fragment of a TLS record from the peer directly to OpenSSL
+ *
+ * Fragments are written to the input BIO as they arrive, instead of being
+ * reassembled in dirty_in and then copied again when the record is complete.
+ *
+ * @param[in] request	The current #REQUEST.
+ * @param[in] session	The current TLS session.
+ * @param[in] data	Fragment to write.
+ * @param[in] data_len	Length of the fragment.
+ * @return
+ *	- -1 on error.
+ *	- 0 on success.
+ */
+int tls_session_recv_fragment(REQUEST *request, tls_session_t *session, uint8_t const *data, size_t data_len)
+{
+	int ret;
+
+	if (!data_len) return 0;
+
+	if ((session->dirty_in.used + BIO_ctrl_pending(session->into_ssl) + data_len) > FR_TLS_MAX_RECORD_SIZE) {
+		REDEBUG("Exceeded maximum record size");
+		return -1;
+	}
+
+	ret = BIO_write(session->into_ssl, data, data_len);
+	if (ret != (int)data_len) {
+		REDEBUG("Failed writing %zu bytes to TLS BIO: %d", data_len, ret);
+		return -1;
+	}
+
+	return 0;
+}
+
 /** Decrypt application data
  *
  * @note Handshake must have completed before this function may be called.
@@ -1138,7 +1185,8 @@ int tls_session_recv(REQUEST *request, tls_session_t *session)
 	 *	Decrypt the complete record.
 	 */
 	if (session->dirty_in.used) {
-		ret = BIO_write(session->into_ssl, session->dirty_in.data, session->dirty_in.used);
+		ret = BIO_write(session->into_ssl, session->dirty_in.data + session->dirty_in.start,
+				session->dirty_in.used);
 		if (ret != (int) session->dirty_in.used) {
 			record_init(&session->dirty_in);
 			REDEBUG("Failed writing %zd bytes to SSL BIO: %d", session->dirty_in.used, ret);
@@ -1239,15 +1287,17 @@ int tls_session_send(REQUEST *request, tls_session_t *session)
 	 */
 	if (session->clean_in.used > 0) {
 		RDEBUG2("TLS application data to encrypt (%zu bytes)", session->clean_in.used);
-		log_request_hex(L_DBG, L_DBG_LVL_3, request, session->clean_in.data, session->clean_in.used);
+		log_request_hex(L_DBG, L_DBG_LVL_3, request,
+				session->clean_in.data + session->clean_in.start, session->clean_in.used);
 
-		ret = SSL_write(session->ssl, session->clean_in.data, session->clean_in.used);
+		ret = SSL_write(session->ssl, session->clean_in.data + session->clean_in.start, session->clean_in.used);
 		record_to_buff(&session->clean_in, NULL, ret);
 
 		/* Get the dirty data from Bio to send it */
 		ret = BIO_read(session->from_ssl, session->dirty_out.data,
 			       sizeof(session->dirty_out.data));
 		if (ret > 0) {
+			session->dirty_out.start = 0;
 			session->dirty_out.used = ret;
 			ret = 0;
 		} else {
@@ -1290,6 +1340,7 @@ static void tls_session_alert_send(REQUEST *request, tls_session_t *session)
 	session->info.alert_level = session->pending_alert_level;
 	session->info.alert_description = session->pending_alert_description;
 
+	record_init(&session->dirty_out);
 	session->dirty_out.data[0] = session->info.content_type;
 	session->dirty_out.data[1] = 3;
 	session->dirty_out.data[2] = 1;
@@ -1308,11 +1359,142 @@ static void tls_session_alert_send(REQUEST *request, tls_session_t *session)
 	session_msg_log(request, session, session->dirty_out.data, session->dirty_out.used);
 }
 
+#ifdef SSL_MODE_ASYNC
+/** File descriptors we're waiting on for a paused handshake step
+ *
+ * Inserted into the event list of the worker processing the request.
+ * The async engine signals one of the fds when the operation it's
+ * performing has completed.
+ */
+struct tls_session_async_s {
+	tls_session_t		*session;		//!< The handshake step belongs to.
+	REQUEST			*request;		//!< To resume.
+	fr_event_list_t		*el;			//!< The fds were inserted into.
+
+	OSSL_ASYNC_FD		*fds;			//!< Async fds of the paused job.
+	size_t			num_fds;		//!< How many fds were inserted.
+};
+
+/** Remove the async fds from the event list
+ *
+ */
+static int _tls_session_async_free(tls_session_async_t *async)
+{
+	size_t i;
+
+	for (i = 0; i < async->num_fds; i++) fr_event_fd_delete(async->el, async->fds[i], FR_EVENT_FILTER_IO);
+	async->session->async = NULL;
+
+	return 0;
+}
+
+/** The async engine completed its operation, resume the request
+ *
+ */
+static void tls_session_async_resume(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	tls_session_async_t	*async = talloc_get_type_abort(uctx, tls_session_async_t);
+	REQUEST			*request = async->request;
+
+	RDEBUG3("Async handshake step signalled completion");
+
+	talloc_free(async);
+	unlang_resumable(request);
+}
+
+/** Error on one of the async fds
+ *
+ * Resume the request anyway.  If the operation failed, OpenSSL will
+ * tell us when the handshake is continued.
+ */
+static void tls_session_async_error(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, int fd_errno, void *uctx)
+{
+	tls_session_async_t	*async = talloc_get_type_abort(uctx, tls_session_async_t);
+	REQUEST			*request = async->request;
+
+	RWDEBUG("Error on async fd %i: %s", fd, fr_syserror(fd_errno));
+
+	talloc_free(async);
+	unlang_resumable(request);
+}
+
+/** Wait for a paused handshake step to complete
+ *
+ * @param[in] request	The current request.
+ * @param[in] session	with a paused async job.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int tls_session_async_wait(REQUEST *request, tls_session_t *session)
+{
+	tls_session_async_t	*async;
+	size_t			num_fds = 0, i;
+
+	if (!request->el) {
+		REDEBUG("Can't wait for async handshake step, request has no event list");
+		return -1;
+	}
+
+	if (!SSL_get_all_async_fds(session->ssl, NULL, &num_fds) || !num_fds) {
+		REDEBUG("Async handshake step provided no fds to wait on");
+		return -1;
+	}
+
+	TALLOC_FREE(session->async);
+
+	MEM(async = talloc_zero(request, tls_session_async_t));
+	MEM(async->fds = talloc_array(async, OSSL_ASYNC_FD, num_fds));
+	SSL_get_all_async_fds(session->ssl, async->fds, &num_fds);
+
+	async->session = session;
+	async->request = request;
+	async->el = request->el;
+	talloc_set_destructor(async, _tls_session_async_free);
+
+	for (i = 0; i < num_fds; i++) {
+		if (fr_event_fd_insert(async, async->el, async->fds[i],
+				       tls_session_async_resume, NULL, tls_session_async_error, async) < 0) {
+			RPEDEBUG("Failed inserting async fd");
+			talloc_free(async);
+			return -1;
+		}
+		async->num_fds++;
+	}
+	session->async = async;
+
+	RDEBUG2("Handshake step paused by async engine, waiting on %zu fd(s)", num_fds);
+
+	return 0;
+}
+#endif
+
+/** Return whether the handshake is waiting on an async crypto engine
+ *
+ * If true, the caller should yield, and call #tls_session_handshake again
+ * when the request is resumed.
+ *
+ * @param[in] session	to check.
+ * @return
+ *	- true if a handshake step is still in progress.
+ *	- false otherwise.
+ */
+bool tls_session_async_pending(tls_session_t *session)
+{
+	return (session->async != NULL);
+}
+
 /** Continue a TLS handshake
  *
  * Advance the TLS handshake by feeding OpenSSL data from dirty_in,
  * and reading data from OpenSSL into dirty_out.
  *
+ * If async_handshake is enabled, an async engine may pause the handshake
+ * whilst it performs a private key operation.  In that case this function
+ * returns success, and #tls_session_async_pending will return true until
+ * the request is resumed.  The caller must then call this function again
+ * (with no new data in dirty_in) to continue the handshake.
+ *
  * @param request The current request.
  * @param session The current TLS session.
  * @return
@@ -1349,7 +1531,8 @@ int tls_session_handshake(REQUEST *request, tls_session_t *session)
 	 *	or continue the TLS handshake.
 	 */
 	if (session->dirty_in.used) {
-		ret = BIO_write(session->into_ssl, session->dirty_in.data, session->dirty_in.used);
+		ret = BIO_write(session->into_ssl, session->dirty_in.data + session->dirty_in.start,
+				session->dirty_in.used);
 		if (ret != (int)session->dirty_in.used) {
 			REDEBUG("Failed writing %zd bytes to TLS BIO: %d", session->dirty_in.used, ret);
 			record_init(&session->dirty_in);
@@ -1387,6 +1570,20 @@ int tls_session_handshake(REQUEST *request, tls_session_t *session)
 		goto finish;
 	}
 
+#ifdef SSL_MODE_ASYNC
+	/*
+	 *	The async engine paused the handshake.  Wait
+	 *	for the operation to complete, the next call
+	 *	to SSL_read will continue from where we left
+	 *	off.
+	 */
+	if (SSL_get_error(session->ssl, ret) == SSL_ERROR_WANT_ASYNC) {
+		if (tls_session_async_wait(request, session) < 0) goto error;
+		ret = 0;
+		goto finish;
+	}
+#endif
+
 	/*
 	 *	Returns 0 if we can continue processing the handshake
 	 *	Returns -1 if we encountered a fatal error.
@@ -1485,6 +1682,20 @@ int tls_session_handshake(REQUEST *request, tls_session_t *session)
 		 *	Session was resumed, add attribute to mark it as such.
 		 */
 		if (SSL_session_reused(session->ssl)) {
+			/*
+			 *	Sessions read from the cache are revalidated
+			 *	as they're loaded.  There's no equivalent
+			 *	hook for tickets, so do it here.
+			 */
+			if (tls_ticket_resumed(session->ssl)) {
+				fr_tls_conf_t *conf = SSL_get_ex_data(session->ssl, FR_TLS_EX_INDEX_CONF);
+
+				if (conf->session_cache_verify && (tls_validate_client_cert_chain(session->ssl) != 1)) {
+					REDEBUG("Validation failed for session resumed from ticket");
+					goto error;
+				}
+			}
+
 			/*
 			 *	Mark the request as resumed.
 			 */
@@ -1501,6 +1712,7 @@ int tls_session_handshake(REQUEST *request, tls_session_t *session)
 		ret = BIO_read(session->from_ssl, session->dirty_out.data,
 			       sizeof(session->dirty_out.data));
 		if (ret > 0) {
+			session->dirty_out.start = 0;
 			session->dirty_out.used = ret;
 		} else if (BIO_should_retry(session->from_ssl)) {
 			record_init(&session->dirty_in);
@@ -1543,6 +1755,8 @@ finish:
  */
 static int _tls_session_free(tls_session_t *session)
 {
+	TALLOC_FREE(session->async);
+
 	if (session->ssl) {
 		SSL_set_quiet_shutdown(session->ssl, 1);
 		SSL_shutdown(session->ssl);
@@ -1566,6 +1780,7 @@ static void session_init(tls_session_t *session)
 
 	session->mtu = 0;
 	session->opaque = NULL;
+	session->async = NULL;
 }
 
 /** Create a new client TLS session
@@ -1839,7 +2054,9 @@ tls_session_t *tls_session_init_server(TALLOC_CTX *ctx, fr_tls_conf_t *conf, REQ
 		session->mtu = vp->vp_uint32;
 	}
 
-	if (conf->session_cache_server) session->allow_session_resumption = true; /* otherwise it's false */
+	if (conf->session_cache_server || conf->session_cache_memory || conf->session_cache_stateless) {
+		session->allow_session_resumption = true; /* otherwise it's false */
+	}
 
 	tls_session_request_unbind(session->ssl);
 
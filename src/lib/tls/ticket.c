@@ -0,0 +1,359 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file tls/ticket.c
+ * @brief Stateless TLS session resumption using session tickets (RFC 5077)
+ *
+ * Session state is encrypted with a key only the server knows, and handed to
+ * the client.  On resumption the client presents the ticket, and we decrypt
+ * it, so no cache lookups are required.
+ *
+ * The ticket keys are shared by all the SSL_CTX of a TLS configuration, and
+ * so by all workers.  They're either generated at startup and rotated
+ * periodically, or read from a file, which allows them to be shared between
+ * multiple servers.
+ *
+ * @copyright 2019 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
+
+#ifdef WITH_TLS
+#define LOG_PREFIX "tls - "
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/rad_assert.h>
+
+#include <openssl/rand.h>
+#include <openssl/hmac.h>
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "base.h"
+#include "missing.h"
+
+#define TICKET_KEY_NAME_LEN	16
+#define TICKET_KEY_HMAC_LEN	32
+#define TICKET_KEY_AES_LEN	32
+
+#define TICKET_KEYS_MAX		256		//!< Maximum number of keys we keep for decrypting tickets.
+
+/** A key used to encrypt and authenticate session tickets
+ *
+ * The layout matches what we read from the key file.
+ */
+typedef struct {
+	uint8_t			name[TICKET_KEY_NAME_LEN];	//!< Identifies the key in tickets we issue.
+	uint8_t			hmac[TICKET_KEY_HMAC_LEN];	//!< Authenticates the ticket.
+	uint8_t			aes[TICKET_KEY_AES_LEN];	//!< Encrypts the ticket.
+} tls_ticket_key_t;
+
+struct fr_tls_ticket_keys_s {
+	pthread_mutex_t		mutex;			//!< The keys are shared by every worker.
+
+	tls_ticket_key_t	*keys;			//!< keys[0] encrypts new tickets.  The rest
+							///< are only used to decrypt existing ones.
+	uint32_t		num_keys;		//!< How many keys are valid.
+
+	char const		*file;			//!< Read keys from this file instead of generating them.
+	time_t			mtime;			//!< Modification time of the file when we last read it.
+	time_t			checked;		//!< When we last checked if the file changed.
+
+	uint32_t		rotation;		//!< How often we generate a new key.
+	time_t			rotated;		//!< When the current key was generated.
+};
+
+/** Generate a new key, and retire the oldest one
+ *
+ * @note Must be called with the mutex held.
+ */
+static int ticket_keys_generate(fr_tls_ticket_keys_t *tk, time_t now)
+{
+	tls_ticket_key_t	key;
+
+	if ((RAND_bytes(key.name, sizeof(key.name)) != 1) ||
+	    (RAND_bytes(key.hmac, sizeof(key.hmac)) != 1) ||
+	    (RAND_bytes(key.aes, sizeof(key.aes)) != 1)) {
+		tls_log_error(NULL, "Failed generating session ticket key");
+		return -1;
+	}
+
+	if (tk->num_keys < talloc_array_length(tk->keys)) tk->num_keys++;
+	memmove(&tk->keys[1], &tk->keys[0], sizeof(tk->keys[0]) * (tk->num_keys - 1));
+	memcpy(&tk->keys[0], &key, sizeof(tk->keys[0]));
+	tk->rotated = now;
+
+	return 0;
+}
+
+/** Read the keys from the key file
+ *
+ * The file contains one or more 80 byte keys.  The first is used to
+ * encrypt new tickets, any others are only used to decrypt tickets
+ * issued with them.
+ *
+ * @note Must be called with the mutex held.
+ */
+static int ticket_keys_load(fr_tls_ticket_keys_t *tk)
+{
+	int			fd;
+	struct stat		buf;
+	tls_ticket_key_t	*keys;
+	size_t			num_keys;
+	ssize_t			len;
+
+	fd = open(tk->file, O_RDONLY);
+	if (fd < 0) {
+		ERROR("Failed opening session ticket key file \"%s\": %s", tk->file, fr_syserror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &buf) < 0) {
+		ERROR("Failed reading session ticket key file \"%s\": %s", tk->file, fr_syserror(errno));
+	error:
+		close(fd);
+		return -1;
+	}
+
+	if (!buf.st_size || (buf.st_size % sizeof(tls_ticket_key_t))) {
+		ERROR("Session ticket key file \"%s\" must contain one or more keys of %zu bytes",
+		      tk->file, sizeof(tls_ticket_key_t));
+		goto error;
+	}
+
+	num_keys = buf.st_size / sizeof(tls_ticket_key_t);
+	if (num_keys > TICKET_KEYS_MAX) {
+		ERROR("Session ticket key file \"%s\" contains too many keys (%zu), maximum is %u",
+		      tk->file, num_keys, TICKET_KEYS_MAX);
+		goto error;
+	}
+
+	MEM(keys = talloc_array(tk, tls_ticket_key_t, num_keys));
+	len = read(fd, keys, buf.st_size);
+	if (len != buf.st_size) {
+		ERROR("Failed reading session ticket key file \"%s\": %s", tk->file,
+		      len < 0 ? fr_syserror(errno) : "Short read");
+		talloc_free(keys);
+		goto error;
+	}
+	close(fd);
+
+	talloc_free(tk->keys);
+	tk->keys = keys;
+	tk->num_keys = num_keys;
+	tk->mtime = buf.st_mtime;
+
+	DEBUG2("Loaded %zu session ticket key(s) from \"%s\"", num_keys, tk->file);
+
+	return 0;
+}
+
+/** Rotate the keys, or re-read the key file if it changed
+ *
+ * @note Must be called with the mutex held.
+ */
+static void ticket_keys_update(fr_tls_ticket_keys_t *tk, time_t now)
+{
+	struct stat buf;
+
+	if (!tk->file) {
+		if (!tk->rotation || ((now - tk->rotated) < (time_t)tk->rotation)) return;
+
+		(void) ticket_keys_generate(tk, now);
+		return;
+	}
+
+	/*
+	 *	Check at most once a second.  If the file is
+	 *	broken, we keep using the keys we have.
+	 */
+	if (tk->checked == now) return;
+	tk->checked = now;
+
+	if ((stat(tk->file, &buf) < 0) || (buf.st_mtime == tk->mtime)) return;
+
+	(void) ticket_keys_load(tk);
+}
+
+/** Encrypt or decrypt a session ticket
+ *
+ * Called by OpenSSL when it needs to issue a ticket, or when the client
+ * presents one.
+ *
+ * @return
+ *	- 1 if the ticket can be used.
+ *	- 2 if the ticket can be used, but should be renewed as it was
+ *	  encrypted with an old key.
+ *	- 0 if the key wasn't found, and a full handshake is required.
+ *	- -1 on error.
+ */
+static int tls_ticket_key_cb(SSL *ssl, unsigned char key_name[TICKET_KEY_NAME_LEN], unsigned char *iv,
+			     EVP_CIPHER_CTX *cipher_ctx, HMAC_CTX *hmac_ctx, int enc)
+{
+	fr_tls_conf_t		*conf = talloc_get_type_abort(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)),
+							      fr_tls_conf_t);
+	REQUEST			*request = SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_REQUEST);
+	fr_tls_ticket_keys_t	*tk = conf->session_ticket_keys;
+	tls_ticket_key_t	key;
+	uint32_t		i;
+	int			ret;
+
+	pthread_mutex_lock(&tk->mutex);
+	ticket_keys_update(tk, time(NULL));
+
+	if (enc) {
+		memcpy(&key, &tk->keys[0], sizeof(key));
+		pthread_mutex_unlock(&tk->mutex);
+
+		if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) != 1) {
+			tls_log_error(request, "Failed generating session ticket IV");
+			return -1;
+		}
+		memcpy(key_name, key.name, sizeof(key.name));
+
+		if ((EVP_EncryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), NULL, key.aes, iv) != 1) ||
+		    (HMAC_Init_ex(hmac_ctx, key.hmac, sizeof(key.hmac), EVP_sha256(), NULL) != 1)) {
+			tls_log_error(request, "Failed initialising session ticket encryption");
+			return -1;
+		}
+
+		ROPTIONAL(RDEBUG2, DEBUG2, "Issuing session ticket");
+		return 1;
+	}
+
+	for (i = 0; i < tk->num_keys; i++) {
+		if (memcmp(key_name, tk->keys[i].name, sizeof(tk->keys[i].name)) == 0) break;
+	}
+	if (i == tk->num_keys) {
+		pthread_mutex_unlock(&tk->mutex);
+
+		ROPTIONAL(RDEBUG2, DEBUG2, "Session ticket key not found, ticket has expired");
+		return 0;
+	}
+	memcpy(&key, &tk->keys[i], sizeof(key));
+	pthread_mutex_unlock(&tk->mutex);
+
+	if ((HMAC_Init_ex(hmac_ctx, key.hmac, sizeof(key.hmac), EVP_sha256(), NULL) != 1) ||
+	    (EVP_DecryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), NULL, key.aes, iv) != 1)) {
+		tls_log_error(request, "Failed initialising session ticket decryption");
+		return -1;
+	}
+
+	ret = (i == 0) ? 1 : 2;
+	ROPTIONAL(RDEBUG2, DEBUG2, "Resuming session from ticket%s", (ret == 2) ? ", ticket will be renewed" : "");
+
+	return ret;
+}
+
+static int _ticket_keys_free(fr_tls_ticket_keys_t *tk)
+{
+	pthread_mutex_destroy(&tk->mutex);
+
+	return 0;
+}
+
+/** Allocate the ticket keys for a TLS configuration
+ *
+ * @param[in] ctx		to allocate the keys in.
+ * @param[in] file		to read keys from.  If NULL keys are generated.
+ * @param[in] rotation		How often to generate a new key.  0 to never
+ *				rotate keys.  Ignored if keys are read from a file.
+ * @param[in] lifetime		The maximum period a session can be resumed after.
+ *				Determines how many old keys we keep.
+ * @return
+ *	- The new keys on success.
+ *	- NULL on error.
+ */
+fr_tls_ticket_keys_t *tls_ticket_keys_alloc(TALLOC_CTX *ctx, char const *file, uint32_t rotation, uint32_t lifetime)
+{
+	fr_tls_ticket_keys_t	*tk;
+	uint32_t		num_keys = 1;
+
+	MEM(tk = talloc_zero(ctx, fr_tls_ticket_keys_t));
+	pthread_mutex_init(&tk->mutex, NULL);
+	talloc_set_destructor(tk, _ticket_keys_free);
+
+	if (file) {
+		MEM(tk->file = talloc_typed_strdup(tk, file));
+		if (ticket_keys_load(tk) < 0) {
+		error:
+			talloc_free(tk);
+			return NULL;
+		}
+		tk->checked = time(NULL);
+
+		return tk;
+	}
+
+	/*
+	 *	Keep enough old keys to decrypt any ticket
+	 *	issued within the session lifetime.
+	 */
+	if (rotation) num_keys = ((lifetime + rotation - 1) / rotation) + 1;
+	if (num_keys > TICKET_KEYS_MAX) num_keys = TICKET_KEYS_MAX;
+
+	tk->rotation = rotation;
+	MEM(tk->keys = talloc_zero_array(tk, tls_ticket_key_t, num_keys));
+	if (ticket_keys_generate(tk, time(NULL)) < 0) goto error;
+
+	return tk;
+}
+
+/** Whether a session was resumed from a ticket
+ *
+ * Sessions are only written to the cache once all phases of authentication
+ * have completed.  Tickets are issued during the handshake, before any
+ * tunneled authentication has taken place, so tunneled methods must not
+ * skip their inner authentication for sessions resumed from tickets.
+ *
+ * @param ssl	The current OpenSSL session.
+ * @return
+ *	- true if the session was resumed from a ticket.
+ *	- false if the session was not resumed, or was resumed from the cache.
+ */
+bool tls_ticket_resumed(SSL *ssl)
+{
+	fr_tls_conf_t *conf = talloc_get_type_abort(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)), fr_tls_conf_t);
+
+	return conf->session_cache_stateless && SSL_session_reused(ssl);
+}
+
+/** Sets callbacks on a SSL_CTX to enable stateless session resumption
+ *
+ * @param ctx			to modify.
+ * @param conf			containing the ticket keys.
+ */
+void tls_ticket_init(SSL_CTX *ctx, fr_tls_conf_t const *conf)
+{
+	rad_assert(conf->session_ticket_keys);
+
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+	SSL_CTX_set_timeout(ctx, conf->session_cache_lifetime);
+	SSL_CTX_set_tlsext_ticket_key_cb(ctx, tls_ticket_key_cb);
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+	SSL_CTX_set_num_tickets(ctx, 1);
+#endif
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	SSL_CTX_set_not_resumable_session_callback(ctx, tls_cache_disable_cb);
+#endif
+}
+#endif /* WITH_TLS */
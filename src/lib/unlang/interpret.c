@@ -28,6 +28,7 @@ RCSID("$Id$")
 #include <freeradius-devel/server/modpriv.h>
 #include <freeradius-devel/server/parser.h>
 #include <freeradius-devel/server/xlat.h>
+#include <freeradius-devel/util/probe.h>
 
 #include "unlang_priv.h"
 #include "parallel_priv.h"
@@ -445,6 +446,7 @@ static inline unlang_frame_action_t unlang_frame_eval(REQUEST *request, unlang_s
 		if (!frame->repeat && (unlang_ops[instruction->type].debug_braces)) {
 			RDEBUG2("%s {", instruction->debug_name);
 			RINDENT();
+			UNLANG_TRACE(request, fr_time(), FR_TRACE_BEGIN, instruction->debug_name);
 		}
 
 		/*
@@ -538,6 +540,7 @@ static inline unlang_frame_action_t unlang_frame_eval(REQUEST *request, unlang_s
 
 			if (unlang_ops[instruction->type].debug_braces) {
 				REXDENT();
+				UNLANG_TRACE(request, fr_time(), FR_TRACE_END, instruction->debug_name);
 
 				/*
 				 *	If we're at debug level 1, don't emit the closing
@@ -565,6 +568,7 @@ static inline unlang_frame_action_t unlang_frame_eval(REQUEST *request, unlang_s
 			if ((action == UNLANG_ACTION_EXECUTE_NEXT) && unlang_ops[instruction->type].debug_braces) {
 				REXDENT();
 				RDEBUG2("}");
+				UNLANG_TRACE(request, fr_time(), FR_TRACE_END, instruction->debug_name);
 			}
 			break;
 		} /* switch over return code from the interpreter function */
@@ -603,6 +607,7 @@ rlm_rcode_t unlang_run(REQUEST *request)
 	rad_assert(request->runnable_id < 0);
 
 	RDEBUG4("** [%i] %s - interpreter entered", stack->depth, __FUNCTION__);
+	FR_PROBE2(unlang_start, request->number, stack->depth);
 
 	for (;;) {
 		switch (fa) {
@@ -660,6 +665,7 @@ rlm_rcode_t unlang_run(REQUEST *request)
 			 */
 			if (unlang_ops[frame->instruction->type].debug_braces) {
 				REXDENT();
+				UNLANG_TRACE(request, fr_time(), FR_TRACE_END, frame->instruction->debug_name);
 
 				/*
 				 *	If we're at debug level 1, don't emit the closing
@@ -701,6 +707,7 @@ rlm_rcode_t unlang_run(REQUEST *request)
 
 		case UNLANG_FRAME_ACTION_YIELD:
 			rad_assert(stack->result == RLM_MODULE_YIELD);
+			FR_PROBE2(unlang_finish, request->number, stack->result);
 			return stack->result;
 		}
 		break;
@@ -734,6 +741,7 @@ rlm_rcode_t unlang_run(REQUEST *request)
 	stack->depth--;
 	DUMP_STACK;
 
+	FR_PROBE2(unlang_finish, request->number, stack->result);
 	return stack->result;
 }
 
@@ -31,6 +31,7 @@ RCSID("$Id$")
 #include <freeradius-devel/server/parser.h>
 #include <freeradius-devel/unlang/base.h>
 #include <freeradius-devel/server/xlat.h>
+#include <freeradius-devel/util/probe.h>
 #include "unlang_priv.h"
 #include "module_priv.h"
 #include "subrequest_priv.h"
@@ -490,6 +491,16 @@ static inline void safe_unlock(module_instance_t *instance)
 	if (instance->mutex) pthread_mutex_unlock(instance->mutex);
 }
 
+/*
+ *	Record a call which has returned a result
+ */
+static inline void unlang_module_metrics(unlang_frame_state_module_t *ms, fr_time_t now)
+{
+	fr_metrics_inc(ms->thread->metrics, MODULE_METRIC_CALLS);
+	fr_metrics_observe(ms->thread->metrics, MODULE_METRIC_RUN_TIME, ms->running);
+	fr_metrics_observe(ms->thread->metrics, MODULE_METRIC_ELAPSED_TIME, now - ms->start);
+}
+
 static unlang_action_t unlang_module(REQUEST *request,
 					  rlm_rcode_t *presult, int *priority)
 {
@@ -500,6 +511,7 @@ static unlang_action_t unlang_module(REQUEST *request,
 	unlang_frame_state_module_t	*ms;
 	int				stack_depth = stack->depth;
 	char const 			*caller;
+	fr_time_t			now;
 
 #ifndef NDEBUG
 	int unlang_indent		= request->log.unlang_indent;
@@ -538,10 +550,16 @@ static unlang_action_t unlang_module(REQUEST *request,
 
 	caller = request->module;
 	request->module = sp->module_instance->name;
+	ms->start = fr_time();
+	UNLANG_TRACE(request, ms->start, FR_TRACE_BEGIN, sp->module_instance->name);
+	FR_PROBE2(module_call, request->number, sp->module_instance->name);
 	safe_lock(sp->module_instance);	/* Noop unless instance->mutex set */
 	*presult = sp->method(sp->module_instance->dl_inst->data, ms->thread->data, request);
 	safe_unlock(sp->module_instance);
+	now = fr_time();
+	ms->running = now - ms->start;
 	request->module = caller;
+	FR_PROBE4(module_return, request->number, sp->module_instance->name, *presult, ms->running);
 
 	/*
 	 *	Is now marked as "stop" when it wasn't before, we must have been blocked.
@@ -553,9 +571,13 @@ static unlang_action_t unlang_module(REQUEST *request,
 
 	if (*presult == RLM_MODULE_YIELD) {
 		ms->thread->active_callers++;
+		UNLANG_TRACE(request, now, FR_TRACE_INSTANT, "yield");
 		goto done;
 	}
 
+	unlang_module_metrics(ms, now);
+	UNLANG_TRACE(request, now, FR_TRACE_END, sp->module_instance->name);
+
 	/*
 	 *	Module execution finished, ident should be the same.
 	 */
@@ -633,6 +655,7 @@ static unlang_action_t unlang_module_resume(REQUEST *request, rlm_rcode_t *presu
 	unlang_module_t			*mc = unlang_generic_to_module(mr->parent);
 	int				stack_depth = stack->depth;
 	char const			*caller;
+	fr_time_t			start, now;
 
 	unlang_frame_state_module_t	*ms = NULL;
 
@@ -645,14 +668,26 @@ static unlang_action_t unlang_module_resume(REQUEST *request, rlm_rcode_t *presu
 	 */
 	caller = request->module;
 	request->module = mc->module_instance->name;
+	start = fr_time();
+	UNLANG_TRACE(request, start, FR_TRACE_INSTANT, "resume");
+	FR_PROBE2(module_resume, request->number, mc->module_instance->name);
 	safe_lock(mc->module_instance);
 	*presult = request->rcode = ((fr_unlang_module_resume_t)mr->resume)(request,
 									    mc->module_instance->dl_inst->data,
 									    ms->thread->data, mr->rctx);
 	safe_unlock(mc->module_instance);
+	now = fr_time();
+	ms->running += now - start;
 	request->module = caller;
-
-	if (*presult != RLM_MODULE_YIELD) ms->thread->active_callers--;
+	FR_PROBE4(module_return, request->number, mc->module_instance->name, *presult, ms->running);
+
+	if (*presult != RLM_MODULE_YIELD) {
+		ms->thread->active_callers--;
+		unlang_module_metrics(ms, now);
+		UNLANG_TRACE(request, now, FR_TRACE_END, mc->module_instance->name);
+	} else {
+		UNLANG_TRACE(request, now, FR_TRACE_INSTANT, "yield");
+	}
 
 	RDEBUG2("%s (%s)", instruction->name ? instruction->name : "",
 		fr_int2str(mod_rcode_table, *presult, "<invalid>"));
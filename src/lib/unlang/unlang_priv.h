@@ -32,6 +32,7 @@
 #include <freeradius-devel/server/rad_assert.h>
 #include <freeradius-devel/unlang/base.h>
 #include <freeradius-devel/io/listen.h>
+#include <freeradius-devel/util/trace.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -39,6 +40,14 @@ extern "C" {
 
 #define UNLANG_STACK_MAX (64)
 
+/** Record an event, if the request is being traced
+ *
+ * _when is only evaluated for traced requests.
+ */
+#define UNLANG_TRACE(_request, _when, _phase, _name) do { \
+	if ((_request)->traced) fr_trace_event((_request)->number, _when, _phase, "unlang", _name); \
+} while (0)
+
 /* Actions may be a positive integer (the highest one returned in the group
  * will be returned), or the keyword "return", represented here by
  * MOD_ACTION_RETURN, to cause an immediate return.
@@ -223,6 +232,8 @@ typedef struct {
  */
 typedef struct {
 	module_thread_instance_t *thread;			//!< thread-local data for this module
+	fr_time_t		start;				//!< when the module was called
+	fr_time_t		running;			//!< time spent in the module so far
 } unlang_frame_state_module_t;
 
 /** State of a redundant operation
@@ -8,11 +8,13 @@ TARGET		:= libfreeradius-util.a
 SOURCES		:= \
 		   ascend.c \
 		   base64.c \
+		   crc32.c \
 		   cursor.c \
 		   debug.c \
 		   dict.c \
 		   event.c \
 		   fifo.c \
+		   file_index.c \
 		   fring.c \
 		   getaddrinfo.c \
 		   hash.c \
@@ -22,6 +24,8 @@ SOURCES		:= \
 		   inet.c \
 		   isaac.c \
 		   log.c \
+		   log_async.c \
+		   metrics.c \
 		   md4.c \
 		   md5.c \
 		   misc.c \
@@ -46,6 +50,7 @@ SOURCES		:= \
 		   syserror.c \
 		   talloc.c \
 		   token.c \
+		   trace.c \
 		   trie.c \
 		   udp.c \
 		   udpfromto.c \
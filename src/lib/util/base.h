@@ -38,12 +38,14 @@ RCSIDH(libradius_h, "$Id$")
 #include <freeradius-devel/util/ascend.h>
 #include <freeradius-devel/util/base64.h>
 #include <freeradius-devel/util/conf.h>
+#include <freeradius-devel/util/crc32.h>
 #include <freeradius-devel/util/cursor.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/util/dict.h>
 #include <freeradius-devel/util/dlist.h>
 #include <freeradius-devel/util/event.h>
 #include <freeradius-devel/util/fifo.h>
+#include <freeradius-devel/util/file_index.h>
 #include <freeradius-devel/util/fring.h>
 #include <freeradius-devel/util/hash.h>
 #include <freeradius-devel/util/heap.h>
@@ -51,11 +53,13 @@ RCSIDH(libradius_h, "$Id$")
 #include <freeradius-devel/util/log.h>
 #include <freeradius-devel/util/lsan.h>
 #include <freeradius-devel/util/md4.h>
+#include <freeradius-devel/util/metrics.h>
 #include <freeradius-devel/util/misc.h>
 #include <freeradius-devel/util/packet.h>
 #include <freeradius-devel/util/pair_cursor.h>
 #include <freeradius-devel/util/pair.h>
 #include <freeradius-devel/util/print.h>
+#include <freeradius-devel/util/probe.h>
 #include <freeradius-devel/util/proto.h>
 #include <freeradius-devel/util/rand.h>
 #include <freeradius-devel/util/rbtree.h>
@@ -68,6 +72,7 @@ RCSIDH(libradius_h, "$Id$")
 #include <freeradius-devel/util/talloc.h>
 #include <freeradius-devel/util/thread_local.h>
 #include <freeradius-devel/util/token.h>
+#include <freeradius-devel/util/trace.h>
 #include <freeradius-devel/util/trie.h>
 #include <freeradius-devel/util/types.h>
 #include <freeradius-devel/util/udp.h>
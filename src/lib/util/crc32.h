@@ -0,0 +1,39 @@
+#pragma once
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** CRC-32 (IEEE 802.3) checksums
+ *
+ * @file src/lib/util/crc32.h
+ *
+ * @copyright 2019 The FreeRADIUS server project
+ */
+RCSIDH(crc32_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <freeradius-devel/build.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint32_t	fr_crc32(uint32_t crc, uint8_t const *in, size_t in_len);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,629 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Memory mapped, pre-sorted, index of delimited text files
+ *
+ * An index file contains a table of keys sorted by value, and the records
+ * (lists of fields) they refer to.  It's built offline, and mapped read
+ * only, so lookups need no parsing or allocation, and the pages are shared
+ * between all processes using the same file.
+ *
+ * The layout of a file is:
+ *
+ *	- #fr_file_index_header_t.
+ *	- #fr_file_index_key_t[num_keys], sorted by key.  Keys which are equal
+ *	  are kept in the order they were added.
+ *	- Key strings.
+ *	- Records, each is an array of num_fields uint32_t field offsets
+ *	  (relative to the start of the record, 0 if the field is absent),
+ *	  followed by the NUL terminated field values.
+ *
+ * All integers are stored in host byte order.  Files built on hosts with a
+ * different byte order are rejected.
+ *
+ * Offsets are checked against the size of the file whenever they're used,
+ * so a corrupt file can only result in failed lookups.
+ *
+ * @file src/lib/util/file_index.c
+ *
+ * @copyright 2019 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/util/file_index.h>
+#include <freeradius-devel/util/strerror.h>
+#include <freeradius-devel/util/syserror.h>
+#include <freeradius-devel/util/talloc.h>
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FR_FILE_INDEX_BYTE_ORDER	0x01020304
+
+/** On disk header
+ */
+typedef struct {
+	char			magic[8];		//!< #FR_FILE_INDEX_MAGIC.
+	uint32_t		version;		//!< #FR_FILE_INDEX_VERSION.
+	uint32_t		byte_order;		//!< #FR_FILE_INDEX_BYTE_ORDER.
+	uint32_t		num_fields;		//!< Fields in each record.
+	uint32_t		key_field;		//!< Which field the keys were taken from.
+	uint64_t		num_keys;		//!< Entries in the key table.
+	uint64_t		num_records;		//!< Number of records.
+	uint64_t		keys_offset;		//!< Start of the key table.
+	uint64_t		records_offset;		//!< Start of the records.
+	uint64_t		file_size;		//!< Total size of the file.
+} fr_file_index_header_t;
+
+/** On disk key table entry
+ */
+typedef struct {
+	uint64_t		key_offset;		//!< Of the key string.
+	uint64_t		record_offset;		//!< Of the record the key refers to.
+	uint32_t		key_len;		//!< Length of the key string.
+	uint32_t		reserved;
+} fr_file_index_key_t;
+
+struct fr_file_index_s {
+	uint8_t const		*map;			//!< The mapped file.
+	size_t			size;			//!< Of the mapping.
+
+	fr_file_index_header_t const *header;
+	fr_file_index_key_t const *keys;
+};
+
+/** A key added to the index, before it's written
+ */
+typedef struct {
+	char const		*key;
+	uint32_t		key_len;
+	uint64_t		record;			//!< Offset of the record in the record buffer.
+	uint64_t		seq;			//!< Order the key was added in.
+} fr_file_index_writer_key_t;
+
+struct fr_file_index_writer_s {
+	uint32_t		num_fields;
+	uint32_t		key_field;
+
+	uint8_t			*records;		//!< Buffer of records.
+	size_t			records_len;		//!< How much of the buffer is used.
+	uint64_t		num_records;
+
+	fr_file_index_writer_key_t *keys;		//!< Keys added so far.
+	size_t			num_keys;
+};
+
+static int _file_index_free(fr_file_index_t *idx)
+{
+	void *map;
+
+	memcpy(&map, &idx->map, sizeof(map));	/* const */
+	munmap(map, idx->size);
+
+	return 0;
+}
+
+/** Check if a file is an index file
+ *
+ * @param[in] filename	to check.
+ * @return
+ *	- true if the file starts with #FR_FILE_INDEX_MAGIC.
+ *	- false if it doesn't, or can't be read.
+ */
+bool fr_file_index_is_index(char const *filename)
+{
+	int	fd;
+	char	magic[sizeof(FR_FILE_INDEX_MAGIC)];
+	ssize_t	len;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) return false;
+
+	len = read(fd, magic, sizeof(magic));
+	close(fd);
+
+	return (len == sizeof(magic)) && (memcmp(magic, FR_FILE_INDEX_MAGIC, sizeof(magic)) == 0);
+}
+
+/** Map an index file, and validate its header
+ *
+ * @param[in] ctx	to allocate the index in.  The file is unmapped when
+ *			the index is freed.
+ * @param[in] filename	of the index.
+ * @return
+ *	- A new index on success.
+ *	- NULL on error.
+ */
+fr_file_index_t *fr_file_index_open(TALLOC_CTX *ctx, char const *filename)
+{
+	int				fd;
+	struct stat			st;
+	void				*map;
+	fr_file_index_t			*idx;
+	fr_file_index_header_t const	*header;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fr_strerror_printf("Failed opening %s: %s", filename, fr_syserror(errno));
+		return NULL;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		fr_strerror_printf("Failed checking %s: %s", filename, fr_syserror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	if ((size_t)st.st_size < sizeof(*header)) {
+		fr_strerror_printf("%s is too short to be an index", filename);
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fr_strerror_printf("Failed mapping %s: %s", filename, fr_syserror(errno));
+		return NULL;
+	}
+
+	idx = talloc_zero(ctx, fr_file_index_t);
+	if (!idx) {
+		munmap(map, st.st_size);
+		fr_strerror_printf("Out of memory");
+		return NULL;
+	}
+	idx->map = map;
+	idx->size = st.st_size;
+	talloc_set_destructor(idx, _file_index_free);
+
+	header = idx->header = (fr_file_index_header_t const *)idx->map;
+
+	if (memcmp(header->magic, FR_FILE_INDEX_MAGIC, sizeof(header->magic)) != 0) {
+		fr_strerror_printf("%s is not an index", filename);
+	error:
+		talloc_free(idx);
+		return NULL;
+	}
+
+	if (header->byte_order != FR_FILE_INDEX_BYTE_ORDER) {
+		fr_strerror_printf("%s was built on a host with a different byte order", filename);
+		goto error;
+	}
+
+	if (header->version != FR_FILE_INDEX_VERSION) {
+		fr_strerror_printf("%s has version %u, expected version %u", filename,
+				   header->version, FR_FILE_INDEX_VERSION);
+		goto error;
+	}
+
+	if (header->file_size != idx->size) {
+		fr_strerror_printf("%s is truncated, or has been modified (expected %" PRIu64 " bytes, got %zu)",
+				   filename, header->file_size, idx->size);
+		goto error;
+	}
+
+	if (!header->num_fields || ((header->key_field != FR_FILE_INDEX_NO_KEY_FIELD) &&
+				    (header->key_field >= header->num_fields))) {
+		fr_strerror_printf("%s has invalid field counts", filename);
+		goto error;
+	}
+
+	if ((header->keys_offset < sizeof(*header)) || (header->keys_offset > idx->size) ||
+	    (header->keys_offset % sizeof(uint64_t)) ||
+	    (header->num_keys > ((idx->size - header->keys_offset) / sizeof(fr_file_index_key_t))) ||
+	    (header->records_offset > idx->size)) {
+		fr_strerror_printf("%s has invalid offsets", filename);
+		goto error;
+	}
+
+	idx->keys = (fr_file_index_key_t const *)(idx->map + header->keys_offset);
+
+#ifdef MADV_RANDOM
+	(void) madvise(map, idx->size, MADV_RANDOM);
+#endif
+
+	return idx;
+}
+
+/** Return the number of fields in each record
+ *
+ */
+uint32_t fr_file_index_num_fields(fr_file_index_t const *idx)
+{
+	return idx->header->num_fields;
+}
+
+/** Return the field the keys were taken from
+ *
+ * @return the field number, or #FR_FILE_INDEX_NO_KEY_FIELD.
+ */
+uint32_t fr_file_index_key_field(fr_file_index_t const *idx)
+{
+	return idx->header->key_field;
+}
+
+/** Compare a key in the key table with a key we're looking for
+ *
+ * @return
+ *	- <0, 0, >0 as with memcmp.
+ *	- 1 if the key table entry is invalid, so it sorts after everything.
+ */
+static int file_index_key_cmp(fr_file_index_t const *idx, fr_file_index_key_t const *entry,
+			      char const *key, size_t key_len)
+{
+	int	ret;
+	size_t	len;
+
+	if ((entry->key_offset > idx->size) || (entry->key_len > (idx->size - entry->key_offset))) return 1;
+
+	len = entry->key_len < key_len ? entry->key_len : key_len;
+
+	ret = memcmp(idx->map + entry->key_offset, key, len);
+	if (ret != 0) return ret;
+
+	return (entry->key_len > key_len) - (entry->key_len < key_len);
+}
+
+/** Find all the entries for a key
+ *
+ * @param[out] first	position of the first matching entry.
+ * @param[in] idx	to search.
+ * @param[in] key	to search for.
+ * @param[in] key_len	length of the key.
+ * @return the number of matching entries, which are at first, first + 1, etc.
+ */
+size_t fr_file_index_find(size_t *first, fr_file_index_t const *idx, char const *key, size_t key_len)
+{
+	size_t lo = 0, hi = idx->header->num_keys, i;
+
+	/*
+	 *	Find the first entry which is not less than the key.
+	 */
+	while (lo < hi) {
+		size_t mid = lo + ((hi - lo) / 2);
+
+		if (file_index_key_cmp(idx, &idx->keys[mid], key, key_len) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	for (i = lo; i < idx->header->num_keys; i++) {
+		if (file_index_key_cmp(idx, &idx->keys[i], key, key_len) != 0) break;
+	}
+
+	*first = lo;
+
+	return i - lo;
+}
+
+/** Get the fields of the record an entry refers to
+ *
+ * @param[out] fields	array of #fr_file_index_num_fields pointers.  Absent
+ *			fields are set to NULL.  The values remain valid
+ *			until the index is freed.
+ * @param[in] idx	to get the record from.
+ * @param[in] pos	of the entry, as returned by #fr_file_index_find.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the record is invalid.
+ */
+int fr_file_index_fields(char const **fields, fr_file_index_t const *idx, size_t pos)
+{
+	uint64_t	record;
+	uint32_t	i, num_fields = idx->header->num_fields;
+	uint32_t const	*offsets;
+
+	if (pos >= idx->header->num_keys) {
+		fr_strerror_printf("Invalid index entry %zu", pos);
+		return -1;
+	}
+
+	record = idx->keys[pos].record_offset;
+	if ((record < idx->header->records_offset) || (record > idx->size) || (record % sizeof(uint32_t)) ||
+	    ((idx->size - record) / sizeof(uint32_t) < num_fields)) {
+	invalid:
+		fr_strerror_printf("Invalid record for index entry %zu", pos);
+		return -1;
+	}
+
+	offsets = (uint32_t const *)(idx->map + record);
+	for (i = 0; i < num_fields; i++) {
+		uint64_t value;
+
+		if (!offsets[i]) {
+			fields[i] = NULL;
+			continue;
+		}
+
+		value = record + offsets[i];
+		if ((value >= idx->size) || !memchr(idx->map + value, '\0', idx->size - value)) goto invalid;
+
+		fields[i] = (char const *)(idx->map + value);
+	}
+
+	return 0;
+}
+
+/** Allocate a writer to build a new index
+ *
+ * @param[in] ctx		to allocate the writer in.
+ * @param[in] num_fields	in each record.
+ * @param[in] key_field		Which field the keys are taken from, or #FR_FILE_INDEX_NO_KEY_FIELD.
+ * @return
+ *	- A new writer.
+ *	- NULL on error.
+ */
+fr_file_index_writer_t *fr_file_index_writer_alloc(TALLOC_CTX *ctx, uint32_t num_fields, uint32_t key_field)
+{
+	fr_file_index_writer_t *w;
+
+	if (!num_fields || ((key_field != FR_FILE_INDEX_NO_KEY_FIELD) && (key_field >= num_fields))) {
+		fr_strerror_printf("Invalid field counts");
+		return NULL;
+	}
+
+	w = talloc_zero(ctx, fr_file_index_writer_t);
+	if (!w) {
+		fr_strerror_printf("Out of memory");
+		return NULL;
+	}
+	w->num_fields = num_fields;
+	w->key_field = key_field;
+
+	return w;
+}
+
+/** Add a record to the index
+ *
+ * @param[in] w		to add the record to.
+ * @param[in] fields	Array of num_fields values.  NULL values are recorded as absent.
+ * @return
+ *	- The record, to pass to #fr_file_index_key_add.
+ *	- -1 on error.
+ */
+int64_t fr_file_index_record_add(fr_file_index_writer_t *w, char const * const *fields)
+{
+	size_t		len, used, offset, i;
+	uint32_t	*offsets;
+	uint64_t	record;
+
+	/*
+	 *	Records are aligned so their offsets can be read in place.
+	 */
+	record = (w->records_len + (sizeof(uint32_t) - 1)) & ~((uint64_t)sizeof(uint32_t) - 1);
+
+	len = w->num_fields * sizeof(uint32_t);
+	for (i = 0; i < w->num_fields; i++) if (fields[i]) len += strlen(fields[i]) + 1;
+
+	if (len > UINT32_MAX) {
+		fr_strerror_printf("Record is too long");
+		return -1;
+	}
+
+	used = talloc_array_length(w->records);
+	if ((record + len) > used) {
+		uint8_t *records;
+
+		if (!used) used = 65536;
+		while ((record + len) > used) used *= 2;
+
+		records = talloc_realloc(w, w->records, uint8_t, used);
+		if (!records) {
+			fr_strerror_printf("Out of memory");
+			return -1;
+		}
+		w->records = records;
+	}
+
+	memset(w->records + w->records_len, 0, record - w->records_len);
+
+	offsets = (uint32_t *)(w->records + record);
+	offset = w->num_fields * sizeof(uint32_t);
+	for (i = 0; i < w->num_fields; i++) {
+		size_t field_len;
+
+		if (!fields[i]) {
+			offsets[i] = 0;
+			continue;
+		}
+
+		field_len = strlen(fields[i]) + 1;
+		memcpy(w->records + record + offset, fields[i], field_len);
+		offsets[i] = offset;
+		offset += field_len;
+	}
+
+	w->records_len = record + len;
+	w->num_records++;
+
+	return record;
+}
+
+/** Add a key which refers to a record
+ *
+ * @param[in] w		to add the key to.
+ * @param[in] key	to add.  May be added multiple times, for different records.
+ * @param[in] record	as returned by #fr_file_index_record_add.
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+int fr_file_index_key_add(fr_file_index_writer_t *w, char const *key, int64_t record)
+{
+	size_t				key_len = strlen(key);
+	fr_file_index_writer_key_t	*entry;
+
+	if ((record < 0) || ((uint64_t)record >= w->records_len)) {
+		fr_strerror_printf("Invalid record");
+		return -1;
+	}
+
+	if (key_len > UINT32_MAX) {
+		fr_strerror_printf("Key is too long");
+		return -1;
+	}
+
+	if (w->num_keys >= talloc_array_length(w->keys)) {
+		fr_file_index_writer_key_t *keys;
+
+		keys = talloc_realloc(w, w->keys, fr_file_index_writer_key_t,
+				      w->num_keys ? w->num_keys * 2 : 1024);
+		if (!keys) {
+		oom:
+			fr_strerror_printf("Out of memory");
+			return -1;
+		}
+		w->keys = keys;
+	}
+
+	entry = &w->keys[w->num_keys];
+	entry->key = talloc_bstrndup(w->keys, key, key_len);
+	if (!entry->key) goto oom;
+	entry->key_len = key_len;
+	entry->record = record;
+	entry->seq = w->num_keys++;
+
+	return 0;
+}
+
+static int writer_key_cmp(void const *one, void const *two)
+{
+	fr_file_index_writer_key_t const *a = one, *b = two;
+	size_t	len = a->key_len < b->key_len ? a->key_len : b->key_len;
+	int	ret;
+
+	ret = memcmp(a->key, b->key, len);
+	if (ret != 0) return ret;
+
+	ret = (a->key_len > b->key_len) - (a->key_len < b->key_len);
+	if (ret != 0) return ret;
+
+	return (a->seq > b->seq) - (a->seq < b->seq);
+}
+
+/** Sort the keys, and write the index
+ *
+ * The index is written to a temporary file, which is renamed over filename,
+ * so processes which have the old index mapped are unaffected.
+ *
+ * @param[in] w		to write.
+ * @param[in] filename	to write the index to.
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+int fr_file_index_write(fr_file_index_writer_t *w, char const *filename)
+{
+	fr_file_index_header_t	header;
+	uint64_t		key_strings, offset;
+	size_t			i;
+	char			*tmp;
+	int			fd;
+	FILE			*fp;
+	static uint8_t const	padding[sizeof(uint64_t)];
+
+	qsort(w->keys, w->num_keys, sizeof(w->keys[0]), writer_key_cmp);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, FR_FILE_INDEX_MAGIC, sizeof(header.magic));
+	header.version = FR_FILE_INDEX_VERSION;
+	header.byte_order = FR_FILE_INDEX_BYTE_ORDER;
+	header.num_fields = w->num_fields;
+	header.key_field = w->key_field;
+	header.num_keys = w->num_keys;
+	header.num_records = w->num_records;
+	header.keys_offset = sizeof(header);
+
+	key_strings = header.keys_offset + (w->num_keys * sizeof(fr_file_index_key_t));
+	offset = key_strings;
+	for (i = 0; i < w->num_keys; i++) offset += w->keys[i].key_len + 1;
+
+	header.records_offset = (offset + (sizeof(uint64_t) - 1)) & ~((uint64_t)sizeof(uint64_t) - 1);
+	header.file_size = header.records_offset + w->records_len;
+
+	tmp = talloc_asprintf(w, "%s.XXXXXX", filename);
+	if (!tmp) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		fr_strerror_printf("Failed creating %s: %s", tmp, fr_syserror(errno));
+		talloc_free(tmp);
+		return -1;
+	}
+	(void) fchmod(fd, 0644);
+
+	fp = fdopen(fd, "w");
+	if (!fp) {
+		fr_strerror_printf("Failed opening %s: %s", tmp, fr_syserror(errno));
+		close(fd);
+	error:
+		unlink(tmp);
+		talloc_free(tmp);
+		return -1;
+	}
+
+	if (fwrite(&header, sizeof(header), 1, fp) != 1) {
+	write_error:
+		fr_strerror_printf("Failed writing %s: %s", tmp, fr_syserror(errno));
+		fclose(fp);
+		goto error;
+	}
+
+	offset = key_strings;
+	for (i = 0; i < w->num_keys; i++) {
+		fr_file_index_key_t entry = {
+			.key_offset = offset,
+			.record_offset = header.records_offset + w->keys[i].record,
+			.key_len = w->keys[i].key_len
+		};
+
+		if (fwrite(&entry, sizeof(entry), 1, fp) != 1) goto write_error;
+		offset += w->keys[i].key_len + 1;
+	}
+
+	for (i = 0; i < w->num_keys; i++) {
+		if (fwrite(w->keys[i].key, w->keys[i].key_len + 1, 1, fp) != 1) goto write_error;
+	}
+
+	if ((header.records_offset > offset) &&
+	    (fwrite(padding, header.records_offset - offset, 1, fp) != 1)) goto write_error;
+
+	if (w->records_len && (fwrite(w->records, w->records_len, 1, fp) != 1)) goto write_error;
+
+	if (fclose(fp) != 0) {
+		fr_strerror_printf("Failed writing %s: %s", tmp, fr_syserror(errno));
+		goto error;
+	}
+
+	if (rename(tmp, filename) < 0) {
+		fr_strerror_printf("Failed renaming %s to %s: %s", tmp, filename, fr_syserror(errno));
+		goto error;
+	}
+
+	talloc_free(tmp);
+
+	return 0;
+}
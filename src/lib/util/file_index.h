@@ -0,0 +1,69 @@
+#pragma once
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Memory mapped, pre-sorted, index of delimited text files
+ *
+ * @file src/lib/util/file_index.h
+ *
+ * @copyright 2019 The FreeRADIUS server project
+ */
+RCSIDH(file_index_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <freeradius-devel/build.h>
+#include <freeradius-devel/missing.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <talloc.h>
+
+#define FR_FILE_INDEX_MAGIC	"FRINDEX"	//!< First bytes of every index file.
+#define FR_FILE_INDEX_VERSION	1		//!< Incremented whenever the format changes.
+
+/** No key field was recorded when the index was built
+ */
+#define FR_FILE_INDEX_NO_KEY_FIELD	UINT32_MAX
+
+typedef struct fr_file_index_s fr_file_index_t;
+typedef struct fr_file_index_writer_s fr_file_index_writer_t;
+
+bool			fr_file_index_is_index(char const *filename);
+
+fr_file_index_t		*fr_file_index_open(TALLOC_CTX *ctx, char const *filename);
+
+uint32_t		fr_file_index_num_fields(fr_file_index_t const *idx);
+
+uint32_t		fr_file_index_key_field(fr_file_index_t const *idx);
+
+size_t			fr_file_index_find(size_t *first, fr_file_index_t const *idx, char const *key, size_t key_len);
+
+int			fr_file_index_fields(char const **fields, fr_file_index_t const *idx, size_t pos);
+
+fr_file_index_writer_t	*fr_file_index_writer_alloc(TALLOC_CTX *ctx, uint32_t num_fields, uint32_t key_field);
+
+int64_t			fr_file_index_record_add(fr_file_index_writer_t *w, char const * const *fields);
+
+int			fr_file_index_key_add(fr_file_index_writer_t *w, char const *key, int64_t record);
+
+int			fr_file_index_write(fr_file_index_writer_t *w, char const *filename);
+
+#ifdef __cplusplus
+}
+#endif
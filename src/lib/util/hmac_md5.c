@@ -31,6 +31,7 @@
 RCSID("$Id$")
 
 #include <freeradius-devel/util/md5.h>
+#include <freeradius-devel/util/talloc.h>
 #include <freeradius-devel/util/thread_local.h>
 
 #ifdef HAVE_OPENSSL_EVP_H
@@ -150,6 +151,112 @@ void fr_hmac_md5(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *in, size_t in
 }
 #endif /* HAVE_OPENSSL_EVP_H */
 
+/** Pre-computed HMAC-MD5 key
+ *
+ * The first block of both the inner and outer hashes depends only on the
+ * key, so it can be processed once, and the resulting states copied for
+ * each message.
+ */
+struct fr_hmac_md5_key_s {
+	fr_md5_ctx_t	*inner;			//!< MD5 state after ingesting K XOR ipad.
+	fr_md5_ctx_t	*outer;			//!< MD5 state after ingesting K XOR opad.
+};
+
+static int _hmac_md5_key_free(fr_hmac_md5_key_t *key)
+{
+	if (key->inner) fr_md5_ctx_free(&key->inner);
+	if (key->outer) fr_md5_ctx_free(&key->outer);
+
+	return 0;
+}
+
+/** Pre-compute the inner and outer HMAC-MD5 states for a key
+ *
+ * The result is read-only, and may be shared between threads.
+ *
+ * @param[in] ctx	to allocate the key in.
+ * @param[in] key	Pointer to authentication key.
+ * @param[in] key_len	Length of authentication key.
+ * @return
+ *	- A new pre-computed key.
+ *	- NULL on error.
+ */
+fr_hmac_md5_key_t *fr_hmac_md5_key_alloc(TALLOC_CTX *ctx, uint8_t const *key, size_t key_len)
+{
+	fr_hmac_md5_key_t	*hmac;
+	uint8_t			k_ipad[64];
+	uint8_t			k_opad[64];
+	uint8_t			tk[MD5_DIGEST_LENGTH];
+	int			i;
+
+	/* if key is longer than 64 bytes reset it to key=MD5(key) */
+	if (key_len > sizeof(k_ipad)) {
+		fr_md5_calc(tk, key, key_len);
+
+		key = tk;
+		key_len = sizeof(tk);
+	}
+
+	memset(k_ipad, 0, sizeof(k_ipad));
+	memset(k_opad, 0, sizeof(k_opad));
+	memcpy(k_ipad, key, key_len);
+	memcpy(k_opad, key, key_len);
+
+	for (i = 0; i < 64; i++) {
+		k_ipad[i] ^= 0x36;
+		k_opad[i] ^= 0x5c;
+	}
+
+	hmac = talloc_zero(ctx, fr_hmac_md5_key_t);
+	if (!hmac) return NULL;
+	talloc_set_destructor(hmac, _hmac_md5_key_free);
+
+	hmac->inner = fr_md5_ctx_alloc(false);
+	hmac->outer = fr_md5_ctx_alloc(false);
+	if (!hmac->inner || !hmac->outer) {
+		talloc_free(hmac);
+		return NULL;
+	}
+
+	fr_md5_update(hmac->inner, k_ipad, sizeof(k_ipad));
+	fr_md5_update(hmac->outer, k_opad, sizeof(k_opad));
+
+	memset(k_ipad, 0, sizeof(k_ipad));
+	memset(k_opad, 0, sizeof(k_opad));
+	memset(tk, 0, sizeof(tk));
+
+	return hmac;
+}
+
+/** Calculate HMAC-MD5 using a pre-computed key
+ *
+ * Produces the same digest as #fr_hmac_md5, but skips hashing the padded
+ * key for every message.
+ *
+ * @param digest Caller digest to be filled in.
+ * @param in Pointer to data stream.
+ * @param inlen length of data stream.
+ * @param key Pre-computed key from #fr_hmac_md5_key_alloc.
+ */
+void fr_hmac_md5_precomputed(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *in, size_t inlen,
+			     fr_hmac_md5_key_t const *key)
+{
+	fr_md5_ctx_t	*ctx;
+	uint8_t		inner[MD5_DIGEST_LENGTH];
+
+	ctx = fr_md5_ctx_alloc(true);
+
+	fr_md5_ctx_copy(ctx, key->inner);
+	fr_md5_update(ctx, in, inlen);
+	fr_md5_final(inner, ctx);
+
+	fr_md5_ctx_copy(ctx, key->outer);
+	fr_md5_update(ctx, inner, sizeof(inner));
+	fr_md5_final(digest, ctx);
+
+	fr_md5_ctx_free(&ctx);
+}
+
 /*
 Test Vectors (Trailing '\0' of a character string not included in test):
 
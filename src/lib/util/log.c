@@ -372,6 +372,8 @@ int fr_vlog(fr_log_t const *log, fr_log_type_t type, char const *msg, va_list ap
 	case L_DST_FILES:
 	case L_DST_STDOUT:
 	case L_DST_STDERR:
+		if (fr_log_async_enabled()) return fr_log_async_write(log, buffer, strlen(buffer));
+
 		return write(log->fd, buffer, strlen(buffer));
 
 	default:
@@ -128,6 +128,19 @@ int	fr_log_perror(fr_log_t const *log, fr_log_type_t type, char const *msg, ...)
 
 bool	fr_rate_limit_enabled(void);
 
+/*
+ *	log_async.c
+ */
+int	fr_log_async_start(size_t ring_size);
+
+void	fr_log_async_stop(void);
+
+bool	fr_log_async_enabled(void);
+
+ssize_t	fr_log_async_write(fr_log_t const *log, char const *buffer, size_t len) CC_HINT(nonnull);
+
+void	fr_log_async_stats(uint64_t *written, uint64_t *dropped) CC_HINT(nonnull);
+
 #ifdef __cplusplus
 }
 #endif
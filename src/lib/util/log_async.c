@@ -0,0 +1,516 @@
+/*
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Write log messages from a dedicated thread
+ *
+ * Each thread which logs gets its own single producer / single consumer
+ * ring buffer.  Formatted messages are copied into the ring, and a
+ * writer thread drains all of the rings, gathering consecutive messages
+ * for the same destination into a single writev() call.
+ *
+ * If a ring is full the message is dropped and counted.  The writer
+ * reports the number of dropped messages the next time it writes to a
+ * log destination.
+ *
+ * @file src/lib/util/log_async.c
+ *
+ * @copyright 2019 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include "log.h"
+
+#include <freeradius-devel/util/strerror.h>
+#include <freeradius-devel/util/syserror.h>
+#include <freeradius-devel/util/thread_local.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+#define LOG_ASYNC_MIN_RING_SIZE		4096
+#define LOG_ASYNC_MAX_IOV		64
+
+/** Header for a message in the ring
+ *
+ * A header with a NULL log marks padding at the end of the ring.
+ */
+typedef struct {
+	fr_log_t const		*log;			//!< Destination of the message.
+	size_t			len;			//!< Length of the message, not including the header.
+} fr_log_async_msg_t;
+
+/** Round a message length up to a multiple of the header size
+ *
+ * Every message then starts at a multiple of the header size, as does the
+ * end of the ring.  So if a message doesn't fit at the end of the ring,
+ * there's always room for a padding header.
+ */
+#define LOG_ASYNC_ALIGN(_x)		(((_x) + (sizeof(fr_log_async_msg_t) - 1)) & ~(sizeof(fr_log_async_msg_t) - 1))
+
+typedef struct fr_log_async_ring_s fr_log_async_ring_t;
+
+/** Per-thread ring buffer
+ *
+ * head and tail are byte offsets which only ever increase.  The producer
+ * writes head, the writer thread writes tail.
+ */
+struct fr_log_async_ring_s {
+	_Atomic(size_t)		head;			//!< Where the producer writes the next message.
+	_Atomic(size_t)		tail;			//!< Where the writer reads the next message.
+
+	_Atomic(uint64_t)	dropped;		//!< Messages dropped because the ring was full.
+	_Atomic(bool)		orphaned;		//!< The thread which owned the ring has exited.
+
+	size_t			size;			//!< Size of the ring, a power of 2.
+	uint8_t			*data;
+
+	fr_log_async_ring_t	*next;			//!< Next ring in the list of all rings.
+};
+
+/** State of the writer thread
+ *
+ */
+typedef struct {
+	pthread_t		thread;
+	pthread_mutex_t		mutex;			//!< Protects the ring list, and the condition.
+	pthread_cond_t		cond;			//!< Signalled when messages are waiting.
+
+	fr_log_async_ring_t	*rings;			//!< All rings, active and orphaned.
+	size_t			ring_size;		//!< Size of each ring.
+
+	_Atomic(bool)		running;		//!< Whether new messages are accepted.
+	_Atomic(bool)		sleeping;		//!< Whether the writer is waiting for messages.
+
+	_Atomic(uint64_t)	written;		//!< Messages written.
+	uint64_t		dropped_freed;		//!< Messages dropped by rings which have been freed.
+	uint64_t		dropped_reported;	//!< Dropped messages we've already complained about.
+} fr_log_async_t;
+
+static fr_log_async_t log_async = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER
+};
+
+fr_thread_local_setup(fr_log_async_ring_t *, log_async_ring)	/* macro */
+static _Thread_local bool log_async_thread_stop;	//!< The ring for this thread has been released.
+
+/** Mark the ring as orphaned when the thread exits
+ *
+ * The writer thread frees it once it's been drained.
+ */
+static void _log_async_ring_release(void *arg)
+{
+	fr_log_async_ring_t *ring = arg;
+
+	atomic_store_explicit(&ring->orphaned, true, memory_order_release);
+	log_async_ring = NULL;
+	log_async_thread_stop = true;
+}
+
+/** Get the ring for this thread, creating it if necessary
+ *
+ */
+static fr_log_async_ring_t *log_async_ring_get(void)
+{
+	fr_log_async_ring_t *ring;
+
+	if (log_async_ring) return log_async_ring;
+	if (log_async_thread_stop) return NULL;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring) return NULL;
+
+	ring->data = malloc(log_async.ring_size);
+	if (!ring->data) {
+		free(ring);
+		return NULL;
+	}
+	ring->size = log_async.ring_size;
+
+	pthread_mutex_lock(&log_async.mutex);
+	ring->next = log_async.rings;
+	log_async.rings = ring;
+	pthread_mutex_unlock(&log_async.mutex);
+
+	log_async_ring = ring;
+	fr_thread_local_set_destructor(log_async_ring, _log_async_ring_release, ring);
+
+	return ring;
+}
+
+/** Free a ring, keeping track of how many messages it dropped
+ *
+ * @note Must be called with the mutex held.
+ */
+static void log_async_ring_free(fr_log_async_ring_t *ring)
+{
+	log_async.dropped_freed += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+
+	free(ring->data);
+	free(ring);
+}
+
+/** Count the messages dropped by all rings
+ *
+ * @note Must be called with the mutex held.
+ */
+static uint64_t log_async_dropped(void)
+{
+	fr_log_async_ring_t	*ring;
+	uint64_t		dropped = log_async.dropped_freed;
+
+	for (ring = log_async.rings; ring; ring = ring->next) {
+		dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+	}
+
+	return dropped;
+}
+
+/** Write a complete iovec array, dealing with short writes
+ *
+ */
+static void log_async_writev(int fd, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt > 0) {
+		ssize_t ret;
+
+		ret = writev(fd, iov, iovcnt);
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			return;
+		}
+
+		while ((iovcnt > 0) && ((size_t) ret >= iov->iov_len)) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+
+		if (iovcnt > 0) {
+			iov->iov_base = (uint8_t *) iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+}
+
+/** Drain one ring, gathering messages for the same destination
+ *
+ * @note Must be called with the mutex held.
+ *
+ * @return the number of messages written.
+ */
+static uint64_t log_async_ring_drain(fr_log_async_ring_t *ring)
+{
+	struct iovec		iov[LOG_ASYNC_MAX_IOV + 1];
+	char			notice[128];
+	int			iovcnt = 0;
+	fr_log_t const		*log = NULL;
+	size_t			head, tail;
+	uint64_t		count = 0, dropped;
+
+	head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+	if (tail == head) return 0;
+
+	while (tail != head) {
+		fr_log_async_msg_t *msg = (fr_log_async_msg_t *) (ring->data + (tail & (ring->size - 1)));
+
+		tail += sizeof(*msg) + LOG_ASYNC_ALIGN(msg->len);
+		if (!msg->log) continue;	/* padding */
+
+		if ((msg->log != log) || (iovcnt == LOG_ASYNC_MAX_IOV)) {
+			if (iovcnt) log_async_writev(log->fd, iov, iovcnt);
+			iovcnt = 0;
+			log = msg->log;
+
+			/*
+			 *	Tell the administrator that we've been
+			 *	throwing messages away.
+			 */
+			dropped = log_async_dropped();
+			if (dropped != log_async.dropped_reported) {
+				iov[iovcnt].iov_base = notice;
+				iov[iovcnt].iov_len = snprintf(notice, sizeof(notice),
+							       "Log buffer full, dropped %" PRIu64 " messages\n",
+							       dropped - log_async.dropped_reported);
+				iovcnt++;
+				log_async.dropped_reported = dropped;
+			}
+		}
+
+		iov[iovcnt].iov_base = (uint8_t *) (msg + 1);
+		iov[iovcnt].iov_len = msg->len;
+		iovcnt++;
+		count++;
+	}
+
+	if (iovcnt) log_async_writev(log->fd, iov, iovcnt);
+
+	/*
+	 *	Only release the space once the data has been written,
+	 *	as the iovecs point into the ring.
+	 */
+	atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+	return count;
+}
+
+/** Drain all rings, and free any which are orphaned and empty
+ *
+ * @note Must be called with the mutex held.
+ *
+ * @return the number of messages written.
+ */
+static uint64_t log_async_drain(void)
+{
+	fr_log_async_ring_t	**last, *ring;
+	uint64_t		count = 0;
+
+	last = &log_async.rings;
+	while ((ring = *last)) {
+		count += log_async_ring_drain(ring);
+
+		if (atomic_load_explicit(&ring->orphaned, memory_order_acquire) &&
+		    (atomic_load_explicit(&ring->head, memory_order_acquire) ==
+		     atomic_load_explicit(&ring->tail, memory_order_relaxed))) {
+			*last = ring->next;
+			log_async_ring_free(ring);
+			continue;
+		}
+
+		last = &ring->next;
+	}
+
+	if (count) atomic_fetch_add_explicit(&log_async.written, count, memory_order_relaxed);
+
+	return count;
+}
+
+static void *log_async_thread(UNUSED void *arg)
+{
+	pthread_mutex_lock(&log_async.mutex);
+
+	while (atomic_load_explicit(&log_async.running, memory_order_acquire)) {
+		struct timespec when;
+
+		if (log_async_drain() > 0) continue;
+
+		/*
+		 *	Nothing to do.  Go to sleep until a producer
+		 *	wakes us up.  The timeout bounds the latency of
+		 *	any message which races with us going to sleep.
+		 */
+		atomic_store_explicit(&log_async.sleeping, true, memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+		if (log_async_drain() > 0) {
+			atomic_store_explicit(&log_async.sleeping, false, memory_order_relaxed);
+			continue;
+		}
+
+		clock_gettime(CLOCK_REALTIME, &when);
+		when.tv_nsec += 100 * 1000 * 1000;
+		if (when.tv_nsec >= 1000 * 1000 * 1000) {
+			when.tv_sec++;
+			when.tv_nsec -= 1000 * 1000 * 1000;
+		}
+		pthread_cond_timedwait(&log_async.cond, &log_async.mutex, &when);
+		atomic_store_explicit(&log_async.sleeping, false, memory_order_relaxed);
+	}
+
+	/*
+	 *	Flush anything which was queued before we were told to stop.
+	 */
+	log_async_drain();
+
+	pthread_mutex_unlock(&log_async.mutex);
+
+	return NULL;
+}
+
+/** Queue a formatted log message for the writer thread
+ *
+ * @param[in] log	destination.  Must remain valid until the writer thread is stopped.
+ * @param[in] buffer	formatted message, including any trailing newline.
+ * @param[in] len	of the message.
+ * @return
+ *	- len if the message was queued or written.
+ *	- 0 if the message was dropped because the ring was full.
+ *	- <0 on write error.
+ */
+ssize_t fr_log_async_write(fr_log_t const *log, char const *buffer, size_t len)
+{
+	fr_log_async_ring_t	*ring;
+	fr_log_async_msg_t	*msg;
+	size_t			head, tail, offset, need, pad;
+
+	if (!atomic_load_explicit(&log_async.running, memory_order_acquire)) goto sync;
+
+	ring = log_async_ring_get();
+	if (!ring) goto sync;
+
+	need = sizeof(*msg) + LOG_ASYNC_ALIGN(len);
+	if (need > (ring->size / 2)) goto sync;		/* too big for the ring */
+
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+	/*
+	 *	Messages are never split.  If there's not enough room
+	 *	at the end of the ring, pad it out, and start again at
+	 *	the beginning.
+	 */
+	offset = head & (ring->size - 1);
+	pad = (ring->size - offset < need) ? ring->size - offset : 0;
+
+	if ((head - tail) + pad + need > ring->size) {
+		atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+		return 0;
+	}
+
+	if (pad) {
+		msg = (fr_log_async_msg_t *) (ring->data + offset);
+		msg->log = NULL;
+		msg->len = pad - sizeof(*msg);
+		head += pad;
+		offset = 0;
+	}
+
+	msg = (fr_log_async_msg_t *) (ring->data + offset);
+	msg->log = log;
+	msg->len = len;
+	memcpy(msg + 1, buffer, len);
+
+	atomic_store_explicit(&ring->head, head + need, memory_order_release);
+
+	/*
+	 *	Only take the mutex if the writer is asleep.
+	 */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&log_async.sleeping, memory_order_relaxed)) {
+		pthread_mutex_lock(&log_async.mutex);
+		pthread_cond_signal(&log_async.cond);
+		pthread_mutex_unlock(&log_async.mutex);
+	}
+
+	return len;
+
+sync:
+	return write(log->fd, buffer, len);
+}
+
+/** Whether log messages are being written by the writer thread
+ *
+ */
+bool fr_log_async_enabled(void)
+{
+	return atomic_load_explicit(&log_async.running, memory_order_relaxed);
+}
+
+/** Return counters for the asynchronous log writer
+ *
+ * @param[out] written	Messages written by the writer thread.
+ * @param[out] dropped	Messages dropped because a ring was full.
+ */
+void fr_log_async_stats(uint64_t *written, uint64_t *dropped)
+{
+	*written = atomic_load_explicit(&log_async.written, memory_order_relaxed);
+
+	pthread_mutex_lock(&log_async.mutex);
+	*dropped = log_async_dropped();
+	pthread_mutex_unlock(&log_async.mutex);
+}
+
+/** Start the asynchronous log writer
+ *
+ * @note Must be called after the server has daemonized, as the writer
+ *	thread doesn't survive fork().
+ *
+ * @param[in] ring_size	Size of each per-thread ring.  Rounded up to a power of 2.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_log_async_start(size_t ring_size)
+{
+	int ret;
+
+	if (atomic_load_explicit(&log_async.running, memory_order_relaxed)) return 0;
+
+	if (ring_size < LOG_ASYNC_MIN_RING_SIZE) ring_size = LOG_ASYNC_MIN_RING_SIZE;
+	if (ring_size > (SIZE_MAX >> 1)) {
+		fr_strerror_printf("Log ring size too large");
+		return -1;
+	}
+	log_async.ring_size = 1;
+	while (log_async.ring_size < ring_size) log_async.ring_size <<= 1;
+
+	atomic_store_explicit(&log_async.running, true, memory_order_release);
+
+	ret = pthread_create(&log_async.thread, NULL, log_async_thread, NULL);
+	if (ret != 0) {
+		atomic_store_explicit(&log_async.running, false, memory_order_release);
+		fr_strerror_printf("Failed creating log writer thread: %s", fr_syserror(ret));
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Stop the asynchronous log writer, flushing any queued messages
+ *
+ * Messages logged after this function is called are written synchronously.
+ */
+void fr_log_async_stop(void)
+{
+	fr_log_async_ring_t **last, *ring;
+
+	if (!atomic_load_explicit(&log_async.running, memory_order_relaxed)) return;
+
+	pthread_mutex_lock(&log_async.mutex);
+	atomic_store_explicit(&log_async.running, false, memory_order_release);
+	pthread_cond_signal(&log_async.cond);
+	pthread_mutex_unlock(&log_async.mutex);
+
+	pthread_join(log_async.thread, NULL);
+
+	/*
+	 *	Rings belonging to threads which are still running
+	 *	stay in the list, and are drained if async logging
+	 *	is started again.
+	 */
+	last = &log_async.rings;
+	while ((ring = *last)) {
+		if (!atomic_load_explicit(&ring->orphaned, memory_order_acquire)) {
+			last = &ring->next;
+			continue;
+		}
+		*last = ring->next;
+		log_async_ring_free(ring);
+	}
+}
@@ -14,6 +14,7 @@ extern "C" {
 
 #include <freeradius-devel/build.h>
 #include <freeradius-devel/missing.h>
+#include <freeradius-devel/util/talloc.h>
 
 #include <inttypes.h>
 #include <sys/types.h>
@@ -85,8 +86,15 @@ extern		fr_md5_final_t		fr_md5_final;
 void		fr_md5_calc(uint8_t out[static MD5_DIGEST_LENGTH], uint8_t const *in, size_t inlen);
 
 /* hmac.c */
+typedef struct fr_hmac_md5_key_s fr_hmac_md5_key_t;
+
 void		fr_hmac_md5(uint8_t digest[static MD5_DIGEST_LENGTH], uint8_t const *in, size_t inlen,
 			    uint8_t const *key, size_t key_len);
+
+fr_hmac_md5_key_t *fr_hmac_md5_key_alloc(TALLOC_CTX *ctx, uint8_t const *key, size_t key_len);
+
+void		fr_hmac_md5_precomputed(uint8_t digest[static MD5_DIGEST_LENGTH], uint8_t const *in, size_t inlen,
+					fr_hmac_md5_key_t const *key);
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,693 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Registry of per-thread counters, gauges, and histograms
+ *
+ * Metrics are grouped into sets, identified by a name and (optional)
+ * labels.  Each thread which updates a set allocates its own shard of
+ * the set, and only ever writes to that shard.  Shards are cache line
+ * aligned, so threads never write to the same cache line, and updates
+ * are plain loads and stores.
+ *
+ * Readers sum all of the shards in a set.  The registry mutex is only
+ * taken when shards are allocated or freed, and when metrics are read,
+ * so reading never slows down the threads updating the metrics.
+ *
+ * When a shard is freed, its values are added to the set, so counters
+ * don't go backwards when a thread exits.  The set is freed along with
+ * its last shard.
+ *
+ * @file src/lib/util/metrics.c
+ *
+ * @copyright 2019 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/util/metrics.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/hash.h>
+#include <freeradius-devel/util/strerror.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define METRICS_CACHE_LINE	64
+
+struct fr_metrics_set_s {
+	char const		*name;		//!< Name of the set.
+	char const		*labels;	//!< Labels, or NULL.
+	char const		*key;		//!< Name and labels, for the registry hash.
+
+	fr_metric_def_t const	*defs;		//!< What the metrics are.
+	unsigned int		num;		//!< Number of metrics.
+	unsigned int		*offset;	//!< Slot of each metric.
+	unsigned int		num_slots;	//!< Slots used by all of the metrics.
+
+	uint64_t		*retired;	//!< Values of shards which have been freed.
+
+	fr_dlist_head_t		shards;		//!< Live shards.
+	fr_dlist_t		entry;		//!< In the registry.
+};
+
+typedef struct {
+	fr_metrics_shard_t	shard;		//!< Must be first.
+	fr_dlist_t		entry;		//!< In the set.
+} metrics_shard_t;
+
+static pthread_mutex_t	metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+static fr_hash_table_t	*metrics_ht;		//!< Sets, by name and labels.
+static fr_dlist_head_t	metrics_list;		//!< Sets, in the order they were registered.
+
+static uint32_t metrics_hash(void const *data)
+{
+	fr_metrics_set_t const *set = data;
+
+	return fr_hash_string(set->key);
+}
+
+static int metrics_cmp(void const *one, void const *two)
+{
+	fr_metrics_set_t const *a = one, *b = two;
+
+	return strcmp(a->key, b->key);
+}
+
+/** Find or create a set
+ *
+ * Must be called with the registry mutex held.
+ */
+static fr_metrics_set_t *metrics_set_find(char const *name, char const *labels,
+					  fr_metric_def_t const *defs, unsigned int num)
+{
+	fr_metrics_set_t	*set, find;
+	char			*key;
+	unsigned int		i;
+
+	key = talloc_asprintf(NULL, "%s{%s}", name, labels ? labels : "");
+	if (!key) return NULL;
+
+	find.key = key;
+	set = fr_hash_table_finddata(metrics_ht, &find);
+	if (set) {
+		talloc_free(key);
+
+		if (set->num != num) {
+			fr_strerror_printf("Metrics %s registered with %u metrics, not %u", set->key, set->num, num);
+			return NULL;
+		}
+
+		return set;
+	}
+
+	if (!defs) {
+		talloc_free(key);
+		return NULL;
+	}
+
+	set = talloc_zero(NULL, fr_metrics_set_t);
+	if (!set) {
+	oom:
+		talloc_free(key);
+		fr_strerror_printf("Out of memory");
+		return NULL;
+	}
+
+	set->key = talloc_steal(set, key);
+	set->name = talloc_strdup(set, name);
+	if (labels) set->labels = talloc_strdup(set, labels);
+	set->defs = defs;
+	set->num = num;
+
+	set->offset = talloc_array(set, unsigned int, num);
+	if (!set->offset) {
+	oom_set:
+		talloc_free(set);
+		fr_strerror_printf("Out of memory");
+		return NULL;
+	}
+
+	for (i = 0; i < num; i++) {
+		set->offset[i] = set->num_slots;
+		set->num_slots += (defs[i].type == FR_METRIC_HISTOGRAM) ? FR_METRICS_HIST_SLOTS : 1;
+	}
+
+	set->retired = talloc_zero_array(set, uint64_t, set->num_slots);
+	if (!set->retired) goto oom_set;
+
+	fr_dlist_init(&set->shards, metrics_shard_t, entry);
+
+	if (!fr_hash_table_insert(metrics_ht, set)) {
+		talloc_free(set);
+		key = NULL;
+		goto oom;
+	}
+	fr_dlist_insert_tail(&metrics_list, set);
+
+	return set;
+}
+
+/** Add a set (all of its shards and retired values) into an array of slots
+ *
+ * Must be called with the registry mutex held.
+ */
+static void metrics_set_sum(uint64_t *out, fr_metrics_set_t *set)
+{
+	metrics_shard_t	*ms;
+	unsigned int	i;
+
+	memcpy(out, set->retired, sizeof(uint64_t) * set->num_slots);
+
+	for (ms = fr_dlist_head(&set->shards);
+	     ms != NULL;
+	     ms = fr_dlist_next(&set->shards, ms)) {
+		for (i = 0; i < set->num_slots; i++) {
+			out[i] += atomic_load_explicit(&ms->shard.slots[i], memory_order_relaxed);
+		}
+	}
+}
+
+static int _metrics_shard_free(metrics_shard_t *ms)
+{
+	fr_metrics_set_t	*set = ms->shard.set;
+	unsigned int		i;
+
+	pthread_mutex_lock(&metrics_mutex);
+	for (i = 0; i < set->num_slots; i++) {
+		set->retired[i] += atomic_load_explicit(&ms->shard.slots[i], memory_order_relaxed);
+	}
+	fr_dlist_remove(&set->shards, ms);
+
+	/*
+	 *	Last one out frees the set.
+	 */
+	if (!fr_dlist_head(&set->shards)) {
+		fr_hash_table_delete(metrics_ht, set);
+		fr_dlist_remove(&metrics_list, set);
+		talloc_free(set);
+	}
+	pthread_mutex_unlock(&metrics_mutex);
+
+	free(ms->shard.slots);
+
+	return 0;
+}
+
+/** Allocate a shard of a set of metrics for the calling thread
+ *
+ * The set is created if this is the first shard with this name and
+ * labels.  Later shards must use the same definitions.
+ *
+ * @param[in] ctx	to allocate the shard in.  The shard is removed from
+ *			the set when it's freed.
+ * @param[in] name	of the set, e.g. "worker".
+ * @param[in] labels	of the set, e.g. "instance=\"stats\"".  May be NULL.
+ * @param[in] defs	of the metrics in the set.  Must remain valid until
+ *			all of the shards have been freed.
+ * @param[in] num	of metrics in defs.
+ * @return
+ *	- The new shard.
+ *	- NULL on error.
+ */
+fr_metrics_shard_t *fr_metrics_shard_alloc(TALLOC_CTX *ctx, char const *name, char const *labels,
+					   fr_metric_def_t const *defs, unsigned int num)
+{
+	fr_metrics_set_t	*set;
+	metrics_shard_t		*ms;
+	size_t			size;
+	void			*slots;
+
+	ms = talloc_zero(ctx, metrics_shard_t);
+	if (!ms) {
+		fr_strerror_printf("Out of memory");
+		return NULL;
+	}
+
+	pthread_mutex_lock(&metrics_mutex);
+	if (!metrics_ht) {
+		metrics_ht = fr_hash_table_create(NULL, metrics_hash, metrics_cmp, NULL);
+		if (!metrics_ht) {
+			pthread_mutex_unlock(&metrics_mutex);
+			fr_strerror_printf("Out of memory");
+			talloc_free(ms);
+			return NULL;
+		}
+		fr_dlist_init(&metrics_list, fr_metrics_set_t, entry);
+	}
+
+	set = metrics_set_find(name, labels, defs, num);
+	if (!set) {
+	error:
+		pthread_mutex_unlock(&metrics_mutex);
+		talloc_free(ms);
+		return NULL;
+	}
+
+	/*
+	 *	Round up to a whole number of cache lines, so that
+	 *	no other shard shares them.
+	 */
+	size = (set->num_slots * sizeof(fr_metric_slot_t) + METRICS_CACHE_LINE - 1) & ~((size_t) METRICS_CACHE_LINE - 1);
+	if (posix_memalign(&slots, METRICS_CACHE_LINE, size) != 0) {
+		fr_strerror_printf("Out of memory");
+		if (!fr_dlist_head(&set->shards)) {
+			fr_hash_table_delete(metrics_ht, set);
+			fr_dlist_remove(&metrics_list, set);
+			talloc_free(set);
+		}
+		goto error;
+	}
+	memset(slots, 0, size);
+
+	ms->shard.slots = slots;
+	ms->shard.offset = set->offset;
+	ms->shard.set = set;
+	fr_dlist_insert_tail(&set->shards, ms);
+	talloc_set_destructor(ms, _metrics_shard_free);
+	pthread_mutex_unlock(&metrics_mutex);
+
+	return &ms->shard;
+}
+
+/** Read the values of the counters and gauges in a set, summed across all threads
+ *
+ * @param[out] out	Where to write the values, one per metric.
+ *			Histograms are returned as their count.
+ * @param[in] name	of the set.
+ * @param[in] labels	of the set.  May be NULL.
+ * @param[in] num	size of out.
+ * @return
+ *	- 0 on success.
+ *	- -1 if there is no such set.
+ */
+int fr_metrics_read(uint64_t *out, char const *name, char const *labels, unsigned int num)
+{
+	fr_metrics_set_t	*set;
+	uint64_t		*sum;
+	unsigned int		i;
+
+	pthread_mutex_lock(&metrics_mutex);
+	set = metrics_ht ? metrics_set_find(name, labels, NULL, num) : NULL;
+	if (!set) {
+		pthread_mutex_unlock(&metrics_mutex);
+		return -1;
+	}
+
+	sum = talloc_array(NULL, uint64_t, set->num_slots);
+	if (!sum) {
+		pthread_mutex_unlock(&metrics_mutex);
+		return -1;
+	}
+	metrics_set_sum(sum, set);
+	pthread_mutex_unlock(&metrics_mutex);
+
+	for (i = 0; i < num; i++) {
+		out[i] = sum[set->offset[i] + ((set->defs[i].type == FR_METRIC_HISTOGRAM) ? FR_METRICS_HIST_BUCKETS : 0)];
+	}
+	talloc_free(sum);
+
+	return 0;
+}
+
+/** Call a function for every metric, with its value summed across all threads
+ *
+ * Sets are walked in the order they were registered.  The registry is
+ * locked for the duration of the walk, so the callback must not
+ * allocate or free shards.
+ */
+void fr_metrics_walk(fr_metrics_walk_t func, void *uctx)
+{
+	fr_metrics_set_t	*set;
+	uint64_t		*sum = NULL;
+	unsigned int		i;
+
+	pthread_mutex_lock(&metrics_mutex);
+	if (!metrics_ht) goto done;
+
+	for (set = fr_dlist_head(&metrics_list);
+	     set != NULL;
+	     set = fr_dlist_next(&metrics_list, set)) {
+		if (talloc_array_length(sum) < set->num_slots) {
+			talloc_free(sum);
+			sum = talloc_array(NULL, uint64_t, set->num_slots);
+			if (!sum) break;
+		}
+
+		metrics_set_sum(sum, set);
+
+		for (i = 0; i < set->num; i++) func(set->name, set->labels, &set->defs[i], sum + set->offset[i], uctx);
+	}
+
+done:
+	pthread_mutex_unlock(&metrics_mutex);
+	talloc_free(sum);
+}
+
+/** Return the upper bound (in nanoseconds) of a histogram bucket
+ *
+ * @return the bound, or UINT64_MAX for the last bucket.
+ */
+uint64_t fr_metrics_bucket_bound(unsigned int bucket)
+{
+	if (bucket >= (FR_METRICS_HIST_BUCKETS - 1)) return UINT64_MAX;
+
+	return ((uint64_t) 1 << bucket) * 1000;
+}
+
+/** A copy of a set, and its values summed across all threads
+ *
+ */
+typedef struct {
+	char const		*name;		//!< Name of the set.
+	char const		*labels;	//!< Labels, or NULL.
+	fr_metric_def_t		*defs;		//!< Copied, as the set may be freed once we unlock.
+	unsigned int		num;		//!< Number of metrics.
+	unsigned int		*offset;	//!< Slot of each metric.
+	uint64_t		*sum;		//!< Values of all of the slots.
+	fr_dlist_t		entry;		//!< In the order the sets were registered.
+} metrics_snapshot_t;
+
+/** Copy every set, with its values summed across all threads
+ *
+ * The registry is only locked while the values are copied, so the
+ * copies can be formatted without holding up threads which are
+ * allocating or freeing shards.
+ *
+ * @param[in] ctx	to allocate the copies in.
+ * @param[out] list	of #metrics_snapshot_t, in the order the sets were registered.
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+static int metrics_snapshot(TALLOC_CTX *ctx, fr_dlist_head_t *list)
+{
+	fr_metrics_set_t	*set;
+	metrics_snapshot_t	*snap;
+	unsigned int		i;
+
+	fr_dlist_init(list, metrics_snapshot_t, entry);
+
+	pthread_mutex_lock(&metrics_mutex);
+	if (!metrics_ht) goto done;
+
+	for (set = fr_dlist_head(&metrics_list);
+	     set != NULL;
+	     set = fr_dlist_next(&metrics_list, set)) {
+		snap = talloc_zero(ctx, metrics_snapshot_t);
+		if (!snap) {
+		oom:
+			pthread_mutex_unlock(&metrics_mutex);
+			fr_strerror_printf("Out of memory");
+			return -1;
+		}
+		fr_dlist_insert_tail(list, snap);
+
+		snap->name = talloc_strdup(snap, set->name);
+		if (!snap->name) goto oom;
+		if (set->labels) {
+			snap->labels = talloc_strdup(snap, set->labels);
+			if (!snap->labels) goto oom;
+		}
+
+		snap->num = set->num;
+		snap->defs = talloc_memdup(snap, set->defs, sizeof(fr_metric_def_t) * set->num);
+		snap->offset = talloc_memdup(snap, set->offset, sizeof(unsigned int) * set->num);
+		snap->sum = talloc_array(snap, uint64_t, set->num_slots);
+		if (!snap->defs || !snap->offset || !snap->sum) goto oom;
+
+		for (i = 0; i < set->num; i++) {
+			snap->defs[i].name = talloc_strdup(snap, set->defs[i].name);
+			if (!snap->defs[i].name) goto oom;
+			if (set->defs[i].help) {
+				snap->defs[i].help = talloc_strdup(snap, set->defs[i].help);
+				if (!snap->defs[i].help) goto oom;
+			}
+		}
+
+		metrics_set_sum(snap->sum, set);
+	}
+
+done:
+	pthread_mutex_unlock(&metrics_mutex);
+
+	return 0;
+}
+
+/** A metric family, i.e. one metric in all of the sets with the same name
+ *
+ * OpenMetrics requires all of the samples in a family to be printed
+ * together, but the sets with the same name may have been registered
+ * at any time.
+ */
+typedef struct {
+	char const		*name;		//!< Prefix, set name, and metric name.
+	fr_metric_def_t const	*def;		//!< From the first set.
+	char			*samples;	//!< Printed samples.
+	fr_dlist_t		entry;		//!< In the order the families were found.
+} metrics_family_t;
+
+typedef struct {
+	TALLOC_CTX		*ctx;		//!< For the families.
+	char const		*prefix;	//!< Of every metric name.
+	fr_hash_table_t		*ht;		//!< Families by name.
+	fr_dlist_head_t		list;		//!< Families in order.
+	bool			failed;		//!< Ran out of memory.
+} metrics_render_t;
+
+static uint32_t metrics_family_hash(void const *data)
+{
+	metrics_family_t const *family = data;
+
+	return fr_hash_string(family->name);
+}
+
+static int metrics_family_cmp(void const *one, void const *two)
+{
+	metrics_family_t const *a = one, *b = two;
+
+	return strcmp(a->name, b->name);
+}
+
+/** Print the labels of a sample, with an optional extra label
+ *
+ */
+static char *metrics_labels(TALLOC_CTX *ctx, char const *labels, char const *extra)
+{
+	if (!labels || !*labels) {
+		if (!extra) return talloc_strdup(ctx, "");
+		return talloc_asprintf(ctx, "{%s}", extra);
+	}
+
+	if (!extra) return talloc_asprintf(ctx, "{%s}", labels);
+
+	return talloc_asprintf(ctx, "{%s,%s}", labels, extra);
+}
+
+static void metrics_render(char const *set_name, char const *labels, fr_metric_def_t const *def,
+			   uint64_t const *value, void *uctx)
+{
+	metrics_render_t	*render = uctx;
+	metrics_family_t	*family, find;
+	char			*name, *l;
+	unsigned int		i;
+	uint64_t		total = 0;
+
+	if (render->failed) return;
+
+	name = talloc_asprintf(render->ctx, "%s%s_%s", render->prefix, set_name, def->name);
+	if (!name) goto oom;
+
+	find.name = name;
+	family = fr_hash_table_finddata(render->ht, &find);
+	if (family) {
+		talloc_free(name);
+	} else {
+		family = talloc_zero(render->ctx, metrics_family_t);
+		if (!family) goto oom;
+
+		family->name = talloc_steal(family, name);
+		family->def = def;
+		family->samples = talloc_strdup(family, "");
+		if (!family->samples || !fr_hash_table_insert(render->ht, family)) goto oom;
+		fr_dlist_insert_tail(&render->list, family);
+	}
+
+	/*
+	 *	A family has one type, even if a later set
+	 *	disagrees.
+	 */
+	if (def->type != family->def->type) return;
+
+	switch (def->type) {
+	case FR_METRIC_COUNTER:
+		l = metrics_labels(family, labels, NULL);
+		if (!l) goto oom;
+		family->samples = talloc_asprintf_append_buffer(family->samples, "%s_total%s %" PRIu64 "\n",
+								family->name, l, value[0]);
+		talloc_free(l);
+		break;
+
+	case FR_METRIC_GAUGE:
+		l = metrics_labels(family, labels, NULL);
+		if (!l) goto oom;
+		family->samples = talloc_asprintf_append_buffer(family->samples, "%s%s %" PRIi64 "\n",
+								family->name, l, (int64_t) value[0]);
+		talloc_free(l);
+		break;
+
+	/*
+	 *	Buckets are cumulative, and bounds and the sum are
+	 *	in seconds.
+	 */
+	case FR_METRIC_HISTOGRAM:
+		for (i = 0; i < FR_METRICS_HIST_BUCKETS; i++) {
+			uint64_t	bound = fr_metrics_bucket_bound(i);
+			char		le[32];
+
+			total += value[i];
+
+			if (bound == UINT64_MAX) {
+				strcpy(le, "le=\"+Inf\"");
+			} else {
+				snprintf(le, sizeof(le), "le=\"%" PRIu64 ".%06" PRIu64 "\"",
+					 bound / 1000000000, (bound / 1000) % 1000000);
+			}
+
+			l = metrics_labels(family, labels, le);
+			if (!l) goto oom;
+			family->samples = talloc_asprintf_append_buffer(family->samples, "%s_bucket%s %" PRIu64 "\n",
+									family->name, l, total);
+			talloc_free(l);
+			if (!family->samples) goto oom;
+		}
+
+		l = metrics_labels(family, labels, NULL);
+		if (!l) goto oom;
+		family->samples = talloc_asprintf_append_buffer(family->samples,
+								"%s_count%s %" PRIu64 "\n"
+								"%s_sum%s %" PRIu64 ".%09" PRIu64 "\n",
+								family->name, l, value[FR_METRICS_HIST_BUCKETS],
+								family->name, l,
+								value[FR_METRICS_HIST_BUCKETS + 1] / 1000000000,
+								value[FR_METRICS_HIST_BUCKETS + 1] % 1000000000);
+		talloc_free(l);
+		break;
+	}
+
+	if (family->samples) return;
+
+oom:
+	render->failed = true;
+}
+
+/** Print all of the metrics in the OpenMetrics text format
+ *
+ * Counters have a "_total" suffix, and histogram buckets and sums are
+ * in seconds.  Values are read the same way as fr_metrics_walk(), so
+ * the threads updating them are never locked.  The registry is only
+ * locked while the values are copied, and not while they're printed.
+ *
+ * @param[in] ctx	to allocate the text in.
+ * @param[in] prefix	for every metric name, e.g. "freeradius_".
+ * @return
+ *	- The text, ending with "# EOF".
+ *	- NULL on error.
+ */
+char *fr_metrics_openmetrics(TALLOC_CTX *ctx, char const *prefix)
+{
+	metrics_render_t	render = { .prefix = prefix ? prefix : "" };
+	metrics_family_t	*family;
+	metrics_snapshot_t	*snap;
+	fr_dlist_head_t		snapshots;
+	unsigned int		i;
+	char			*out;
+
+	render.ctx = talloc_new(NULL);
+	if (!render.ctx) return NULL;
+
+	render.ht = fr_hash_table_create(render.ctx, metrics_family_hash, metrics_family_cmp, NULL);
+	if (!render.ht) {
+	error:
+		talloc_free(render.ctx);
+		fr_strerror_printf("Out of memory");
+		return NULL;
+	}
+	fr_dlist_init(&render.list, metrics_family_t, entry);
+
+	if (metrics_snapshot(render.ctx, &snapshots) < 0) goto error;
+
+	for (snap = fr_dlist_head(&snapshots);
+	     snap != NULL;
+	     snap = fr_dlist_next(&snapshots, snap)) {
+		for (i = 0; i < snap->num; i++) {
+			metrics_render(snap->name, snap->labels, &snap->defs[i], snap->sum + snap->offset[i], &render);
+		}
+	}
+	if (render.failed) goto error;
+
+	out = talloc_strdup(ctx, "");
+	for (family = fr_dlist_head(&render.list);
+	     out && family;
+	     family = fr_dlist_next(&render.list, family)) {
+		static char const *types[] = {
+			[FR_METRIC_COUNTER] = "counter",
+			[FR_METRIC_GAUGE] = "gauge",
+			[FR_METRIC_HISTOGRAM] = "histogram"
+		};
+
+		out = talloc_asprintf_append_buffer(out, "# TYPE %s %s\n", family->name, types[family->def->type]);
+		if (out && family->def->help) {
+			out = talloc_asprintf_append_buffer(out, "# HELP %s %s\n", family->name, family->def->help);
+		}
+		if (out) out = talloc_strdup_append_buffer(out, family->samples);
+	}
+	if (out) out = talloc_strdup_append_buffer(out, "# EOF\n");
+	if (!out) goto error;
+
+	talloc_free(render.ctx);
+
+	return out;
+}
+
+/** Estimate a quantile of a histogram
+ *
+ * @param[in] value	of the histogram, as passed to a #fr_metrics_walk_t.
+ * @param[in] q		quantile, e.g. 0.99.
+ * @return
+ *	- The upper bound (in nanoseconds) of the bucket containing the quantile.
+ *	- UINT64_MAX if the quantile is in the last bucket.
+ *	- 0 if the histogram is empty.
+ */
+uint64_t fr_metrics_quantile(uint64_t const *value, double q)
+{
+	uint64_t	count = value[FR_METRICS_HIST_BUCKETS];
+	uint64_t	rank, total = 0;
+	unsigned int	i;
+
+	if (!count) return 0;
+
+	rank = (uint64_t) (q * count);
+	if (rank < 1) rank = 1;
+	if (rank > count) rank = count;
+
+	for (i = 0; i < FR_METRICS_HIST_BUCKETS; i++) {
+		total += value[i];
+		if (total >= rank) return fr_metrics_bucket_bound(i);
+	}
+
+	return UINT64_MAX;
+}
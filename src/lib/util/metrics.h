@@ -0,0 +1,160 @@
+#pragma once
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Registry of per-thread counters, gauges, and histograms
+ *
+ * @file src/lib/util/metrics.h
+ *
+ * @copyright 2019 The FreeRADIUS server project
+ */
+RCSIDH(metrics_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <freeradius-devel/build.h>
+#include <freeradius-devel/missing.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <talloc.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+/** Number of histogram buckets
+ *
+ * Bucket N counts observations <= 2^N microseconds, the last bucket
+ * counts everything else.
+ */
+#define FR_METRICS_HIST_BUCKETS		28
+
+/** Slots used by a histogram, the buckets, the count, and the sum (in nanoseconds)
+ *
+ */
+#define FR_METRICS_HIST_SLOTS		(FR_METRICS_HIST_BUCKETS + 2)
+
+typedef enum {
+	FR_METRIC_COUNTER = 0,			//!< Only ever increases.
+	FR_METRIC_GAUGE,			//!< Goes up and down.  Summed across threads.
+	FR_METRIC_HISTOGRAM			//!< Distribution of times.
+} fr_metric_type_t;
+
+typedef struct {
+	char const		*name;		//!< Appended to the set name when exported.
+	char const		*help;		//!< Description of the metric.
+	fr_metric_type_t	type;		//!< Counter, gauge, or histogram.
+} fr_metric_def_t;
+
+typedef _Atomic(uint64_t) fr_metric_slot_t;
+
+typedef struct fr_metrics_set_s fr_metrics_set_t;
+
+/** One thread's copy of the metrics in a set
+ *
+ * Only the thread which allocated the shard may update it.  Readers sum
+ * all of the shards in a set, so updates need no locks, and no atomic
+ * read-modify-write operations.
+ */
+typedef struct {
+	fr_metric_slot_t	*slots;		//!< Cache line aligned.
+	unsigned int const	*offset;	//!< Slot of each metric.
+	fr_metrics_set_t	*set;		//!< The set this shard belongs to.
+} fr_metrics_shard_t;
+
+/** Called for each metric by fr_metrics_walk()
+ *
+ * @param[in] set_name	Name of the set.
+ * @param[in] labels	Labels of the set, or NULL.
+ * @param[in] def	Definition of the metric.
+ * @param[in] value	Summed across all threads.  For histograms, this is
+ *			#FR_METRICS_HIST_SLOTS values.
+ * @param[in] uctx	passed to fr_metrics_walk().
+ */
+typedef void (*fr_metrics_walk_t)(char const *set_name, char const *labels, fr_metric_def_t const *def,
+				  uint64_t const *value, void *uctx);
+
+fr_metrics_shard_t	*fr_metrics_shard_alloc(TALLOC_CTX *ctx, char const *name, char const *labels,
+						fr_metric_def_t const *defs, unsigned int num);
+
+int			fr_metrics_read(uint64_t *out, char const *name, char const *labels, unsigned int num);
+
+void			fr_metrics_walk(fr_metrics_walk_t func, void *uctx);
+
+uint64_t		fr_metrics_bucket_bound(unsigned int bucket);
+
+uint64_t		fr_metrics_quantile(uint64_t const *value, double q);
+
+char			*fr_metrics_openmetrics(TALLOC_CTX *ctx, char const *prefix);
+
+/** Add to a counter or gauge in the calling thread's shard
+ *
+ */
+static inline void fr_metrics_add(fr_metrics_shard_t *shard, unsigned int idx, uint64_t n)
+{
+	fr_metric_slot_t *slot = &shard->slots[shard->offset[idx]];
+
+	atomic_store_explicit(slot, atomic_load_explicit(slot, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+#define fr_metrics_inc(_shard, _idx)	fr_metrics_add(_shard, _idx, 1)
+#define fr_metrics_dec(_shard, _idx)	fr_metrics_add(_shard, _idx, UINT64_MAX)
+
+/** Return the value of a counter or gauge in one shard
+ *
+ */
+static inline uint64_t fr_metrics_value(fr_metrics_shard_t const *shard, unsigned int idx)
+{
+	return atomic_load_explicit(&shard->slots[shard->offset[idx]], memory_order_relaxed);
+}
+
+/** Record a time in a histogram in the calling thread's shard
+ *
+ * @param[in] shard	to update.
+ * @param[in] idx	of the histogram.
+ * @param[in] ns	time in nanoseconds.
+ */
+static inline void fr_metrics_observe(fr_metrics_shard_t *shard, unsigned int idx, uint64_t ns)
+{
+	fr_metric_slot_t	*slots = &shard->slots[shard->offset[idx]];
+	uint64_t		usec = (ns + 999) / 1000;
+	unsigned int		bucket;
+
+	/*
+	 *	ceil(log2(usec))
+	 */
+	if (usec <= 1) {
+		bucket = 0;
+	} else {
+		bucket = 64 - __builtin_clzll(usec - 1);
+		if (bucket >= FR_METRICS_HIST_BUCKETS) bucket = FR_METRICS_HIST_BUCKETS - 1;
+	}
+
+#define INC(_slot, _n) atomic_store_explicit(_slot, atomic_load_explicit(_slot, memory_order_relaxed) + (_n), memory_order_relaxed)
+	INC(&slots[bucket], 1);
+	INC(&slots[FR_METRICS_HIST_BUCKETS], 1);
+	INC(&slots[FR_METRICS_HIST_BUCKETS + 1], ns);
+#undef INC
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -334,6 +334,87 @@ char *fr_trim(char const *str, size_t size)
 	return q;
 }
 
+/** Find the end of a CSV field, allowing for quotation marks
+ *
+ * Quoted fields are unquoted in place, with "" becoming ".  A CR or LF
+ * ends the last field on the line.
+ *
+ * @param[out] out	Set to the delimiter after the field, or NULL if
+ *			this is the last field on the line.
+ * @param[in] buf	Start of the field.  Modified in place.
+ * @param[in] delimiter	between fields.
+ * @return
+ *	- true on success.
+ *	- false if a quoted field isn't terminated.
+ */
+bool fr_csv_field(char **out, char *buf, char delimiter)
+{
+	char *p, *q;
+
+	if (*buf != '"') {
+		*out = strchr(buf, delimiter);
+
+		if (!*out) {	/* mash CR / LF */
+			for (p = buf; *p != '\0'; p++) {
+				if (*p < ' ') {
+					*p = '\0';
+					break;
+				}
+			}
+		}
+
+		return true;
+	}
+
+	p = buf + 1;
+	q = buf;
+
+	while (*p) {
+		if (*p < ' ') {
+			*q = '\0';
+			*out = NULL;
+			return true;
+		}
+
+		/*
+		 *	Double quotes to single quotes.
+		 */
+		if ((*p == '"') && (p[1] == '"')) {
+			*(q++) = '"';
+			p += 2;
+			continue;
+		}
+
+		/*
+		 *	Double quotes and EOL mean we're done.
+		 */
+		if ((*p == '"') && (p[1] < ' ')) {
+			*(q++) = '\0';
+
+			*out = NULL;
+			return true;
+		}
+
+		/*
+		 *	Double quotes and delimiter: point to the delimiter.
+		 */
+		if ((*p == '"') && (p[1] == delimiter)) {
+			*(q++) = '\0';
+
+			*out = p + 1;
+			return true;
+		}
+
+		/*
+		 *	Everything else gets copied over verbatim
+		 */
+		*(q++) = *(p++);
+		*q = '\0';
+	}
+
+	return false;
+}
+
 /*
  *	So we don't have ifdef's in the rest of the code
  */
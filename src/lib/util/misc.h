@@ -153,6 +153,7 @@ size_t		fr_hex2bin(uint8_t *bin, size_t outlen, char const *hex, size_t inlen);
 int		fr_strtoull(uint64_t *out, char **end, char const *value);
 int		fr_strtoll(int64_t *out, char **end, char const *value);
 char		*fr_trim(char const *str, size_t size);
+bool		fr_csv_field(char **out, char *buf, char delimiter);
 
 int		fr_nonblock(int fd);
 int		fr_blocking(int fd);
@@ -0,0 +1,77 @@
+#pragma once
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Static (USDT) probes, for tracing with bpftrace, SystemTap, or DTrace
+ *
+ * When <sys/sdt.h> is available, each probe compiles to a single "nop"
+ * instruction, and a note in the binary which tells the tracer where
+ * the probe is, and where to find its arguments.  Nothing else is
+ * executed until a tracer attaches to the probe.
+ *
+ * All probes are in the "freeradius" provider.  e.g.
+ *
+ @verbatim
+   bpftrace -e 'usdt:/usr/sbin/radiusd:freeradius:worker_get_request { @queue = hist(arg2); }'
+ @endverbatim
+ *
+ * Arguments should be cheap to evaluate, as they are evaluated whether
+ * or not a tracer is attached.  Pass values which have already been
+ * calculated, and leave the rest to the tracer.
+ *
+ * When <sys/sdt.h> isn't available, the probes compile to nothing.
+ *
+ * Times are in nanoseconds.
+ *
+ @verbatim
+   network_read		(fd, size, data, priority)
+   channel_send_request	(channel, sequence, size, priority)
+   worker_get_request	(request, packet code, queue time, decode time)
+   worker_send_reply	(request, reply code, processing time, time since received)
+   unlang_start		(request, stack depth)
+   unlang_finish	(request, rcode)
+   module_call		(request, module name)
+   module_resume	(request, module name)
+   module_return	(request, module name, rcode, processing time so far)
+   pool_get_start	(pool name, request)
+   pool_get_done	(pool name, request, connection or NULL)
+ @endverbatim
+ *
+ * Request numbers are 0 when there's no request.
+ *
+ * @file src/lib/util/probe.h
+ *
+ * @copyright 2019 The FreeRADIUS server project
+ */
+RCSIDH(probe_h, "$Id$")
+
+#ifdef HAVE_SYS_SDT_H
+#  include <sys/sdt.h>
+
+#  define FR_PROBE0(_name)				DTRACE_PROBE(freeradius, _name)
+#  define FR_PROBE1(_name, _a)				DTRACE_PROBE1(freeradius, _name, _a)
+#  define FR_PROBE2(_name, _a, _b)			DTRACE_PROBE2(freeradius, _name, _a, _b)
+#  define FR_PROBE3(_name, _a, _b, _c)			DTRACE_PROBE3(freeradius, _name, _a, _b, _c)
+#  define FR_PROBE4(_name, _a, _b, _c, _d)		DTRACE_PROBE4(freeradius, _name, _a, _b, _c, _d)
+#  define FR_PROBE5(_name, _a, _b, _c, _d, _e)		DTRACE_PROBE5(freeradius, _name, _a, _b, _c, _d, _e)
+#else
+#  define FR_PROBE0(_name)
+#  define FR_PROBE1(_name, _a)
+#  define FR_PROBE2(_name, _a, _b)
+#  define FR_PROBE3(_name, _a, _b, _c)
+#  define FR_PROBE4(_name, _a, _b, _c, _d)
+#  define FR_PROBE5(_name, _a, _b, _c, _d, _e)
+#endif
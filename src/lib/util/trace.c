@@ -0,0 +1,391 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Sampling tracer, which records timestamped events into per-thread rings
+ *
+ * Callers decide which requests are traced, usually by calling
+ * fr_trace_sample() once per request, and then record events for
+ * those requests only.  Requests which aren't traced cost one branch
+ * per event site.
+ *
+ * Each thread writes to its own ring, which is allocated the first
+ * time the thread records an event.  Writing an event is a copy, and
+ * a release store of the ring head.  No locks are taken.
+ *
+ * Readers take the registry mutex, which only stops rings from being
+ * freed.  Each ring is copied while the owning thread keeps writing to
+ * it, and the head is re-read afterwards.  Any events which may have
+ * been overwritten during the copy are discarded.
+ *
+ * @file src/lib/util/trace.c
+ *
+ * @copyright 2019 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/util/trace.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/strerror.h>
+#include <freeradius-devel/util/thread_local.h>
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <talloc.h>
+#include <unistd.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+#define TRACE_NAME_LEN	39
+#define NSEC		1000000000
+
+/** Combine the thread ID and the event ID into an ID which is unique in the process
+ *
+ */
+#define TRACE_CHROME_ID(_tid, _id)	(((uint64_t)(_tid) << 48) | ((_id) & ((UINT64_C(1) << 48) - 1)))
+
+/** One event, sized to fill a cache line
+ *
+ */
+typedef struct {
+	uint64_t		when;			//!< Nanoseconds, as returned by fr_time().
+	uint64_t		id;			//!< Usually the request number.
+	char const		*category;		//!< Must be a string literal.
+	char			phase;			//!< #fr_trace_phase_t.
+	char			name[TRACE_NAME_LEN];	//!< Copied, so it can be printed after the
+							//!< caller has freed it.
+} trace_event_t;
+
+typedef struct {
+	fr_dlist_t		entry;			//!< In the registry.
+	unsigned int		tid;			//!< Printed as the thread ID.
+	_Atomic(uint64_t)	head;			//!< Number of events ever written.
+	trace_event_t		event[FR_TRACE_RING_SIZE];
+} trace_ring_t;
+
+/** An event copied out of a ring, for sorting
+ *
+ */
+typedef struct {
+	trace_event_t		event;
+	unsigned int		tid;
+	uint64_t		seq;			//!< Keeps events with the same time in order.
+} trace_dump_t;
+
+static pthread_mutex_t		trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static fr_dlist_head_t		trace_list;		//!< All rings.
+static bool			trace_list_init = false;
+static size_t			trace_num;		//!< Number of rings.
+static unsigned int		trace_tid;		//!< Last thread ID handed out.
+
+static _Atomic(bool)		trace_running;
+static _Atomic(uint32_t)	trace_rate;		//!< Trace 1 in N requests.
+static _Atomic(uint64_t)	trace_started;		//!< Events before this are ignored.
+
+static _Thread_local uint32_t	trace_count;		//!< Requests seen since the last one sampled.
+
+fr_thread_local_setup(trace_ring_t *, trace_ring)	/* macro */
+
+static void _trace_ring_free(void *arg)
+{
+	trace_ring_t *ring = talloc_get_type_abort(arg, trace_ring_t);
+
+	pthread_mutex_lock(&trace_mutex);
+	fr_dlist_remove(&trace_list, ring);
+	trace_num--;
+	pthread_mutex_unlock(&trace_mutex);
+
+	talloc_free(ring);
+}
+
+static trace_ring_t *trace_ring_get(void)
+{
+	trace_ring_t *ring;
+
+	ring = trace_ring;
+	if (ring) return ring;
+
+	ring = talloc_zero(NULL, trace_ring_t);
+	if (!ring) return NULL;
+	atomic_init(&ring->head, 0);
+
+	pthread_mutex_lock(&trace_mutex);
+	if (!trace_list_init) {
+		fr_dlist_init(&trace_list, trace_ring_t, entry);
+		trace_list_init = true;
+	}
+	ring->tid = ++trace_tid;
+	fr_dlist_insert_tail(&trace_list, ring);
+	trace_num++;
+	pthread_mutex_unlock(&trace_mutex);
+
+	fr_thread_local_set_destructor(trace_ring, _trace_ring_free, ring);
+
+	return ring;
+}
+
+/** Return whether the tracer is running
+ *
+ * Events may still be recorded for requests which were sampled before
+ * the tracer was stopped.
+ */
+bool fr_trace_running(void)
+{
+	return atomic_load_explicit(&trace_running, memory_order_relaxed);
+}
+
+/** Decide whether the calling thread should trace the next request
+ *
+ * @return
+ *	- true if the request should be traced.
+ *	- false if it should not be traced, or the tracer isn't running,
+ *	  or only requests which ask to be traced are traced.
+ */
+bool fr_trace_sample(void)
+{
+	uint32_t rate;
+
+	if (!atomic_load_explicit(&trace_running, memory_order_relaxed)) return false;
+
+	rate = atomic_load_explicit(&trace_rate, memory_order_relaxed);
+	if (!rate) return false;
+
+	if (++trace_count < rate) return false;
+
+	trace_count = 0;
+	return true;
+}
+
+/** Record an event in the calling thread's ring
+ *
+ * @param[in] id	Events with the same ID, recorded by the same thread,
+ *			are grouped together.  Usually this is the request number.
+ * @param[in] when	the event happened, in nanoseconds.
+ * @param[in] phase	of the event.
+ * @param[in] category	of the event.  Must be a string literal.
+ * @param[in] name	of the event.  Copied, and truncated if it's too long.
+ */
+void fr_trace_event(uint64_t id, uint64_t when, fr_trace_phase_t phase, char const *category, char const *name)
+{
+	trace_ring_t	*ring;
+	trace_event_t	*event;
+	uint64_t	head;
+
+	ring = trace_ring_get();
+	if (!ring) return;
+
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	event = &ring->event[head & (FR_TRACE_RING_SIZE - 1)];
+
+	event->when = when;
+	event->id = id;
+	event->category = category;
+	event->phase = phase;
+	strlcpy(event->name, name, sizeof(event->name));
+
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/** Start tracing
+ *
+ * Events recorded before this call are not printed by fr_trace_dump().
+ *
+ * @param[in] now	the current time, on the same clock as the events.
+ * @param[in] rate	Trace one request in every "rate" requests.  If 0,
+ *			only requests which ask to be traced are traced.
+ */
+void fr_trace_start(uint64_t now, uint32_t rate)
+{
+	atomic_store_explicit(&trace_started, now, memory_order_relaxed);
+	atomic_store_explicit(&trace_rate, rate, memory_order_relaxed);
+	atomic_store_explicit(&trace_running, true, memory_order_relaxed);
+}
+
+/** Stop sampling new requests
+ *
+ * Recorded events are kept, so they can be printed with fr_trace_dump().
+ */
+void fr_trace_stop(void)
+{
+	atomic_store_explicit(&trace_running, false, memory_order_relaxed);
+}
+
+static int trace_dump_cmp(void const *one, void const *two)
+{
+	trace_dump_t const *a = one, *b = two;
+	int ret;
+
+	ret = (a->event.when > b->event.when) - (a->event.when < b->event.when);
+	if (ret != 0) return ret;
+
+	return (a->seq > b->seq) - (a->seq < b->seq);
+}
+
+/** Copy the events out of one ring
+ *
+ * Must be called with the registry mutex held.
+ */
+static size_t trace_ring_copy(trace_dump_t *out, trace_ring_t *ring, uint64_t started)
+{
+	uint64_t	head, first, seq, valid;
+	size_t		used = 0, kept, i;
+
+	head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	first = (head > FR_TRACE_RING_SIZE) ? head - FR_TRACE_RING_SIZE : 0;
+
+	for (seq = first; seq < head; seq++) {
+		out[used].event = ring->event[seq & (FR_TRACE_RING_SIZE - 1)];
+		out[used].tid = ring->tid;
+		out[used].seq = seq;
+		used++;
+	}
+
+	/*
+	 *	The owning thread may have overwritten the oldest
+	 *	events while we were copying them.  It may also be
+	 *	part way through writing the event after the new head.
+	 */
+	atomic_thread_fence(memory_order_acquire);
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	valid = (head >= FR_TRACE_RING_SIZE) ? head - FR_TRACE_RING_SIZE + 1 : 0;
+
+	/*
+	 *	Keep events which weren't overwritten, and which were
+	 *	recorded after the tracer was (re)started.
+	 */
+	for (i = 0, kept = 0; i < used; i++) {
+		if (out[i].seq < valid) continue;
+		if (out[i].event.when < started) continue;
+
+		if (kept != i) out[kept] = out[i];
+		kept++;
+	}
+
+	return kept;
+}
+
+/** Print a string as a JSON string
+ *
+ */
+static void trace_json_string(FILE *fp, char const *str)
+{
+	char const *p;
+
+	fputc('"', fp);
+	for (p = str; *p; p++) {
+		switch (*p) {
+		case '"':
+		case '\\':
+			fputc('\\', fp);
+			fputc(*p, fp);
+			break;
+
+		default:
+			if (iscntrl((uint8_t) *p)) {
+				fprintf(fp, "\\u%04x", (uint8_t) *p);
+				break;
+			}
+			fputc(*p, fp);
+			break;
+		}
+	}
+	fputc('"', fp);
+}
+
+/** Print the recorded events
+ *
+ * @param[in] fp	to print to.
+ * @param[in] format	to print the events in.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_trace_dump(FILE *fp, fr_trace_format_t format)
+{
+	trace_dump_t	*dump;
+	trace_ring_t	*ring;
+	size_t		used = 0, i;
+	uint64_t	started;
+	pid_t		pid = getpid();
+
+	started = atomic_load_explicit(&trace_started, memory_order_relaxed);
+
+	pthread_mutex_lock(&trace_mutex);
+	dump = talloc_array(NULL, trace_dump_t, trace_num * FR_TRACE_RING_SIZE + 1);
+	if (!dump) {
+		pthread_mutex_unlock(&trace_mutex);
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	if (trace_num) {
+		for (ring = fr_dlist_head(&trace_list);
+		     ring != NULL;
+		     ring = fr_dlist_next(&trace_list, ring)) {
+			used += trace_ring_copy(dump + used, ring, started);
+		}
+	}
+	pthread_mutex_unlock(&trace_mutex);
+
+	qsort(dump, used, sizeof(*dump), trace_dump_cmp);
+
+	if (format == FR_TRACE_FORMAT_CHROME) fprintf(fp, "{\"traceEvents\":[\n");
+
+	for (i = 0; i < used; i++) {
+		trace_event_t const *event = &dump[i].event;
+
+		switch (format) {
+		case FR_TRACE_FORMAT_CHROME:
+			/*
+			 *	Requests interleave on a thread, so
+			 *	they're async events.  Each worker
+			 *	numbers its requests from zero, and
+			 *	async IDs are shared by the whole
+			 *	process, so scope the ID by thread.
+			 */
+			fprintf(fp, "{\"name\":");
+			trace_json_string(fp, event->name);
+			fprintf(fp, ",\"cat\":\"%s\",\"ph\":\"%c\",\"id\":\"0x%" PRIx64 "\",\"ts\":%" PRIu64 ".%03u"
+				",\"pid\":%u,\"tid\":%u}%s\n",
+				event->category, event->phase, TRACE_CHROME_ID(dump[i].tid, event->id),
+				event->when / 1000, (unsigned int) (event->when % 1000),
+				(unsigned int) pid, dump[i].tid, (i + 1 < used) ? "," : "");
+			break;
+
+		case FR_TRACE_FORMAT_PERF:
+			fprintf(fp, "radiusd %u/%u [000] %" PRIu64 ".%06u: freeradius:%s_%s: request=%" PRIu64 " name=\"%s\"\n",
+				(unsigned int) pid, dump[i].tid,
+				event->when / NSEC, (unsigned int) ((event->when % NSEC) / 1000),
+				event->category,
+				(event->phase == FR_TRACE_BEGIN) ? "begin" :
+				(event->phase == FR_TRACE_END) ? "end" : "event",
+				event->id, event->name);
+			break;
+		}
+	}
+
+	if (format == FR_TRACE_FORMAT_CHROME) fprintf(fp, "],\"displayTimeUnit\":\"ns\"}\n");
+
+	talloc_free(dump);
+
+	return 0;
+}
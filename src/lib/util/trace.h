@@ -0,0 +1,69 @@
+#pragma once
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Sampling tracer, which records timestamped events into per-thread rings
+ *
+ * @file src/lib/util/trace.h
+ *
+ * @copyright 2019 The FreeRADIUS server project
+ */
+RCSIDH(trace_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <freeradius-devel/build.h>
+#include <freeradius-devel/missing.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/** Number of events kept by each thread
+ *
+ * Must be a power of 2.  When the ring is full, the oldest events are
+ * overwritten.
+ */
+#define FR_TRACE_RING_SIZE	8192
+
+typedef enum {
+	FR_TRACE_BEGIN = 'b',			//!< Start of a span.
+	FR_TRACE_END = 'e',			//!< End of the most recent span with the same ID.
+	FR_TRACE_INSTANT = 'n'			//!< Something happened.
+} fr_trace_phase_t;
+
+typedef enum {
+	FR_TRACE_FORMAT_CHROME = 0,		//!< Chrome trace event JSON, for chrome://tracing, or Perfetto.
+	FR_TRACE_FORMAT_PERF			//!< The same as "perf script" output.
+} fr_trace_format_t;
+
+bool	fr_trace_running(void);
+
+bool	fr_trace_sample(void);
+
+void	fr_trace_event(uint64_t id, uint64_t when, fr_trace_phase_t phase, char const *category, char const *name);
+
+void	fr_trace_start(uint64_t now, uint32_t rate);
+
+void	fr_trace_stop(void);
+
+int	fr_trace_dump(FILE *fp, fr_trace_format_t format);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1 +1 @@
-SUBMAKEFILES := proto_control.mk proto_control_unix.mk libfreeradius-control.mk radmin.mk
+SUBMAKEFILES := proto_control.mk proto_control_unix.mk proto_control_http.mk libfreeradius-control.mk radmin.mk
@@ -0,0 +1,716 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file proto_control_http.c
+ * @brief Serve metrics over HTTP, in the OpenMetrics text format.
+ *
+ * Requests are answered by the network thread which reads them.
+ * Nothing is sent to the workers, and the metrics are read from the
+ * per-thread counters without locking the threads which update them.
+ *
+ * Sockets are non-blocking.  Replies are buffered, and whatever the
+ * client doesn't accept immediately is written when the socket becomes
+ * writable.  A slow client can't hold up the network thread, and is
+ * disconnected if it doesn't take all of the replies within
+ * "send_timeout".
+ *
+ * @copyright 2019 The FreeRADIUS server project.
+ */
+#include <netdb.h>
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/protocol.h>
+#include <freeradius-devel/util/metrics.h>
+#include <freeradius-devel/util/trie.h>
+#include <freeradius-devel/io/base.h>
+#include <freeradius-devel/io/application.h>
+#include <freeradius-devel/io/listen.h>
+#include <freeradius-devel/io/schedule.h>
+#include <freeradius-devel/server/rad_assert.h>
+#include "proto_control.h"
+
+extern fr_app_io_t proto_control_http;
+
+#define HTTP_MAX_REQUEST	4096
+
+typedef struct proto_control_http_s proto_control_http_t;
+
+/** Replies which haven't been written yet
+ *
+ * The network owns the events for the socket, so write events are
+ * registered against a dup() of it.
+ */
+typedef struct {
+	int				fd;			//!< dup() of the socket, for write events.
+	fr_event_list_t			*el;			//!< the events are in.
+
+	bool				writing;		//!< whether the write event is registered.
+	fr_event_timer_t const		*ev;			//!< for the send timeout.
+
+	uint8_t				*data;			//!< replies to write.
+	size_t				data_len;		//!< of the replies.
+	size_t				written;		//!< how much of the replies has been written.
+} proto_control_http_out_t;
+
+typedef struct {
+	char const			*name;			//!< socket name
+
+	int				sockfd;
+
+	proto_control_http_t const	*inst;			//!< our instance data.
+	fr_event_list_t			*el;			//!< for writing replies.
+
+	fr_io_address_t			*connection;		//!< for connected sockets.
+
+	RADCLIENT			radclient;		//!< for faking out clients
+
+	proto_control_http_out_t	*out;			//!< replies we haven't written yet.
+	bool				closing;		//!< close once the replies have been written.
+
+	size_t				request_len;		//!< of the data in request
+	char				request[HTTP_MAX_REQUEST];	//!< headers we've read so far
+} proto_control_http_thread_t;
+
+struct proto_control_http_s {
+	CONF_SECTION			*cs;			//!< our configuration
+
+	fr_ipaddr_t			ipaddr;			//!< IP address to listen on.
+
+	char const			*interface;		//!< Interface to bind to.
+	char const			*port_name;		//!< Name of the port for getservent().
+
+	uint16_t			port;			//!< Port to listen on.
+
+	fr_ipaddr_t			*allow;			//!< networks allowed to read the metrics
+
+	char const			*path;			//!< of the metrics, e.g. "/metrics"
+	char const			*prefix;		//!< of every metric name
+
+	struct timeval			send_timeout;		//!< how long a client has to take its replies
+};
+
+static const CONF_PARSER http_listen_config[] = {
+	{ FR_CONF_OFFSET("ipaddr", FR_TYPE_COMBO_IP_ADDR, proto_control_http_t, ipaddr) },
+	{ FR_CONF_OFFSET("ipv4addr", FR_TYPE_IPV4_ADDR, proto_control_http_t, ipaddr) },
+	{ FR_CONF_OFFSET("ipv6addr", FR_TYPE_IPV6_ADDR, proto_control_http_t, ipaddr) },
+
+	{ FR_CONF_OFFSET("interface", FR_TYPE_STRING, proto_control_http_t, interface) },
+	{ FR_CONF_OFFSET("port_name", FR_TYPE_STRING, proto_control_http_t, port_name) },
+
+	{ FR_CONF_OFFSET("port", FR_TYPE_UINT16, proto_control_http_t, port) },
+
+	{ FR_CONF_OFFSET("allow", FR_TYPE_COMBO_IP_PREFIX | FR_TYPE_MULTI, proto_control_http_t, allow) },
+
+	{ FR_CONF_OFFSET("path", FR_TYPE_STRING, proto_control_http_t, path), .dflt = "/metrics" },
+	{ FR_CONF_OFFSET("prefix", FR_TYPE_STRING, proto_control_http_t, prefix), .dflt = "freeradius_" },
+
+	{ FR_CONF_OFFSET("send_timeout", FR_TYPE_TIMEVAL, proto_control_http_t, send_timeout), .dflt = "1.0" },
+
+	CONF_PARSER_TERMINATOR
+};
+
+static int _http_out_free(proto_control_http_out_t *out)
+{
+	if (out->writing) (void) fr_event_fd_delete(out->el, out->fd, FR_EVENT_FILTER_IO);
+	if (out->ev) (void) fr_event_timer_delete(out->el, &out->ev);
+	close(out->fd);
+
+	return 0;
+}
+
+/** Add a reply to the ones waiting to be written
+ *
+ */
+static int http_respond(proto_control_http_thread_t *thread, char const *status, char const *content_type,
+			char const *body, bool head)
+{
+	proto_control_http_out_t	*out = thread->out;
+	char				header[256];
+	size_t				body_len = body ? strlen(body) : 0;
+	size_t				need;
+	int				len;
+
+	len = snprintf(header, sizeof(header),
+		       "HTTP/1.1 %s\r\n"
+		       "Content-Type: %s\r\n"
+		       "Content-Length: %zu\r\n"
+		       "\r\n", status, content_type, body_len);
+	if ((len < 0) || ((size_t) len >= sizeof(header))) return -1;
+
+	if (head) body_len = 0;
+
+	if (!out) {
+		if (!thread->el) {
+			fr_strerror_printf("No event list for writing replies");
+			return -1;
+		}
+
+		MEM(out = talloc_zero(thread, proto_control_http_out_t));
+		out->fd = dup(thread->sockfd);
+		if (out->fd < 0) {
+			fr_strerror_printf("Failed duplicating socket: %s", fr_syserror(errno));
+			talloc_free(out);
+			return -1;
+		}
+		out->el = thread->el;
+		talloc_set_destructor(out, _http_out_free);
+		thread->out = out;
+	}
+
+	need = out->data_len + len + body_len;
+	if (need > talloc_array_length(out->data)) {
+		uint8_t *data;
+
+		data = talloc_realloc(out, out->data, uint8_t, need);
+		if (!data) {
+			fr_strerror_printf("Out of memory");
+			return -1;
+		}
+		out->data = data;
+	}
+
+	memcpy(out->data + out->data_len, header, len);
+	out->data_len += len;
+
+	if (body_len) {
+		memcpy(out->data + out->data_len, body, body_len);
+		out->data_len += body_len;
+	}
+
+	return 0;
+}
+
+static int http_flush(proto_control_http_thread_t *thread);
+static int http_process_requests(proto_control_http_thread_t *thread);
+
+/** Give up on a client
+ *
+ * The network owns the socket, so we shut it down, and let the next
+ * read tell the network to close it.
+ */
+static void http_close(proto_control_http_thread_t *thread)
+{
+	proto_control_http_out_t *out = thread->out;
+
+	if (out->writing) {
+		(void) fr_event_fd_delete(out->el, out->fd, FR_EVENT_FILTER_IO);
+		out->writing = false;
+	}
+	if (out->ev) (void) fr_event_timer_delete(out->el, &out->ev);
+
+	(void) shutdown(thread->sockfd, SHUT_RDWR);
+}
+
+static void http_send_timeout(UNUSED fr_event_list_t *el, UNUSED struct timeval *now, void *uctx)
+{
+	proto_control_http_thread_t *thread = talloc_get_type_abort(uctx, proto_control_http_thread_t);
+
+	DEBUG2("proto_control_http - Timed out writing replies to %s", thread->name);
+
+	thread->out->ev = NULL;
+	http_close(thread);
+}
+
+/** Write more of the replies, and answer any requests which arrived while we were waiting
+ *
+ */
+static void http_writable(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	proto_control_http_thread_t *thread = talloc_get_type_abort(uctx, proto_control_http_thread_t);
+
+	if ((http_flush(thread) < 0) || (http_process_requests(thread) < 0)) http_close(thread);
+}
+
+static void http_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, int fd_errno, void *uctx)
+{
+	proto_control_http_thread_t *thread = talloc_get_type_abort(uctx, proto_control_http_thread_t);
+
+	DEBUG2("proto_control_http - Failed writing replies to %s: %s", thread->name, fr_syserror(fd_errno));
+
+	http_close(thread);
+}
+
+/** Write as much of the replies as the client will take
+ *
+ * If the client doesn't take all of them, wait for the socket to
+ * become writable.  The send timeout starts when we first have to
+ * wait, and isn't reset when the client takes more, so a client which
+ * reads slowly can't keep the connection open indefinitely.
+ *
+ * @return
+ *	- 0 if the replies have been written, or we're waiting to write them.
+ *	- -1 on error.
+ */
+static int http_flush(proto_control_http_thread_t *thread)
+{
+	proto_control_http_out_t	*out = thread->out;
+	struct timeval			when;
+
+	if (!out) return 0;
+
+	while (out->written < out->data_len) {
+		ssize_t slen;
+
+		slen = write(out->fd, out->data + out->written, out->data_len - out->written);
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) goto wait;
+
+			DEBUG2("proto_control_http - Failed writing replies to %s: %s", thread->name, fr_syserror(errno));
+			return -1;
+		}
+
+		out->written += slen;
+	}
+
+	/*
+	 *	Everything has been written.
+	 */
+	out->data_len = out->written = 0;
+
+	if (out->writing) {
+		if (fr_event_fd_delete(out->el, out->fd, FR_EVENT_FILTER_IO) < 0) return -1;
+		out->writing = false;
+	}
+	if (out->ev) (void) fr_event_timer_delete(out->el, &out->ev);
+
+	return 0;
+
+wait:
+	if (!out->writing) {
+		if (fr_event_fd_insert(out, out->el, out->fd, NULL, http_writable, http_error, thread) < 0) {
+			PERROR("proto_control_http - Failed adding write event for %s", thread->name);
+			return -1;
+		}
+		out->writing = true;
+	}
+
+	if (!out->ev) {
+		gettimeofday(&when, NULL);
+		fr_timeval_add(&when, &when, &thread->inst->send_timeout);
+
+		if (fr_event_timer_insert(out, out->el, &out->ev, &when, http_send_timeout, thread) < 0) {
+			PERROR("proto_control_http - Failed adding send timeout for %s", thread->name);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/** Answer one request
+ *
+ * If the connection should be closed, it is closed once the reply has
+ * been written.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+static int http_process(proto_control_http_thread_t *thread, char *request)
+{
+	proto_control_http_t const	*inst = thread->inst;
+	char				*method, *path, *version, *p;
+	bool				head = false;
+	char				*text;
+
+	/*
+	 *	Request line is "METHOD PATH VERSION"
+	 */
+	method = request;
+	path = strchr(method, ' ');
+	if (!path) goto bad_request;
+	*(path++) = '\0';
+
+	version = strchr(path, ' ');
+	if (!version) goto bad_request;
+	*(version++) = '\0';
+
+	p = strstr(version, "\r\n");
+	if (!p) goto bad_request;
+	*p = '\0';
+
+	if (strncmp(version, "HTTP/1.", 7) != 0) {
+	bad_request:
+		thread->closing = true;
+		return http_respond(thread, "400 Bad Request", "text/plain", "Bad request\n", false);
+	}
+
+	/*
+	 *	HTTP/1.0 closes by default, HTTP/1.1 keeps the
+	 *	connection open unless told otherwise.
+	 */
+	if (strcmp(version, "HTTP/1.0") == 0) thread->closing = true;
+	if (strcasestr(p + 2, "\r\nConnection: close") || (strncasecmp(p + 2, "Connection: close", 17) == 0)) {
+		thread->closing = true;
+	}
+
+	p = strchr(path, '?');
+	if (p) *p = '\0';
+
+	if (strcmp(method, "HEAD") == 0) {
+		head = true;
+
+	} else if (strcmp(method, "GET") != 0) {
+		DEBUG2("proto_control_http - Rejecting method %s on %s", method, thread->name);
+		return http_respond(thread, "405 Method Not Allowed", "text/plain", "Method not allowed\n", false);
+	}
+
+	if (strcmp(path, inst->path) != 0) {
+		DEBUG2("proto_control_http - No such path %s on %s", path, thread->name);
+		return http_respond(thread, "404 Not Found", "text/plain", "Not found\n", head);
+	}
+
+	text = fr_metrics_openmetrics(NULL, inst->prefix);
+	if (!text) {
+		PERROR("proto_control_http - Failed printing metrics");
+		return http_respond(thread, "500 Internal Server Error", "text/plain", "Failed printing metrics\n", head);
+	}
+
+	if (http_respond(thread, "200 OK",
+			 "application/openmetrics-text; version=1.0.0; charset=utf-8", text, head) < 0) {
+		talloc_free(text);
+		return -1;
+	}
+	talloc_free(text);
+
+	return 0;
+}
+
+/** Answer every complete request which we've read
+ *
+ * The requests have no bodies, so anything after the headers is the
+ * next request.  If the client hasn't taken the earlier replies, the
+ * requests wait until it does.
+ *
+ * @return
+ *	- 0 to keep the connection open.
+ *	- -1 to close it.
+ */
+static int http_process_requests(proto_control_http_thread_t *thread)
+{
+	char *end;
+
+	while (!thread->closing && (!thread->out || !thread->out->writing) &&
+	       ((end = strstr(thread->request, "\r\n\r\n")) != NULL)) {
+		size_t used;
+
+		end[2] = '\0';
+		used = (end + 4) - thread->request;
+
+		if (http_process(thread, thread->request) < 0) return -1;
+
+		memmove(thread->request, thread->request + used, thread->request_len - used + 1);
+		thread->request_len -= used;
+
+		if (http_flush(thread) < 0) return -1;
+	}
+
+	/*
+	 *	Close the connection once the client has taken all
+	 *	of the replies.
+	 */
+	if (thread->closing && (!thread->out || !thread->out->writing)) return -1;
+
+	return 0;
+}
+
+static ssize_t mod_read(fr_listen_t *li, UNUSED void **packet_ctx, fr_time_t **recv_time, UNUSED uint8_t *buffer,
+			UNUSED size_t buffer_len, size_t *leftover, UNUSED uint32_t *priority, UNUSED bool *is_dup)
+{
+	proto_control_http_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_control_http_thread_t);
+	ssize_t				data_size;
+
+	data_size = read(thread->sockfd, thread->request + thread->request_len,
+			 sizeof(thread->request) - thread->request_len - 1);
+	if (data_size < 0) {
+		if ((errno == EINTR) || (errno == EAGAIN) || (errno == EWOULDBLOCK)) return 0;
+
+		DEBUG2("proto_control_http got read error on %s: %s", thread->name, fr_syserror(errno));
+		return -1;
+	}
+
+	/*
+	 *	The other end closed the connection, or we shut it
+	 *	down.
+	 */
+	if (data_size == 0) return -1;
+
+	**recv_time = fr_time();
+	*leftover = 0;
+
+	thread->request_len += data_size;
+	thread->request[thread->request_len] = '\0';
+
+	if (http_process_requests(thread) < 0) return -1;
+
+	if (thread->request_len >= (sizeof(thread->request) - 1)) {
+		DEBUG2("proto_control_http - Request headers are too large on %s", thread->name);
+		return -1;
+	}
+
+	/*
+	 *	Nothing is ever sent to the workers.
+	 */
+	return 0;
+}
+
+static ssize_t mod_write(UNUSED fr_listen_t *li, UNUSED void *packet_ctx, UNUSED fr_time_t request_time,
+			 UNUSED uint8_t *buffer, size_t buffer_len, UNUSED size_t written)
+{
+	/*
+	 *	Replies are written by mod_read(), or when the socket
+	 *	becomes writable.
+	 */
+	return buffer_len;
+}
+
+static int mod_connection_set(fr_listen_t *li, fr_io_address_t *connection)
+{
+	proto_control_http_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_control_http_thread_t);
+
+	thread->connection = connection;
+
+	return 0;
+}
+
+static void mod_network_get(UNUSED void *instance, int *ipproto, bool *dynamic_clients, fr_trie_t const **trie)
+{
+	*ipproto = IPPROTO_TCP;
+	*dynamic_clients = false;
+	*trie = NULL;
+}
+
+/** Open a TCP listener for HTTP
+ *
+ */
+static int mod_open(fr_listen_t *li)
+{
+	proto_control_http_t const     	*inst = talloc_get_type_abort_const(li->app_io_instance, proto_control_http_t);
+	proto_control_http_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_control_http_thread_t);
+
+	int				sockfd;
+	uint16_t			port = inst->port;
+	CONF_SECTION			*server_cs;
+	CONF_ITEM			*ci;
+
+	rad_assert(!thread->connection);
+
+	li->fd = sockfd = fr_socket_server_tcp(&inst->ipaddr, &port, inst->port_name, true);
+	if (sockfd < 0) {
+		PERROR("Failed opening TCP socket");
+	error:
+		return -1;
+	}
+
+	if (fr_socket_bind(sockfd, &inst->ipaddr, &port, inst->interface) < 0) {
+		close(sockfd);
+		PERROR("Failed binding socket");
+		goto error;
+	}
+
+	if (listen(sockfd, 8) < 0) {
+		close(sockfd);
+		PERROR("Failed listening on socket");
+		goto error;
+	}
+
+	thread->sockfd = sockfd;
+
+	ci = cf_parent(inst->cs); /* listen { ... } */
+	rad_assert(ci != NULL);
+	ci = cf_parent(ci);
+	rad_assert(ci != NULL);
+
+	server_cs = cf_item_to_section(ci);
+
+	thread->name = fr_app_io_socket_name(thread, &proto_control_http,
+					     NULL, 0,
+					     &inst->ipaddr, inst->port,
+					     inst->interface);
+
+	DEBUG("Listening on metrics address %s bound to virtual server %s",
+	      thread->name, cf_section_name2(server_cs));
+
+	/*
+	 *	Set up the fake client
+	 */
+	thread->radclient.longname = thread->name;
+	thread->radclient.ipaddr.af = inst->ipaddr.af;
+	thread->radclient.src_ipaddr.af = inst->ipaddr.af;
+
+	thread->radclient.server_cs = server_cs;
+	thread->radclient.server = cf_section_name2(server_cs);
+
+	return 0;
+}
+
+/** Set the file descriptor for this socket.
+ *
+ */
+static int mod_fd_set(fr_listen_t *li, int fd)
+{
+	proto_control_http_t const	*inst = talloc_get_type_abort_const(li->app_io_instance, proto_control_http_t);
+	proto_control_http_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_control_http_thread_t);
+
+	thread->sockfd = fd;
+	thread->inst = inst;
+	thread->closing = false;
+	thread->request_len = 0;
+
+	thread->name = fr_app_io_socket_name(thread, &proto_control_http,
+					     &thread->connection->src_ipaddr, thread->connection->src_port,
+					     &inst->ipaddr, inst->port,
+					     inst->interface);
+
+	if (fr_nonblock(fd) < 0) {
+		PERROR("Failed setting socket to non-blocking");
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Set the event list for writing replies
+ *
+ */
+static void mod_event_list_set(fr_listen_t *li, fr_event_list_t *el, UNUSED void *nr)
+{
+	proto_control_http_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_control_http_thread_t);
+
+	thread->el = el;
+}
+
+static char const *mod_name(fr_listen_t *li)
+{
+	proto_control_http_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_control_http_thread_t);
+
+	return thread->name;
+}
+
+static int mod_bootstrap(void *instance, CONF_SECTION *cs)
+{
+	proto_control_http_t	*inst = talloc_get_type_abort(instance, proto_control_http_t);
+
+	inst->cs = cs;
+
+	/*
+	 *	Complain if no "ipaddr" is set.
+	 */
+	if (inst->ipaddr.af == AF_UNSPEC) {
+		cf_log_err(cs, "No 'ipaddr' was specified in the 'http' section");
+		return -1;
+	}
+
+	if (!inst->port) {
+		struct servent *s;
+
+		if (!inst->port_name) {
+			cf_log_err(cs, "No 'port' was specified in the 'http' section");
+			return -1;
+		}
+
+		s = getservbyname(inst->port_name, "tcp");
+		if (!s) {
+			cf_log_err(cs, "Unknown value for 'port_name = %s", inst->port_name);
+			return -1;
+		}
+
+		inst->port = ntohl(s->s_port);
+	}
+
+	if (inst->path[0] != '/') {
+		cf_log_err(cs, "Invalid value for 'path = %s'.  It must start with '/'", inst->path);
+		return -1;
+	}
+
+	FR_TIMEVAL_BOUND_CHECK("send_timeout", &inst->send_timeout, >=, 0, 100000);
+	FR_TIMEVAL_BOUND_CHECK("send_timeout", &inst->send_timeout, <=, 30, 0);
+
+	return 0;
+}
+
+static bool http_is_loopback(fr_ipaddr_t const *ipaddr)
+{
+	switch (ipaddr->af) {
+	case AF_INET:
+		return ((ntohl(ipaddr->addr.v4.s_addr) >> 24) == 127);
+
+#ifdef HAVE_STRUCT_SOCKADDR_IN6
+	case AF_INET6:
+		return IN6_IS_ADDR_LOOPBACK(&ipaddr->addr.v6);
+#endif
+
+	default:
+		return false;
+	}
+}
+
+/** Only allow connections from the "allow" networks
+ *
+ * If there are no "allow" networks, only connections from the local
+ * host are allowed.
+ */
+static RADCLIENT *mod_client_find(fr_listen_t *li, fr_ipaddr_t const *ipaddr, UNUSED int ipproto)
+{
+	proto_control_http_t const     	*inst = talloc_get_type_abort_const(li->app_io_instance, proto_control_http_t);
+	proto_control_http_thread_t    	*thread = talloc_get_type_abort(li->thread_instance, proto_control_http_thread_t);
+	size_t				i, num;
+
+	num = talloc_array_length(inst->allow);
+	if (!num) {
+		if (http_is_loopback(ipaddr)) return &thread->radclient;
+		goto deny;
+	}
+
+	for (i = 0; i < num; i++) {
+		fr_ipaddr_t addr = *ipaddr;
+		fr_ipaddr_t network = inst->allow[i];
+
+		if (addr.af != network.af) continue;
+
+		fr_ipaddr_mask(&addr, network.prefix);
+		fr_ipaddr_mask(&network, network.prefix);
+
+		if (fr_ipaddr_cmp(&addr, &network) == 0) return &thread->radclient;
+	}
+
+deny:
+	DEBUG2("proto_control_http - Ignoring connection from %pV, it is not in 'allow'", fr_box_ipaddr(*ipaddr));
+	return NULL;
+}
+
+fr_app_io_t proto_control_http = {
+	.magic			= RLM_MODULE_INIT,
+	.name			= "control_http",
+	.config			= http_listen_config,
+	.inst_size		= sizeof(proto_control_http_t),
+	.thread_inst_size	= sizeof(proto_control_http_thread_t),
+	.bootstrap		= mod_bootstrap,
+
+	.default_message_size	= 4096,
+
+	.open			= mod_open,
+	.read			= mod_read,
+	.write			= mod_write,
+	.fd_set			= mod_fd_set,
+	.connection_set		= mod_connection_set,
+	.event_list_set		= mod_event_list_set,
+	.network_get		= mod_network_get,
+	.client_find		= mod_client_find,
+	.get_name      		= mod_name,
+};
@@ -0,0 +1,9 @@
+TARGETNAME	:= proto_control_http
+
+ifneq "$(TARGETNAME)" ""
+TARGET		:= $(TARGETNAME).a
+endif
+
+SOURCES		:= proto_control_http.c
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-control.a
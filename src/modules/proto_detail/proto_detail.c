@@ -28,6 +28,7 @@
 #include <freeradius-devel/io/schedule.h>
 #include <freeradius-devel/io/application.h>
 #include <freeradius-devel/server/rad_assert.h>
+#include <freeradius-devel/server/detail.h>
 #include "proto_detail.h"
 
 extern fr_app_t proto_detail;
@@ -271,6 +272,32 @@ static int mod_decode(void const *instance, REQUEST *request, uint8_t *const dat
 
 	end = data + data_len;
 
+	/*
+	 *	Binary records carry the addresses and timestamp in
+	 *	a fixed header, and the attributes don't need parsing.
+	 */
+	if (fr_detail_binary_check(data, data_len)) {
+		fr_cursor_init(&cursor, &request->packet->vps);
+		fr_cursor_tail(&cursor);
+
+		if (fr_detail_binary_decode(request, &cursor, &timestamp, data, data_len) < 0) {
+			RPEDEBUG("Malformed binary record");
+			fr_cursor_free_list(&cursor);
+			return -1;
+		}
+
+		if (timestamp) {
+			vp = fr_pair_afrom_da(request->packet, attr_packet_original_timestamp);
+			if (vp) {
+				vp->vp_date = (uint32_t) timestamp;
+				vp->type = VT_DATA;
+				fr_cursor_append(&cursor, vp);
+			}
+		}
+
+		return inst->app_io->decode(inst->app_io_instance, request, data, data_len);
+	}
+
 	MPRINT("HEADER %s", data);
 
 	if (sscanf((char const *) data, "%*s %*s %*d %*d:%*d:%*d %d", &num) != 1) {
@@ -99,6 +99,7 @@ struct proto_detail_work_s {
 	bool				track_progress;		//!< do we track progress by writing?
 	bool				retransmit;		//!< are we retransmitting on error?
 	bool				immediate;		//!< start reading the detail files immediately
+	bool				use_mmap;		//!< map the work file, and index records ahead of reading
 
 	int				mode;			//!< O_RDWR or O_RDONLY
 
@@ -107,6 +108,15 @@ struct proto_detail_work_s {
 
 typedef struct proto_detail_work_thread_s proto_detail_work_thread_t;
 
+/*
+ *	One record found by the mmap indexer.
+ */
+typedef struct {
+	off_t				offset;			//!< start of the record in the work file
+	size_t				len;			//!< length of the record, including the trailing LFs
+	off_t				done_offset;		//!< where the "Timestamp" attribute is, or 0
+} proto_detail_work_record_t;
+
 struct proto_detail_work_thread_s {
 	char const			*name;			//!< debug name for printing
 	proto_detail_work_t const	*inst;			//!< instance data
@@ -145,6 +155,20 @@ struct proto_detail_work_thread_s {
 
 	pthread_mutex_t			worker_mutex;		//!< for the workers
 	int				num_workers;		//!< number of workers
+
+	uint8_t				*map;			//!< mmap'd work file, when "mmap = yes"
+	size_t				map_size;		//!< size of the mapping
+
+	proto_detail_work_record_t	*index;			//!< ring of records indexed ahead of reading
+	uint32_t			index_head;		//!< next record to hand to the network side
+	uint32_t			index_count;		//!< number of records in the ring
+	off_t				index_offset;		//!< where the indexer continues from
+
+	fr_dlist_head_t			inflight;		//!< records read, but not yet done, in file order
+	int				progress_fd;		//!< for persisting the low-water mark
+	char const			*filename_progress;	//!< name of the progress file
+	off_t				progress_offset;	//!< last offset written to the progress file
+	time_t				progress_time;		//!< when we last wrote the progress file
 };
 
 #include <pthread.h>
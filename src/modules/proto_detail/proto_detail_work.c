@@ -31,10 +31,12 @@
 #include <freeradius-devel/io/listen.h>
 #include <freeradius-devel/util/dlist.h>
 #include <freeradius-devel/server/rad_assert.h>
+#include <freeradius-devel/server/detail.h>
 #include "proto_detail.h"
 
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 #ifndef NDEBUG
 #if 0
@@ -55,6 +57,7 @@ typedef struct {
 	proto_detail_work_thread_t	*parent;		//!< talloc_parent is SLOW!
 	fr_time_t			timestamp;		//!< when we read the entry.
 	off_t				done_offset;		//!< where we're tracking the status
+	off_t				offset;			//!< start of the record, for "mmap = yes"
 
 	int				id;			//!< for retransmission counters
 
@@ -69,8 +72,15 @@ typedef struct {
 
 	fr_event_timer_t const		*ev;			//!< retransmission timer
 	fr_dlist_t			entry;			//!< for the retransmission list
+	fr_dlist_t			inflight;		//!< for the low-water mark, for "mmap = yes"
 } fr_detail_entry_t;
 
+/*
+ *	How many records the mmap reader indexes ahead of the
+ *	network side.
+ */
+#define DETAIL_INDEX_AHEAD	(1024)
+
 static CONF_PARSER limit_config[] = {
 	{ FR_CONF_OFFSET("initial_retransmission_time", FR_TYPE_UINT32, proto_detail_work_t, irt), .dflt = STRINGIFY(2) },
 	{ FR_CONF_OFFSET("maximum_retransmission_time", FR_TYPE_UINT32, proto_detail_work_t, mrt), .dflt = STRINGIFY(16) },
@@ -88,6 +98,8 @@ static const CONF_PARSER file_listen_config[] = {
 
 	{ FR_CONF_OFFSET("retransmit", FR_TYPE_BOOL, proto_detail_work_t, retransmit ), .dflt = "yes" },
 
+	{ FR_CONF_OFFSET("mmap", FR_TYPE_BOOL, proto_detail_work_t, use_mmap ), .dflt = "no" },
+
 	{ FR_CONF_POINTER("limit", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) limit_config },
 	CONF_PARSER_TERMINATOR
 };
@@ -142,6 +154,243 @@ static fr_event_update_t resume_read[] = {
 	{ 0 }
 };
 
+/** Find the next batch of records in the mapped work file
+ *
+ * Records are separated by a blank line.  Records which have
+ * already been marked "Done" are skipped here, so that the network
+ * side never sees them.  No other parsing is done, that happens in
+ * the workers, via proto_detail mod_decode().
+ */
+static void work_index(proto_detail_work_t const *inst, proto_detail_work_thread_t *thread)
+{
+	uint8_t const	*start, *end, *rec_end, *p;
+#ifdef MADV_WILLNEED
+	off_t		from = thread->index_offset;
+#endif
+
+	end = thread->map + thread->map_size;
+	start = thread->map + thread->index_offset;
+
+	while ((thread->index_count < DETAIL_INDEX_AHEAD) && (start < end)) {
+		proto_detail_work_record_t	*rec;
+		off_t				done_offset = 0;
+		size_t				len;
+
+		/*
+		 *	Stray blank lines between records.
+		 */
+		if (*start == '\n') {
+			start++;
+			continue;
+		}
+
+		/*
+		 *	Binary records say how long they are.
+		 */
+		if (fr_detail_binary_check(start, end - start)) {
+			ssize_t slen;
+
+			slen = fr_detail_binary_length(start, end - start);
+			if ((slen <= 0) || (slen > (end - start))) {
+				ERROR("proto_detail (%s): Malformed or truncated binary record at offset %zu in file %s",
+				      thread->name, (size_t) (start - thread->map), thread->filename_work);
+				start = end;
+				break;
+			}
+
+			rec_end = start + slen;
+			len = slen;
+
+			if (len > inst->parent->max_packet_size) {
+				DEBUG("Ignoring 'too large' entry at offset %zu of %s",
+				      (size_t) (start - thread->map), thread->filename_work);
+				goto next;
+			}
+
+			if (fr_detail_binary_is_done(start)) goto next;
+
+			done_offset = (start - thread->map) + FR_DETAIL_BINARY_DONE_OFFSET;
+			goto add;
+		}
+
+		p = memmem(start, end - start, "\n\n", 2);
+		rec_end = p ? (p + 2) : end;
+		len = rec_end - start;
+
+		if (len > inst->parent->max_packet_size) {
+			DEBUG("Ignoring 'too large' entry at offset %zu of %s",
+			      (size_t) (start - thread->map), thread->filename_work);
+			goto next;
+		}
+
+		/*
+		 *	Search for the "Timestamp" attribute.  We
+		 *	overload that to track which entries have been
+		 *	used.
+		 */
+		for (p = memchr(start, '\n', len); p; p = memchr(p + 1, '\n', rec_end - (p + 1))) {
+			if (((rec_end - p) >= 6) && (memcmp(p, "\n\tDone", 6) == 0)) goto next;
+
+			if (((rec_end - p) > 11) && (memcmp(p, "\n\tTimestamp", 11) == 0)) {
+				done_offset = (p + 2) - thread->map;
+			}
+		}
+
+	add:
+		rec = &thread->index[(thread->index_head + thread->index_count) % DETAIL_INDEX_AHEAD];
+		rec->offset = start - thread->map;
+		rec->len = len;
+		rec->done_offset = done_offset;
+		thread->index_count++;
+
+	next:
+		start = rec_end;
+	}
+
+	thread->index_offset = start - thread->map;
+
+#ifdef MADV_WILLNEED
+	/*
+	 *	Start paging in the records we just indexed, so that
+	 *	copying them out doesn't block the network side.
+	 */
+	if (thread->index_offset > from) {
+		off_t page = from & ~((off_t) getpagesize() - 1);
+
+		(void) madvise(thread->map + page, thread->index_offset - page, MADV_WILLNEED);
+	}
+#endif
+}
+
+/** Copy a record out of the mapped file, in the format proto_detail mod_decode() expects
+ *
+ */
+static void work_copy(proto_detail_work_thread_t *thread, uint8_t *buffer, off_t offset, size_t len)
+{
+	uint8_t *p, *end;
+
+	memcpy(buffer, thread->map + offset, len);
+
+	if (fr_detail_binary_check(buffer, len)) return;
+
+	/*
+	 *	Each line is parsed individually, so smash the LFs.
+	 */
+	end = buffer + len;
+	for (p = memchr(buffer, '\n', len); p; p = memchr(p, '\n', end - p)) *p++ = '\0';
+}
+
+/** Persist the offset before which every record has been processed
+ *
+ * Records after this offset which have been processed are marked
+ * "Done" in the work file itself, so a restart resumes exactly
+ * where we left off.  This file just lets it skip re-scanning the
+ * start of the work file.
+ */
+static void work_progress(proto_detail_work_thread_t *thread)
+{
+	fr_detail_entry_t	*track;
+	off_t			offset;
+	time_t			now;
+	char			buf[32];
+	int			len;
+
+	if (thread->progress_fd < 0) return;
+
+	track = fr_dlist_head(&thread->inflight);
+	if (track) {
+		offset = track->offset;
+	} else if (thread->index_count) {
+		offset = thread->index[thread->index_head].offset;
+	} else {
+		offset = thread->index_offset;
+	}
+
+	if (offset == thread->progress_offset) return;
+
+	now = time(NULL);
+	if (now == thread->progress_time) return;
+
+	len = snprintf(buf, sizeof(buf), "%020" PRIu64 "\n", (uint64_t) offset);
+	if (pwrite(thread->progress_fd, buf, len, 0) < 0) {
+		ERROR("%s - Failed writing %s: %s", thread->name, thread->filename_progress, fr_syserror(errno));
+		return;
+	}
+
+	thread->progress_offset = offset;
+	thread->progress_time = now;
+}
+
+/** Read the next indexed record from the mapped work file
+ *
+ */
+static ssize_t mod_read_mmap(proto_detail_work_t const *inst, proto_detail_work_thread_t *thread,
+			     void **packet_ctx, fr_time_t **recv_time, uint8_t *buffer, size_t buffer_len, uint32_t *priority)
+{
+	proto_detail_work_record_t	*rec;
+	fr_detail_entry_t		*track;
+
+redo:
+	if (!thread->index_count) work_index(inst, thread);
+
+	if (!thread->index_count) {
+		thread->eof = true;
+
+		/*
+		 *	Nothing was read from the file, and nothing is
+		 *	outstanding.  Tell the network side to close us.
+		 */
+		if (!thread->outstanding) return -1;
+
+		thread->closing = true;
+		return 0;
+	}
+
+	rec = &thread->index[thread->index_head];
+	thread->index_head = (thread->index_head + 1) % DETAIL_INDEX_AHEAD;
+	thread->index_count--;
+
+	if (rec->len > buffer_len) {
+		DEBUG("Ignoring 'too large' entry at offset %zu of %s",
+		      (size_t) rec->offset, thread->filename_work);
+		goto redo;
+	}
+
+	work_copy(thread, buffer, rec->offset, rec->len);
+
+	/*
+	 *	Retransmissions are copied from the map again, so we
+	 *	don't need a copy of the packet.
+	 */
+	track = talloc_zero(thread, fr_detail_entry_t);
+	track->parent = thread;
+	track->timestamp = fr_time();
+	track->id = thread->count++;
+	track->rt = inst->irt;
+	track->offset = rec->offset;
+	track->done_offset = rec->done_offset;
+	track->packet_len = rec->len;
+
+	fr_dlist_insert_tail(&thread->inflight, track);
+
+	*packet_ctx = track;
+	*recv_time = &track->timestamp;
+	*priority = inst->parent->priority;
+
+	thread->outstanding++;
+
+	/*
+	 *	Pause reading until such time as we need more packets.
+	 */
+	if (!thread->paused && (thread->outstanding >= inst->max_outstanding)) {
+		(void) fr_event_filter_update(thread->el, thread->fd, FR_EVENT_FILTER_IO, pause_read);
+		thread->paused = true;
+	}
+
+	MPRINT("Returning NUM %u - record at offset %zu", thread->outstanding, (size_t) rec->offset);
+	return rec->len;
+}
+
 static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t **recv_time, uint8_t *buffer, size_t buffer_len, size_t *leftover, uint32_t *priority, UNUSED bool *is_dup)
 {
 	proto_detail_work_t const	*inst = talloc_get_type_abort_const(li->app_io_instance, proto_detail_work_t);
@@ -180,7 +429,11 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t **recv_tim
 		}
 
 		rad_assert(buffer_len >= track->packet_len);
-		memcpy(buffer, track->packet, track->packet_len);
+		if (track->packet) {
+			memcpy(buffer, track->packet, track->packet_len);
+		} else {
+			work_copy(thread, buffer, track->offset, track->packet_len);
+		}
 
 		DEBUG("Retrying packet %d (retransmission %u)", track->id, track->count);
 		*packet_ctx = track;
@@ -209,6 +462,8 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t **recv_tim
 		return 0;
 	}
 
+	if (inst->use_mmap) return mod_read_mmap(inst, thread, packet_ctx, recv_time, buffer, buffer_len, priority);
+
 	/*
 	 *	If we've cached leftover data from the ring buffer,
 	 *	copy it back.
@@ -282,6 +537,55 @@ redo:
 	next = NULL;
 	stopped_search = end;
 
+	/*
+	 *	Binary records say how long they are, so there's no
+	 *	need to search for the end of the record.
+	 */
+	if (fr_detail_binary_check(buffer, end - buffer)) {
+		ssize_t slen;
+
+		slen = fr_detail_binary_length(buffer, end - buffer);
+		if (slen < 0) {
+			PERROR("proto_detail (%s): Malformed binary record at offset %zu in file %s",
+			       thread->name, (size_t) thread->header_offset, thread->filename_work);
+			return -1;
+		}
+
+		if ((slen == 0) || (slen > (end - buffer))) {
+			if (thread->eof) {
+				ERROR("proto_detail (%s): Truncated binary record at offset %zu in file %s",
+				      thread->name, (size_t) thread->header_offset, thread->filename_work);
+				return -1;
+			}
+
+			if ((size_t) slen > buffer_len) {
+				ERROR("proto_detail (%s): Too large entry (>%d bytes) found at offset %zu of file %s",
+				      thread->name, (int) buffer_len, (size_t) thread->header_offset,
+				      thread->filename_work);
+				return -1;
+			}
+
+			*leftover = end - buffer;
+			return 0;
+		}
+
+		packet_len = slen;
+		next = buffer + packet_len;
+		*leftover = end - next;
+		thread->last_search = 0;
+
+		if (packet_len > inst->parent->max_packet_size) {
+			DEBUG("Ignoring 'too large' entry at offset %zu of %s",
+			      (size_t) thread->header_offset, thread->filename_work);
+			goto skip_record;
+		}
+
+		if (fr_detail_binary_is_done(buffer)) goto skip_record;
+
+		done_offset = thread->header_offset + FR_DETAIL_BINARY_DONE_OFFSET;
+		goto alloc_track;
+	}
+
 	/*
 	 *	Look for "end of record" marker, starting from the
 	 *	beginning of the buffer.
@@ -434,6 +738,12 @@ redo:
 	skip_record:
 		MPRINT("Skipping record");
 		if (next) {
+			/*
+			 *	Keep header_offset in sync with the file,
+			 *	so that "Done" is written to the right place.
+			 */
+			thread->header_offset += (next - buffer);
+
 			memmove(buffer, next, (end - next));
 			data_size = (end - next);
 			*leftover = 0;
@@ -480,6 +790,7 @@ redo:
 		}
 	}
 
+alloc_track:
 	/*
 	 *	Allocate the tracking entry.
 	 */
@@ -649,6 +960,14 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, fr_time_t request_ti
 
 	} else if (inst->track_progress && (track->done_offset > 0)) {
 	mark_done:
+		/*
+		 *	The file is mapped shared, so this is just a copy.
+		 */
+		if (thread->map) {
+			memcpy(thread->map + track->done_offset, "Done", 4);
+			goto free_track;
+		}
+
 		/*
 		 *	Seek to the entry, mark it as done, and then seek to
 		 *	the point in the file where we were reading from.
@@ -663,6 +982,11 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, fr_time_t request_ti
 free_track:
 	thread->outstanding--;
 
+	if (inst->use_mmap) {
+		fr_dlist_remove(&thread->inflight, track);
+		work_progress(thread);
+	}
+
 	/*
 	 *	If we need to read some more packet, let's do so.
 	 */
@@ -696,6 +1020,71 @@ free_track:
 	return buffer_len;
 }
 
+/** Map the work file, and find out where a previous reader stopped
+ *
+ */
+static int mod_open_mmap(proto_detail_work_t const *inst, proto_detail_work_thread_t *thread)
+{
+	struct stat	buf;
+	char		progress[32];
+	ssize_t		len;
+
+	if (fstat(thread->fd, &buf) < 0) {
+		cf_log_err(inst->cs, "Failed examining %s: %s", thread->filename_work, fr_syserror(errno));
+		return -1;
+	}
+
+	MEM(thread->index = talloc_array(thread, proto_detail_work_record_t, DETAIL_INDEX_AHEAD));
+
+	/*
+	 *	An empty file is read as being at EOF.
+	 */
+	thread->map_size = buf.st_size;
+	if (!thread->map_size) return 0;
+
+	thread->map = mmap(NULL, thread->map_size, PROT_READ | (inst->track_progress ? PROT_WRITE : 0),
+			   MAP_SHARED, thread->fd, 0);
+	if (thread->map == MAP_FAILED) {
+		thread->map = NULL;
+		cf_log_err(inst->cs, "Failed mapping %s: %s", thread->filename_work, fr_syserror(errno));
+		return -1;
+	}
+
+#ifdef MADV_SEQUENTIAL
+	(void) madvise(thread->map, thread->map_size, MADV_SEQUENTIAL);
+#endif
+
+	if (!inst->track_progress) return 0;
+
+	thread->filename_progress = talloc_typed_asprintf(thread, "%s.offset", thread->filename_work);
+	thread->progress_fd = open(thread->filename_progress, O_RDWR | O_CREAT, 0600);
+	if (thread->progress_fd < 0) {
+		cf_log_err(inst->cs, "Failed opening %s: %s", thread->filename_progress, fr_syserror(errno));
+		return -1;
+	}
+
+	/*
+	 *	Only trust the offset if it's at the start of a
+	 *	record.  Otherwise, re-scan the whole file, and rely on
+	 *	the "Done" markers.
+	 */
+	len = pread(thread->progress_fd, progress, sizeof(progress) - 1, 0);
+	if (len > 0) {
+		uint64_t offset;
+
+		progress[len] = '\0';
+		offset = strtoull(progress, NULL, 10);
+
+		if ((offset <= thread->map_size) &&
+		    ((offset == 0) || ((offset >= 2) && (thread->map[offset - 1] == '\n') && (thread->map[offset - 2] == '\n')))) {
+			DEBUG("Resuming %s from offset %" PRIu64, thread->filename_work, offset);
+			thread->index_offset = thread->progress_offset = offset;
+		}
+	}
+
+	return 0;
+}
+
 /** Open a detail listener
  *
  */
@@ -705,6 +1094,8 @@ static int mod_open(fr_listen_t *li)
 	proto_detail_work_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_detail_work_thread_t);
 
 	fr_dlist_init(&thread->list, fr_detail_entry_t, entry);
+	fr_dlist_init(&thread->inflight, fr_detail_entry_t, inflight);
+	thread->progress_fd = -1;
 
 	/*
 	 *	Open the file if we haven't already been given one.
@@ -738,6 +1129,8 @@ static int mod_open(fr_listen_t *li)
 		thread->file_size = 1;
 	}
 
+	if (inst->use_mmap && (mod_open_mmap(inst, thread) < 0)) return -1;
+
 	rad_assert(thread->name == NULL);
 	rad_assert(thread->filename_work != NULL);
 	thread->name = talloc_typed_asprintf(thread, "proto_detail working file %s", thread->filename_work);
@@ -772,6 +1165,17 @@ static int mod_close_internal(proto_detail_work_thread_t *thread)
 
 	unlink(thread->filename_work);
 
+	if (thread->map) {
+		(void) munmap(thread->map, thread->map_size);
+		thread->map = NULL;
+	}
+
+	if (thread->progress_fd >= 0) {
+		unlink(thread->filename_progress);
+		close(thread->progress_fd);
+		thread->progress_fd = -1;
+	}
+
 	close(thread->fd);
 	thread->fd = -1;
 
@@ -903,7 +1307,16 @@ static int mod_bootstrap(void *instance, CONF_SECTION *cs)
 	}
 
 	FR_INTEGER_BOUND_CHECK("limit.maximum_outstanding", inst->max_outstanding, >=, 1);
-	FR_INTEGER_BOUND_CHECK("limit.maximum_outstanding", inst->max_outstanding, <=, 256);
+
+	/*
+	 *	The mmap reader doesn't copy packets for
+	 *	retransmission, so it can have a much larger window.
+	 */
+	if (inst->use_mmap) {
+		FR_INTEGER_BOUND_CHECK("limit.maximum_outstanding", inst->max_outstanding, <=, 65536);
+	} else {
+		FR_INTEGER_BOUND_CHECK("limit.maximum_outstanding", inst->max_outstanding, <=, 256);
+	}
 
 	return 0;
 }
@@ -35,19 +35,19 @@ static int transport_parse(TALLOC_CTX *ctx, void *out, UNUSED void *parent, CONF
 
 static const CONF_PARSER priority_config[] = {
 	{ FR_CONF_OFFSET("DHCP-Discover", FR_TYPE_UINT32, proto_dhcpv4_t, priorities[FR_DHCP_DISCOVER]),
-	  .func = cf_table_parse_uint32, .uctx = channel_packet_priority, .dflt = "normal" },
+	  .func = cf_table_parse_uint32, .uctx = request_priority_table, .dflt = "normal" },
 	{ FR_CONF_OFFSET("DHCP-Request", FR_TYPE_UINT32, proto_dhcpv4_t, priorities[FR_DHCP_REQUEST]),
-	  .func = cf_table_parse_uint32, .uctx = channel_packet_priority, .dflt = "normal" },
+	  .func = cf_table_parse_uint32, .uctx = request_priority_table, .dflt = "normal" },
 	{ FR_CONF_OFFSET("DHCP-Decline", FR_TYPE_UINT32, proto_dhcpv4_t, priorities[FR_DHCP_DECLINE]),
-	  .func = cf_table_parse_uint32, .uctx = channel_packet_priority, .dflt = "normal" },
+	  .func = cf_table_parse_uint32, .uctx = request_priority_table, .dflt = "normal" },
 	{ FR_CONF_OFFSET("DHCP-Release", FR_TYPE_UINT32, proto_dhcpv4_t, priorities[FR_DHCP_RELEASE]),
-	  .func = cf_table_parse_uint32, .uctx = channel_packet_priority, .dflt = "normal" },
+	  .func = cf_table_parse_uint32, .uctx = request_priority_table, .dflt = "normal" },
 	{ FR_CONF_OFFSET("DHCP-Inform", FR_TYPE_UINT32, proto_dhcpv4_t, priorities[FR_DHCP_INFORM]),
-	  .func = cf_table_parse_uint32, .uctx = channel_packet_priority, .dflt = "normal" },
+	  .func = cf_table_parse_uint32, .uctx = request_priority_table, .dflt = "normal" },
 	{ FR_CONF_OFFSET("DHCP-Lease-Query", FR_TYPE_UINT32, proto_dhcpv4_t, priorities[FR_DHCP_LEASE_QUERY]),
-	  .func = cf_table_parse_uint32, .uctx = channel_packet_priority, .dflt = "low" },
+	  .func = cf_table_parse_uint32, .uctx = request_priority_table, .dflt = "low" },
 	{ FR_CONF_OFFSET("DHCP-Bulk-Lease-Query", FR_TYPE_UINT32, proto_dhcpv4_t, priorities[FR_DHCP_BULK_LEASE_QUERY]),
-	  .func = cf_table_parse_uint32, .uctx = channel_packet_priority, .dflt = "low" },
+	  .func = cf_table_parse_uint32, .uctx = request_priority_table, .dflt = "low" },
 	CONF_PARSER_TERMINATOR
 };
 
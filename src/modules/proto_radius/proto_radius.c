@@ -55,15 +55,15 @@ static CONF_PARSER const limit_config[] = {
 
 static const CONF_PARSER priority_config[] = {
 	{ FR_CONF_OFFSET("Access-Request", FR_TYPE_UINT32, proto_radius_t, priorities[FR_CODE_ACCESS_REQUEST]),
-	  .func = cf_table_parse_uint32, .uctx = channel_packet_priority, .dflt = "high" },
+	  .func = cf_table_parse_uint32, .uctx = request_priority_table, .dflt = "high" },
 	{ FR_CONF_OFFSET("Accounting-Request", FR_TYPE_UINT32, proto_radius_t, priorities[FR_CODE_ACCOUNTING_REQUEST]),
-	  .func = cf_table_parse_uint32, .uctx = channel_packet_priority, .dflt = "low" },
+	  .func = cf_table_parse_uint32, .uctx = request_priority_table, .dflt = "low" },
 	{ FR_CONF_OFFSET("CoA-Request", FR_TYPE_UINT32, proto_radius_t, priorities[FR_CODE_COA_REQUEST]),
-	  .func = cf_table_parse_uint32, .uctx = channel_packet_priority, .dflt = "normal" },
+	  .func = cf_table_parse_uint32, .uctx = request_priority_table, .dflt = "normal" },
 	{ FR_CONF_OFFSET("Disconnect-Request", FR_TYPE_UINT32, proto_radius_t, priorities[FR_CODE_DISCONNECT_REQUEST]),
-	  .func = cf_table_parse_uint32, .uctx = channel_packet_priority, .dflt = "low" },
+	  .func = cf_table_parse_uint32, .uctx = request_priority_table, .dflt = "low" },
 	{ FR_CONF_OFFSET("Status-Server", FR_TYPE_UINT32, proto_radius_t, priorities[FR_CODE_STATUS_SERVER]),
-	  .func = cf_table_parse_uint32, .uctx = channel_packet_priority, .dflt = "now" },
+	  .func = cf_table_parse_uint32, .uctx = request_priority_table, .dflt = "now" },
 
 	CONF_PARSER_TERMINATOR
 };
@@ -496,8 +496,9 @@ static ssize_t mod_encode(void const *instance, REQUEST *request, uint8_t *buffe
 		return -1;
 	}
 
-	if (fr_radius_sign(buffer, request->packet->data,
-			   (uint8_t const *) client->secret, talloc_array_length(client->secret) - 1) < 0) {
+	if (fr_radius_sign_precomputed(buffer, request->packet->data,
+				       (uint8_t const *) client->secret, talloc_array_length(client->secret) - 1,
+				       client->secret_hmac) < 0) {
 		RPEDEBUG("Failed signing RADIUS reply");
 		return -1;
 	}
@@ -584,6 +585,48 @@ static int mod_priority_set(void const *instance, uint8_t const *buffer, UNUSED
 	return inst->priorities[buffer[0]];
 }
 
+/** Find the State attribute, so that EAP conversations are handled by the same worker
+ *
+ * @param[in] instance	of proto_radius.
+ * @param[out] key	Where to write a pointer to the State value.
+ * @param[in] buffer	raw packet.
+ * @param[in] buflen	length of the packet.
+ * @return
+ *	- 0 if the packet has no State.
+ *	- >0 the length of the State.
+ */
+static size_t mod_affinity_get(UNUSED void const *instance, uint8_t const **key,
+			       uint8_t const *buffer, size_t buflen)
+{
+	uint8_t const *p, *end;
+	size_t packet_len;
+
+	if (buflen < RADIUS_HEADER_LENGTH) return 0;
+
+	if ((buffer[0] != FR_CODE_ACCESS_REQUEST) && (buffer[0] != FR_CODE_ACCESS_CHALLENGE)) return 0;
+
+	packet_len = (buffer[2] << 8) | buffer[3];
+	if (packet_len > buflen) packet_len = buflen;
+
+	p = buffer + RADIUS_HEADER_LENGTH;
+	end = buffer + packet_len;
+
+	while ((p + 2) <= end) {
+		if ((p[1] < 2) || ((p + p[1]) > end)) return 0;
+
+		if (p[0] == FR_STATE) {
+			if (p[1] == 2) return 0;
+
+			*key = p + 2;
+			return p[1] - 2;
+		}
+
+		p += p[1];
+	}
+
+	return 0;
+}
+
 /** Open listen sockets/connect to external event source
  *
  * @param[in] instance	Ctx data for this application.
@@ -858,5 +901,6 @@ fr_app_t proto_radius = {
 	.decode			= mod_decode,
 	.encode			= mod_encode,
 	.entry_point_set	= mod_entry_point_set,
-	.priority		= mod_priority_set
+	.priority		= mod_priority_set,
+	.affinity		= mod_affinity_get
 };
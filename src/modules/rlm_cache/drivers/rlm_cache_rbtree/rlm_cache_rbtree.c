@@ -19,18 +19,53 @@
  * @file rlm_cache_rbtree.c
  * @brief Simple rbtree based cache.
  *
- * @copyright 2014 The FreeRADIUS server project
+ * Entries are split between a number of lock striped shards, selected
+ * by a hash of the cache key.  Each shard has its own tree, expiry heap
+ * and mutex, so requests for different keys rarely contend.
+ *
+ * Optionally each worker thread may keep a small, direct mapped, L1
+ * cache of entries it has recently retrieved.  L1 entries are private
+ * copies, and are invalidated whenever the shard they were copied from
+ * is modified, so they can be read without taking any locks.
+ *
+ * @copyright 2014,2019 The FreeRADIUS server project
  */
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/util/heap.h>
+#include <freeradius-devel/util/thread_local.h>
 #include <freeradius-devel/server/rad_assert.h>
 #include "../../rlm_cache.h"
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+#define CACHE_RBTREE_MAX_SHARDS		1024
+#define CACHE_RBTREE_MAX_L1		65536
+
+/** A single lock striped partition of the cache
+ *
+ */
 typedef struct {
 	rbtree_t		*cache;		//!< Tree for looking up cache keys.
 	fr_heap_t		*heap;		//!< For managing entry expiry.
 
-	pthread_mutex_t		mutex;		//!< Protect the tree from multiple readers/writers.
+	pthread_mutex_t		mutex;		//!< Protect the shard from multiple readers/writers.
+
+	_Atomic(uint64_t)	generation;	//!< Incremented every time the shard is modified.
+						//!< Used to invalidate L1 entries.
+	_Atomic(uint32_t)	num_entries;	//!< Entries in the shard, readable without the mutex.
+} rlm_cache_rbtree_shard_t;
+
+typedef struct {
+	uint32_t		num_shards;	//!< How many shards we split the cache into.
+	uint32_t		l1_size;	//!< How many entries each thread may hold in its L1 cache.
+
+	rlm_cache_rbtree_shard_t *shards;	//!< Array of shards.
+
+	unsigned int		id;		//!< Index of this driver in the thread local array.
 } rlm_cache_rbtree_t;
 
 typedef struct {
@@ -38,6 +73,38 @@ typedef struct {
 	int32_t			heap_id;	//!< Offset used for heap.
 } rlm_cache_rbtree_entry_t;
 
+/** A private copy of a cache entry, held in a thread's L1 cache
+ *
+ */
+typedef struct {
+	rlm_cache_entry_t	*c;		//!< Copy of the entry.
+	uint32_t		hash;		//!< Hash of the entry's key.
+	uint64_t		generation;	//!< Generation of the shard when the copy was made.
+} rlm_cache_rbtree_l1_slot_t;
+
+/** Per-thread state for a driver instance
+ *
+ * Also serves as the handle passed back from #cache_acquire.
+ */
+typedef struct {
+	rlm_cache_rbtree_t const *driver;	//!< Driver instance this state belongs to.
+	rlm_cache_rbtree_shard_t *locked;	//!< Shard we currently hold the mutex for.
+	rlm_cache_rbtree_l1_slot_t *l1;		//!< Direct mapped L1 cache.  NULL if disabled.
+} rlm_cache_rbtree_thread_t;
+
+static CONF_PARSER driver_config[] = {
+	{ FR_CONF_OFFSET("shards", FR_TYPE_UINT32, rlm_cache_rbtree_t, num_shards), .dflt = "16" },
+	{ FR_CONF_OFFSET("l1_size", FR_TYPE_UINT32, rlm_cache_rbtree_t, l1_size), .dflt = "0" },
+	CONF_PARSER_TERMINATOR
+};
+
+/*
+ *	Thread local array of per-driver state, indexed by driver id.
+ */
+fr_thread_local_setup(rlm_cache_rbtree_thread_t **, cache_rbtree_thread)	/* macro */
+
+static unsigned int cache_rbtree_instances;
+
 /** Compare two entries by key
  *
  * There may only be one entry with the same key.
@@ -79,19 +146,182 @@ static int _cache_entry_free(UNUSED void *ctx, void *data)
 	return 2;
 }
 
+/** Free the thread local driver state array when the thread exits
+ *
+ */
+static void _cache_rbtree_thread_free(void *arg)
+{
+	talloc_free(arg);
+}
+
+/** Lock a shard, releasing any other shard the handle holds
+ *
+ * The entry returned by #cache_entry_find must remain valid until the
+ * handle is released, or another operation is performed with it, so
+ * we hold the shard's mutex until then.
+ */
+static inline void cache_shard_lock(rlm_cache_rbtree_thread_t *t, rlm_cache_rbtree_shard_t *shard)
+{
+	if (t->locked == shard) return;
+	if (t->locked) pthread_mutex_unlock(&t->locked->mutex);
+
+	pthread_mutex_lock(&shard->mutex);
+	t->locked = shard;
+}
+
+/** Record that a shard was modified
+ *
+ * Any L1 copies made from the shard before this point will no longer be used.
+ */
+static inline void cache_shard_modified(rlm_cache_rbtree_shard_t *shard)
+{
+	atomic_store_explicit(&shard->num_entries, rbtree_num_elements(shard->cache), memory_order_relaxed);
+	atomic_fetch_add_explicit(&shard->generation, 1, memory_order_release);
+}
+
+/** Remove an entry from a shard and free it
+ *
+ * @note The shard must be locked.
+ */
+static inline void cache_shard_remove(rlm_cache_rbtree_shard_t *shard, rlm_cache_entry_t *c)
+{
+	fr_heap_extract(shard->heap, c);
+	rbtree_deletebydata(shard->cache, c);
+	talloc_free(c);
+	cache_shard_modified(shard);
+}
+
+/** Remove any entries from the shard which have expired
+ *
+ * @note The shard must be locked.
+ */
+static void cache_shard_reap(rlm_cache_rbtree_shard_t *shard, time_t now)
+{
+	rlm_cache_entry_t *c;
+
+	while ((c = fr_heap_peek(shard->heap)) && (c->expires < now)) cache_shard_remove(shard, c);
+}
+
+/** Get this thread's state for a driver instance, allocating it if needed
+ *
+ */
+static rlm_cache_rbtree_thread_t *cache_thread_state(rlm_cache_rbtree_t const *driver, REQUEST *request)
+{
+	rlm_cache_rbtree_thread_t	**array = cache_rbtree_thread;
+	rlm_cache_rbtree_thread_t	*t;
+
+	if (!array || (talloc_array_length(array) <= driver->id)) {
+		rlm_cache_rbtree_thread_t	**new;
+		size_t				len = array ? talloc_array_length(array) : 0;
+
+		new = talloc_realloc(NULL, array, rlm_cache_rbtree_thread_t *, cache_rbtree_instances);
+		if (!new) {
+		oom:
+			RERROR("Failed allocating thread local cache state");
+			return NULL;
+		}
+		memset(new + len, 0, (talloc_array_length(new) - len) * sizeof(*new));
+
+		if (new != array) {
+			fr_thread_local_set_destructor(cache_rbtree_thread, _cache_rbtree_thread_free, new);
+			array = new;
+		}
+	}
+
+	t = array[driver->id];
+	if (t) return t;
+
+	t = talloc_zero(array, rlm_cache_rbtree_thread_t);
+	if (!t) goto oom;
+	t->driver = driver;
+
+	if (driver->l1_size > 0) {
+		t->l1 = talloc_zero_array(t, rlm_cache_rbtree_l1_slot_t, driver->l1_size);
+		if (!t->l1) {
+			talloc_free(t);
+			goto oom;
+		}
+	}
+	array[driver->id] = t;
+
+	return t;
+}
+
+/** Make a private copy of an entry for the L1 cache
+ *
+ * The copy must not reference any memory owned by the original entry,
+ * as the original may be freed by another thread at any time.
+ */
+static rlm_cache_entry_t *cache_entry_copy(TALLOC_CTX *ctx, rlm_cache_entry_t const *c)
+{
+	rlm_cache_entry_t	*copy;
+	vp_map_t const		*map;
+	vp_map_t		**last;
+
+	copy = talloc_zero(ctx, rlm_cache_entry_t);
+	if (!copy) return NULL;
+
+	copy->key = talloc_memdup(copy, c->key, c->key_len);
+	if (!copy->key) goto error;
+	copy->key_len = c->key_len;
+	copy->hits = c->hits;
+	copy->created = c->created;
+	copy->expires = c->expires;
+
+	last = &copy->maps;
+	for (map = c->maps; map; map = map->next) {
+		vp_map_t *c_map;
+
+		c_map = talloc_zero(copy, vp_map_t);
+		if (!c_map) goto error;
+		c_map->op = map->op;
+
+		c_map->lhs = talloc(c_map, vp_tmpl_t);
+		if (!c_map->lhs) goto error;
+		*c_map->lhs = *map->lhs;
+		c_map->lhs->name = talloc_bstrndup(c_map->lhs, map->lhs->name, map->lhs->len);
+		if (!c_map->lhs->name) goto error;
+		if (map->lhs->tmpl_unknown) {
+			c_map->lhs->tmpl_unknown = fr_dict_unknown_acopy(c_map->lhs, map->lhs->tmpl_unknown);
+			c_map->lhs->tmpl_da = c_map->lhs->tmpl_unknown;
+		}
+
+		c_map->rhs = tmpl_init(talloc(c_map, vp_tmpl_t), TMPL_TYPE_DATA,
+				       map->rhs->name, map->rhs->len, map->rhs->quote);
+		if (!c_map->rhs) goto error;
+		if (fr_value_box_copy(c_map->rhs, &c_map->rhs->tmpl_value, &map->rhs->tmpl_value) < 0) goto error;
+		c_map->rhs->tmpl_value_type = map->rhs->tmpl_value_type;
+
+		*last = c_map;
+		last = &(*last)->next;
+	}
+
+	return copy;
+
+error:
+	talloc_free(copy);
+	return NULL;
+}
+
 /** Cleanup a cache_rbtree instance
  *
  */
 static int mod_detach(void *instance)
 {
-	rlm_cache_rbtree_t *driver = talloc_get_type_abort(instance, rlm_cache_rbtree_t);
+	rlm_cache_rbtree_t	*driver = talloc_get_type_abort(instance, rlm_cache_rbtree_t);
+	uint32_t		i;
 
-	if (driver->cache) {
-		rbtree_walk(driver->cache, RBTREE_DELETE_ORDER, _cache_entry_free, NULL);
-		talloc_free(driver->cache);
-	}
+	if (!driver->shards) return 0;
+
+	for (i = 0; i < driver->num_shards; i++) {
+		rlm_cache_rbtree_shard_t *shard = &driver->shards[i];
 
-	pthread_mutex_destroy(&driver->mutex);
+		if (!shard->cache) continue;
+
+		rbtree_walk(shard->cache, RBTREE_DELETE_ORDER, _cache_entry_free, NULL);
+		pthread_mutex_destroy(&shard->mutex);
+	}
+	talloc_free(driver->shards);
 
 	return 0;
 }
@@ -102,32 +332,63 @@ static int mod_detach(void *instance)
  */
 static int mod_instantiate(UNUSED rlm_cache_config_t const *config, void *instance, UNUSED CONF_SECTION *conf)
 {
-	rlm_cache_rbtree_t *driver = talloc_get_type_abort(instance, rlm_cache_rbtree_t);
+	rlm_cache_rbtree_t	*driver = talloc_get_type_abort(instance, rlm_cache_rbtree_t);
+	uint32_t		i, num_shards = 1;
+
+	FR_INTEGER_BOUND_CHECK("shards", driver->num_shards, >=, 1);
+	FR_INTEGER_BOUND_CHECK("shards", driver->num_shards, <=, CACHE_RBTREE_MAX_SHARDS);
+	FR_INTEGER_BOUND_CHECK("l1_size", driver->l1_size, <=, CACHE_RBTREE_MAX_L1);
 
 	/*
-	 *	The cache.
+	 *	Round up to a power of two so we can mask the hash.
 	 */
-	driver->cache = rbtree_talloc_create(NULL, cache_entry_cmp, rlm_cache_rbtree_entry_t, NULL, 0);
-	if (!driver->cache) {
-		ERROR("Failed to create cache");
-		return -1;
-	}
-	talloc_link_ctx(driver, driver->cache);
+	while (num_shards < driver->num_shards) num_shards <<= 1;
+	driver->num_shards = num_shards;
 
 	/*
-	 *	The heap of entries to expire.
+	 *	The shards are parented from the NULL ctx and linked
+	 *	to the instance, as the trees and heaps grow after
+	 *	the instance data is marked read only.
 	 */
-	driver->heap = fr_heap_talloc_create(driver, cache_heap_cmp, rlm_cache_rbtree_entry_t, heap_id);
-	if (!driver->heap) {
-		ERROR("Failed to create heap for the cache");
+	driver->shards = talloc_zero_array(NULL, rlm_cache_rbtree_shard_t, driver->num_shards);
+	if (!driver->shards) {
+		ERROR("Failed allocating cache shards");
 		return -1;
 	}
+	talloc_link_ctx(driver, driver->shards);
+
+	for (i = 0; i < driver->num_shards; i++) {
+		rlm_cache_rbtree_shard_t *shard = &driver->shards[i];
+
+		/*
+		 *	The cache.
+		 */
+		shard->cache = rbtree_talloc_create(driver->shards, cache_entry_cmp, rlm_cache_rbtree_entry_t, NULL, 0);
+		if (!shard->cache) {
+			ERROR("Failed to create cache");
+			return -1;
+		}
 
-	if (pthread_mutex_init(&driver->mutex, NULL) < 0) {
-		ERROR("Failed initializing mutex: %s", fr_syserror(errno));
-		return -1;
+		/*
+		 *	The heap of entries to expire.
+		 */
+		shard->heap = fr_heap_talloc_create(driver->shards, cache_heap_cmp, rlm_cache_rbtree_entry_t, heap_id);
+		if (!shard->heap) {
+			ERROR("Failed to create heap for the cache");
+			return -1;
+		}
+
+		if (pthread_mutex_init(&shard->mutex, NULL) < 0) {
+			ERROR("Failed initializing mutex: %s", fr_syserror(errno));
+			return -1;
+		}
+
+		atomic_init(&shard->generation, 0);
+		atomic_init(&shard->num_entries, 0);
 	}
 
+	driver->id = cache_rbtree_instances++;
+
 	return 0;
 }
 
@@ -153,71 +414,100 @@ static rlm_cache_entry_t *cache_entry_alloc(UNUSED rlm_cache_config_t const *con
 
 /** Locate a cache entry
  *
- * @note handle not used except for sanity checks.
+ * Checks the thread's L1 cache first (if enabled), then locks the
+ * shard the key hashes to and searches its tree.
  *
  * @copydetails cache_entry_find_t
  */
 static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
 				       UNUSED rlm_cache_config_t const *config, void *instance,
-				       REQUEST *request, UNUSED void *handle, uint8_t const *key, size_t key_len)
+				       REQUEST *request, void *handle, uint8_t const *key, size_t key_len)
 {
-	rlm_cache_rbtree_t *driver = talloc_get_type_abort(instance, rlm_cache_rbtree_t);
+	rlm_cache_rbtree_t		*driver = talloc_get_type_abort(instance, rlm_cache_rbtree_t);
+	rlm_cache_rbtree_thread_t	*t = talloc_get_type_abort(handle, rlm_cache_rbtree_thread_t);
+	rlm_cache_rbtree_shard_t	*shard;
+	rlm_cache_rbtree_l1_slot_t	*slot = NULL;
+	rlm_cache_entry_t		*c;
+	uint32_t			hash;
 
-	rlm_cache_entry_t *c;
+	hash = fr_hash(key, key_len);
+	shard = &driver->shards[hash & (driver->num_shards - 1)];
+
+	/*
+	 *	Check the L1 cache.  The copy is only valid if the
+	 *	shard hasn't been modified since it was made.
+	 */
+	if (t->l1) {
+		slot = &t->l1[hash % driver->l1_size];
+		c = slot->c;
+		if (c && (slot->hash == hash) && (c->key_len == key_len) && (memcmp(c->key, key, key_len) == 0)) {
+			if ((slot->generation == atomic_load_explicit(&shard->generation, memory_order_acquire)) &&
+			    (c->expires >= request->packet->timestamp.tv_sec)) {
+				RDEBUG3("Found entry in L1 cache");
+				*out = c;
+				return CACHE_OK;
+			}
+		}
+		if (c) TALLOC_FREE(slot->c);
+	}
 
-	rad_assert(driver->cache);
+	cache_shard_lock(t, shard);
 
 	/*
 	 *	Clear out old entries
 	 */
-	c = fr_heap_peek(driver->heap);
-	if (c && (c->expires < request->packet->timestamp.tv_sec)) {
-		fr_heap_extract(driver->heap, c);
-		rbtree_deletebydata(driver->cache, c);
-		talloc_free(c);
-	}
+	cache_shard_reap(shard, request->packet->timestamp.tv_sec);
 
 	/*
 	 *	Is there an entry for this key?
 	 */
-	c = rbtree_finddata(driver->cache, &(rlm_cache_entry_t){ .key = key, .key_len = key_len });
+	c = rbtree_finddata(shard->cache, &(rlm_cache_entry_t){ .key = key, .key_len = key_len });
 	if (!c) {
 		*out = NULL;
 		return CACHE_MISS;
 	}
+
+	/*
+	 *	Populate the L1 cache.  Failure here isn't fatal,
+	 *	we just won't have a copy next time.
+	 */
+	if (slot) {
+		slot->c = cache_entry_copy(t, c);
+		slot->hash = hash;
+		slot->generation = atomic_load_explicit(&shard->generation, memory_order_relaxed);
+	}
 	*out = c;
 
 	return CACHE_OK;
 }
 
 /** Free an entry and remove it from the data store
- *
- * @note handle not used except for sanity checks.
  *
  * @copydetails cache_entry_expire_t
  */
 static cache_status_t cache_entry_expire(UNUSED rlm_cache_config_t const *config, void *instance,
-					 REQUEST *request, UNUSED void *handle,
+					 REQUEST *request, void *handle,
 					 uint8_t const *key, size_t key_len)
 {
-	rlm_cache_rbtree_t *driver = talloc_get_type_abort(instance, rlm_cache_rbtree_t);
-	rlm_cache_entry_t *c;
+	rlm_cache_rbtree_t		*driver = talloc_get_type_abort(instance, rlm_cache_rbtree_t);
+	rlm_cache_rbtree_thread_t	*t = talloc_get_type_abort(handle, rlm_cache_rbtree_thread_t);
+	rlm_cache_rbtree_shard_t	*shard;
+	rlm_cache_entry_t		*c;
 
 	if (!request) return CACHE_ERROR;
 
-	c = rbtree_finddata(driver->cache, &(rlm_cache_entry_t){ .key = key, .key_len = key_len });
+	shard = &driver->shards[fr_hash(key, key_len) & (driver->num_shards - 1)];
+	cache_shard_lock(t, shard);
+
+	c = rbtree_finddata(shard->cache, &(rlm_cache_entry_t){ .key = key, .key_len = key_len });
 	if (!c) return CACHE_MISS;
 
-	fr_heap_extract(driver->heap, c);
-	rbtree_deletebydata(driver->cache, c);
-	talloc_free(c);
+	cache_shard_remove(shard, c);
 
 	return CACHE_OK;
 }
 
 /** Insert a new entry into the data store
- *
- * @note handle not used except for sanity checks.
  *
  * @copydetails cache_entry_insert_t
  */
@@ -225,118 +515,152 @@ static cache_status_t cache_entry_insert(rlm_cache_config_t const *config, void
 					 REQUEST *request, void *handle,
 					 rlm_cache_entry_t const *c)
 {
-	cache_status_t status;
-
-	rlm_cache_rbtree_t *driver = talloc_get_type_abort(instance, rlm_cache_rbtree_t);
-	rlm_cache_entry_t *my_c;
+	cache_status_t			status;
 
-	rad_assert(handle == request);
+	rlm_cache_rbtree_t		*driver = talloc_get_type_abort(instance, rlm_cache_rbtree_t);
+	rlm_cache_rbtree_thread_t	*t = talloc_get_type_abort(handle, rlm_cache_rbtree_thread_t);
+	rlm_cache_rbtree_shard_t	*shard;
+	rlm_cache_entry_t		*my_c;
 
 	if (!request) return CACHE_ERROR;
 
 	memcpy(&my_c, &c, sizeof(my_c));
 
+	shard = &driver->shards[fr_hash(c->key, c->key_len) & (driver->num_shards - 1)];
+	cache_shard_lock(t, shard);
+
+	cache_shard_reap(shard, request->packet->timestamp.tv_sec);
+
 	/*
 	 *	Allow overwriting
 	 */
-	if (!rbtree_insert(driver->cache, my_c)) {
+	if (!rbtree_insert(shard->cache, my_c)) {
 		status = cache_entry_expire(config, instance, request, handle, c->key, c->key_len);
 		if ((status != CACHE_OK) && !fr_cond_assert(0)) return CACHE_ERROR;
 
-		if (!rbtree_insert(driver->cache, my_c)) {
+		if (!rbtree_insert(shard->cache, my_c)) {
 			RERROR("Failed adding entry");
 
 			return CACHE_ERROR;
 		}
 	}
 
-	if (fr_heap_insert(driver->heap, my_c) < 0) {
-		rbtree_deletebydata(driver->cache, my_c);
+	if (fr_heap_insert(shard->heap, my_c) < 0) {
+		rbtree_deletebydata(shard->cache, my_c);
+		cache_shard_modified(shard);
 		RERROR("Failed adding entry to expiry heap");
 
 		return CACHE_ERROR;
 	}
+	cache_shard_modified(shard);
 
 	return CACHE_OK;
 }
 
 /** Update the TTL of an entry
  *
- * @note handle not used except for sanity checks.
+ * The entry passed in may be an L1 copy, so we always operate on the
+ * entry held by the shard.
  *
  * @copydetails cache_entry_set_ttl_t
  */
 static cache_status_t cache_entry_set_ttl(UNUSED rlm_cache_config_t const *config, void *instance,
-					  REQUEST *request, UNUSED void *handle,
+					  REQUEST *request, void *handle,
 					  rlm_cache_entry_t *c)
 {
-	rlm_cache_rbtree_t *driver = talloc_get_type_abort(instance, rlm_cache_rbtree_t);
+	rlm_cache_rbtree_t		*driver = talloc_get_type_abort(instance, rlm_cache_rbtree_t);
+	rlm_cache_rbtree_thread_t	*t = talloc_get_type_abort(handle, rlm_cache_rbtree_thread_t);
+	rlm_cache_rbtree_shard_t	*shard;
+	rlm_cache_entry_t		*my_c;
 
 #ifdef NDEBUG
 	if (!request) return CACHE_ERROR;
 #endif
 
-	if (!fr_cond_assert(fr_heap_extract(driver->heap, c) == 0)) {
+	shard = &driver->shards[fr_hash(c->key, c->key_len) & (driver->num_shards - 1)];
+	cache_shard_lock(t, shard);
+
+	my_c = rbtree_finddata(shard->cache, c);
+	if (!my_c) {
+		RERROR("Entry was removed before its TTL could be updated");
+		return CACHE_ERROR;
+	}
+
+	if (!fr_cond_assert(fr_heap_extract(shard->heap, my_c) == 0)) {
 		RERROR("Entry not in heap");
 		return CACHE_ERROR;
 	}
+	my_c->expires = c->expires;
 
-	if (fr_heap_insert(driver->heap, c) < 0) {
-		rbtree_deletebydata(driver->cache, c);	/* make sure we don't leak entries... */
+	if (fr_heap_insert(shard->heap, my_c) < 0) {
+		rbtree_deletebydata(shard->cache, my_c);	/* make sure we don't leak entries... */
+		cache_shard_modified(shard);
 		RERROR("Failed updating entry TTL.  Entry was forcefully expired");
 		return CACHE_ERROR;
 	}
+	cache_shard_modified(shard);
+
 	return CACHE_OK;
 }
 
 /** Return the number of entries in the cache
  *
- * @note handle not used except for sanity checks.
+ * The count is assembled from the per-shard counts without locking,
+ * so may be slightly stale.
  *
  * @copydetails cache_entry_count_t
  */
 static uint32_t cache_entry_count(UNUSED rlm_cache_config_t const *config, void *instance,
 				  REQUEST *request, UNUSED void *handle)
 {
-	rlm_cache_rbtree_t *driver = talloc_get_type_abort(instance, rlm_cache_rbtree_t);
+	rlm_cache_rbtree_t	*driver = talloc_get_type_abort(instance, rlm_cache_rbtree_t);
+	uint32_t		i, count = 0;
 
 	if (!request) return CACHE_ERROR;
 
-	return rbtree_num_elements(driver->cache);
+	for (i = 0; i < driver->num_shards; i++) {
+		count += atomic_load_explicit(&driver->shards[i].num_entries, memory_order_relaxed);
+	}
+
+	return count;
 }
 
-/** Lock the rbtree
+/** Get the thread's handle for the cache
  *
- * @note handle not used except for sanity checks.
+ * No locks are taken here, the relevant shard is locked when an
+ * operation is performed on a key.
  *
  * @copydetails cache_acquire_t
  */
 static int cache_acquire(void **handle, UNUSED rlm_cache_config_t const *config, void *instance,
 			 REQUEST *request)
 {
-	rlm_cache_rbtree_t *driver = talloc_get_type_abort(instance, rlm_cache_rbtree_t);
+	rlm_cache_rbtree_t		*driver = talloc_get_type_abort(instance, rlm_cache_rbtree_t);
+	rlm_cache_rbtree_thread_t	*t;
 
-	pthread_mutex_lock(&driver->mutex);
+	t = cache_thread_state(driver, request);
+	if (!t) return -1;
 
-	*handle = request;		/* handle is unused, this is just for sanity checking */
+	rad_assert(!t->locked);
 
-	RDEBUG3("Mutex acquired");
+	*handle = t;
 
 	return 0;
 }
 
-/** Release an entry unlocking any mutexes
- *
- * @note handle not used except for sanity checks.
+/** Release the handle, unlocking any shard we hold
  *
  * @copydetails cache_release_t
  */
-static void cache_release(UNUSED rlm_cache_config_t const *config, void *instance, REQUEST *request,
-			  UNUSED rlm_cache_handle_t *handle)
+static void cache_release(UNUSED rlm_cache_config_t const *config, UNUSED void *instance, REQUEST *request,
+			  rlm_cache_handle_t *handle)
 {
-	rlm_cache_rbtree_t *driver = talloc_get_type_abort(instance, rlm_cache_rbtree_t);
+	rlm_cache_rbtree_thread_t *t = talloc_get_type_abort(handle, rlm_cache_rbtree_thread_t);
+
+	if (!t->locked) return;
 
-	pthread_mutex_unlock(&driver->mutex);
+	pthread_mutex_unlock(&t->locked->mutex);
+	t->locked = NULL;
 
 	RDEBUG3("Mutex released");
 }
@@ -348,6 +672,7 @@ cache_driver_t rlm_cache_rbtree = {
 	.instantiate	= mod_instantiate,
 	.detach		= mod_detach,
 	.inst_size	= sizeof(rlm_cache_rbtree_t),
+	.config		= driver_config,
 	.alloc		= cache_entry_alloc,
 
 	.find		= cache_entry_find,
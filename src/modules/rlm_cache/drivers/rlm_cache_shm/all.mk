@@ -0,0 +1,3 @@
+TARGET		:= rlm_cache_shm.a
+SOURCES		:= rlm_cache_shm.c ../../serialize.c
+TGT_LDLIBS	:= $(LIBS)
@@ -0,0 +1,570 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_cache_shm.c
+ * @brief Shared memory cache, backed by a memory mapped file.
+ *
+ * Entries are serialized and written into fixed size slots in a memory
+ * mapped file.  Slots are located by open addressing on a hash of the
+ * key, within a small probe window.
+ *
+ * Each slot carries a sequence number, which is odd whilst the slot is
+ * being written.  Writers claim a slot by atomically incrementing the
+ * sequence number from an even value, and readers copy the slot then
+ * check the sequence number hasn't changed.  No locks are held, so
+ * multiple server processes on the same host may map the same file.
+ *
+ * As the file persists, the cache survives server restarts.
+ *
+ * Each process holds a shared lock on the file whilst it's mapped.  Only
+ * a process which can get an exclusive lock, i.e. the only process
+ * using the file, may initialise it, or clear out slots left claimed by
+ * a writer which died.
+ *
+ * @copyright 2019 The FreeRADIUS server project
+ */
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/rad_assert.h>
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../../rlm_cache.h"
+#include "../../serialize.h"
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+#define CACHE_SHM_MAGIC		0x46524353	//!< "FRCS"
+#define CACHE_SHM_VERSION	1
+#define CACHE_SHM_PROBE		8		//!< How many slots we search for a key.
+#define CACHE_SHM_RETRIES	4		//!< How many times we retry a read which raced a write.
+
+/** Header at the start of the cache file
+ *
+ * Used to validate the file matches our configuration before we use it.
+ */
+typedef struct {
+	uint32_t		magic;		//!< Always #CACHE_SHM_MAGIC.
+	uint32_t		version;	//!< Format of the file.
+	uint32_t		num_slots;	//!< Number of slots following the header.
+	uint32_t		slot_size;	//!< Size of each slot, including its header.
+	uint8_t			pad[48];	//!< Keep slots cache line aligned.
+} rlm_cache_shm_header_t;
+
+/** A single entry in the cache file
+ *
+ */
+typedef struct {
+	_Atomic(uint32_t)	seq;		//!< Even when stable, odd whilst being written.
+	uint32_t		hash;		//!< Hash of the key.
+	uint32_t		key_len;	//!< Length of the key.  0 if the slot is empty.
+	uint32_t		data_len;	//!< Length of the serialized entry.
+	int64_t			created;	//!< When the entry was created.
+	int64_t			expires;	//!< When the entry expires.
+	uint8_t			data[];		//!< Key, followed by the serialized entry.
+} rlm_cache_shm_slot_t;
+
+typedef struct {
+	char const		*filename;	//!< File to map.
+	uint32_t		num_slots;	//!< How many entries the file holds.
+	uint32_t		slot_size;	//!< Maximum size of an entry.
+
+	int			fd;		//!< File descriptor of the cache file.
+	uint8_t			*map;		//!< Start of the mapping.
+	size_t			map_len;	//!< Length of the mapping.
+} rlm_cache_shm_t;
+
+static CONF_PARSER driver_config[] = {
+	{ FR_CONF_OFFSET("filename", FR_TYPE_FILE_OUTPUT | FR_TYPE_REQUIRED, rlm_cache_shm_t, filename) },
+	{ FR_CONF_OFFSET("slots", FR_TYPE_UINT32, rlm_cache_shm_t, num_slots), .dflt = "65536" },
+	{ FR_CONF_OFFSET("slot_size", FR_TYPE_UINT32, rlm_cache_shm_t, slot_size), .dflt = "1024" },
+	CONF_PARSER_TERMINATOR
+};
+
+/** Return a pointer to the slot at the specified index
+ *
+ */
+static inline rlm_cache_shm_slot_t *cache_slot(rlm_cache_shm_t const *driver, uint32_t idx)
+{
+	return (rlm_cache_shm_slot_t *)(driver->map + sizeof(rlm_cache_shm_header_t) +
+					((size_t)(idx % driver->num_slots) * driver->slot_size));
+}
+
+/** Take exclusive ownership of a slot
+ *
+ * @param[in] slot	to claim.
+ * @param[in] seq	Sequence number we expect the slot to have.
+ * @return
+ *	- true if we now own the slot.
+ *	- false if another writer got there first.
+ */
+static inline bool cache_slot_claim(rlm_cache_shm_slot_t *slot, uint32_t seq)
+{
+	if (seq & 0x01) return false;
+
+	return atomic_compare_exchange_strong_explicit(&slot->seq, &seq, seq + 1,
+						       memory_order_acquire, memory_order_relaxed);
+}
+
+/** Release a slot we previously claimed, publishing any changes
+ *
+ */
+static inline void cache_slot_release(rlm_cache_shm_slot_t *slot)
+{
+	atomic_fetch_add_explicit(&slot->seq, 1, memory_order_release);
+}
+
+/** Read a consistent copy of a slot
+ *
+ * @param[out] out	Where to copy the slot.  Must be slot_size bytes.
+ * @param[out] seq	The sequence number of the copy.
+ * @param[in] slot	to read.
+ * @param[in] len	How many bytes to copy.
+ * @return
+ *	- true if the copy is consistent.
+ *	- false if the slot was being written.
+ */
+static bool cache_slot_read(rlm_cache_shm_slot_t *out, uint32_t *seq, rlm_cache_shm_slot_t *slot, size_t len)
+{
+	int i;
+
+	for (i = 0; i < CACHE_SHM_RETRIES; i++) {
+		uint32_t before, after;
+
+		before = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		if (before & 0x01) continue;
+
+		memcpy(((uint8_t *)out) + sizeof(out->seq), ((uint8_t *)slot) + sizeof(slot->seq),
+		       len - sizeof(slot->seq));
+
+		atomic_thread_fence(memory_order_acquire);
+		after = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+		if (before != after) continue;
+
+		*seq = before;
+		return true;
+	}
+
+	return false;
+}
+
+/** Check whether a slot copy holds the specified key
+ *
+ */
+static inline bool cache_slot_match(rlm_cache_shm_t const *driver, rlm_cache_shm_slot_t const *slot,
+				    uint32_t hash, uint8_t const *key, size_t key_len)
+{
+	if ((slot->key_len != key_len) || (slot->hash != hash)) return false;
+	if ((sizeof(*slot) + slot->key_len + slot->data_len) > driver->slot_size) return false;
+
+	return (memcmp(slot->data, key, key_len) == 0);
+}
+
+/** Cleanup a cache_shm instance
+ *
+ */
+static int mod_detach(void *instance)
+{
+	rlm_cache_shm_t *driver = talloc_get_type_abort(instance, rlm_cache_shm_t);
+
+	if (driver->map) munmap(driver->map, driver->map_len);
+	if (driver->fd >= 0) close(driver->fd);
+
+	return 0;
+}
+
+/** Open and map the cache file, initialising it if required
+ *
+ * @copydetails cache_instantiate_t
+ */
+static int mod_instantiate(rlm_cache_config_t const *config, void *instance, UNUSED CONF_SECTION *conf)
+{
+	rlm_cache_shm_t		*driver = talloc_get_type_abort(instance, rlm_cache_shm_t);
+	rlm_cache_shm_header_t	*hdr;
+	struct stat		st;
+	bool			init = false, exclusive = true;
+	uint32_t		i;
+
+	driver->fd = -1;
+
+	if (config->max_entries > 0) {
+		ERROR("max_entries is not supported by this driver");
+		return -1;
+	}
+
+	FR_INTEGER_BOUND_CHECK("slots", driver->num_slots, >=, CACHE_SHM_PROBE);
+	FR_INTEGER_BOUND_CHECK("slot_size", driver->slot_size, >=, 128);
+	FR_INTEGER_BOUND_CHECK("slot_size", driver->slot_size, <=, 65536);
+
+	/*
+	 *	Keep the slots aligned for the atomic sequence numbers.
+	 */
+	driver->slot_size = (driver->slot_size + 63) & ~63;
+	driver->map_len = sizeof(rlm_cache_shm_header_t) + ((size_t)driver->num_slots * driver->slot_size);
+
+	driver->fd = open(driver->filename, O_RDWR | O_CREAT, 0600);
+	if (driver->fd < 0) {
+		ERROR("Failed opening \"%s\": %s", driver->filename, fr_syserror(errno));
+		return -1;
+	}
+
+	/*
+	 *	If no other process has the file open, we get an
+	 *	exclusive lock, and can (re)initialise it.
+	 *
+	 *	Otherwise wait for a shared lock, which also waits for
+	 *	any process which is still initialising the file.
+	 */
+	if (flock(driver->fd, LOCK_EX | LOCK_NB) < 0) {
+		if ((errno != EWOULDBLOCK) || (flock(driver->fd, LOCK_SH) < 0)) {
+			ERROR("Failed locking \"%s\": %s", driver->filename, fr_syserror(errno));
+			return -1;
+		}
+		exclusive = false;
+	}
+
+	if (fstat(driver->fd, &st) < 0) {
+		ERROR("Failed getting size of \"%s\": %s", driver->filename, fr_syserror(errno));
+		return -1;
+	}
+
+	if ((size_t)st.st_size != driver->map_len) {
+		if (!exclusive) {
+			ERROR("Cache file \"%s\" is in use by another process with a different configuration",
+			      driver->filename);
+			return -1;
+		}
+
+		if ((st.st_size != 0) && (ftruncate(driver->fd, 0) < 0)) {
+			ERROR("Failed truncating \"%s\": %s", driver->filename, fr_syserror(errno));
+			return -1;
+		}
+		if (ftruncate(driver->fd, driver->map_len) < 0) {
+			ERROR("Failed resizing \"%s\": %s", driver->filename, fr_syserror(errno));
+			return -1;
+		}
+		init = true;
+	}
+
+	driver->map = mmap(NULL, driver->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, driver->fd, 0);
+	if (driver->map == MAP_FAILED) {
+		driver->map = NULL;
+		ERROR("Failed mapping \"%s\": %s", driver->filename, fr_syserror(errno));
+		return -1;
+	}
+
+	hdr = (rlm_cache_shm_header_t *)driver->map;
+	if (!init && ((hdr->magic != CACHE_SHM_MAGIC) || (hdr->version != CACHE_SHM_VERSION) ||
+		      (hdr->num_slots != driver->num_slots) || (hdr->slot_size != driver->slot_size))) {
+		if (!exclusive) {
+			ERROR("Cache file \"%s\" is in use by another process with a different configuration",
+			      driver->filename);
+			return -1;
+		}
+
+		WARN("Cache file \"%s\" does not match configuration, discarding existing entries", driver->filename);
+		memset(driver->map, 0, driver->map_len);
+		init = true;
+	}
+
+	if (init) {
+		hdr->magic = CACHE_SHM_MAGIC;
+		hdr->version = CACHE_SHM_VERSION;
+		hdr->num_slots = driver->num_slots;
+		hdr->slot_size = driver->slot_size;
+	} else if (exclusive) {
+		/*
+		 *	A process may have died whilst writing a slot,
+		 *	leaving it permanently claimed.  As no other
+		 *	process has the file mapped, any odd sequence
+		 *	numbers must be from dead writers.  Clear out
+		 *	those slots.
+		 */
+		for (i = 0; i < driver->num_slots; i++) {
+			rlm_cache_shm_slot_t *slot = cache_slot(driver, i);
+			uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+
+			if (!(seq & 0x01)) continue;
+
+			slot->key_len = 0;
+			atomic_store_explicit(&slot->seq, seq + 1, memory_order_release);
+		}
+		INFO("Using existing cache file \"%s\"", driver->filename);
+	} else {
+		INFO("Using cache file \"%s\", shared with another process", driver->filename);
+	}
+
+	/*
+	 *	Hold a shared lock for as long as we have the file
+	 *	mapped.  It's released when the file is closed.
+	 */
+	if (exclusive && (flock(driver->fd, LOCK_SH) < 0)) {
+		ERROR("Failed locking \"%s\": %s", driver->filename, fr_syserror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Free an entry we deserialized
+ *
+ * @copydetails cache_entry_free_t
+ */
+static void cache_entry_free(rlm_cache_entry_t *c)
+{
+	talloc_free(c);
+}
+
+/** Locate a cache entry in the shared memory segment
+ *
+ * @copydetails cache_entry_find_t
+ */
+static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
+				       UNUSED rlm_cache_config_t const *config, void *instance,
+				       REQUEST *request, UNUSED void *handle, uint8_t const *key, size_t key_len)
+{
+	rlm_cache_shm_t		*driver = talloc_get_type_abort(instance, rlm_cache_shm_t);
+	rlm_cache_shm_slot_t	*copy;
+	rlm_cache_entry_t	*c;
+	uint32_t		hash, seq, i;
+
+	hash = fr_hash(key, key_len);
+
+	copy = talloc_size(NULL, driver->slot_size);
+	if (!copy) return CACHE_ERROR;
+
+	for (i = 0; i < CACHE_SHM_PROBE; i++) {
+		rlm_cache_shm_slot_t *slot = cache_slot(driver, hash + i);
+
+		/*
+		 *	Cheap check before we copy the whole slot.
+		 */
+		if ((slot->hash != hash) || (slot->key_len != key_len)) continue;
+
+		if (!cache_slot_read(copy, &seq, slot, driver->slot_size)) continue;
+		if (!cache_slot_match(driver, copy, hash, key, key_len)) continue;
+
+		if (copy->expires < request->packet->timestamp.tv_sec) break;
+
+		c = talloc_zero(NULL, rlm_cache_entry_t);
+		if (!c) break;
+
+		/*
+		 *	cache_deserialize expects a \n terminated buffer
+		 *	it can write to, which our copy is.
+		 */
+		if (cache_deserialize(c, request->dict, (char *)copy->data + copy->key_len, copy->data_len) < 0) {
+			RPERROR("Invalid entry");
+			talloc_free(c);
+			talloc_free(copy);
+			return CACHE_ERROR;
+		}
+		c->key = talloc_memdup(c, key, key_len);
+		c->key_len = key_len;
+		talloc_free(copy);
+
+		RDEBUG3("Found entry in slot %u", (hash + i) % driver->num_slots);
+
+		*out = c;
+		return CACHE_OK;
+	}
+	talloc_free(copy);
+
+	return CACHE_MISS;
+}
+
+/** Clear any slots in the probe window holding the specified key
+ *
+ * @param[in] driver	instance.
+ * @param[in] hash	of the key.
+ * @param[in] key	to remove.
+ * @param[in] key_len	of the key.
+ * @param[in] skip	Slot to leave alone (the one we just wrote).  May be NULL.
+ * @return The number of slots cleared.
+ */
+static int cache_slots_clear(rlm_cache_shm_t *driver, uint32_t hash, uint8_t const *key, size_t key_len,
+			     rlm_cache_shm_slot_t *skip)
+{
+	uint32_t	i;
+	int		cleared = 0;
+
+	for (i = 0; i < CACHE_SHM_PROBE; i++) {
+		rlm_cache_shm_slot_t	*slot = cache_slot(driver, hash + i);
+		uint32_t		seq;
+
+		if (slot == skip) continue;
+		if ((slot->hash != hash) || (slot->key_len != key_len)) continue;
+
+		seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		if (!cache_slot_claim(slot, seq)) continue;
+
+		if (cache_slot_match(driver, slot, hash, key, key_len)) {
+			slot->key_len = 0;
+			cleared++;
+		}
+		cache_slot_release(slot);
+	}
+
+	return cleared;
+}
+
+/** Insert a new entry into the shared memory segment
+ *
+ * Overwrites any existing entry with the same key, then the first empty or
+ * expired slot, then the slot closest to expiry.
+ *
+ * @copydetails cache_entry_insert_t
+ */
+static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config, void *instance,
+					 REQUEST *request, UNUSED void *handle, rlm_cache_entry_t const *c)
+{
+	rlm_cache_shm_t		*driver = talloc_get_type_abort(instance, rlm_cache_shm_t);
+	rlm_cache_shm_slot_t	*slot = NULL;
+	TALLOC_CTX		*pool;
+	char			*to_store;
+	size_t			data_len;
+	uint32_t		hash, i;
+	int			attempt;
+
+	pool = talloc_pool(NULL, 1024);
+	if (!pool) return CACHE_ERROR;
+
+	if (cache_serialize(pool, &to_store, c) < 0) {
+		RPERROR("Failed serializing entry");
+		talloc_free(pool);
+		return CACHE_ERROR;
+	}
+	data_len = talloc_array_length(to_store) - 1;
+
+	if ((sizeof(*slot) + c->key_len + data_len) > driver->slot_size) {
+		REDEBUG("Entry too large (%zu bytes), increase 'slot_size' to at least %zu bytes",
+			c->key_len + data_len, sizeof(*slot) + c->key_len + data_len);
+		talloc_free(pool);
+		return CACHE_ERROR;
+	}
+
+	hash = fr_hash(c->key, c->key_len);
+
+	for (attempt = 0; attempt < CACHE_SHM_RETRIES; attempt++) {
+		rlm_cache_shm_slot_t	*best = NULL;
+		uint32_t		best_seq = 0;
+		int			best_rank = 0;	/* 3 = same key, 2 = empty, 1 = expired, 0 = live */
+		int64_t			best_expires = INT64_MAX;
+
+		/*
+		 *	Pick the best candidate slot without claiming anything.
+		 */
+		for (i = 0; i < CACHE_SHM_PROBE; i++) {
+			rlm_cache_shm_slot_t	*candidate = cache_slot(driver, hash + i);
+			uint32_t		seq = atomic_load_explicit(&candidate->seq, memory_order_acquire);
+			int			rank;
+
+			if (seq & 0x01) continue;
+
+			if (candidate->key_len == 0) {
+				rank = 2;
+			} else if ((candidate->hash == hash) && (candidate->key_len == c->key_len) &&
+				   (memcmp(candidate->data, c->key, c->key_len) == 0)) {
+				rank = 3;
+			} else if (candidate->expires < request->packet->timestamp.tv_sec) {
+				rank = 1;
+			} else {
+				rank = 0;
+			}
+
+			if (!best || (rank > best_rank) || ((rank == 0) && (best_rank == 0) &&
+							    (candidate->expires < best_expires))) {
+				best = candidate;
+				best_seq = seq;
+				best_rank = rank;
+				best_expires = candidate->expires;
+			}
+			if (rank == 3) break;
+		}
+
+		if (best && cache_slot_claim(best, best_seq)) {
+			slot = best;
+			break;
+		}
+	}
+
+	if (!slot) {
+		REDEBUG("Failed finding a free slot for entry");
+		talloc_free(pool);
+		return CACHE_ERROR;
+	}
+
+	slot->hash = hash;
+	slot->key_len = c->key_len;
+	slot->data_len = data_len;
+	slot->created = c->created;
+	slot->expires = c->expires;
+	memcpy(slot->data, c->key, c->key_len);
+	memcpy(slot->data + c->key_len, to_store, data_len);
+	cache_slot_release(slot);
+
+	talloc_free(pool);
+
+	/*
+	 *	Another writer may have inserted the same key
+	 *	into a different slot concurrently, or the entry
+	 *	may have been in a slot we didn't consider.
+	 */
+	cache_slots_clear(driver, hash, c->key, c->key_len, slot);
+
+	RDEBUG3("Wrote %zu bytes to slot %u", c->key_len + data_len,
+		(uint32_t)(((uint8_t *)slot - driver->map - sizeof(rlm_cache_shm_header_t)) / driver->slot_size));
+
+	return CACHE_OK;
+}
+
+/** Remove an entry from the shared memory segment
+ *
+ * @copydetails cache_entry_expire_t
+ */
+static cache_status_t cache_entry_expire(UNUSED rlm_cache_config_t const *config, void *instance,
+					 UNUSED REQUEST *request, UNUSED void *handle,
+					 uint8_t const *key, size_t key_len)
+{
+	rlm_cache_shm_t *driver = talloc_get_type_abort(instance, rlm_cache_shm_t);
+
+	if (cache_slots_clear(driver, fr_hash(key, key_len), key, key_len, NULL) == 0) return CACHE_MISS;
+
+	return CACHE_OK;
+}
+
+extern cache_driver_t rlm_cache_shm;
+cache_driver_t rlm_cache_shm = {
+	.name		= "rlm_cache_shm",
+	.magic		= RLM_MODULE_INIT,
+	.instantiate	= mod_instantiate,
+	.detach		= mod_detach,
+	.inst_size	= sizeof(rlm_cache_shm_t),
+	.config		= driver_config,
+
+	.free		= cache_entry_free,
+
+	.find		= cache_entry_find,
+	.insert		= cache_entry_insert,
+	.expire		= cache_entry_expire,
+};
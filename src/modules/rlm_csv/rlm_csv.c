@@ -29,6 +29,7 @@ RCSID("$Id$")
 #include <freeradius-devel/server/rad_assert.h>
 
 #include <freeradius-devel/server/map_proc.h>
+#include <freeradius-devel/util/file_index.h>
 
 static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST *request,
 				fr_value_box_t **key, vp_map_t const *maps);
@@ -46,6 +47,7 @@ typedef struct {
 	char const	*delimiter;
 	char const	*header;
 	char const	*key;
+	uint32_t	reload_interval;
 
 	int		num_fields;
 	int		used_fields;
@@ -53,9 +55,18 @@ typedef struct {
 
 	char const     	**field_names;
 	int		*field_offsets; /* field X from the file maps to array entry Y here */
-	rbtree_t	*tree;
+	fr_reload_t	*reload;	/* rlm_csv_data_t, rebuilt when the file changes */
 } rlm_csv_t;
 
+/*
+ *	Either a tree built by parsing the file, or an index built
+ *	offline by radindex.
+ */
+typedef struct {
+	rbtree_t	*tree;		/* of rlm_csv_entry_t */
+	fr_file_index_t	*index;
+} rlm_csv_data_t;
+
 typedef struct {
 	struct rlm_csv_entry_t *next;
 	char const *key;
@@ -70,6 +81,7 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("delimiter", FR_TYPE_STRING | FR_TYPE_REQUIRED | FR_TYPE_NOT_EMPTY, rlm_csv_t, delimiter), .dflt = "," },
 	{ FR_CONF_OFFSET("header", FR_TYPE_STRING | FR_TYPE_REQUIRED | FR_TYPE_NOT_EMPTY, rlm_csv_t, header) },
 	{ FR_CONF_OFFSET("key_field", FR_TYPE_STRING | FR_TYPE_REQUIRED | FR_TYPE_NOT_EMPTY, rlm_csv_t, key) },
+	{ FR_CONF_OFFSET("reload_interval", FR_TYPE_UINT32, rlm_csv_t, reload_interval), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -81,100 +93,29 @@ static int csv_entry_cmp(void const *one, void const *two)
 	return strcmp(a->key, b->key);
 }
 
-/*
- *	Allow for quotation marks.
- */
-static bool buf2entry(rlm_csv_t *inst, char *buf, char **out)
-{
-	char *p, *q;
-
-	if (*buf != '"') {
-		*out = strchr(buf + 1, *inst->delimiter);
-
-		if (!*out) {	/* mash CR / LF */
-			for (p = buf + 1; *p != '\0'; p++) {
-				if (*p < ' ') {
-					*p = '\0';
-					break;
-				}
-			}
-		}
-
-		return true;
-	}
-
-	p = buf + 1;
-	q = buf;
-
-	while (*p) {
-		if (*p < ' ') {
-			*q = '\0';
-			*out = NULL;
-			return true;
-		}
-
-		/*
-		 *	Double quotes to single quotes.
-		 */
-		if ((*p == '"') && (p[1] == '"')) {
-			*(q++) = '"';
-			p += 2;
-			continue;
-		}
-
-		/*
-		 *	Double quotes and EOL mean we're done.
-		 */
-		if ((*p == '"') && (p[1] < ' ')) {
-			*(q++) = '\0';
-
-			*out = NULL;
-			return true;
-		}
-
-		/*
-		 *	Double quotes and delimiter: point to the delimiter.
-		 */
-		if ((*p == '"') && (p[1] == *inst->delimiter)) {
-			*(q++) = '\0';
-
-			*out = p + 1;
-			return true;
-		}
-
-		/*
-		 *	Everything else gets copied over verbatim
-		 */
-		*(q++) = *(p++);
-		*q = '\0';
-	}
-
-	return false;
-}
-
 /*
  *	Convert a buffer to a CSV entry
  */
-static rlm_csv_entry_t *file2csv(CONF_SECTION *conf, rlm_csv_t *inst, int lineno, char *buffer)
+static rlm_csv_entry_t *file2csv(rbtree_t *tree, rlm_csv_t const *inst, int lineno, char *buffer)
 {
 	rlm_csv_entry_t *e;
 	int i;
 	char *p, *q;
 
-	MEM(e = (rlm_csv_entry_t *)talloc_zero_array(inst->tree, uint8_t,
-						     sizeof(*e) + inst->used_fields + sizeof(e->data[0])));
+	MEM(e = (rlm_csv_entry_t *)talloc_zero_array(tree, uint8_t,
+						     sizeof(*e) + inst->used_fields * sizeof(e->data[0])));
 	talloc_set_type(e, rlm_csv_entry_t);
 
 	for (p = buffer, i = 0; p != NULL; p = q, i++) {
-		if (!buf2entry(inst, p, &q)) {
-			cf_log_err(conf, "Malformed entry in file %s line %d", inst->filename, lineno);
+		if (!fr_csv_field(&q, p, *inst->delimiter)) {
+			fr_strerror_printf("Malformed entry in file %s line %d", inst->filename, lineno);
 			return NULL;
 		}
 
 		if (q) *(q++) = '\0';
 
 		if (i >= inst->num_fields) {
-			cf_log_err(conf, "Too many fields at file %s line %d", inst->filename, lineno);
+			fr_strerror_printf("Too many fields at file %s line %d", inst->filename, lineno);
 			return NULL;
 		}
 
@@ -195,24 +136,104 @@ static rlm_csv_entry_t *file2csv(CONF_SECTION *conf, rlm_csv_t *inst, int lineno
 	}
 
 	if (i < inst->num_fields) {
-		cf_log_err(conf, "Too few fields at file %s line %d (%d < %d)", inst->filename, lineno, i, inst->num_fields);
+		fr_strerror_printf("Too few fields at file %s line %d (%d < %d)", inst->filename, lineno, i, inst->num_fields);
 		return NULL;
 	}
 
 	/*
 	 *	FIXME: Allow duplicate keys later.
 	 */
-	if (!rbtree_insert(inst->tree, e)) {
-		cf_log_err(conf, "Failed inserting entry for filename %s line %d: duplicate entry",
-			      inst->filename, lineno);
+	if (!rbtree_insert(tree, e)) {
+		fr_strerror_printf("Failed inserting entry for filename %s line %d: duplicate entry",
+				   inst->filename, lineno);
 		return NULL;
 	}
 
 	return e;
 }
 
+/*
+ *	Map an index built by radindex.  There's nothing to parse,
+ *	just check it has the same layout as the header.
+ */
+static void *csv_index_open(rlm_csv_data_t *data, rlm_csv_t const *inst, char const *filename)
+{
+	data->index = fr_file_index_open(data, filename);
+	if (!data->index) {
+		talloc_free(data);
+		return NULL;
+	}
 
-static int fieldname2offset(rlm_csv_t *inst, char const *field_name)
+	if (fr_file_index_num_fields(data->index) != (uint32_t)inst->num_fields) {
+		fr_strerror_printf("Index %s has %u fields, but the header has %d", filename,
+				   fr_file_index_num_fields(data->index), inst->num_fields);
+	error:
+		talloc_free(data);
+		return NULL;
+	}
+
+	if (fr_file_index_key_field(data->index) != (uint32_t)inst->key_field) {
+		fr_strerror_printf("Index %s is keyed on a different field to '%s'", filename, inst->key);
+		goto error;
+	}
+
+	return data;
+}
+
+/*
+ *	Read the file into a new tree.
+ */
+static void *csv_build(char const *filename, void *uctx)
+{
+	rlm_csv_t const *inst = uctx;
+	rlm_csv_data_t *data;
+	rbtree_t *tree;
+	FILE *fp;
+	int lineno;
+	char buffer[8192];
+
+	MEM(data = talloc_zero(NULL, rlm_csv_data_t));
+
+	if (fr_file_index_is_index(filename)) return csv_index_open(data, inst, filename);
+
+	tree = rbtree_talloc_create(data, csv_entry_cmp, rlm_csv_entry_t, NULL, 0);
+	if (!tree) {
+		fr_strerror_printf("Out of memory");
+		talloc_free(data);
+		return NULL;
+	}
+	data->tree = tree;
+
+	/*
+	 *	Read the file line by line.
+	 */
+	fp = fopen(filename, "r");
+	if (!fp) {
+		fr_strerror_printf("Error opening filename %s: %s", filename, fr_syserror(errno));
+		talloc_free(data);
+		return NULL;
+	}
+
+	lineno = 1;
+	while (fgets(buffer, sizeof(buffer), fp)) {
+		rlm_csv_entry_t *e;
+
+		e = file2csv(tree, inst, lineno, buffer);
+		if (!e) {
+			fclose(fp);
+			talloc_free(data);
+			return NULL;
+		}
+
+		lineno++;
+	}
+
+	fclose(fp);
+
+	return data;
+}
+
+static int fieldname2column(rlm_csv_t *inst, char const *field_name)
 {
 	int i;
 
@@ -223,14 +244,22 @@ static int fieldname2offset(rlm_csv_t *inst, char const *field_name)
 	 *	array is faster than more complex solutions.
 	 */
 	for (i = 0; i < inst->num_fields; i++) {
-		if (strcmp(field_name, inst->field_names[i]) == 0) {
-			return inst->field_offsets[i];
-		}
+		if (strcmp(field_name, inst->field_names[i]) == 0) return i;
 	}
 
 	return -1;
 }
 
+static int fieldname2offset(rlm_csv_t *inst, char const *field_name)
+{
+	int i;
+
+	i = fieldname2column(inst, field_name);
+	if (i < 0) return -1;
+
+	return inst->field_offsets[i];
+}
+
 /*
  *	Verify the result of the map.
  */
@@ -277,9 +306,6 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 	char const *p;
 	char *q;
 	char *header;
-	FILE *fp;
-	int lineno;
-	char buffer[8192];
 
 	inst->name = cf_section_name2(conf);
 	if (!inst->name) inst->name = cf_section_name1(conf);
@@ -366,38 +392,27 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
-	inst->tree = rbtree_talloc_create(inst, csv_entry_cmp, rlm_csv_entry_t, NULL, 0);
-	if (!inst->tree) goto oom;
-
 	/*
-	 *	Read the file line by line.
+	 *	And register the map function.
 	 */
-	fp = fopen(inst->filename, "r");
-	if (!fp) {
-		cf_log_err(conf, "Error opening filename %s: %s", inst->filename, fr_syserror(errno));
-		return -1;
-	}
+	map_proc_register(inst, inst->name, mod_map_proc, csv_map_verify, 0);
 
-	lineno = 1;
-	while (fgets(buffer, sizeof(buffer), fp)) {
-		rlm_csv_entry_t *e;
+	return 0;
+}
 
-		e = file2csv(conf, inst, lineno, buffer);
-		if (!e) {
-			fclose(fp);
-			return -1;
-		}
+/*
+ *	Read the file, and re-read it whenever it changes.
+ */
+static int mod_instantiate(void *instance, CONF_SECTION *conf)
+{
+	rlm_csv_t *inst = instance;
 
-		lineno++;
+	inst->reload = fr_reload_alloc(inst, inst->name, inst->filename, inst->reload_interval, csv_build, inst);
+	if (!inst->reload) {
+		cf_log_err(conf, "%s", fr_strerror());
+		return -1;
 	}
 
-	fclose(fp);
-
-	/*
-	 *	And register the map function.
-	 */
-	map_proc_register(inst, inst->name, mod_map_proc, csv_map_verify, 0);
-
 	return 0;
 }
 
@@ -441,7 +456,7 @@ static int csv_map_getvalue(TALLOC_CTX *ctx, VALUE_PAIR **out, REQUEST *request,
 	vp = fr_pair_afrom_da(ctx, da);
 	rad_assert(vp);
 
-	if (fr_pair_value_from_str(vp, str, talloc_array_length(str) - 1, '\0', true) < 0) {
+	if (fr_pair_value_from_str(vp, str, strlen(str), '\0', true) < 0) {
 		RWDEBUG("Failed parsing value \"%pV\" for attribute %s: %s", fr_box_strvalue_buffer(str),
 			map->lhs->tmpl_da->name, fr_strerror());
 		talloc_free(vp);
@@ -473,7 +488,9 @@ static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST
 {
 	rlm_rcode_t		rcode = RLM_MODULE_UPDATED;
 	rlm_csv_t		*inst = talloc_get_type_abort(mod_inst, rlm_csv_t);
-	rlm_csv_entry_t		*e;
+	rlm_csv_data_t		*data;
+	rlm_csv_entry_t		*e = NULL;
+	char const		**fields = NULL;
 	vp_map_t const		*map;
 
 	if (!*key) {
@@ -486,10 +503,38 @@ static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST
 		return RLM_MODULE_FAIL;
 	}
 
-	e = rbtree_finddata(inst->tree, &(rlm_csv_entry_t){ .key = (*key)->vb_strvalue });
-	if (!e) {
-		rcode = RLM_MODULE_NOOP;
-		goto finish;
+	/*
+	 *	Entries remain valid until the data is released, even
+	 *	if the file is reloaded in the mean time.
+	 */
+	data = fr_reload_acquire(inst->reload);
+
+	if (data->index) {
+		size_t first;
+
+		/*
+		 *	The strings point directly into the mapped
+		 *	file, so nothing is copied.
+		 *
+		 *	FIXME: Allow duplicate keys later.
+		 */
+		if (!fr_file_index_find(&first, data->index, (*key)->vb_strvalue, (*key)->vb_length)) {
+			rcode = RLM_MODULE_NOOP;
+			goto finish;
+		}
+
+		MEM(fields = talloc_array(request, char const *, inst->num_fields));
+		if (fr_file_index_fields(fields, data->index, first) < 0) {
+			RPEDEBUG("Failed reading %s", inst->filename);
+			rcode = RLM_MODULE_FAIL;
+			goto finish;
+		}
+	} else {
+		e = rbtree_finddata(data->tree, &(rlm_csv_entry_t){ .key = (*key)->vb_strvalue });
+		if (!e) {
+			rcode = RLM_MODULE_NOOP;
+			goto finish;
+		}
 	}
 
 	RINDENT();
@@ -498,6 +543,7 @@ static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST
 	     map = map->next) {
 		int field;
 		char *field_name;
+		char *value;
 
 		/*
 		 *	Avoid memory allocations if possible.
@@ -513,7 +559,8 @@ static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST
 			memcpy(&field_name, &map->rhs->name, sizeof(field_name)); /* const */
 		}
 
-		field = fieldname2offset(inst, field_name);
+		field = fieldname2column(inst, field_name);
+		if ((field >= 0) && !fields) field = inst->field_offsets[field];
 
 		if (field_name != map->rhs->name) talloc_free(field_name);
 
@@ -528,7 +575,14 @@ static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST
 		 *	Pass the raw data to the callback, which will
 		 *	create the VP and add it to the map.
 		 */
-		if (map_to_request(request, map, csv_map_getvalue, e->data[field]) < 0) {
+		if (fields) {
+			memcpy(&value, &fields[field], sizeof(value)); /* const */
+		} else {
+			value = e->data[field];
+		}
+		if (!value) continue;
+
+		if (map_to_request(request, map, csv_map_getvalue, value) < 0) {
 			REXDENT();
 			rcode = RLM_MODULE_FAIL;
 			goto finish;
@@ -538,6 +592,9 @@ static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST
 	REXDENT();
 
 finish:
+	fr_reload_release(inst->reload);
+	talloc_free(fields);
+
 	return rcode;
 }
 
@@ -549,4 +606,5 @@ rad_module_t rlm_csv = {
 	.inst_size	= sizeof(rlm_csv_t),
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
+	.instantiate	= mod_instantiate,
 };
@@ -30,6 +30,7 @@ RCSID("$Id$")
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/server/rad_assert.h>
 #include <freeradius-devel/server/exfile.h>
+#include <freeradius-devel/server/detail.h>
 
 #include <ctype.h>
 #include <fcntl.h>
@@ -56,6 +57,8 @@ typedef struct {
 	char const	*group;		//!< Group to use for new files.
 
 	char const	*header;	//!< Header format.
+	char const	*format;	//!< "text" or "binary".
+	bool		binary;		//!< Write binary records.
 	bool		locking;	//!< Whether the file should be locked.
 
 	bool		log_srcdst;	//!< Add IP src/dst attributes to entries.
@@ -66,17 +69,22 @@ typedef struct {
 
 	exfile_t    	*ef;		//!< Log file handler
 
+	exfile_batch_conf_t batch_conf;	//!< Batch writer configuration.
+	exfile_batch_t	*batch;		//!< Writes records from a dedicated thread.
+
 	fr_hash_table_t *ht;		//!< Holds suppressed attributes.
 } rlm_detail_t;
 
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("filename", FR_TYPE_FILE_OUTPUT | FR_TYPE_REQUIRED | FR_TYPE_XLAT, rlm_detail_t, filename), .dflt = "%A/%{Packet-Src-IP-Address}/detail" },
 	{ FR_CONF_OFFSET("header", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_detail_t, header), .dflt = "%t" },
+	{ FR_CONF_OFFSET("format", FR_TYPE_STRING, rlm_detail_t, format), .dflt = "text" },
 	{ FR_CONF_OFFSET("permissions", FR_TYPE_UINT32, rlm_detail_t, perm), .dflt = "0600" },
 	{ FR_CONF_OFFSET("group", FR_TYPE_STRING, rlm_detail_t, group) },
 	{ FR_CONF_OFFSET("locking", FR_TYPE_BOOL, rlm_detail_t, locking), .dflt = "no" },
 	{ FR_CONF_OFFSET("escape_filenames", FR_TYPE_BOOL, rlm_detail_t, escape), .dflt = "no" },
 	{ FR_CONF_OFFSET("log_packet_header", FR_TYPE_BOOL, rlm_detail_t, log_srcdst), .dflt = "no" },
+	{ FR_CONF_OFFSET("batch", FR_TYPE_SUBSECTION, rlm_detail_t, batch_conf), .subcs = (void const *) exfile_batch_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -160,12 +168,38 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		inst->escape_func = rad_filename_make_safe;
 	}
 
+	if (strcmp(inst->format, "binary") == 0) {
+		inst->binary = true;
+	} else if (strcmp(inst->format, "text") != 0) {
+		cf_log_err(conf, "Invalid value \"%s\" for 'format', must be \"text\" or \"binary\"", inst->format);
+		return -1;
+	}
+
 	inst->ef = module_exfile_init(inst, conf, 256, 30, inst->locking, NULL, NULL);
 	if (!inst->ef) {
 		cf_log_err(conf, "Failed creating log file context");
 		return -1;
 	}
 
+	/*
+	 *	Text entries are formatted in memory before being
+	 *	queued.  Binary entries always are.
+	 */
+#ifndef HAVE_OPEN_MEMSTREAM
+	if (inst->batch_conf.enabled && !inst->binary) {
+		cf_log_warn(conf, "Ignoring \"batch\" - open_memstream() is not available on this system");
+		inst->batch_conf.enabled = false;
+	}
+#endif
+
+	if (inst->batch_conf.enabled) {
+		inst->batch = exfile_batch_alloc(inst, inst->ef, &inst->batch_conf);
+		if (!inst->batch) {
+			cf_log_perr(conf, "Failed creating batch writer");
+			return -1;
+		}
+	}
+
 	/*
 	 *	Suppress certain attributes.
 	 */
@@ -377,17 +411,105 @@ static int detail_write(FILE *out, rlm_detail_t const *inst, REQUEST *request, R
 	return 0;
 }
 
+/** Encode a single detail entry as a binary record
+ *
+ * The same attributes are written as for text entries, but the
+ * header, addresses and timestamp are in the fixed record header.
+ *
+ * @param[out] out Where to write the record.  NULL if the packet was empty.
+ * @param[out] out_len Length of the record.
+ * @param[in] inst Instance of rlm_detail.
+ * @param[in] request The current request.
+ * @param[in] packet associated with the request (request, reply, proxy-request, proxy-reply...).
+ * @param[in] compat Write out entry in compatibility mode.
+ */
+static int detail_write_binary(uint8_t **out, size_t *out_len, rlm_detail_t const *inst, REQUEST *request,
+			       RADIUS_PACKET *packet, bool compat)
+{
+	VALUE_PAIR	*vp;
+	fr_cursor_t	cursor;
+	uint8_t		*record;
+	size_t		len;
+
+	*out = NULL;
+
+	if (!packet->vps) {
+		RWDEBUG("Skipping empty packet");
+		return 0;
+	}
+
+	record = fr_detail_binary_alloc(request, &len, packet, &request->packet->timestamp);
+	if (!record) {
+	oom:
+		RERROR("Out of memory");
+		talloc_free(record);
+		return -1;
+	}
+
+	if (!compat) {
+		VALUE_PAIR type_vp;
+
+		memset(&type_vp, 0, sizeof(type_vp));
+		type_vp.da = attr_packet_type;
+		fr_value_box_shallow(&type_vp.data, (uint32_t) packet->code, true);
+
+		if (fr_detail_binary_encode_pair(&record, &len, &type_vp) < 0) goto oom;
+	}
+
+	for (vp = fr_cursor_init(&cursor, &packet->vps);
+	     vp;
+	     vp = fr_cursor_next(&cursor)) {
+		if (inst->ht && fr_hash_table_finddata(inst->ht, vp->da)) continue;
+
+		if (compat && (vp->da == attr_user_password)) continue;
+
+		if (fr_detail_binary_encode_pair(&record, &len, vp) < 0) goto oom;
+	}
+
+	fr_detail_binary_finalise(record, len);
+
+	*out = record;
+	*out_len = len;
+
+	return 0;
+}
+
+/** Called when the batch writer has written the entry
+ *
+ */
+static rlm_rcode_t detail_batch_resume(REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *rctx)
+{
+	if (exfile_batch_wait_result(request, rctx) < 0) return RLM_MODULE_FAIL;
+
+	return RLM_MODULE_OK;
+}
+
+/** Stop waiting for the batch writer if the request is cancelled
+ *
+ */
+static void detail_batch_signal(REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *rctx,
+				fr_state_signal_t action)
+{
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	exfile_batch_wait_cancel(request, rctx);
+}
+
 /*
  *	Do detail, compatible with old accounting
  */
-static rlm_rcode_t CC_HINT(nonnull) detail_do(void const *instance, REQUEST *request,
-					      RADIUS_PACKET *packet, bool compat)
+static rlm_rcode_t CC_HINT(nonnull(1,2,3)) detail_do(void const *instance, REQUEST *request,
+						     RADIUS_PACKET *packet, bool compat,
+						     fr_unlang_module_resume_t resume)
 {
 	int		outfd, dupfd;
 	char		buffer[DIRLEN];
 
 	FILE		*outfp;
 
+	uint8_t		*binary = NULL;
+	size_t		binary_len = 0;
+
 #ifdef HAVE_GRP_H
 	gid_t		gid;
 	char		*endptr;
@@ -406,9 +528,77 @@ static rlm_rcode_t CC_HINT(nonnull) detail_do(void const *instance, REQUEST *req
 
 	RDEBUG2("%s expands to %s", inst->filename, buffer);
 
+	if (inst->binary) {
+		if (detail_write_binary(&binary, &binary_len, inst, request, packet, compat) < 0) return RLM_MODULE_FAIL;
+		if (!binary) return RLM_MODULE_OK;
+	}
+
+	/*
+	 *	Format the record in memory, and queue it for the
+	 *	batch writer.
+	 */
+	if (inst->batch) {
+		char			*record = NULL;
+		struct iovec		vector;
+		exfile_batch_entry_t	*wait;
+		gid_t			group = -1;
+		int			ret;
+
+		if (binary) {
+			vector.iov_base = binary;
+			vector.iov_len = binary_len;
+		} else {
+#ifdef HAVE_OPEN_MEMSTREAM
+			size_t record_len = 0;
+
+			outfp = open_memstream(&record, &record_len);
+			if (!outfp) {
+				RERROR("Failed allocating record buffer: %s", fr_syserror(errno));
+				return RLM_MODULE_FAIL;
+			}
+
+			ret = detail_write(outfp, inst, request, packet, compat);
+			fclose(outfp);
+			if (ret < 0) {
+				free(record);
+				return RLM_MODULE_FAIL;
+			}
+
+			vector.iov_base = record;
+			vector.iov_len = record_len;
+#else
+			rad_assert(0);	/* batch is only enabled for binary entries */
+			return RLM_MODULE_FAIL;
+#endif
+		}
+
+		/*
+		 *	The file may not exist until the writer
+		 *	thread gets to it, so it changes the group.
+		 */
+		if (inst->group != NULL) {
+			gid = strtol(inst->group, &endptr, 10);
+			if ((*endptr != '\0') && (rad_getgid(request, &gid, inst->group) < 0)) {
+				RDEBUG2("Unable to find system group '%s'", inst->group);
+			} else {
+				group = gid;
+			}
+		}
+
+		ret = exfile_batch_writev(&wait, inst->batch, request, buffer, inst->perm, group, &vector, 1);
+		free(record);
+		talloc_free(binary);
+		if (ret < 0) return RLM_MODULE_FAIL;
+
+		if (wait) return unlang_module_yield(request, resume, detail_batch_signal, wait);
+
+		return RLM_MODULE_OK;
+	}
+
 	outfd = exfile_open(inst->ef, request, buffer, inst->perm);
 	if (outfd < 0) {
 		RPERROR("Couldn't open file %s", buffer);
+		talloc_free(binary);
 		/* coverity[missing_unlock] */
 		return RLM_MODULE_FAIL;
 	}
@@ -428,6 +618,25 @@ static rlm_rcode_t CC_HINT(nonnull) detail_do(void const *instance, REQUEST *req
 	}
 
 skip_group:
+	/*
+	 *	Binary records are written with one write(), so they
+	 *	don't need buffering.
+	 */
+	if (binary) {
+		ssize_t slen;
+
+		slen = write(outfd, binary, binary_len);
+		talloc_free(binary);
+		exfile_close(inst->ef, request, outfd);
+
+		if (slen < 0) {
+			RERROR("Failed writing to detail file: %s", fr_syserror(errno));
+			return RLM_MODULE_FAIL;
+		}
+
+		return RLM_MODULE_OK;
+	}
+
 	outfp = NULL;
 	dupfd = dup(outfd);
 	if (dupfd < 0) {
@@ -465,7 +674,7 @@ skip_group:
  */
 static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, UNUSED void *thread, REQUEST *request)
 {
-	return detail_do(instance, request, request->packet, true);
+	return detail_do(instance, request, request->packet, true, detail_batch_resume);
 }
 
 /*
@@ -473,7 +682,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, UNUSED void *
  */
 static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, UNUSED void *thread, REQUEST *request)
 {
-	return detail_do(instance, request, request->packet, false);
+	return detail_do(instance, request, request->packet, false, detail_batch_resume);
 }
 
 /*
@@ -481,7 +690,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, UNUSED void *t
  */
 static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, UNUSED void *thread, REQUEST *request)
 {
-	return detail_do(instance, request, request->reply, false);
+	return detail_do(instance, request, request->reply, false, detail_batch_resume);
 }
 
 #ifdef WITH_COA
@@ -490,7 +699,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, UNUSED void *t
  */
 static rlm_rcode_t CC_HINT(nonnull) mod_recv_coa(void *instance, UNUSED void *thread, REQUEST *request)
 {
-	return detail_do(instance, request, request->packet, false);
+	return detail_do(instance, request, request->packet, false, detail_batch_resume);
 }
 
 /*
@@ -498,7 +707,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_recv_coa(void *instance, UNUSED void *th
  */
 static rlm_rcode_t CC_HINT(nonnull) mod_send_coa(void *instance, UNUSED void *thread, REQUEST *request)
 {
-	return detail_do(instance, request, request->reply, false);
+	return detail_do(instance, request, request->reply, false, detail_batch_resume);
 }
 #endif
 
@@ -508,33 +717,47 @@ static rlm_rcode_t CC_HINT(nonnull) mod_send_coa(void *instance, UNUSED void *th
 #ifdef WITH_PROXY
 static rlm_rcode_t CC_HINT(nonnull) mod_pre_proxy(void *instance, UNUSED void *thread, REQUEST *request)
 {
-	return detail_do(instance, request, request->proxy->packet, false);
+	return detail_do(instance, request, request->proxy->packet, false, detail_batch_resume);
 }
 
 
+/*
+ *	Post-Proxy-Type = Fail, once the batch writer has written the entry.
+ */
+static rlm_rcode_t mod_post_proxy_resume(REQUEST *request, void *instance, void *thread, void *rctx)
+{
+	rlm_rcode_t rcode;
+
+	rcode = detail_batch_resume(request, instance, thread, rctx);
+	if (rcode == RLM_MODULE_OK) {
+		request->reply->code = FR_CODE_ACCOUNTING_RESPONSE;
+	}
+	return rcode;
+}
+
 /*
  *	Outgoing Access-Request Reply - write the detail files.
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_post_proxy(void *instance, void *thread, REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull) mod_post_proxy(void *instance, UNUSED void *thread, REQUEST *request)
 {
 	/*
 	 *	No reply: we must be doing Post-Proxy-Type = Fail.
 	 *
-	 *	Note that we just call the normal accounting function,
-	 *	to minimize the amount of code, and to highlight that
-	 *	it's doing normal accounting.
+	 *	Note that we write the same entry as the normal
+	 *	accounting function, to highlight that it's doing
+	 *	normal accounting.
 	 */
 	if (!request->proxy->reply) {
 		rlm_rcode_t rcode;
 
-		rcode = mod_accounting(instance, thread, request);
+		rcode = detail_do(instance, request, request->packet, true, mod_post_proxy_resume);
 		if (rcode == RLM_MODULE_OK) {
 			request->reply->code = FR_CODE_ACCOUNTING_RESPONSE;
 		}
 		return rcode;
 	}
 
-	return detail_do(instance, request, request->proxy->reply, false);
+	return detail_do(instance, request, request->proxy->reply, false, detail_batch_resume);
 }
 #endif
 
@@ -438,10 +438,25 @@ finish:
  */
 static rlm_rcode_t mod_authenticate_result_async(REQUEST *request, void *instance, void *thread, void *uctx)
 {
+	rlm_eap_t	*inst = talloc_get_type_abort(instance, rlm_eap_t);
 	eap_session_t	*eap_session = talloc_get_type_abort(uctx, eap_session_t);
-	rlm_rcode_t	result = unlang_stack_result(request);
+	rlm_rcode_t	result;
+
+	/*
+	 *	The submodule was waiting on something external
+	 *	(like an async crypto engine), call it again so
+	 *	it can finish processing this round.
+	 */
+	if (eap_session->process_pending) {
+		eap_session->process_pending = false;
+
+		result = eap_session->process(inst->methods[eap_session->type].submodule_inst->data, eap_session);
+		if (result == RLM_MODULE_YIELD) return RLM_MODULE_YIELD;
+	} else {
+		result = unlang_stack_result(request);
+	}
 
-	return mod_authenticate_result(request, instance, thread, eap_session, result);
+	return mod_authenticate_result(request, inst, thread, eap_session, result);
 }
 
 /** Select the correct callback based on a response
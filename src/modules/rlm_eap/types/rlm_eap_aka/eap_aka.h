@@ -135,6 +135,8 @@ typedef struct {
 									///< for EAP-AKA'.
 
 	int  				aka_id;				//!< Packet ID. (replay protection).
+
+	fr_sim_vector_cache_t		*vector_cache;			//!< Pre-generated quintuplets, or NULL.
 } eap_aka_session_t;
 
 typedef struct {
@@ -145,4 +147,11 @@ typedef struct {
 	bool				protected_success;
 
 	eap_aka_actions_t		actions;			//!< Pre-compiled virtual server sections.
+
+	uint32_t			vector_batch_size;		//!< How many quintuplets to generate at once.
+	uint32_t			vector_max_entries;		//!< Maximum number of subscribers to cache
+									///< quintuplets for.
+	uint32_t			vector_lifetime;		//!< How long pre-generated quintuplets are
+									///< valid for.
+	fr_sim_vector_cache_t		*vector_cache;			//!< Pre-generated quintuplets.
 } rlm_eap_aka_t;
@@ -55,11 +55,19 @@ static int mod_section_compile(eap_aka_actions_t *actions, CONF_SECTION *server_
 static int virtual_server_parse(TALLOC_CTX *ctx, void *out, void *parent,
 				CONF_ITEM *ci, UNUSED CONF_PARSER const *rule);
 
+static CONF_PARSER vector_cache_config[] = {
+	{ FR_CONF_OFFSET("batch_size", FR_TYPE_UINT32, rlm_eap_aka_t, vector_batch_size), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, rlm_eap_aka_t, vector_max_entries), .dflt = "65536" },
+	{ FR_CONF_OFFSET("lifetime", FR_TYPE_UINT32, rlm_eap_aka_t, vector_lifetime), .dflt = "300" },
+	CONF_PARSER_TERMINATOR
+};
+
 static CONF_PARSER submodule_config[] = {
 	{ FR_CONF_OFFSET("network_name", FR_TYPE_STRING | FR_TYPE_REQUIRED, rlm_eap_aka_t, network_name ) },
 	{ FR_CONF_OFFSET("request_identity", FR_TYPE_BOOL, rlm_eap_aka_t, request_identity ), .dflt = "no" },
 	{ FR_CONF_OFFSET("protected_success", FR_TYPE_BOOL, rlm_eap_aka_t, protected_success ), .dflt = "no" },
 	{ FR_CONF_OFFSET("virtual_server", FR_TYPE_VOID, rlm_eap_aka_t, actions), .func = virtual_server_parse },
+	{ FR_CONF_POINTER("vector_cache", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) vector_cache_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -353,7 +361,8 @@ static int eap_aka_send_challenge(eap_session_t *eap_session)
 	 *	Get vectors from attribute or generate
 	 *	them using COMP128-* or Milenage.
 	 */
-	if (fr_sim_vector_umts_from_attrs(eap_session, request->control, &eap_aka_session->keys, &src) != 0) {
+	if (fr_sim_vector_umts_from_attrs(eap_session, request->control, &eap_aka_session->keys, &src,
+					  eap_aka_session->vector_cache) != 0) {
 	    	REDEBUG("Failed retrieving UMTS vectors");
 		return RLM_MODULE_FAIL;
 	}
@@ -1135,6 +1144,7 @@ static rlm_rcode_t mod_session_init(void *instance, eap_session_t *eap_session)
 	 */
 	eap_aka_session->request_identity = inst->request_identity;
 	eap_aka_session->send_result_ind = inst->protected_success;
+	eap_aka_session->vector_cache = inst->vector_cache;
 	eap_aka_session->id_req = SIM_NO_ID_REQ;	/* Set the default */
 
 	/*
@@ -1364,6 +1374,29 @@ static int mod_namespace_load(CONF_SECTION *server_cs)
 	return mod_section_compile(NULL, server_cs);
 }
 
+/** Create the vector cache if local quintuplets generation is batched
+ *
+ */
+static int mod_instantiate(void *instance, CONF_SECTION *cs)
+{
+	rlm_eap_aka_t		*inst = instance;
+
+	if (!inst->vector_batch_size) return 0;
+
+	FR_INTEGER_BOUND_CHECK("vector_cache.batch_size", inst->vector_batch_size, <=, 1024);
+	FR_INTEGER_BOUND_CHECK("vector_cache.max_entries", inst->vector_max_entries, >=, 1);
+	FR_INTEGER_BOUND_CHECK("vector_cache.lifetime", inst->vector_lifetime, >=, 1);
+
+	inst->vector_cache = fr_sim_vector_cache_alloc(inst, inst->vector_batch_size,
+						       inst->vector_max_entries, inst->vector_lifetime);
+	if (!inst->vector_cache) {
+		cf_log_perr(cs, "Failed creating vector cache");
+		return -1;
+	}
+
+	return 0;
+}
+
 static int mod_load(void)
 {
 	if (virtual_server_namespace_register("eap-aka", mod_namespace_load) < 0) return -1;
@@ -1398,6 +1431,7 @@ rlm_eap_submodule_t rlm_eap_aka = {
 
 	.onload		= mod_load,
 	.unload		= mod_unload,
+	.instantiate	= mod_instantiate,	/* Create new submodule instance */
 	.session_init	= mod_session_init,	/* Initialise a new EAP session */
 	.entry_point	= mod_process,		/* Process next round of EAP method */
 };
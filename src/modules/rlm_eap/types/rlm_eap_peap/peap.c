@@ -511,7 +511,7 @@ rlm_rcode_t eap_peap_process(eap_session_t *eap_session, tls_session_t *tls_sess
 	case PEAP_STATUS_TUNNEL_ESTABLISHED:
 		/* FIXME: should be no data in the buffer here, check & assert? */
 
-		if (SSL_session_reused(tls_session->ssl)) {
+		if (SSL_session_reused(tls_session->ssl) && !tls_ticket_resumed(tls_session->ssl)) {
 			RDEBUG2("Skipping Phase2 because of session resumption");
 			t->session_resumption_state = PEAP_RESUMPTION_YES;
 			if (t->soh) {
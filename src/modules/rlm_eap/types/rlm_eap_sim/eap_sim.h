@@ -58,10 +58,18 @@ typedef struct {
 								///< indications (SIM-Notification-Success).
 
 	int  				sim_id;			//!< Packet ID. (replay protection)
+
+	fr_sim_vector_cache_t		*vector_cache;		//!< Pre-generated triplets, or NULL.
 } eap_sim_session_t;
 
 
 typedef struct {
 	char const			*virtual_server;	//!< Virtual server for HLR integration.
 	bool				protected_success;	//!< Send protected success messages.
+
+	uint32_t			vector_batch_size;	//!< How many triplets to generate at once.
+	uint32_t			vector_max_entries;	//!< Maximum number of subscribers to cache
+								///< triplets for.
+	uint32_t			vector_lifetime;	//!< How long pre-generated triplets are valid for.
+	fr_sim_vector_cache_t		*vector_cache;		//!< Pre-generated triplets.
 } rlm_eap_sim_t;
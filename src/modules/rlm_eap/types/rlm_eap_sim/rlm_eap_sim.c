@@ -52,9 +52,17 @@ static FR_NAME_NUMBER const sim_state_table[] = {
 	{ NULL }
 };
 
+static CONF_PARSER vector_cache_config[] = {
+	{ FR_CONF_OFFSET("batch_size", FR_TYPE_UINT32, rlm_eap_sim_t, vector_batch_size), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, rlm_eap_sim_t, vector_max_entries), .dflt = "65536" },
+	{ FR_CONF_OFFSET("lifetime", FR_TYPE_UINT32, rlm_eap_sim_t, vector_lifetime), .dflt = "300" },
+	CONF_PARSER_TERMINATOR
+};
+
 static CONF_PARSER submodule_config[] = {
 	{ FR_CONF_OFFSET("virtual_server", FR_TYPE_STRING, rlm_eap_sim_t, virtual_server) },
 	{ FR_CONF_OFFSET("protected_success", FR_TYPE_BOOL, rlm_eap_sim_t, protected_success ), .dflt = "no" },
+	{ FR_CONF_POINTER("vector_cache", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) vector_cache_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -289,9 +297,12 @@ static int eap_sim_send_challenge(eap_session_t *eap_session)
 	rad_assert(eap_session->request->reply);
 
 	RDEBUG2("Acquiring GSM vector(s)");
-	if ((fr_sim_vector_gsm_from_attrs(eap_session, request->control, 0, &eap_sim_session->keys, &src) != 0) ||
-	    (fr_sim_vector_gsm_from_attrs(eap_session, request->control, 1, &eap_sim_session->keys, &src) != 0) ||
-	    (fr_sim_vector_gsm_from_attrs(eap_session, request->control, 2, &eap_sim_session->keys, &src) != 0)) {
+	if ((fr_sim_vector_gsm_from_attrs(eap_session, request->control, 0, &eap_sim_session->keys, &src,
+					  eap_sim_session->vector_cache) != 0) ||
+	    (fr_sim_vector_gsm_from_attrs(eap_session, request->control, 1, &eap_sim_session->keys, &src,
+					  eap_sim_session->vector_cache) != 0) ||
+	    (fr_sim_vector_gsm_from_attrs(eap_session, request->control, 2, &eap_sim_session->keys, &src,
+					  eap_sim_session->vector_cache) != 0)) {
 	    	REDEBUG("Failed retrieving SIM vectors");
 		return RLM_MODULE_FAIL;
 	}
@@ -1085,6 +1096,7 @@ static rlm_rcode_t mod_session_init(void *instance, eap_session_t *eap_session)
 	 *	to be toggled by attributes later.
 	 */
 	eap_sim_session->send_result_ind = inst->protected_success;
+	eap_sim_session->vector_cache = inst->vector_cache;
 	eap_sim_session->id_req = SIM_ANY_ID_REQ;	/* Set the default */
 
 	/*
@@ -1147,6 +1159,29 @@ static rlm_rcode_t mod_session_init(void *instance, eap_session_t *eap_session)
 	return RLM_MODULE_HANDLED;
 }
 
+/** Create the vector cache if local triplets generation is batched
+ *
+ */
+static int mod_instantiate(void *instance, CONF_SECTION *cs)
+{
+	rlm_eap_sim_t		*inst = instance;
+
+	if (!inst->vector_batch_size) return 0;
+
+	FR_INTEGER_BOUND_CHECK("vector_cache.batch_size", inst->vector_batch_size, <=, 1024);
+	FR_INTEGER_BOUND_CHECK("vector_cache.max_entries", inst->vector_max_entries, >=, 1);
+	FR_INTEGER_BOUND_CHECK("vector_cache.lifetime", inst->vector_lifetime, >=, 1);
+
+	inst->vector_cache = fr_sim_vector_cache_alloc(inst, inst->vector_batch_size,
+						       inst->vector_max_entries, inst->vector_lifetime);
+	if (!inst->vector_cache) {
+		cf_log_perr(cs, "Failed creating vector cache");
+		return -1;
+	}
+
+	return 0;
+}
+
 static int mod_load(void)
 {
 	if (fr_sim_init() < 0) return -1;
@@ -1178,6 +1213,7 @@ rlm_eap_submodule_t rlm_eap_sim = {
 
 	.onload		= mod_load,
 	.unload		= mod_unload,
+	.instantiate	= mod_instantiate,	/* Create new submodule instance */
 	.session_init	= mod_session_init,	/* Initialise a new EAP session */
 	.entry_point	= mod_process,		/* Process next round of EAP method */
 };
@@ -226,6 +226,13 @@ static rlm_rcode_t mod_process(void *instance, eap_session_t *eap_session)
 	case EAP_TLS_HANDLED:
 		return RLM_MODULE_HANDLED;
 
+	/*
+	 *	An async engine is processing a handshake
+	 *	step, we'll be called again when it's done.
+	 */
+	case EAP_TLS_YIELD:
+		return RLM_MODULE_YIELD;
+
 	/*
 	 *	Handshake is done, proceed with decoding tunneled
 	 *	data.
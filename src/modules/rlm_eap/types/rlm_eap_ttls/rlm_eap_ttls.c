@@ -164,7 +164,7 @@ static rlm_rcode_t mod_process(void *arg, eap_session_t *eap_session)
 	 *	an EAP-TLS-Success packet here.
 	 */
 	case EAP_TLS_ESTABLISHED:
-		if (SSL_session_reused(tls_session->ssl)) {
+		if (SSL_session_reused(tls_session->ssl) && !tls_ticket_resumed(tls_session->ssl)) {
 			RDEBUG2("Skipping Phase2 due to session resumption");
 			goto do_keys;
 		}
@@ -192,6 +192,13 @@ static rlm_rcode_t mod_process(void *arg, eap_session_t *eap_session)
 	case EAP_TLS_HANDLED:
 		return RLM_MODULE_HANDLED;
 
+	/*
+	 *	An async engine is processing a handshake
+	 *	step, we'll be called again when it's done.
+	 */
+	case EAP_TLS_YIELD:
+		return RLM_MODULE_YIELD;
+
 	/*
 	 *	Handshake is done, proceed with decoding tunneled
 	 *	data.
@@ -32,38 +32,68 @@ RCSID("$Id$")
 #include <ctype.h>
 #include <fcntl.h>
 
+/** DEFAULT entries which share a value for an indexed check item
+ */
+typedef struct {
+	fr_value_box_t const	*value;		//!< Value the check item compares against.
+	size_t			count;		//!< Number of entries, whilst building the index.
+	PAIR_LIST const		**entries;	//!< Entries with this value, in file order.
+} rlm_files_bucket_t;
+
+/** DEFAULT entries indexed by one of their '==' check items
+ */
+typedef struct {
+	fr_dict_attr_t const	*da;		//!< Attribute the entries are indexed by.
+	size_t			count;		//!< Number of entries, whilst building the index.
+	rbtree_t		*values;	//!< Tree of #rlm_files_bucket_t, keyed by value.
+	PAIR_LIST const		**entries;	//!< All entries in the index, in file order.
+} rlm_files_index_t;
+
+/** A users file, compiled into a form which is cheap to match requests against
+ *
+ * User entries are found by an exact match on their name.  DEFAULT entries
+ * with a suitable '==' check item are indexed by the value of that item, so
+ * only the entries which could possibly match a request are evaluated.
+ */
+typedef struct {
+	fr_hash_table_t		*users;		//!< Lists of user entries, keyed by name.
+	rlm_files_index_t	*index;		//!< Indexes of DEFAULT entries, one per attribute.
+	PAIR_LIST const		**unindexed;	//!< DEFAULT entries which must always be evaluated.
+} rlm_files_table_t;
+
 typedef struct rlm_files_t {
 	char const *key;
+	uint32_t reload_interval;
 
 	char const *filename;
-	rbtree_t *common;
+	fr_reload_t *common;
 
 	/* autz */
 	char const *usersfile;
-	rbtree_t *users;
+	fr_reload_t *users;
 
 
 	/* authenticate */
 	char const *auth_usersfile;
-	rbtree_t *auth_users;
+	fr_reload_t *auth_users;
 
 	/* preacct */
 	char const *acct_usersfile;
-	rbtree_t *acct_users;
+	fr_reload_t *acct_users;
 
 #ifdef WITH_PROXY
 	/* pre-proxy */
 	char const *preproxy_usersfile;
-	rbtree_t *preproxy_users;
+	fr_reload_t *preproxy_users;
 
 	/* post-proxy */
 	char const *postproxy_usersfile;
-	rbtree_t *postproxy_users;
+	fr_reload_t *postproxy_users;
 #endif
 
 	/* post-authenticate */
 	char const *postauth_usersfile;
-	rbtree_t *postauth_users;
+	fr_reload_t *postauth_users;
 } rlm_files_t;
 
 static fr_dict_t *dict_freeradius;
@@ -78,11 +108,13 @@ fr_dict_autoload_t rlm_files_dict[] = {
 
 static fr_dict_attr_t const *attr_fall_through;
 static fr_dict_attr_t const *attr_user_name;
+static fr_dict_attr_t const *attr_user_password;
 
 extern fr_dict_attr_autoload_t rlm_files_dict_attr[];
 fr_dict_attr_autoload_t rlm_files_dict_attr[] = {
 	{ .out = &attr_fall_through, .name = "Fall-Through", .type = FR_TYPE_BOOL, .dict = &dict_freeradius },
 	{ .out = &attr_user_name, .name = "User-Name", .type = FR_TYPE_STRING, .dict = &dict_radius },
+	{ .out = &attr_user_password, .name = "User-Password", .type = FR_TYPE_STRING, .dict = &dict_radius },
 
 	{ NULL }
 };
@@ -109,31 +141,248 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("auth_usersfile", FR_TYPE_FILE_INPUT, rlm_files_t, auth_usersfile) },
 	{ FR_CONF_OFFSET("postauth_usersfile", FR_TYPE_FILE_INPUT, rlm_files_t, postauth_usersfile) },
 	{ FR_CONF_OFFSET("key", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_files_t, key) },
+	{ FR_CONF_OFFSET("reload_interval", FR_TYPE_UINT32, rlm_files_t, reload_interval), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
 
+static uint32_t pairlist_hash(void const *data)
+{
+	return fr_hash_string(((PAIR_LIST const *)data)->name);
+}
+
 static int pairlist_cmp(void const *a, void const *b)
 {
 	return strcmp(((PAIR_LIST const *)a)->name, ((PAIR_LIST const *)b)->name);
 }
 
-static int getusersfile(TALLOC_CTX *ctx, char const *filename, rbtree_t **ptree)
+static int pairlist_order_cmp(void const *a, void const *b)
+{
+	PAIR_LIST const *my_a = *(PAIR_LIST const * const *)a;
+	PAIR_LIST const *my_b = *(PAIR_LIST const * const *)b;
+
+	return (my_a->order > my_b->order) - (my_a->order < my_b->order);
+}
+
+static int bucket_cmp(void const *a, void const *b)
+{
+	return fr_value_box_cmp(((rlm_files_bucket_t const *)a)->value, ((rlm_files_bucket_t const *)b)->value);
+}
+
+/** Whether a DEFAULT entry can be indexed by a check item
+ *
+ * The index is only used to skip entries which cannot match, so the check
+ * item must only ever match a request attribute with an identical value.
+ *
+ * Attributes with comparison functions are checked for at run time, as
+ * the modules registering them may not have been instantiated yet.
+ */
+static bool check_item_indexable(VALUE_PAIR const *vp)
+{
+	if (vp->op != T_OP_CMP_EQ) return false;
+
+	/*
+	 *	Expanded values aren't known until run time.
+	 */
+	if (vp->type != VT_DATA) return false;
+
+	/*
+	 *	Server items are skipped by paircmp(), tagged
+	 *	attributes need the tag to match too, and
+	 *	User-Password is skipped if the request doesn't
+	 *	contain one.
+	 */
+	if (fr_dict_by_da(vp->da) != dict_radius) return false;
+	if (vp->da->flags.has_tag) return false;
+	if (vp->da == attr_user_password) return false;
+
+	switch (vp->vp_type) {
+	case FR_TYPE_STRING:
+	case FR_TYPE_OCTETS:
+	case FR_TYPE_UINT8:
+	case FR_TYPE_UINT16:
+	case FR_TYPE_UINT32:
+	case FR_TYPE_UINT64:
+	case FR_TYPE_INT32:
+	case FR_TYPE_DATE:
+	case FR_TYPE_IPV4_ADDR:
+	case FR_TYPE_IPV6_ADDR:
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+static rlm_files_index_t *index_find(rlm_files_table_t *table, fr_dict_attr_t const *da)
+{
+	size_t i, num = talloc_array_length(table->index);
+
+	for (i = 0; i < num; i++) if (table->index[i].da == da) return &table->index[i];
+
+	return NULL;
+}
+
+/** Index DEFAULT entries by their most selective check item
+ *
+ * The most selective attribute is the one with the most distinct values
+ * across all the DEFAULT entries.
+ */
+static int index_defaults(rlm_files_table_t *table, PAIR_LIST **defaults)
+{
+	size_t			i, j, num_defaults = talloc_array_length(defaults), num_unindexed = 0;
+	rlm_files_bucket_t	**chosen;
+	rlm_files_index_t	**chosen_index;
+	fr_cursor_t		cursor;
+	VALUE_PAIR		*vp;
+
+	MEM(table->index = talloc_array(table, rlm_files_index_t, 0));
+
+	/*
+	 *	Find every distinct value of every indexable
+	 *	attribute.
+	 */
+	for (i = 0; i < num_defaults; i++) {
+		for (vp = fr_cursor_init(&cursor, &defaults[i]->check);
+		     vp;
+		     vp = fr_cursor_next(&cursor)) {
+			rlm_files_index_t	*index;
+			rlm_files_bucket_t	*bucket, my_bucket;
+
+			if (!check_item_indexable(vp)) continue;
+
+			index = index_find(table, vp->da);
+			if (!index) {
+				size_t num = talloc_array_length(table->index);
+
+				MEM(table->index = talloc_realloc(table, table->index, rlm_files_index_t, num + 1));
+				index = &table->index[num];
+				memset(index, 0, sizeof(*index));
+				index->da = vp->da;
+				MEM(index->values = rbtree_talloc_create(table, bucket_cmp, rlm_files_bucket_t,
+									 NULL, RBTREE_FLAG_NONE));
+			}
+
+			my_bucket.value = &vp->data;
+			if (rbtree_finddata(index->values, &my_bucket)) continue;
+
+			MEM(bucket = talloc_zero(index->values, rlm_files_bucket_t));
+			bucket->value = &vp->data;
+			if (!rbtree_insert(index->values, bucket)) return -1;
+		}
+	}
+
+	/*
+	 *	Pick the most selective indexable check item for
+	 *	each entry.
+	 */
+	MEM(chosen = talloc_zero_array(table, rlm_files_bucket_t *, num_defaults));
+	MEM(chosen_index = talloc_zero_array(table, rlm_files_index_t *, num_defaults));
+	for (i = 0; i < num_defaults; i++) {
+		rlm_files_index_t	*best = NULL;
+		VALUE_PAIR		*best_vp = NULL;
+		rlm_files_bucket_t	my_bucket;
+
+		for (vp = fr_cursor_init(&cursor, &defaults[i]->check);
+		     vp;
+		     vp = fr_cursor_next(&cursor)) {
+			rlm_files_index_t *index;
+
+			if (!check_item_indexable(vp)) continue;
+
+			index = index_find(table, vp->da);
+			if (!best || (rbtree_num_elements(index->values) > rbtree_num_elements(best->values))) {
+				best = index;
+				best_vp = vp;
+			}
+		}
+
+		if (!best) {
+			num_unindexed++;
+			continue;
+		}
+
+		my_bucket.value = &best_vp->data;
+		chosen[i] = rbtree_finddata(best->values, &my_bucket);
+		chosen[i]->count++;
+		chosen_index[i] = best;
+		best->count++;
+	}
+
+	for (i = 0; i < talloc_array_length(table->index); i++) {
+		rlm_files_index_t *index = &table->index[i];
+
+		MEM(index->entries = talloc_array(table, PAIR_LIST const *, index->count));
+		index->count = 0;
+	}
+	MEM(table->unindexed = talloc_array(table, PAIR_LIST const *, num_unindexed));
+	num_unindexed = 0;
+
+	/*
+	 *	Fill in the entry lists.  Walking the entries in
+	 *	file order means every list is sorted by order.
+	 */
+	for (i = 0; i < num_defaults; i++) {
+		rlm_files_bucket_t *bucket = chosen[i];
+
+		if (!bucket) {
+			table->unindexed[num_unindexed++] = defaults[i];
+			continue;
+		}
+
+		if (!bucket->entries) {
+			MEM(bucket->entries = talloc_array(bucket, PAIR_LIST const *, bucket->count));
+			bucket->count = 0;
+		}
+		bucket->entries[bucket->count++] = defaults[i];
+		chosen_index[i]->entries[chosen_index[i]->count++] = defaults[i];
+	}
+
+	talloc_free(chosen);
+	talloc_free(chosen_index);
+
+	/*
+	 *	Values which weren't chosen for any entry are left
+	 *	in the index as empty buckets.  Attributes which
+	 *	weren't chosen for any entry are removed entirely.
+	 */
+	for (i = 0, j = 0; i < talloc_array_length(table->index); i++) {
+		if (!table->index[i].count) {
+			talloc_free(table->index[i].values);
+			talloc_free(table->index[i].entries);
+			continue;
+		}
+		table->index[j++] = table->index[i];
+	}
+	if (!j) {
+		TALLOC_FREE(table->index);
+	} else {
+		MEM(table->index = talloc_realloc(table, table->index, rlm_files_index_t, j));
+	}
+
+	return 0;
+}
+
+static int getusersfile(TALLOC_CTX *ctx, char const *filename, rlm_files_table_t **ptable)
 {
-	int rcode;
-	VALUE_PAIR *vp;
-	PAIR_LIST *users = NULL;
-	PAIR_LIST *entry, *next;
-	PAIR_LIST *user_list, *default_list, **default_tail;
-	rbtree_t *tree;
+	int			rcode;
+	VALUE_PAIR		*vp;
+	PAIR_LIST		*users = NULL;
+	PAIR_LIST		*entry, *next;
+	PAIR_LIST		*user_list, **defaults;
+	size_t			num_defaults = 0;
+	rlm_files_table_t	*table;
 
 	if (!filename) {
-		*ptree = NULL;
+		*ptable = NULL;
 		return 0;
 	}
 
-	rcode = pairlist_read(ctx, dict_radius, filename, &users, 1);
+	MEM(table = talloc_zero(ctx, rlm_files_table_t));
+
+	rcode = pairlist_read(table, dict_radius, filename, &users, 1);
 	if (rcode < 0) {
+		talloc_free(table);
 		return -1;
 	}
 
@@ -204,17 +453,20 @@ static int getusersfile(TALLOC_CTX *ctx, char const *filename, rbtree_t **ptree)
 			}
 		}
 
+		if (strcmp(entry->name, "DEFAULT") == 0) num_defaults++;
+
 		entry = entry->next;
 	}
 
-	tree = rbtree_create(ctx, pairlist_cmp, NULL, RBTREE_FLAG_NONE);
-	if (!tree) {
-		pairlist_free(&users);
+	table->users = fr_hash_table_create(table, pairlist_hash, pairlist_cmp, NULL);
+	if (!table->users) {
+	error:
+		talloc_free(table);
 		return -1;
 	}
 
-	default_list = NULL;
-	default_tail = &default_list;
+	MEM(defaults = talloc_array(table, PAIR_LIST *, num_defaults));
+	num_defaults = 0;
 
 	/*
 	 *	We've read the entries in linearly, but putting them
@@ -229,44 +481,22 @@ static int getusersfile(TALLOC_CTX *ctx, char const *filename, rbtree_t **ptree)
 		entry->next = NULL;
 
 		/*
-		 *	DEFAULT entries get their own list.
+		 *	DEFAULT entries get indexed separately.
 		 */
 		if (strcmp(entry->name, "DEFAULT") == 0) {
-			if (!default_list) {
-				default_list = entry;
-
-				/*
-				 *	Insert the first DEFAULT into the tree.
-				 */
-				if (!rbtree_insert(tree, entry)) {
-				error:
-					pairlist_free(&entry);
-					pairlist_free(&next);
-					talloc_free(tree);
-					return -1;
-				}
-
-			} else {
-				/*
-				 *	Tack this entry onto the tail
-				 *	of the DEFAULT list.
-				 */
-				*default_tail = entry;
-			}
-
-			default_tail = &entry->next;
+			defaults[num_defaults++] = entry;
 			continue;
 		}
 
 		/*
 		 *	Not DEFAULT, must be a normal user.
 		 */
-		user_list = rbtree_finddata(tree, entry);
+		user_list = fr_hash_table_finddata(table->users, entry);
 		if (!user_list) {
 			/*
 			 *	Insert the first one.
 			 */
-			if (!rbtree_insert(tree, entry)) goto error;
+			if (!fr_hash_table_insert(table->users, entry)) goto error;
 		} else {
 			/*
 			 *	Find the tail of this list, and add it
@@ -278,22 +508,96 @@ static int getusersfile(TALLOC_CTX *ctx, char const *filename, rbtree_t **ptree)
 		}
 	}
 
-	*ptree = tree;
+	rcode = index_defaults(table, defaults);
+	talloc_free(defaults);
+	if (rcode < 0) goto error;
+
+	DEBUG2("%s: %i user names, %zu DEFAULT entries in %zu indexes, %zu unindexed",
+	       filename, fr_hash_table_num_elements(table->users), num_defaults,
+	       talloc_array_length(table->index), talloc_array_length(table->unindexed));
+
+	*ptable = table;
 
 	return 0;
 }
 
 
+static void *files_build(char const *filename, UNUSED void *uctx)
+{
+	rlm_files_table_t *table;
+
+	if (getusersfile(NULL, filename, &table) < 0) return NULL;
+
+	return table;
+}
+
+/** Check whether the files have changed, and reload them now if they have
+ *
+ * Expands to the number of files which were reloaded.
+ *
+ * Example: "%{files:reload}"
+ */
+static ssize_t files_xlat(UNUSED TALLOC_CTX *ctx, char **out, size_t outlen,
+			  void const *mod_inst, UNUSED void const *xlat_inst,
+			  REQUEST *request, char const *fmt)
+{
+	rlm_files_t const	*inst = mod_inst;
+	fr_reload_t		*reload[] = { inst->common, inst->users, inst->acct_users,
+#ifdef WITH_PROXY
+					      inst->preproxy_users, inst->postproxy_users,
+#endif
+					      inst->auth_users, inst->postauth_users };
+	size_t			i;
+	unsigned int		reloaded = 0;
+
+	if (strcmp(fmt, "reload") != 0) {
+		REDEBUG("Invalid argument \"%s\", expected \"reload\"", fmt);
+		return -1;
+	}
+
+	for (i = 0; i < NUM_ELEMENTS(reload); i++) {
+		if (!reload[i]) continue;
+
+		if (fr_reload_check(reload[i]) == 1) reloaded++;
+	}
+
+	return snprintf(*out, outlen, "%u", reloaded);
+}
+
+/*
+ *	Register the reload xlat
+ */
+static int mod_bootstrap(void *instance, CONF_SECTION *conf)
+{
+	char const *name;
+
+	name = cf_section_name2(conf);
+	if (!name) name = cf_section_name1(conf);
+
+	xlat_register(instance, name, files_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN, false);
+
+	return 0;
+}
 
 /*
- *	(Re-)read the "users" file into memory.
+ *	Read the "users" files into memory, and re-read them
+ *	whenever they change.
  */
-static int mod_instantiate(void *instance, UNUSED CONF_SECTION *conf)
+static int mod_instantiate(void *instance, CONF_SECTION *conf)
 {
-	rlm_files_t *inst = instance;
+	rlm_files_t	*inst = instance;
+	char const	*name;
+
+	name = cf_section_name2(conf);
+	if (!name) name = cf_section_name1(conf);
 
 #undef READFILE
-#define READFILE(_x, _y) do { if (getusersfile(inst, inst->_x, &inst->_y) != 0) { ERROR("Failed reading %s", inst->_x); return -1;} } while (0)
+#define READFILE(_x, _y) do { \
+	if (inst->_x) { \
+		inst->_y = fr_reload_alloc(inst, name, inst->_x, inst->reload_interval, files_build, NULL); \
+		if (!inst->_y) { ERROR("Failed reading %s", inst->_x); return -1; } \
+	} \
+} while (0)
 
 	READFILE(filename, common);
 	READFILE(usersfile, users);
@@ -310,16 +614,85 @@ static int mod_instantiate(void *instance, UNUSED CONF_SECTION *conf)
 	return 0;
 }
 
+/** Find the indexed DEFAULT entries which could match a request
+ *
+ * @param[in] ctx	to allocate the candidate list in.
+ * @param[out] out	Candidates, sorted by order.  NULL if there are none.
+ * @param[in] table	to search.
+ * @param[in] vps	request attributes to look up.
+ * @return the number of candidates.
+ */
+static size_t files_candidates(TALLOC_CTX *ctx, PAIR_LIST const ***out,
+			       rlm_files_table_t const *table, VALUE_PAIR *vps)
+{
+	PAIR_LIST const		**candidates = NULL;
+	size_t			i, j, num = 0;
+	VALUE_PAIR		*vp;
+
+	for (i = 0; i < talloc_array_length(table->index); i++) {
+		rlm_files_index_t const *index = &table->index[i];
+
+		/*
+		 *	A comparison function may have been
+		 *	registered for the attribute, in which case
+		 *	its values mean something else entirely.
+		 */
+		if (paircmp_find(index->da)) {
+			MEM(candidates = talloc_realloc(ctx, candidates, PAIR_LIST const *,
+							num + talloc_array_length(index->entries)));
+			memcpy(candidates + num, index->entries, talloc_array_length(index->entries) * sizeof(*candidates));
+			num += talloc_array_length(index->entries);
+			continue;
+		}
+
+		for (vp = vps; vp; vp = vp->next) {
+			rlm_files_bucket_t const	*bucket;
+			rlm_files_bucket_t		my_bucket;
+
+			if (vp->da != index->da) continue;
+
+			my_bucket.value = &vp->data;
+			bucket = rbtree_finddata(index->values, &my_bucket);
+			if (!bucket || !bucket->entries) continue;
+
+			MEM(candidates = talloc_realloc(ctx, candidates, PAIR_LIST const *,
+							num + bucket->count));
+			memcpy(candidates + num, bucket->entries, bucket->count * sizeof(*candidates));
+			num += bucket->count;
+		}
+	}
+
+	if (num > 1) {
+		qsort(candidates, num, sizeof(*candidates), pairlist_order_cmp);
+
+		/*
+		 *	Remove duplicates, from requests with multiple
+		 *	instances of an attribute with the same value.
+		 */
+		for (i = 1, j = 1; i < num; i++) {
+			if (candidates[i] != candidates[j - 1]) candidates[j++] = candidates[i];
+		}
+		num = j;
+	}
+
+	*out = candidates;
+
+	return num;
+}
+
 /*
  *	Common code called by everything below.
  */
-static rlm_rcode_t file_common(rlm_files_t const *inst, REQUEST *request, char const *filename, rbtree_t *tree,
+static rlm_rcode_t file_common(rlm_files_t const *inst, REQUEST *request, char const *filename,
+			       fr_reload_t *reload,
 			       RADIUS_PACKET *request_packet, RADIUS_PACKET *reply_packet)
 {
 	char const	*name;
+	rlm_files_table_t const *table;
 	VALUE_PAIR	*check_tmp = NULL;
 	VALUE_PAIR	*reply_tmp = NULL;
-	PAIR_LIST const *user_pl, *default_pl;
+	PAIR_LIST const *user_pl, **candidates;
+	size_t		num_candidates, num_unindexed, i = 0, j = 0;
 	bool		found = false;
 	PAIR_LIST	my_pl;
 	char		buffer[256];
@@ -340,40 +713,49 @@ static rlm_rcode_t file_common(rlm_files_t const *inst, REQUEST *request, char c
 		name = len ? buffer : "NONE";
 	}
 
-	if (!tree) return RLM_MODULE_NOOP;
+	if (!reload) return RLM_MODULE_NOOP;
+
+	/*
+	 *	The table stays valid until it's released, even if
+	 *	the file is reloaded in the mean time.
+	 */
+	table = fr_reload_acquire(reload);
 
 	my_pl.name = name;
-	user_pl = rbtree_finddata(tree, &my_pl);
-	my_pl.name = "DEFAULT";
-	default_pl = rbtree_finddata(tree, &my_pl);
+	user_pl = fr_hash_table_finddata(table->users, &my_pl);
+
+	num_candidates = files_candidates(request, &candidates, table, request_packet->vps);
+	num_unindexed = talloc_array_length(table->unindexed);
 
 	/*
 	 *	Find the entry for the user.
+	 *
+	 *	User entries, unindexed DEFAULT entries, and
+	 *	candidate DEFAULT entries are each sorted by order.
+	 *	Walk all three, evaluating the entries in the
+	 *	order they appeared in the file.
 	 */
-	while (user_pl || default_pl) {
+	while (user_pl || (i < num_unindexed) || (j < num_candidates)) {
 		fr_cursor_t cursor;
 		VALUE_PAIR *vp;
-		PAIR_LIST const *pl;
+		PAIR_LIST const *pl = user_pl;
 
 		/*
 		 *	Figure out which entry to match on.
 		 */
+		if ((i < num_unindexed) && (!pl || (table->unindexed[i]->order < pl->order))) {
+			pl = table->unindexed[i];
+		}
+		if ((j < num_candidates) && (!pl || (candidates[j]->order < pl->order))) {
+			pl = candidates[j];
+		}
 
-		if (!default_pl && user_pl) {
-			pl = user_pl;
-			user_pl = user_pl->next;
-
-		} else if (!user_pl && default_pl) {
-			pl = default_pl;
-			default_pl = default_pl->next;
-
-		} else if (user_pl->order < default_pl->order) {
-			pl = user_pl;
+		if (pl == user_pl) {
 			user_pl = user_pl->next;
-
+		} else if ((i < num_unindexed) && (pl == table->unindexed[i])) {
+			i++;
 		} else {
-			pl = default_pl;
-			default_pl = default_pl->next;
+			j++;
 		}
 
 		MEM(fr_pair_list_copy(request, &check_tmp, pl->check) >= 0);
@@ -382,35 +764,43 @@ static rlm_rcode_t file_common(rlm_files_t const *inst, REQUEST *request, char c
 		     vp = fr_cursor_next(&cursor)) {
 			if (xlat_eval_pair(request, vp) < 0) {
 				RWARN("Failed parsing expanded value for check item, skipping entry: %s", fr_strerror());
-				fr_pair_list_free(&check_tmp);
-				continue;
+				break;
 			}
 		}
 
-		if (paircmp(request, request_packet->vps, check_tmp, &reply_packet->vps) == 0) {
-			RDEBUG2("Found match \"%s\" one line %d of %s", pl->name, pl->lineno, filename);
-			found = true;
+		/*
+		 *	Check items from entries which didn't match
+		 *	mustn't be compared against the next entry.
+		 */
+		if (vp || (paircmp(request, request_packet->vps, check_tmp, &reply_packet->vps) != 0)) {
+			fr_pair_list_free(&check_tmp);
+			continue;
+		}
 
-			/* ctx may be reply or proxy */
-			MEM(fr_pair_list_copy(reply_packet, &reply_tmp, pl->reply) >= 0);
+		RDEBUG2("Found match \"%s\" one line %d of %s", pl->name, pl->lineno, filename);
+		found = true;
 
-			radius_pairmove(request, &reply_packet->vps, reply_tmp, true);
-			fr_pair_list_move(&request->control, &check_tmp);
+		/* ctx may be reply or proxy */
+		MEM(fr_pair_list_copy(reply_packet, &reply_tmp, pl->reply) >= 0);
 
-			reply_tmp = NULL;	/* radius_pairmove() frees input attributes */
-			fr_pair_list_free(&check_tmp);
+		radius_pairmove(request, &reply_packet->vps, reply_tmp, true);
+		fr_pair_list_move(&request->control, &check_tmp);
 
-			/*
-			 *	Fallthrough?
-			 */
-			if (!fall_through(pl->reply)) break;
-		}
+		reply_tmp = NULL;	/* radius_pairmove() frees input attributes */
+		fr_pair_list_free(&check_tmp);
+
+		/*
+		 *	Fallthrough?
+		 */
+		if (!fall_through(pl->reply)) break;
 	}
 
 	/*
 	 *	Remove server internal parameters.
 	 */
 	fr_pair_delete_by_da(&reply_packet->vps, attr_fall_through);
+	talloc_free(candidates);
+	fr_reload_release(reload);
 
 	/*
 	 *	See if we succeeded.
@@ -499,6 +889,7 @@ rad_module_t rlm_files = {
 	.name		= "files",
 	.inst_size	= sizeof(rlm_files_t),
 	.config		= module_config,
+	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate,
@@ -106,6 +106,8 @@ typedef struct {
 		exfile_t		*ef;			//!< Exclusive file access handle.
 		bool			escape;			//!< Do filename escaping, yes / no.
 		xlat_escape_t		escape_func;		//!< Escape function.
+		exfile_batch_conf_t	batch;			//!< Batch writer configuration.
+		exfile_batch_t		*eb;			//!< Writes lines from a dedicated thread.
 	} file;
 
 	struct {
@@ -129,6 +131,7 @@ static const CONF_PARSER file_config[] = {
 	{ FR_CONF_OFFSET("permissions", FR_TYPE_UINT32, linelog_instance_t, file.permissions), .dflt = "0600" },
 	{ FR_CONF_OFFSET("group", FR_TYPE_STRING, linelog_instance_t, file.group_str) },
 	{ FR_CONF_OFFSET("escape_filenames", FR_TYPE_BOOL, linelog_instance_t, file.escape), .dflt = "no" },
+	{ FR_CONF_OFFSET("batch", FR_TYPE_SUBSECTION, linelog_instance_t, file.batch), .subcs = (void const *) exfile_batch_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -342,6 +345,14 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 				}
 			}
 		}
+
+		if (inst->file.batch.enabled) {
+			inst->file.eb = exfile_batch_alloc(inst, inst->file.ef, &inst->file.batch);
+			if (!inst->file.eb) {
+				cf_log_perr(conf, "Failed creating batch writer");
+				return -1;
+			}
+		}
 	}
 		break;
 
@@ -436,6 +447,27 @@ static size_t linelog_escape_func(UNUSED REQUEST *request,
 	return fr_snprint(out, outlen, in, -1, 0);
 }
 
+/** Called when the batch writer has written the line
+ *
+ */
+static rlm_rcode_t linelog_batch_resume(REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *rctx)
+{
+	if (exfile_batch_wait_result(request, rctx) < 0) return RLM_MODULE_FAIL;
+
+	return RLM_MODULE_OK;
+}
+
+/** Stop waiting for the batch writer if the request is cancelled
+ *
+ */
+static void linelog_batch_signal(REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *rctx,
+				 fr_state_signal_t action)
+{
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	exfile_batch_wait_cancel(request, rctx);
+}
+
 /** Write a linelog message
  *
  * Write a log message to syslog or a flat file.
@@ -656,6 +688,27 @@ build_vector:
 			*p = '/';
 		}
 
+		/*
+		 *	Queue the line for the batch writer.
+		 */
+		if (inst->file.eb) {
+			exfile_batch_entry_t *wait;
+
+			if (exfile_batch_writev(&wait, inst->file.eb, request, path, inst->file.permissions,
+						inst->file.group_str ? inst->file.group : (gid_t) -1,
+						vector_p, vector_len) < 0) {
+				rcode = RLM_MODULE_FAIL;
+				goto finish;
+			}
+
+			/*
+			 *	The line has been copied, so we can
+			 *	free everything before yielding.
+			 */
+			if (wait) rcode = unlang_module_yield(request, linelog_batch_resume, linelog_batch_signal, wait);
+			break;
+		}
+
 		fd = exfile_open(inst->file.ef, request, path, inst->file.permissions);
 		if (fd < 0) {
 			RERROR("Failed to open %s: %s", path, fr_syserror(errno));
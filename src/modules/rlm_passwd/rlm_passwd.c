@@ -28,6 +28,7 @@ RCSID("$Id$")
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/server/rad_assert.h>
+#include <freeradius-devel/util/file_index.h>
 
 struct mypasswd {
 	struct mypasswd *next;
@@ -46,6 +47,7 @@ struct hashtable {
 	char buffer[1024];
 	FILE *fp;
 	char delimiter;
+	fr_file_index_t *index;	/* set instead of the table when reading an index built by radindex */
 };
 
 static fr_dict_t *dict_freeradius;
@@ -152,11 +154,19 @@ static void release_hash_table(struct hashtable * ht){
 	ht->tablesize = 0;
 }
 
+#ifdef TEST
 static void release_ht(struct hashtable * ht){
 	if (!ht) return;
 	release_hash_table(ht);
 	talloc_free(ht);
 }
+#endif
+
+static int _release_hash_table(struct hashtable *ht)
+{
+	release_hash_table(ht);
+	return 0;
+}
 
 static struct hashtable * build_hash_table (char const * file, int num_fields,
 					    int key_field, int islist, int tablesize, int ignorenis, char delimiter)
@@ -357,7 +367,7 @@ int main(void){
 
 #else  /* TEST */
 typedef struct {
-	struct hashtable	*ht;
+	fr_reload_t		*reload;	//!< hashtable, rebuilt when the file changes.
 	struct mypasswd		*pwd_fmt;
 	char const		*filename;
 	char const		*format;
@@ -365,6 +375,7 @@ typedef struct {
 	bool			allow_multiple;
 	bool			ignore_nislike;
 	uint32_t		hash_size;
+	uint32_t		reload_interval;
 	uint32_t		num_fields;
 	uint32_t		key_field;
 	uint32_t		listable;
@@ -384,9 +395,63 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("allow_multiple_keys", FR_TYPE_BOOL, rlm_passwd_t, allow_multiple), .dflt = "no" },
 
 	{ FR_CONF_OFFSET("hash_size", FR_TYPE_UINT32, rlm_passwd_t, hash_size), .dflt = "100" },
+
+	{ FR_CONF_OFFSET("reload_interval", FR_TYPE_UINT32, rlm_passwd_t, reload_interval), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
+/*
+ *	Map an index built by radindex.  There's nothing to parse, just
+ *	check it has the same layout as the format.
+ */
+static struct hashtable *passwd_index_open(rlm_passwd_t const *inst, char const *filename)
+{
+	struct hashtable	*ht;
+
+	MEM(ht = talloc_zero(NULL, struct hashtable));
+	ht->num_fields = inst->num_fields;
+	ht->key_field = inst->key_field;
+
+	ht->index = fr_file_index_open(ht, filename);
+	if (!ht->index) {
+	error:
+		talloc_free(ht);
+		return NULL;
+	}
+
+	if (fr_file_index_num_fields(ht->index) != inst->num_fields) {
+		fr_strerror_printf("Index %s has %u fields, but the format has %u", filename,
+				   fr_file_index_num_fields(ht->index), inst->num_fields);
+		goto error;
+	}
+
+	if (fr_file_index_key_field(ht->index) != inst->key_field) {
+		fr_strerror_printf("Index %s is keyed on field %u, but the format uses field %u", filename,
+				   fr_file_index_key_field(ht->index), inst->key_field);
+		goto error;
+	}
+
+	return ht;
+}
+
+static void *passwd_build(char const *filename, void *uctx)
+{
+	rlm_passwd_t const	*inst = uctx;
+	struct hashtable	*ht;
+
+	if (fr_file_index_is_index(filename)) return passwd_index_open(inst, filename);
+
+	ht = build_hash_table(filename, inst->num_fields, inst->key_field, inst->listable,
+			      inst->hash_size, inst->ignore_nislike, *inst->delimiter);
+	if (!ht) {
+		fr_strerror_printf("Can't build hashtable from passwd file %s: %s", filename, fr_syserror(errno));
+		return NULL;
+	}
+	talloc_set_destructor(ht, _release_hash_table);
+
+	return ht;
+}
+
 static int mod_instantiate(void *instance, CONF_SECTION *conf)
 {
 	int			num_fields = 0, key_field = -1, listable = 0;
@@ -395,6 +460,7 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	size_t			len;
 	int			i;
 	fr_dict_attr_t const	*da;
+	char const		*name;
 	rlm_passwd_t		*inst = instance;
 
 	rad_assert(inst->filename && *inst->filename);
@@ -442,24 +508,13 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
-	inst->ht = build_hash_table(inst->filename, num_fields, key_field, listable,
-				    inst->hash_size, inst->ignore_nislike, *inst->delimiter);
-	if (!inst->ht){
-		ERROR("Can't build hashtable from passwd file");
-		return -1;
-	}
-
 	inst->pwd_fmt = mypasswd_alloc(inst->format, num_fields, &len);
 	if (!inst->pwd_fmt){
 		ERROR("Memory allocation failed");
-		release_ht(inst->ht);
-		inst->ht = NULL;
 		return -1;
 	}
 	if (!string_to_entry(inst->format, num_fields, ':', inst->pwd_fmt , len)) {
 		ERROR("Unable to convert format entry");
-		release_ht(inst->ht);
-		inst->ht = NULL;
 		return -1;
 	}
 
@@ -474,16 +529,12 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	}
 	if (!*inst->pwd_fmt->field[key_field]) {
 		cf_log_err(conf, "key field is empty");
-		release_ht(inst->ht);
-		inst->ht = NULL;
 		return -1;
 	}
 
 	if (fr_dict_attr_by_qualified_name(&da, dict_freeradius,
 					   inst->pwd_fmt->field[key_field], true) != FR_DICT_ATTR_OK) {
 		PERROR("Unable to resolve attribute");
-		release_ht(inst->ht);
-		inst->ht = NULL;
 		return -1;
 	}
 
@@ -492,6 +543,15 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	inst->key_field = key_field;
 	inst->listable = listable;
 
+	name = cf_section_name2(conf);
+	if (!name) name = cf_section_name1(conf);
+
+	inst->reload = fr_reload_alloc(inst, name, inst->filename, inst->reload_interval, passwd_build, inst);
+	if (!inst->reload) {
+		PERROR("Failed reading passwd file");
+		return -1;
+	}
+
 	DEBUG3("num_fields: %d key_field %d(%s) listable: %s", num_fields, key_field,
 	       inst->pwd_fmt->field[key_field], listable ? "yes" : "no");
 
@@ -502,10 +562,7 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 
 static int mod_detach (void *instance) {
 #define inst ((rlm_passwd_t *)instance)
-	if(inst->ht) {
-		release_ht(inst->ht);
-		inst->ht = NULL;
-	}
+	TALLOC_FREE(inst->reload);
 	talloc_free(inst->pwd_fmt);
 	return 0;
 #undef inst
@@ -532,11 +589,53 @@ static void result_add(TALLOC_CTX *ctx, rlm_passwd_t const *inst, REQUEST *reque
 	}
 }
 
+static void result_add_all(rlm_passwd_t const *inst, REQUEST *request, struct mypasswd *pw)
+{
+	result_add(request, inst, request, &request->control, pw, 0, "config");
+	result_add(request->reply, inst, request, &request->reply->vps, pw, 1, "reply_items");
+	result_add(request->packet, inst, request, &request->packet->vps, pw, 2, "request_items");
+}
+
+/*
+ *	Add the results for every record in the index with a matching key.
+ *
+ *	The fields point directly into the mapped file, so nothing is copied.
+ */
+static int index_result_add(rlm_passwd_t const *inst, REQUEST *request, fr_file_index_t const *index,
+			    char const *name)
+{
+	size_t			first, count, i;
+	size_t			len;
+	struct mypasswd		*pw;
+	char const		**fields;
+
+	count = fr_file_index_find(&first, index, name, strlen(name));
+	if (!count) return 0;
+
+	pw = mypasswd_alloc("", inst->num_fields, &len);
+	MEM(fields = talloc_array(pw, char const *, inst->num_fields));
+
+	for (i = first; i < first + count; i++) {
+		if (fr_file_index_fields(fields, index, i) < 0) {
+			RPWDEBUG("Ignoring entry in %s", inst->filename);
+			continue;
+		}
+
+		memcpy(pw->field, fields, inst->num_fields * sizeof(pw->field[0])); /* const */
+		result_add_all(inst, request, pw);
+	}
+
+	talloc_free(pw);
+
+	return 1;
+}
+
 static rlm_rcode_t CC_HINT(nonnull) mod_passwd_map(void *instance, UNUSED void *thread, REQUEST *request)
 {
 	rlm_passwd_t const	*inst = instance;
 
 	char			buffer[1024];
+	struct hashtable	*ht;
 	VALUE_PAIR		*key, *i;
 	struct mypasswd		*pw, *last_found;
 	fr_cursor_t		cursor;
@@ -545,6 +644,12 @@ static rlm_rcode_t CC_HINT(nonnull) mod_passwd_map(void *instance, UNUSED void *
 	key = fr_pair_find_by_da(request->packet->vps, inst->keyattr, TAG_ANY);
 	if (!key) return RLM_MODULE_NOTFOUND;
 
+	/*
+	 *	The table stays valid until it's released, even if
+	 *	the file is reloaded in the mean time.
+	 */
+	ht = fr_reload_acquire(inst->reload);
+
 	for (i = fr_cursor_iter_by_da_init(&cursor, &key, inst->keyattr);
 	     i;
 	     i = fr_cursor_next(&cursor)) {
@@ -552,20 +657,25 @@ static rlm_rcode_t CC_HINT(nonnull) mod_passwd_map(void *instance, UNUSED void *
 		 *	Ensure we have the string form of the attribute
 		 */
 		fr_pair_value_snprint(buffer, sizeof(buffer), i, 0);
-		pw = get_pw_nam(buffer, inst->ht, &last_found);
-		if (!pw) continue;
 
-		do {
-			result_add(request, inst, request, &request->control, pw, 0, "config");
-			result_add(request->reply, inst, request, &request->reply->vps, pw, 1, "reply_items");
-			result_add(request->packet, inst, request, &request->packet->vps, pw, 2, "request_items");
-		} while ((pw = get_next(buffer, inst->ht, &last_found)));
+		if (ht->index) {
+			if (!*buffer || !index_result_add(inst, request, ht->index, buffer)) continue;
+		} else {
+			pw = get_pw_nam(buffer, ht, &last_found);
+			if (!pw) continue;
+
+			do {
+				result_add_all(inst, request, pw);
+			} while ((pw = get_next(buffer, ht, &last_found)));
+		}
 
 		found++;
 
 		if (!inst->allow_multiple) break;
 	}
 
+	fr_reload_release(inst->reload);
+
 	if (!found) return RLM_MODULE_NOTFOUND;
 
 	return RLM_MODULE_OK;
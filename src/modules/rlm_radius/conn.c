@@ -0,0 +1,2128 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_radius/conn.c
+ * @brief Connection handling shared by the RADIUS client transports
+ *
+ * The connection state machine, request queueing, status checks,
+ * zombie detection, and the RADIUS encoding and reply processing are
+ * the same for every transport.  The transports provide the socket
+ * handling via #fr_io_connection_funcs_t.
+ *
+ * @copyright 2017  Network RADIUS SARL
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/io/application.h>
+#include <freeradius-devel/io/listen.h>
+#include <freeradius-devel/server/rad_assert.h>
+#include <freeradius-devel/unlang/base.h>
+
+#include "conn.h"
+
+/*
+ *	How often we publish replies to the shared health table.  This
+ *	keeps every reply from writing to the same cache line.
+ */
+#define HEALTH_UPDATE_INTERVAL	(NANOSEC / 1000)
+
+fr_dict_t *dict_radius;
+
+fr_dict_attr_t const *attr_acct_delay_time;
+fr_dict_attr_t const *attr_error_cause;
+fr_dict_attr_t const *attr_event_timestamp;
+fr_dict_attr_t const *attr_extended_attribute_1;
+fr_dict_attr_t const *attr_message_authenticator;
+fr_dict_attr_t const *attr_nas_identifier;
+fr_dict_attr_t const *attr_original_packet_code;
+fr_dict_attr_t const *attr_proxy_state;
+fr_dict_attr_t const *attr_response_length;
+fr_dict_attr_t const *attr_user_password;
+
+static void conn_alloc(fr_io_connection_inst_t const *inst, fr_io_connection_thread_t *t);
+static void conn_zombie_timeout(UNUSED fr_event_list_t *el, UNUSED struct timeval *now, void *uctx);
+
+/** Record a reply from the home server in the shared health table
+ *
+ *  Any reply means that the home server is alive, no matter which
+ *  thread received it.
+ *
+ * @param[in] c		the connection which received the reply.
+ * @param[in] now	when the reply was received.
+ */
+static void health_reply(fr_io_connection_t const *c, fr_time_t now)
+{
+	rlm_radius_health_t	*health = c->inst->health;
+	int64_t			last;
+
+	if (load(health->state) != HEALTH_ALIVE) {
+		if (atomic_exchange_explicit(&health->state, HEALTH_ALIVE, memory_order_acq_rel) != HEALTH_ALIVE) {
+			INFO("%s - Home server %pV port %u is alive", c->module_name,
+			     fr_box_ipaddr(c->dst_ipaddr), c->dst_port);
+		}
+	}
+
+	last = load(health->last_reply);
+	if ((int64_t) now < (last + HEALTH_UPDATE_INTERVAL)) return;
+
+	store(health->last_reply, (int64_t) now);
+}
+
+/** Check if any thread has received a reply since a given time
+ *
+ */
+bool health_alive_since(fr_io_connection_t const *c, fr_time_t when)
+{
+	rlm_radius_health_t *health = c->inst->health;
+
+	if (aquire(health->state) != HEALTH_ALIVE) return false;
+
+	return (load(health->last_reply) > (int64_t) when);
+}
+
+/** Check if the home server has been marked dead by any thread
+ *
+ */
+static bool health_is_dead(rlm_radius_health_t *health, fr_time_t now)
+{
+	if (aquire(health->state) != HEALTH_DEAD) return false;
+
+	return ((int64_t) now < load(health->dead_until));
+}
+
+/** Mark the home server as zombie, if nothing else has marked it already
+ *
+ */
+static void health_zombie(fr_io_connection_t const *c)
+{
+	rlm_radius_health_t	*health = c->inst->health;
+	uint32_t		state = HEALTH_ALIVE;
+
+	if (atomic_compare_exchange_strong_explicit(&health->state, &state, HEALTH_ZOMBIE,
+						    memory_order_acq_rel, memory_order_relaxed)) {
+		WARN("%s - Home server %pV port %u is not responding", c->module_name,
+		     fr_box_ipaddr(c->dst_ipaddr), c->dst_port);
+	}
+}
+
+/** Mark the home server as dead for all threads
+ *
+ *  Requests fail immediately until the zombie period has passed.
+ *  After that, the next request which gets a reply marks it alive
+ *  again.
+ */
+static void health_dead(fr_io_connection_t const *c)
+{
+	rlm_radius_health_t	*health = c->inst->health;
+	fr_time_t		until;
+
+	until = fr_time() + ((fr_time_t) c->thread->zombie_period.tv_sec * NANOSEC) +
+		((fr_time_t) c->thread->zombie_period.tv_usec * 1000);
+	store(health->dead_until, (int64_t) until);
+
+	if (atomic_exchange_explicit(&health->state, HEALTH_DEAD, memory_order_acq_rel) != HEALTH_DEAD) {
+		ERROR("%s - Home server %pV port %u is dead", c->module_name,
+		      fr_box_ipaddr(c->dst_ipaddr), c->dst_port);
+	}
+}
+
+/** Try to become the thread which sends status checks
+ *
+ * @return
+ *	- true if this connection should send status checks.
+ *	- false if another thread is already doing them.
+ */
+static bool health_claim_status_check(fr_io_connection_t *c)
+{
+	uint32_t checker = 0;
+
+	if (c->status_checker) return true;
+
+	if (!atomic_compare_exchange_strong_explicit(&c->inst->health->checker, &checker, c->thread->id,
+						     memory_order_acq_rel, memory_order_relaxed)) return false;
+
+	c->status_checker = true;
+	return true;
+}
+
+/** Let another thread send status checks
+ *
+ */
+static void health_release_status_check(fr_io_connection_t *c)
+{
+	if (!c->status_checker) return;
+
+	store(c->inst->health->checker, 0);
+	c->status_checker = false;
+}
+
+// ATD start
+// the code to "end" is free of all RADIUS pollution.
+
+static int conn_cmp(void const *one, void const *two)
+{
+	fr_io_connection_t const *a = talloc_get_type_abort_const(one, fr_io_connection_t);
+	fr_io_connection_t const *b = talloc_get_type_abort_const(two, fr_io_connection_t);
+
+	if (timercmp(&a->mrs_time, &b->mrs_time, <)) return -1;
+	if (timercmp(&a->mrs_time, &b->mrs_time, >)) return +1;
+
+	if (a->slots_free < b->slots_free) return -1;
+	if (a->slots_free > b->slots_free) return +1;
+
+	return 0;
+}
+
+
+/** Compare two packets in the "to be sent" queue.
+ *
+ *  Status-Server packets are always sorted before other packets, by
+ *  virtue of request->async->recv_time always being zero.
+ */
+static int queue_cmp(void const *one, void const *two)
+{
+	fr_io_request_t const *a = one;
+	fr_io_request_t const *b = two;
+
+	if (a->request->async->recv_time < b->request->async->recv_time) return -1;
+	if (a->request->async->recv_time > b->request->async->recv_time) return +1;
+
+	return 0;
+}
+
+
+/** Close a socket due to idle timeout
+ *
+ */
+static void conn_idle_timeout(UNUSED fr_event_list_t *el, UNUSED struct timeval *now, void *uctx)
+{
+	fr_io_connection_t *c = talloc_get_type_abort(uctx, fr_io_connection_t);
+
+	DEBUG("%s - Idle timeout for connection %s", c->module_name, c->name);
+
+	talloc_free(c);
+}
+
+
+/** Check if the connection is idle.
+ *
+ *  A connection is idle if it hasn't sent or recieved a packet in a
+ *  while.  Note that "no response to packet" does NOT set the idle
+ *  timeout.
+ */
+static void conn_check_idle(fr_io_connection_t *c)
+{
+	struct timeval when;
+
+	/*
+	 *	We set idle (or not) depending on the conneciton
+	 *	state.
+	 */
+	switch (c->state) {
+	case CONN_INIT:
+	case CONN_OPENING:
+		rad_assert(0 == 1);
+		return;
+
+		/*
+		 *	Active means "alive", and not "has packets".
+		 */
+	case CONN_ACTIVE:
+		/*
+		 *	No outstanding packets, we're idle.
+		 */
+		if (fr_dlist_head(&c->sent) == NULL) {
+			break;
+		}
+
+		/*
+		 *	Has outstanding packets, we're not idle.
+		 */
+		/* FALL-THROUGH */
+
+		/*
+		 *	If a connection is blocked, full, or zombie,
+		 *	it's not idle.
+		 */
+	case CONN_BLOCKED:
+	case CONN_FULL:
+	case CONN_ZOMBIE:
+		if (c->idle_ev) (void) fr_event_timer_delete(c->thread->el, &c->idle_ev);
+		return;
+	}
+
+	/*
+	 *	We've already set an idle timeout.  Don't do it again.
+	 */
+	if (c->idle_ev) return;
+
+	gettimeofday(&when, NULL);
+	when.tv_usec += c->thread->idle_timeout.tv_usec;
+	when.tv_sec += when.tv_usec / USEC;
+	when.tv_usec %= USEC;
+
+	when.tv_sec += c->thread->idle_timeout.tv_sec;
+	when.tv_sec += 1;
+
+	if (timercmp(&when, &c->idle_timeout, >)) {
+		when.tv_sec--;
+		c->idle_timeout = when;
+
+		DEBUG("%s - Setting idle timeout to +%pV for connection %s",
+		      c->module_name, fr_box_timeval(c->thread->idle_timeout), c->name);
+		if (fr_event_timer_insert(c, c->thread->el, &c->idle_ev, &c->idle_timeout, conn_idle_timeout, c) < 0) {
+			ERROR("%s - Failed inserting idle timeout for connection %s",
+			      c->module_name, c->name);
+		}
+	}
+}
+
+
+static int conn_check_zombie(fr_io_connection_t *c)
+{
+	struct timeval when, now;
+
+	switch (c->state) {
+		/*
+		 *	If it's unused, why is there a request for it?
+		 */
+	case CONN_INIT:
+	case CONN_OPENING:
+		rad_assert(0 == 1);
+		return 0;
+
+		/*
+		 *	The connection is already marked "zombie", or
+		 *	is doing status checks.  Don't do it again.
+		 */
+	case CONN_ZOMBIE:
+		return 0;
+
+		/*
+		 *	It was alive, but it might not be any longer.
+		 */
+	case CONN_ACTIVE:
+	case CONN_FULL:
+	case CONN_BLOCKED:
+		break;
+	}
+
+	/*
+	 *	Check if we can mark the connection as "dead".
+	 */
+	gettimeofday(&now, NULL);
+	when = c->last_reply;
+
+	/*
+	 *	Use the zombie_period for the timeout.
+	 *
+	 *	Note that we do this check on every packet, which is a
+	 *	bit annoying, but oh well.
+	 */
+	fr_timeval_add(&when, &when, &c->thread->zombie_period);
+	if (timercmp(&when, &now, > )) return 0;
+
+	/*
+	 *	We haven't had a reply, but other threads have.  The
+	 *	home server is still alive.
+	 */
+	if (health_alive_since(c, fr_time() - (((fr_time_t) c->thread->zombie_period.tv_sec * NANOSEC) +
+					       ((fr_time_t) c->thread->zombie_period.tv_usec * 1000)))) return 0;
+
+	/*
+	 *	The home server hasn't responded in a long time.  Mark
+	 *	the connection as "zombie".
+	 */
+	conn_transition(c, CONN_ZOMBIE);
+
+	return 0;
+}
+
+
+/** Set the socket to "nothing to write"
+ *
+ *  But keep the read event open, just in case the other end sends us
+ *  data.  That way we can process it.
+ *
+ * @param[in] c		Connection data structure
+ */
+void fd_idle(fr_io_connection_t *c)
+{
+	DEBUG3("Marking socket %s as idle", c->name);
+	if (fr_event_fd_insert(c->conn, c->thread->el, c->fd,
+			       c->inst->funcs->read,
+			       NULL,
+			       conn_error,
+			       c) < 0) {
+		PERROR("Failed inserting FD event");
+		fr_connection_signal_reconnect(c->conn);
+	}
+}
+
+/** Set the socket to active
+ *
+ * We have messages we want to send, so need to know when the socket is writable.
+ *
+ * @param[in] c		Connection data structure
+ */
+void fd_active(fr_io_connection_t *c)
+{
+	DEBUG3("%s - Activating connection %s", c->module_name, c->name);
+
+	/*
+	 *	If we're writing to the connection, it's not idle.
+	 */
+	if (c->idle_ev) (void) fr_event_timer_delete(c->thread->el, &c->idle_ev);
+
+	if (fr_event_fd_insert(c->conn, c->thread->el, c->fd,
+			       c->inst->funcs->read,
+			       c->inst->funcs->writable,
+			       conn_error,
+			       c) < 0) {
+		PERROR("Failed inserting FD event");
+
+		/*
+		 *	May free the connection!
+		 */
+		fr_connection_signal_reconnect(c->conn);
+	}
+}
+
+/** Connection errored
+ *
+ */
+void conn_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, int fd_errno, void *uctx)
+{
+	fr_io_connection_t *c = talloc_get_type_abort(uctx, fr_io_connection_t);
+
+	ERROR("%s - Connection failed: %s - %s", c->module_name, fr_syserror(fd_errno), c->name);
+
+	/*
+	 *	Something bad happened... Fix it...
+	 */
+	fr_connection_signal_reconnect(c->conn);
+}
+
+
+/** Set the kernel buffer sizes for a socket
+ *
+ */
+void conn_set_buffers(fr_io_connection_t *c, int fd)
+{
+#ifdef SO_RCVBUF
+	if (c->inst->recv_buff_is_set) {
+		int opt;
+
+		opt = c->inst->recv_buff;
+		if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &opt, sizeof(int)) < 0) {
+			WARN("Failed setting 'recv_buf': %s", fr_syserror(errno));
+		}
+	}
+#endif
+
+#ifdef SO_SNDBUF
+	if (c->inst->send_buff_is_set) {
+		int opt;
+
+		opt = c->inst->send_buff;
+		if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &opt, sizeof(int)) < 0) {
+			WARN("Failed setting 'send_buf': %s", fr_syserror(errno));
+		}
+	}
+#endif
+}
+
+/** Free the connection, and return requests to the thread queue
+ *
+ */
+static int _conn_free(fr_io_connection_t *c)
+{
+	fr_io_request_t	*u;
+	fr_io_connection_thread_t	*t = talloc_get_type_abort(c->thread, fr_io_connection_thread_t);
+
+	/*
+	 *	We're no longer using this connection.
+	 */
+	while (true) {
+		uint32_t num_connections;
+
+		num_connections = load(c->inst->parent->num_connections);
+		rad_assert(num_connections > 0);
+
+		if (cas_decr(c->inst->parent->num_connections, num_connections)) break;
+	}
+
+	/*
+	 *	Explicit free not technically required,
+	 *	but may prevent future ordering issues.
+	 */
+	talloc_free(c->conn);
+	c->conn = NULL;
+
+	/*
+	 *	Move "sent" packets back to the main thread queue
+	 */
+	while ((u = fr_dlist_head(&c->sent)) != NULL) {
+		state_transition(u, REQUEST_IO_STATE_QUEUED, NULL);
+	}
+
+	if (c->zombie_ev) (void) fr_event_timer_delete(c->thread->el, &c->zombie_ev);
+	if (c->idle_ev) (void) fr_event_timer_delete(c->thread->el, &c->idle_ev);
+
+	health_release_status_check(c);
+
+	talloc_free_children(c); /* clears out FD events, timers, etc. */
+
+	switch (c->state) {
+	default:
+		rad_assert(0 == 1);
+		break;
+
+	case CONN_INIT:
+		break;
+
+	case CONN_OPENING:
+		fr_dlist_remove(&c->thread->opening, c);
+		break;
+
+	case CONN_BLOCKED:
+	case CONN_FULL:
+		fr_dlist_remove(&c->thread->blocked, c);
+		break;
+
+	case CONN_ZOMBIE:
+		fr_dlist_remove(&c->thread->zombie, c);
+		break;
+
+	case CONN_ACTIVE:
+		rad_assert(c->heap_id >= 0);
+		(void) fr_heap_extract(t->active, c);
+		break;
+	}
+
+	return 0;
+}
+
+/** Destroy thread data for the IO submodule.
+ *
+ */
+int conn_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	fr_io_connection_thread_t *t = talloc_get_type_abort(thread, fr_io_connection_thread_t);
+
+	if (fr_heap_num_elements(t->queued) != 0) {
+		ERROR("There are still queued requests");
+		return -1;
+	}
+
+	/*
+	 *	Free all of the heaps, lists, and sockets.
+	 */
+	talloc_free_children(t);
+
+	if (fr_dlist_head(&t->opening) != NULL) {
+		ERROR("There are still partially open sockets");
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Instantiate thread data for the submodule.
+ *
+ */
+int conn_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance, fr_event_list_t *el, void *thread)
+{
+	fr_io_connection_inst_t *inst = instance;
+	fr_io_connection_thread_t *t = talloc_get_type_abort(thread, fr_io_connection_thread_t);
+
+#define COPY(_x) t->_x = inst->parent->_x
+	COPY(max_connections);
+	COPY(connection_timeout);
+	COPY(reconnection_delay);
+	COPY(idle_timeout);
+	COPY(zombie_period);
+
+	t->id = atomic_fetch_add_explicit(&inst->health->num_threads, 1, memory_order_relaxed) + 1;
+
+	t->el = el;
+
+	t->queued = fr_heap_talloc_create(t, queue_cmp, fr_io_request_t, heap_id);
+	fr_dlist_init(&t->blocked, fr_io_connection_t, entry);
+	fr_dlist_init(&t->full, fr_io_connection_t, entry);
+	fr_dlist_init(&t->zombie, fr_io_connection_t, entry);
+	fr_dlist_init(&t->opening, fr_io_connection_t, entry);
+
+	t->active = fr_heap_talloc_create(t, conn_cmp, fr_io_connection_t, heap_id);
+
+	conn_alloc(inst, t);
+	return 0;
+}
+
+rlm_rcode_t conn_request_resume(UNUSED REQUEST *request, UNUSED void *instance, UNUSED void *thread, void *ctx)
+{
+	fr_io_request_t *u = talloc_get_type_abort(ctx, fr_io_request_t);
+	rlm_rcode_t rcode;
+
+	rcode = u->rcode;
+	rad_assert(rcode != RLM_MODULE_YIELD);
+	talloc_free(u);
+
+	return rcode;
+}
+
+void conn_transition(fr_io_connection_t *c, fr_io_connection_state_t state)
+{
+	struct timeval when;
+
+	if (c->state == state) return;
+
+	/*
+	 *	Get it out of the old state.
+	 */
+	switch (c->state) {
+	case CONN_INIT:
+		break;
+
+	case CONN_OPENING:
+	case CONN_FULL:
+	case CONN_BLOCKED:
+		fr_dlist_remove(&c->thread->blocked, c); /* we only need 'offset' from the list */
+		break;
+
+	case CONN_ACTIVE:
+		rad_assert(c->heap_id >= 0);
+		(void) fr_heap_extract(c->thread->active, c);
+		if (c->idle_ev) (void) fr_event_timer_delete(c->thread->el, &c->idle_ev);
+		break;
+
+	case CONN_ZOMBIE:
+		/*
+		 *	Don't transition from zombie to blocked when
+		 *	we're trying to write status check packets to
+		 *	the connection.
+		 */
+		if (state == CONN_BLOCKED) return;
+
+		fr_dlist_remove(&c->thread->blocked, c);
+		if (c->zombie_ev) (void) fr_event_timer_delete(c->thread->el, &c->zombie_ev);
+		health_release_status_check(c);
+		break;
+	}
+
+	/*
+	 *	And move it to the new state.
+	 */
+	c->state = state;
+	switch (c->state) {
+	case CONN_INIT:
+		break;
+
+	case CONN_OPENING:
+		fr_dlist_insert_head(&c->thread->opening, c);
+		break;
+
+	case CONN_ACTIVE:
+		rad_assert(c->heap_id < 0);
+		(void) fr_heap_insert(c->thread->active, c);
+		conn_check_idle(c);
+		break;
+
+	case CONN_BLOCKED:
+		if (c->idle_ev) (void) fr_event_timer_delete(c->thread->el, &c->idle_ev);
+
+		fr_dlist_insert_head(&c->thread->blocked, c);
+		break;
+
+	case CONN_FULL:
+		if (c->idle_ev) (void) fr_event_timer_delete(c->thread->el, &c->idle_ev);
+
+		fr_dlist_insert_head(&c->thread->full, c);
+		break;
+
+	case CONN_ZOMBIE:
+		if (c->idle_ev) (void) fr_event_timer_delete(c->thread->el, &c->idle_ev);
+
+		fr_dlist_insert_head(&c->thread->zombie, c);
+
+		gettimeofday(&when, NULL);
+		c->zombie_start = when;
+
+		c->zombie_time = fr_time();
+		health_zombie(c);
+
+		fr_timeval_add(&when, &when, &c->thread->zombie_period);
+		WARN("%s - Entering Zombie state - connection %s", c->module_name, c->name);
+
+		if (fr_event_timer_insert(c, c->thread->el, &c->zombie_ev, &when, conn_zombie_timeout, c) < 0) {
+			ERROR("%s - Failed inserting zombie timeout for connection %s",
+			      c->module_name, c->name);
+		}
+		break;
+	}
+}
+
+void conn_finished_request(fr_io_connection_t *c, fr_io_request_t *u)
+{
+	rad_assert(u->state != REQUEST_IO_STATE_DONE);
+
+	if (c) {
+		rad_assert(u->state == REQUEST_IO_STATE_WRITTEN);
+		state_transition(u, REQUEST_IO_STATE_REPLIED, NULL);
+
+		conn_check_idle(c);
+
+	} else {
+		rad_assert(u->state == REQUEST_IO_STATE_QUEUED);
+		state_transition(u, REQUEST_IO_STATE_REPLIED, NULL);
+	}
+}
+
+// ATD END
+
+
+static int conn_timeout_init(fr_event_list_t *el, fr_io_request_t *u, fr_event_cb_t callback)
+{
+	u->time_sent = fr_time();
+	fr_time_to_timeval(&u->timer.start, u->time_sent);
+
+	if (rr_track_start(&u->timer) < 0) {
+		return -1;
+	}
+
+	if (fr_event_timer_insert(u, el, &u->timer.ev, &u->timer.next,
+				  callback, u) < 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Deal with status check timeouts
+ *
+ *  Each status check is sent as a new packet, with a new ID, a new
+ *  Request Authenticator, and a new Event-Timestamp.
+ */
+static void status_check_timeout(fr_event_list_t *el, struct timeval *now, void *uctx)
+{
+	int				rcode;
+	fr_io_request_t			*u = uctx;
+	fr_io_connection_t		*c = u->c;
+	REQUEST				*request;
+
+	rad_assert(u == c->status_u);
+	rad_assert(u->timer.ev == NULL);
+	rad_assert(!c->inst->parent->synchronous);
+
+	request = u->request;
+
+	RDEBUG("TIMER - response timeout on status check packet reached for try (%d/%d)",
+	       u->timer.count, u->timer.retry->mrc);
+
+	/*
+	 *	Can we send another status check?  If not, the home
+	 *	server is dead.
+	 */
+	rcode = rr_track_retry(&u->timer, now);
+	if (rcode == 0) {
+		REDEBUG("No response to status checks, closing connection %s", c->name);
+		health_dead(c);
+		talloc_free(c);
+		return;
+	}
+
+	/*
+	 *	Insert the next retransmission timer.
+	 */
+	if (fr_event_timer_insert(u, el, &u->timer.ev, &u->timer.next, status_check_timeout, u) < 0) {
+		REDEBUG("Failed inserting retransmission timer for status check - closing connection %s", c->name);
+		talloc_free(c);
+		return;
+	}
+
+	rad_assert(u->state == REQUEST_IO_STATE_WRITTEN);
+
+	/*
+	 *	Free / allocate the ID.  This ensures that the ID
+	 *	changes.  For UDP, it may also move the packet to a
+	 *	different source port.
+	 */
+	c->inst->funcs->id_free(c, u);
+	u->rr = c->inst->funcs->id_alloc(c, u);
+	rad_assert(u->rr != NULL);
+
+	RDEBUG("Sending new status check ID %d on connection %s", u->rr->id, c->name);
+
+	rcode = c->inst->funcs->write(c, u);
+	if (rcode < 0) {
+		RDEBUG("Failed sending status check packet for connection %s", c->name);
+		talloc_free(c);
+		return;
+	}
+
+	/*
+	 *	Blocked.  Write the status check as soon as the
+	 *	socket becomes writable.
+	 */
+	if (rcode == 0) {
+		c->status_check_blocked = true;
+		fd_active(c);
+		return;
+	}
+
+	c->status_check_blocked = false;
+	if (c->inst->funcs->flush) (void) c->inst->funcs->flush(c);
+}
+
+
+/** Mark a connection "zombie" due to zombie timeout.
+ *
+ */
+static void conn_zombie_timeout(UNUSED fr_event_list_t *el, UNUSED struct timeval *now, void *uctx)
+{
+	fr_io_connection_t *c = talloc_get_type_abort(uctx, fr_io_connection_t);
+	fr_io_request_t *u;
+	int rcode;
+
+	ERROR("%s - Zombie timeout for connection %s", c->module_name, c->name);
+
+	/*
+	 *	Another thread has heard from the home server since
+	 *	this connection became zombie.
+	 */
+	if (health_alive_since(c, c->zombie_time)) {
+		DEBUG2("%s - Home server is responding to other threads, reactivating connection %s",
+		       c->module_name, c->name);
+		conn_transition(c, CONN_ACTIVE);
+		if (fr_heap_num_elements(c->thread->queued) > 0) fd_active(c);
+		return;
+	}
+
+	/*
+	 *	Another thread has decided that the home server is
+	 *	dead.
+	 */
+	if (health_is_dead(c->inst->health, fr_time())) {
+		DEBUG2("%s - Home server is dead, closing connection %s", c->module_name, c->name);
+		talloc_free(c);
+		return;
+	}
+
+	if (!c->status_u) {
+		DEBUG2("%s - No status_check response, closing connection %s", c->module_name, c->name);
+		talloc_free(c);
+		return;
+	}
+
+	/*
+	 *	Only one thread sends status checks.  The rest check
+	 *	its results every initial_retransmission_time.
+	 */
+	if (!health_claim_status_check(c)) {
+		struct timeval when;
+
+		DEBUG2("%s - Another thread is sending status checks, waiting - connection %s",
+		       c->module_name, c->name);
+
+		gettimeofday(&when, NULL);
+		when.tv_sec += c->status_u->timer.retry->irt;
+
+		if (fr_event_timer_insert(c, c->thread->el, &c->zombie_ev, &when, conn_zombie_timeout, c) < 0) {
+			ERROR("%s - Failed inserting zombie timeout for connection %s",
+			      c->module_name, c->name);
+			talloc_free(c);
+		}
+		return;
+	}
+
+	/*
+	 *	If we have Status-Server packets, start sending those now.
+	 */
+	u = c->status_u;
+
+	/*
+	 *	Re-initialize the timers.
+	 */
+	u->timer.count = 0;
+	c->status_check_blocked = false;
+
+	/*
+	 *	Start the timers for status checks.
+	 */
+	if (conn_timeout_init(c->thread->el, u, status_check_timeout) < 0) {
+		DEBUG("%s - Failed starting retransmit tracking for connection %s",
+		      c->module_name, c->name);
+		talloc_free(c);
+		return;
+	}
+
+	/*
+	 *	And now write it to the connection.
+	 */
+	rcode = c->inst->funcs->write(c, u);
+	if (rcode < 0) {
+		DEBUG2("%s - Failed writing status check, closing connection %s",
+		       c->module_name, c->name);
+		talloc_free(c);
+		return;
+	}
+
+	/*
+	 *	Blocked.  Wait for the socket to become ready, OR for
+	 *	the retransmission timer to fire.
+	 */
+	if (rcode == 0) {
+		c->status_check_blocked = true;
+		DEBUG2("%s - Blocked writing status check on connection %s",
+		       c->module_name, c->name);
+		fd_active(c);
+		return;
+	}
+
+	/*
+	 *	Note that the status check packets not in any
+	 *	"sent" list
+	 */
+	if (rcode == 1) {
+		u->state = REQUEST_IO_STATE_WRITTEN;
+		u->c = c;
+		if (c->inst->funcs->flush) (void) c->inst->funcs->flush(c);
+		return;
+	}
+
+	/*
+	 *	Status check packets are never replicated.
+	 */
+	rad_assert(0 == 1);
+}
+
+
+void state_transition(fr_io_request_t *u, fr_io_request_state_t state, fr_io_connection_t *c)
+{
+	if (u->state == state) return;
+
+	switch (u->state) {
+	case REQUEST_IO_STATE_INIT:
+		rad_assert((state == REQUEST_IO_STATE_QUEUED) || (state == REQUEST_IO_STATE_DONE));
+		break;
+
+	case REQUEST_IO_STATE_QUEUED:
+		rad_assert(u->heap_id >= 0);
+		(void) fr_heap_extract(u->thread->queued, u);
+		break;
+
+	case REQUEST_IO_STATE_WRITTEN:
+		rad_assert(u->rr != NULL);
+		rad_assert(u->c != NULL);
+
+		/*
+		 *      Status check packets are never removed from
+		 *      the connection, and their IDs are never
+		 *      deallocated.
+		 */
+		if (u == u->c->status_u) {
+			u->state = REQUEST_IO_STATE_INIT;
+			return;
+		}
+
+		u->c->inst->funcs->id_free(u->c, u);
+		fr_dlist_remove(&u->c->sent, u);
+		u->rr = NULL;
+		u->c = NULL;
+		break;
+
+	case REQUEST_IO_STATE_REPLIED:
+		rad_assert(state == REQUEST_IO_STATE_DONE);
+		break;
+
+	default:
+		rad_assert(0 == 1);
+		break;
+	}
+
+	u->state = state;
+	u->c = c;
+
+	switch (u->state) {
+	case REQUEST_IO_STATE_QUEUED:
+	queued:
+		rad_assert(u->rr == NULL);
+		u->c = NULL;
+		rad_assert(u->heap_id < 0);
+		fr_heap_insert(u->thread->queued, u);
+		break;
+
+	case REQUEST_IO_STATE_WRITTEN:
+		rad_assert(c != NULL);
+
+		/*
+		 *	Allocate an ID for the packet.
+		 */
+		u->rr = c->inst->funcs->id_alloc(c, u);
+		if (!u->rr) {
+			u->state = REQUEST_IO_STATE_QUEUED;
+			u->c = NULL;
+			conn_transition(c, CONN_FULL);
+			goto queued;
+		}
+		u->c = c;
+		fr_dlist_insert_tail(&u->c->sent, u);
+		break;
+
+	case REQUEST_IO_STATE_REPLIED:
+		rad_assert(u->rr == NULL);
+		rad_assert(u->c == NULL);
+		if (u->timer.ev) (void) fr_event_timer_delete(u->thread->el, &u->timer.ev);
+		if (u->yielded) unlang_resumable(u->request);
+		break;
+
+	case REQUEST_IO_STATE_DONE:
+		rad_assert(u->rr == NULL);
+		rad_assert(u->c == NULL);
+		if (u->timer.ev) (void) fr_event_timer_delete(u->thread->el, &u->timer.ev);
+		break;
+
+	default:
+		rad_assert(0 == 1);
+		break;
+	}
+}
+
+/* ATD - all of this to "end" is 100% RADIUS only */
+
+/** Turn a reply code into a module rcode;
+ *
+ */
+static rlm_rcode_t code2rcode[FR_MAX_PACKET_CODE] = {
+	[FR_CODE_ACCESS_ACCEPT]		= RLM_MODULE_OK,
+	[FR_CODE_ACCESS_CHALLENGE]	= RLM_MODULE_UPDATED,
+	[FR_CODE_ACCESS_REJECT]		= RLM_MODULE_REJECT,
+
+	[FR_CODE_ACCOUNTING_RESPONSE]	= RLM_MODULE_OK,
+
+	[FR_CODE_COA_ACK]		= RLM_MODULE_OK,
+	[FR_CODE_COA_NAK]		= RLM_MODULE_REJECT,
+
+	[FR_CODE_DISCONNECT_ACK]	= RLM_MODULE_OK,
+	[FR_CODE_DISCONNECT_NAK]	= RLM_MODULE_REJECT,
+
+	[FR_CODE_PROTOCOL_ERROR]	= RLM_MODULE_FAIL,
+};
+
+
+/** If we get a reply, the request must come from one of a small
+ * number of packet types.
+ */
+static FR_CODE allowed_replies[FR_MAX_PACKET_CODE] = {
+	[FR_CODE_ACCESS_ACCEPT]		= FR_CODE_ACCESS_REQUEST,
+	[FR_CODE_ACCESS_CHALLENGE]	= FR_CODE_ACCESS_REQUEST,
+	[FR_CODE_ACCESS_REJECT]		= FR_CODE_ACCESS_REQUEST,
+
+	[FR_CODE_ACCOUNTING_RESPONSE]	= FR_CODE_ACCOUNTING_REQUEST,
+
+	[FR_CODE_COA_ACK]		= FR_CODE_COA_REQUEST,
+	[FR_CODE_COA_NAK]		= FR_CODE_COA_REQUEST,
+
+	[FR_CODE_DISCONNECT_ACK]	= FR_CODE_DISCONNECT_REQUEST,
+	[FR_CODE_DISCONNECT_NAK]	= FR_CODE_DISCONNECT_REQUEST,
+};
+
+
+/** Deal with Protocol-Error replies, and possible negotiation
+ *
+ */
+static void protocol_error_reply(fr_io_connection_t *c, REQUEST *request)
+{
+	VALUE_PAIR *vp, *error_cause;
+
+	error_cause = fr_pair_find_by_da(request->reply->vps, attr_error_cause, TAG_ANY);
+	if (!error_cause) return;
+
+	if ((error_cause->vp_uint32 == 601) &&
+	    attr_response_length &&
+	    ((vp = fr_pair_find_by_da(request->reply->vps, attr_response_length, TAG_ANY)) != NULL)) {
+
+		if ((vp->vp_uint32 > c->buflen) && (vp->vp_uint32 <= 65535)) {
+			request->module = c->module_name;
+			RDEBUG("Increasing buffer size to %u for connection %s", vp->vp_uint32, c->name);
+
+			talloc_free(c->buffer);
+			c->buflen = vp->vp_uint32;
+			MEM(c->buffer = talloc_array(c, uint8_t, c->buflen));
+		}
+	}
+}
+
+/** Deal with Status-Server replies, and possible negotiation
+ *
+ */
+static void status_server_reply(fr_io_connection_t *c, fr_io_request_t *u, REQUEST *request)
+{
+	VALUE_PAIR *vp;
+
+	/*
+	 *	Remove all timers associated with the packet.
+	 */
+	if (u->timer.ev) (void) fr_event_timer_delete(u->thread->el, &u->timer.ev);
+
+	rad_assert(u->state == REQUEST_IO_STATE_WRITTEN);
+
+	if (u->code != FR_CODE_STATUS_SERVER) return;
+
+	/*
+	 *	Allow Response-Length in replies to Status-Server
+	 *	packets.
+	 */
+	if (attr_response_length &&
+	    ((vp = fr_pair_find_by_da(request->reply->vps, attr_response_length, TAG_ANY)) != NULL)) {
+		if ((vp->vp_uint32 > c->buflen) && (vp->vp_uint32 <= 65535)) {
+			request->module = c->module_name;
+			RDEBUG("Increasing buffer size to %u for connection %s", vp->vp_uint32, c->name);
+
+			talloc_free(c->buffer);
+			c->buflen = vp->vp_uint32;
+			MEM(c->buffer = talloc_array(c, uint8_t, c->buflen));
+		}
+	}
+
+	/*
+	 *	Delete the reply VPs, but leave the request VPs in
+	 *	place.
+	 */
+#ifdef __clang_analyzer__
+	if (request->reply)
+#endif
+		fr_pair_list_free(&request->reply->vps);
+
+}
+
+/** Process one reply packet
+ *
+ *  The reply is matched to the request by ID, verified, and decoded
+ *  into the request.  The caller deals with moving the connection
+ *  back to "active".
+ *
+ * @param[in] c		the connection which received the reply.
+ * @param[in] id	the ID tracking table the reply's ID was allocated from.
+ * @param[in] data	the reply packet.
+ * @param[in] data_len	length of the reply packet.
+ * @return
+ *	- true if a request was finished.
+ *	- false if the packet was ignored.
+ */
+bool conn_process_reply(fr_io_connection_t *c, rlm_radius_id_t *id, uint8_t *data, size_t data_len)
+{
+	rlm_radius_request_t		*rr;
+	fr_io_request_t			*u;
+	int				code;
+	decode_fail_t			reason;
+	size_t				packet_len;
+	REQUEST				*request = NULL;
+	uint8_t				original[20];
+
+ { /* RADIUS START - do various protocol-specific validations */
+
+	packet_len = data_len;
+	if (!fr_radius_ok(data, &packet_len, c->inst->parent->max_attributes, false, &reason)) {
+		WARN("%s - Ignoring malformed packet", c->module_name);
+		return false;
+	}
+
+	if (DEBUG_ENABLED3) {
+		DEBUG3("%s - Read packet", c->module_name);
+		fr_radius_print_hex(fr_log_fp, data, packet_len);
+	}
+
+	rr = rr_track_find(id, data[1], NULL);
+	if (!rr) {
+		WARN("%s - Ignoring reply which arrived too late", c->module_name);
+		return false;
+	}
+
+	u = rr->request_io_ctx;
+	request = u->request;
+	rad_assert(request != NULL);
+
+	original[0] = rr->code;
+	original[1] = 0;	/* not looked at by fr_radius_verify_precomputed() */
+	original[2] = 0;
+	original[3] = 20;	/* for debugging */
+	memcpy(original + 4, rr->vector, sizeof(rr->vector));
+
+	if (fr_radius_verify_precomputed(data, original,
+					 (uint8_t const *) c->inst->secret, talloc_array_length(c->inst->secret) - 1,
+					 c->inst->secret_hmac) < 0) {
+		RPWDEBUG("Ignoring response with invalid signature");
+		return false;
+	}
+
+	/*
+	 *	We can only get a reply to a sent packet.
+	 */
+	rad_assert(u->state == REQUEST_IO_STATE_WRITTEN);
+	rad_assert(u->c == c);
+
+	health_reply(c, fr_time());
+
+	code = data[0];
+
+	/*
+	 *	Set request return code based on the packet type.
+	 *	Note that we don't care what the sent packet is, we
+	 *	presume that the reply is correct for the request,
+	 *	because it has been successfully verified.  The reply
+	 *	packet code only affects the module return code,
+	 *	nothing else.
+	 *
+	 *	Protocol-Error is special.  It goes through it's own
+	 *	set of checks.
+	 */
+	if (code == FR_CODE_PROTOCOL_ERROR) {
+		uint8_t const *attr, *end;
+
+		end = data + packet_len;
+		u->rcode = RLM_MODULE_INVALID;
+
+		for (attr = data + 20;
+		     attr < end;
+		     attr += attr[1]) {
+			/*
+			 *	The attribute containing the
+			 *	Original-Packet-Code is an extended
+			 *	attribute.
+			 */
+			if (attr[0] != (uint8_t)attr_extended_attribute_1->attr) continue;
+
+			/*
+			 *	ATTR + LEN + EXT-Attr + uint32
+			 */
+			if (attr[1] != 7) continue;
+
+			/*
+			 *	See if there's an Original-Packet-Code.
+			 */
+			if (attr[2] != (uint8_t)attr_original_packet_code->attr) continue;
+
+			/*
+			 *	Has to be an 8-bit number.
+			 */
+			if ((attr[3] != 0) ||
+			    (attr[4] != 0) ||
+			    (attr[5] != 0)) {
+				REDEBUG("Original-Packet-Code has invalid value > 255");
+				break;
+			}
+
+			/*
+			 *	The value has to match.  We don't
+			 *	currently multiplex different codes
+			 *	with the same IDs on connections.  So
+			 *	this check is just for RFC compliance,
+			 *	and for sanity.
+			 */
+			if (attr[6] != u->code) {
+				REDEBUG("Original-Packet-Code %d does not match original code %d",
+				        attr[6], u->code);
+				break;
+			}
+
+			/*
+			 *	Allow the Protocol-Error response,
+			 *	which returns "fail".
+			 */
+			u->rcode = RLM_MODULE_FAIL;
+			break;
+		}
+
+		/*
+		 *	Decode and print the reply, so that the caller
+		 *	can do something with it.
+		 */
+		goto decode_reply;
+
+	} else if (!code || (code >= FR_MAX_PACKET_CODE)) {
+		REDEBUG("Unknown reply code %d", code);
+		u->rcode = RLM_MODULE_INVALID;
+
+		/*
+		 *	Different debug message.  The packet is within
+		 *	the known bounds, but is one we don't handle.
+		 */
+	} else if (!allowed_replies[code]) {
+		REDEBUG("%s packet received invalid reply code %s", fr_packet_codes[u->code], fr_packet_codes[code]);
+		u->rcode = RLM_MODULE_INVALID;
+
+		/*
+		 *	Status-Server can accept many kinds of
+		 *	replies.
+		 */
+	} else if (u->code == FR_CODE_STATUS_SERVER) {
+		goto check_reply;
+
+		/*
+		 *	The reply is a known code, but isn't
+		 *	appropriate for the request packet type.
+		 */
+	} else if (allowed_replies[code] != (FR_CODE) u->code) {
+		rad_assert(request != NULL);
+
+		REDEBUG("%s packet received invalid reply code %s", fr_packet_codes[u->code], fr_packet_codes[code]);
+		u->rcode = RLM_MODULE_INVALID;
+
+		/*
+		 *	<whew>, it's OK.  Choose the correct module
+		 *	rcode based on the reply code.  This is either
+		 *	OK for an ACK, or FAIL for a NAK.
+		 */
+	} else {
+		VALUE_PAIR *vp;
+
+check_reply:
+		u->rcode = code2rcode[code];
+
+		if (u->rcode == RLM_MODULE_INVALID) {
+			REDEBUG("%s packet received invalid reply code %s", fr_packet_codes[u->code], fr_packet_codes[code]);
+			goto done;
+		}
+
+	decode_reply:
+		vp = NULL;
+
+		/*
+		 *	Decode the attributes, in the context of the
+		 *	reply.  This only fails if the packet is
+		 *	malformed, or if we run out of memory.
+		 */
+		if (fr_radius_decode(request->reply, data, packet_len, original,
+				     c->inst->secret, talloc_array_length(c->inst->secret) - 1, &vp) < 0) {
+			REDEBUG("Failed decoding attributes for packet");
+			fr_pair_list_free(&vp);
+			u->rcode = RLM_MODULE_INVALID;
+			goto done;
+		}
+
+		RDEBUG("Received %s ID %d length %ld reply packet on connection %s",
+		       fr_packet_codes[code], code, packet_len, c->name);
+		log_request_pair_list(L_DBG_LVL_2, request, vp, NULL);
+
+		/*
+		 *	@todo - make this programmatic?  i.e. run a
+		 *	separate policy which updates the reply.
+		 *
+		 *	This is why I wanted to have "recv
+		 *	Access-Accept" policies...  so the user could
+		 *	programatically decide which attributes to add.
+		 */
+
+		request->reply->code = code;
+		fr_pair_add(&request->reply->vps, vp);
+
+		/*
+		 *	Run hard-coded policies on Protocol-Error
+		 */
+		if (code == FR_CODE_PROTOCOL_ERROR) protocol_error_reply(c, request);
+
+		/*
+		 *	Run hard-coded policies on packets *we* sent
+		 *	as status checks.
+		 */
+		if (u == c->status_u) status_server_reply(c, u, request);
+	}
+} /* RADIUS END */
+
+done:
+	rad_assert(request != NULL);
+	rad_assert(request->reply != NULL);
+
+	/*
+	 *	Mark the request as finished.
+	 */
+	rad_assert(u->c == c);
+	rad_assert(u->rr != NULL);
+	rad_assert(u->state == REQUEST_IO_STATE_WRITTEN);
+	conn_finished_request(c, u);
+
+	/*
+	 *	Remember when we last saw a reply.
+	 */
+	gettimeofday(&c->last_reply, NULL);
+
+	/*
+	 *	Track the Most Recently Started with reply.  If we're
+	 *	active, re-order the heap, so that packets we're going
+	 *	to send will use the best connection.
+	 */
+	if (timercmp(&u->timer.start, &c->mrs_time, >)) {
+		if (c->state == CONN_ACTIVE) {
+			(void) fr_heap_extract(c->thread->active, c);
+			c->mrs_time = u->timer.start;
+			(void) fr_heap_insert(c->thread->active, c);
+		} else {
+			c->mrs_time = u->timer.start;
+		}
+	}
+
+	return true;
+}
+
+/** Encode a packet into the connection's buffer
+ *
+ *  Adds Proxy-State and Message-Authenticator, and signs the packet.
+ *
+ * @param c the connection
+ * @param u the fr_io_request_t connecting everything
+ * @return
+ *	- <0 on error
+ *	- >0 the length of the encoded packet in c->buffer.
+ */
+ssize_t conn_encode(fr_io_connection_t *c, fr_io_request_t *u)
+{
+	ssize_t			packet_len;
+	uint8_t			*msg = NULL;
+	int			require_ma = 0;
+	int			proxy_state = 6;
+	REQUEST			*request;
+	char const		*module_name;
+
+	rad_assert(c->inst->parent->allowed[u->code] || (u == c->status_u));
+	if (c->idle_ev) (void) fr_event_timer_delete(c->thread->el, &c->idle_ev);
+
+	request = u->request;
+
+	/*
+	 *	Make sure that we print out the actual encoded value
+	 *	of the Message-Authenticator attribute.  If the caller
+	 *	asked for one, delete theirs (which has a bad value),
+	 *	and remember to add one manually when we encode the
+	 *	packet.  This is the only editing we do on the input
+	 *	request.
+	 */
+	if (fr_pair_find_by_da(request->packet->vps, attr_message_authenticator, TAG_ANY)) {
+		require_ma = 18;
+		pair_delete_request(attr_message_authenticator);
+	}
+
+	/*
+	 *	All proxied Access-Request packets MUST have a
+	 *	Message-Authenticator, otherwise they're insecure.
+	 *	Same goes for Status-Server.
+	 *
+	 *	And we set the authentication vector to a random
+	 *	number...
+	 */
+	if ((u->code == FR_CODE_ACCESS_REQUEST) ||
+	    (u->code == FR_CODE_STATUS_SERVER)) {
+		size_t i;
+		uint32_t hash, base;
+
+		require_ma = 18;
+
+		base = fr_rand();
+		for (i = 0; i < RADIUS_AUTH_VECTOR_LENGTH; i += sizeof(uint32_t)) {
+			hash = fr_rand() ^ base;
+			memcpy(c->buffer + 4 + i, &hash, sizeof(hash));
+		}
+	}
+
+	/*
+	 *	Every status check packet has an Event-Timestamp.  The
+	 *	timestamp changes every time we send a packet.  Status
+	 *	check packets never have Proxy-State, because we
+	 *	generated them, and they're not proxied.
+	 */
+	if (u == c->status_u) {
+		VALUE_PAIR *vp;
+
+		proxy_state = 0;
+		vp = fr_pair_find_by_da(request->packet->vps, attr_event_timestamp, TAG_ANY);
+		if (vp) vp->vp_uint32 = time(NULL);
+	}
+
+	/*
+	 *	We should have at mininum 64-byte packets, so don't
+	 *	bother doing run-time checks here.
+	 */
+	rad_assert(c->buflen >= (size_t) (20 + proxy_state + require_ma));
+
+	/*
+	 *	Encode it, leaving room for Proxy-State and
+	 *	Message-Authenticator if necessary.
+	 */
+	packet_len = fr_radius_encode(c->buffer, c->buflen - proxy_state - require_ma, NULL,
+				      c->inst->secret, talloc_array_length(c->inst->secret) - 1, u->code, u->rr->id,
+				      request->packet->vps);
+	if (packet_len <= 0) return -1;
+
+	/*
+	 *	This hack cleans up the debug output a bit.
+	 */
+	module_name = request->module;
+	request->module = NULL;
+
+	RDEBUG("Sending %s ID %d length %ld over connection %s",
+	       fr_packet_codes[u->code], u->rr->id, packet_len, c->name);
+	log_request_pair_list(L_DBG_LVL_2, request, request->packet->vps, NULL);
+
+	/*
+	 *	Might have been sent and then given up on... free the
+	 *	raw data and the debugging VPs, as they're re-created
+	 *	here.
+	 */
+	if (u->packet) TALLOC_FREE(u->packet);
+	u->packet_len = 0;
+	fr_pair_list_free(&u->extra);
+
+	/*
+	 *	Add Proxy-State to the tail end of the packet.
+	 *	We need to add it here, and NOT in
+	 *	request->packet->vps, because multiple modules
+	 *	may be sending the packets at the same time.
+	 *
+	 *	Note that the length check will always pass, due to
+	 *	the buflen manipulation done above.
+	 */
+	if (proxy_state) {
+		uint8_t		*attr = c->buffer + packet_len;
+		VALUE_PAIR	*vp;
+
+		rad_assert((size_t) (packet_len + proxy_state) <= c->buflen);
+
+		attr[0] = (uint8_t)attr_proxy_state->attr;
+		attr[1] = 6;
+		memcpy(attr + 2, &c->inst->parent->proxy_state, 4);
+
+		vp = fr_pair_afrom_da(u, attr_proxy_state);
+		fr_pair_value_memcpy(vp, attr + 2, 4);
+		fr_pair_add(&u->extra, vp);
+
+		RINDENT();
+		RDEBUG2("&%pP", vp);
+		REXDENT();
+
+		packet_len += 6;
+	}
+
+	/*
+	 *	Add Message-Authenticator manually.
+	 *
+	 *	Note that the length check will always pass, due to
+	 *	the buflen manipulation done above.
+	 */
+	if (require_ma) {
+		rad_assert((size_t) (packet_len + require_ma) <= c->buflen);
+
+		msg = c->buffer + packet_len;
+
+		msg[0] = (uint8_t)attr_message_authenticator->attr;
+		msg[1] = 18;
+		memset(msg + 2, 0, 16);
+
+		packet_len += 18;
+	}
+
+	/*
+	 *	Update the packet header based on the new attributes.
+	 */
+	c->buffer[2] = (packet_len >> 8) & 0xff;
+	c->buffer[3] = packet_len & 0xff;
+
+	/*
+	 *	Now that we're done mangling the packet, sign it.
+	 */
+	if (fr_radius_sign_precomputed(c->buffer, NULL, (uint8_t const *) c->inst->secret,
+				       talloc_array_length(c->inst->secret) - 1, c->inst->secret_hmac) < 0) {
+		request->module = module_name;
+		RERROR("Failed signing packet");
+		return -1;
+	}
+
+	/*
+	 *	Remember the authentication vector, which now has the
+	 *	packet signature.
+	 */
+	memcpy(u->rr->vector, c->buffer + 4, RADIUS_AUTH_VECTOR_LENGTH);
+
+	/*
+	 *	Print out the actual value of the Message-Authenticator attribute
+	 */
+	if (msg) {
+		VALUE_PAIR *vp;
+
+		vp = fr_pair_afrom_da(u, attr_message_authenticator);
+		fr_pair_value_memcpy(vp, msg + 2, 16);
+		fr_pair_add(&u->extra, vp);
+
+		RINDENT();
+		RDEBUG2("&%pP", vp);
+		REXDENT();
+	}
+
+	RHEXDUMP(L_DBG_LVL_3, c->buffer, packet_len, "Encoded packet");
+
+	request->module = module_name;
+
+	return packet_len;
+}
+
+/** Free an fr_io_request_t
+ *
+ *  Unlink the packet from the connection, and remove any tracking
+ *  entries.
+ */
+static int conn_request_free(fr_io_request_t *u)
+{
+	state_transition(u, REQUEST_IO_STATE_DONE, NULL);
+
+	/*
+	 *	We don't have a connection, so we can't update any of
+	 *	the connection timers or states.
+	 */
+	if (!u->c) return 0;
+
+	/*
+	 *	The module is doing async proxying, we don't need to
+	 *	do more.
+	 */
+	if (!u->c->inst->parent->synchronous) return 0;
+
+	/*
+	 *	The module is doing synchronous proxying.  i.e. where
+	 *	we retransmit only when the NAS retransmits.  Since we
+	 *	don't have our own timers, we have to check for zombie
+	 *	connections when the request is finished.
+	 */
+	return conn_check_zombie(u->c);
+}
+
+/** Free the status-check fr_io_request_t
+ *
+ *  Unlink the packet from the connection, and remove any tracking
+ *  entries.
+ */
+static int status_request_free(fr_io_request_t *u)
+{
+	fr_io_connection_t	*c = u->c;
+
+	DEBUG3("%s - Freeing status check ID %d on connection %s", c->module_name, u->rr->id, c->name);
+	c->status_u = NULL;
+
+	/*
+	 *	Status check packets are not in any list, but they do
+	 *	have an ID allocated.  We don't call
+	 *	state_transition() on them, so we have to clean them
+	 *	up ourselves.
+	 */
+	if (u->timer.ev) (void) fr_event_timer_delete(u->thread->el, &u->timer.ev);
+
+	if (u->rr) c->inst->funcs->id_free(c, u);
+	u->rr = NULL;
+
+	return 0;
+}
+
+/** Connection failed
+ *
+ * @param[in] fd	of connection that failed.
+ * @param[in] state	the connection was in when it failed.
+ * @param[in] uctx	the connection.
+ */
+static fr_connection_state_t _conn_failed(UNUSED int fd, fr_connection_state_t state, void *uctx)
+{
+	fr_io_connection_t	*c = talloc_get_type_abort(uctx, fr_io_connection_t);
+
+	/*
+	 *	If the connection was connected when it failed,
+	 *	we need to handle any outstanding packers and
+	 *	timer events before reconnecting.
+	 */
+	if (state == FR_CONNECTION_STATE_CONNECTED) {
+		fr_io_request_t *u;
+
+		/*
+		 *	Reset the Status-Server checks.
+		 */
+		if (c->status_u) {
+			u = c->status_u;
+
+			if (u->timer.ev) (void) fr_event_timer_delete(c->thread->el, &u->timer.ev);
+
+			memset(&u->timer, 0, sizeof(u->timer));
+			u->timer.retry = &c->inst->parent->retry[u->code];
+
+			rad_assert(u->c == c);
+
+			if (u->packet) TALLOC_FREE(u->packet);
+			u->packet_len = 0;
+		}
+		c->status_check_blocked = false;
+		health_release_status_check(c);
+
+		/*
+		 *	Delete all timers associated with the connection.
+		 */
+		if (c->idle_ev) (void) fr_event_timer_delete(c->thread->el, &c->idle_ev);
+		if (c->zombie_ev) (void) fr_event_timer_delete(c->thread->el, &c->zombie_ev);
+
+		/*
+		 *	Move "sent" packets back to the thread queue.
+		 *	They're sent again when a connection is
+		 *	available.
+		 */
+		while ((u = fr_dlist_head(&c->sent)) != NULL) {
+			state_transition(u, REQUEST_IO_STATE_QUEUED, NULL);
+		}
+	}
+
+	conn_transition(c, CONN_OPENING);
+
+	return FR_CONNECTION_STATE_INIT;
+}
+
+/** The connection is ready for packets
+ *
+ *  Called by the transport once the socket is open, and any
+ *  transport handshake has finished.
+ */
+void conn_ready(fr_io_connection_t *c)
+{
+	fr_io_connection_thread_t	*t = c->thread;
+
+	rad_assert(c->state == CONN_OPENING);
+	rad_assert(c->zombie_ev == NULL);
+	memset(&c->zombie_start, 0, sizeof(c->zombie_start));
+	fr_dlist_init(&c->sent, fr_io_request_t, entry);
+
+	/*
+	 *	Connection is "active" now.  i.e. we prefer the newly
+	 *	opened connection for sending packets.
+	 *
+	 *	@todo - connection negotiation via Status-Server
+	 */
+	gettimeofday(&c->mrs_time, NULL);
+	c->last_reply = c->mrs_time;
+
+{ /* RADIUS start */
+	/*
+	 *	Status-Server checks.  Manually build the packet, and
+	 *	all of it's associated glue.
+	 */
+	if (c->inst->parent->status_check && !c->status_u) {
+		fr_io_request_t *u;
+		REQUEST *request;
+
+		u = talloc_zero(c, fr_io_request_t);
+
+		request = request_alloc(u);
+		request->async = talloc_zero(request, fr_async_t);
+		talloc_const_free(request->name);
+		request->name = talloc_strdup(request, c->module_name);
+
+		request->el = c->thread->el;
+		request->packet = fr_radius_alloc(request, false);
+		request->reply = fr_radius_alloc(request, false);
+
+		/*
+		 *	Create the packet contents.
+		 */
+		if (c->inst->parent->status_check == FR_CODE_STATUS_SERVER) {
+			VALUE_PAIR *vp;
+
+			MEM(pair_add_request(&vp, attr_nas_identifier) >= 0);
+			fr_pair_value_strcpy(vp, "status check - are you alive?");
+
+			MEM(pair_add_request(NULL, attr_event_timestamp) >= 0);
+		} else {
+			vp_map_t *map;
+
+			/*
+			 *	Create the VPs, and ignore any errors
+			 *	creating them.
+			 */
+			for (map = c->inst->parent->status_check_map; map != NULL; map = map->next) {
+				/*
+				 *	Skip things which aren't attributes.
+				 */
+				if (map->lhs->type != TMPL_TYPE_ATTR) continue;
+
+				/*
+				 *	Disallow signalling attributes.
+				 */
+				if ((map->lhs->tmpl_da == attr_proxy_state) ||
+				    (map->lhs->tmpl_da == attr_event_timestamp) ||
+				    (map->lhs->tmpl_da == attr_acct_delay_time) ||
+				    (map->lhs->tmpl_da == attr_message_authenticator)) continue;
+
+				/*
+				 *	Allow passwords only in Access-Request packets.
+				 */
+				if ((c->inst->parent->status_check != FR_CODE_ACCESS_REQUEST) &&
+				    (map->lhs->tmpl_da == attr_user_password)) continue;
+
+				(void) map_to_request(request, map, map_to_vp, NULL);
+			}
+
+			/*
+			 *	Always add an Event-Timestamp, which
+			 *	will be the time at which the packet
+			 *	is sent.
+			 */
+			MEM(pair_update_request(NULL, attr_event_timestamp) >= 0);
+		}
+
+		DEBUG3("Status check packet will be %s", fr_packet_codes[u->code]);
+		log_request_pair_list(L_DBG_LVL_3, request, request->packet->vps, NULL);
+
+		/*
+		 *	Initialize the request IO ctx.  Note that we don't set
+		 *	destructors.
+		 */
+		u->request = request;
+		u->code = c->inst->parent->status_check;
+		request->packet->code = u->code;
+		u->c = c;
+		u->thread = t;
+
+		/*
+		 *	Reserve a permanent ID for the packet.  This
+		 *	is because we need to be able to send an ID on
+		 *	demand.  If the proxied packets use all of the
+		 *	IDs, then we can't send a Status-Server check.
+		 */
+		u->rr = c->inst->funcs->id_alloc(c, u);
+		if (!u->rr) {
+			ERROR("%s - Failed allocating status_check ID for connection %s",
+			      c->module_name, c->name);
+			talloc_free(u);
+
+		} else {
+			DEBUG2("%s - Allocated %s ID %u for status checks on connection %s",
+			       c->module_name, fr_packet_codes[u->code], u->rr->id, c->name);
+			talloc_set_destructor(u, status_request_free);
+			c->status_u = u;
+		}
+	}
+
+	/*
+	 *	Reset the timer, retransmission counters, etc.
+	 */
+	if (c->status_u) {
+		fr_io_request_t *u = c->status_u;
+
+		if (u->timer.ev) (void) fr_event_timer_delete(u->thread->el, &u->timer.ev);
+
+		memset(&u->timer, 0, sizeof(u->timer));
+		u->timer.retry = &c->inst->parent->retry[u->code];
+		c->status_check_blocked = false;
+	}
+} /* RADIUS end */
+
+	conn_transition(c, CONN_ACTIVE);
+
+	/*
+	 *	Now that we're open, assume that the connection is
+	 *	writable, and send anything which was waiting for a
+	 *	connection.
+	 */
+	if (fr_heap_num_elements(t->queued) > 0) {
+		c->inst->funcs->writable(t->el, c->fd, 0, c);
+	} else {
+		fd_idle(c);
+	}
+}
+
+
+/** Allocate a new connection and set it up.
+ *
+ */
+static void conn_alloc(fr_io_connection_inst_t const *inst, fr_io_connection_thread_t *t)
+{
+	fr_io_connection_t	*c;
+
+	c = talloc_zero(t, fr_io_connection_t);
+	c->module_name = inst->parent->name;
+	c->heap_id = -1;
+	c->inst = inst;
+	c->thread = t;
+	c->fd = -1;
+	c->dst_ipaddr = inst->dst_ipaddr;
+	c->dst_port = inst->dst_port;
+	c->src_ipaddr = inst->src_ipaddr;
+	c->src_port = 0;
+	c->max_packet_size = inst->max_packet_size;
+
+	c->buffer = talloc_array(c, uint8_t, c->max_packet_size);
+	if (!c->buffer) {
+		cf_log_err(inst->config, "%s failed allocating memory for new connection",
+			   c->module_name);
+		talloc_free(c);
+		return;
+	}
+	c->buflen = c->max_packet_size;
+
+	/*
+	 *	The transport allocates its ID tracking, buffers,
+	 *	etc.
+	 */
+	if (inst->funcs->alloc(c) < 0) {
+		cf_log_err(inst->config, "%s - Failed allocating memory for new connection",
+			   c->module_name);
+		talloc_free(c);
+		return;
+	}
+	fr_dlist_init(&c->sent, fr_io_request_t, entry);
+
+	c->conn = fr_connection_alloc(c, t->el, &t->connection_timeout, &t->reconnection_delay,
+				      inst->funcs->init,
+				      inst->funcs->open,
+				      inst->funcs->close,
+				      c->module_name, c);
+	if (!c->conn) {
+		talloc_free(c);
+		cf_log_err(inst->config, "%s - Failed allocating state handler for new connection",
+			   c->module_name);
+		return;
+	}
+	fr_connection_failed_func(c->conn, _conn_failed);
+
+	/*
+	 *	Enforce max_connections via atomic variables.
+	 *
+	 *	Note that we're counting connections which are in the
+	 *	CONN_OPENING and CONN_ZOMBIE states, too.
+	 */
+	while (true) {
+		uint32_t num_connections;
+
+		num_connections = load(inst->parent->num_connections);
+
+		if (num_connections >= t->max_connections) {
+			TALLOC_FREE(c->conn); /* ordering */
+			talloc_free(c);
+			return;
+		}
+		if (cas_incr(inst->parent->num_connections, num_connections)) break;
+	}
+
+	fr_connection_signal_init(c->conn);
+
+	talloc_set_destructor(c, _conn_free);
+
+	return;
+}
+
+rlm_rcode_t conn_request_push(void *instance, REQUEST *request, void *request_io_ctx, void *thread)
+{
+	rlm_rcode_t    			rcode = RLM_MODULE_FAIL;
+	fr_io_connection_inst_t		*inst = instance;
+	fr_io_connection_thread_t	*t = talloc_get_type_abort(thread, fr_io_connection_thread_t);
+	fr_io_request_t			*u = talloc_get_type_abort(request_io_ctx, fr_io_request_t);
+	fr_io_connection_t		*c;
+
+	rad_assert(request->packet->code > 0);
+	rad_assert(request->packet->code < FR_MAX_PACKET_CODE);
+
+	/*
+	 *	If configured, and we don't have any active
+	 *	connections, fail the request.  This lets "parallel"
+	 *	sections finish much more quickly than otherwise.
+	 */
+	if (inst->parent->no_connection_fail && !fr_heap_num_elements(t->active)) {
+		REDEBUG("Failing request due to 'no_connection_fail = true', and there are no active connections");
+		return RLM_MODULE_FAIL;
+	}
+
+	/*
+	 *	Some thread decided that the home server is dead.
+	 *	Fail the request, so that every thread fails over in
+	 *	the same way.
+	 */
+	if (health_is_dead(inst->health, fr_time())) {
+		REDEBUG("Failing request, as the home server is dead");
+		return RLM_MODULE_FAIL;
+	}
+
+	u->state = REQUEST_IO_STATE_INIT;
+	u->rr = NULL;
+	u->c = NULL;
+	u->request = request;
+	u->rcode = RLM_MODULE_FAIL;
+	u->code = request->packet->code;
+	u->thread = t;
+	u->heap_id = -1;
+	u->timer.retry = &inst->parent->retry[u->code];
+	fr_dlist_entry_init(&u->entry);
+
+	talloc_set_destructor(u, conn_request_free);
+
+	/*
+	 *	Insert the new packet into the thread queue.
+	 */
+	state_transition(u, REQUEST_IO_STATE_QUEUED, NULL);
+
+	/*
+	 *	If it's synchronous, remember the time we sent this
+	 *	packet.  Otherwise, start the retransmission timers.
+	 */
+	if (inst->parent->synchronous) {
+		u->time_sent = fr_time();
+
+	} else if (conn_timeout_init(t->el, u, inst->funcs->response_timeout) < 0) {
+		RDEBUG("%s - Failed starting retransmit tracking", inst->parent->name);
+		talloc_free(u);
+		return RLM_MODULE_FAIL;
+	}
+
+	/*
+	 *	There are OTHER pending writes, wait for the event
+	 *	callbacks to wake up a connection and send the packet.
+	 */
+	if (fr_heap_num_elements(t->queued) > 1) {
+		u->yielded = true;
+		DEBUG3("Thread has pending packets.  Waiting for socket to be ready");
+		return RLM_MODULE_YIELD;
+	}
+
+	/*
+	 *	There are no pending writes.  Get a waiting
+	 *	connection.  If they're all full, try to open a new
+	 *	one.
+	 */
+	c = fr_heap_peek(t->active);
+	if (!c) {
+		/*
+		 *	Only open one new connection at a time.
+		 */
+		if (!fr_dlist_head(&t->opening)) conn_alloc(inst, t);
+
+		/*
+		 *	Add the request to the backlog.  It will be
+		 *	sent either when the new connection is open,
+		 *	or when an existing connection has
+		 *	availability.
+		 */
+		u->yielded = true;
+		return RLM_MODULE_YIELD;
+	}
+
+	/*
+	 *	The connection is active, so try to write to it.
+	 */
+	inst->funcs->writable(t->el, c->fd, 0, c);
+
+	switch (u->state) {
+	case REQUEST_IO_STATE_INIT:
+		rad_assert(0 == 1);
+		break;
+
+	case REQUEST_IO_STATE_QUEUED:
+	case REQUEST_IO_STATE_WRITTEN:
+		rcode = RLM_MODULE_YIELD;
+		u->yielded = true;
+		break;
+
+	case REQUEST_IO_STATE_REPLIED:
+		state_transition(u, REQUEST_IO_STATE_DONE, NULL);
+		/* FALL-THROUGH */
+
+	case REQUEST_IO_STATE_DONE:
+		rcode = RLM_MODULE_OK;
+		break;
+	}
+
+	return rcode;
+}
+
+/** Check the configuration common to all transports
+ *
+ *  The transport must have set a default 'secret' and 'port', if
+ *  it has them, before calling this function.
+ *
+ * @param[in] inst	the common part of the transport's instance data.
+ * @param[in] funcs	the transport's callbacks.
+ * @param[in] parent	rlm_radius_t
+ * @param[in] conf	the transport's configuration section.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int conn_instantiate(fr_io_connection_inst_t *inst, fr_io_connection_funcs_t const *funcs,
+		     rlm_radius_t *parent, CONF_SECTION *conf)
+{
+	inst->parent = parent;
+	inst->replicate = parent->replicate;
+	inst->funcs = funcs;
+
+	/*
+	 *	Ensure that we have a destination address.
+	 */
+	if (inst->dst_ipaddr.af == AF_UNSPEC) {
+		cf_log_err(conf, "A value must be given for 'ipaddr'");
+		return -1;
+	}
+
+	/*
+	 *	If src_ipaddr isn't set, make sure it's INADDR_ANY, of
+	 *	the same address family as dst_ipaddr.
+	 */
+	if (inst->src_ipaddr.af == AF_UNSPEC) {
+		memset(&inst->src_ipaddr, 0, sizeof(inst->src_ipaddr));
+
+		inst->src_ipaddr.af = inst->dst_ipaddr.af;
+
+		if (inst->src_ipaddr.af == AF_INET) {
+			inst->src_ipaddr.prefix = 32;
+		} else {
+			inst->src_ipaddr.prefix = 128;
+		}
+	}
+
+	else if (inst->src_ipaddr.af != inst->dst_ipaddr.af) {
+		cf_log_err(conf, "The 'ipaddr' and 'src_ipaddr' configuration items must "
+			   "be both of the same address family");
+		return -1;
+	}
+
+	if (inst->recv_buff_is_set) {
+		FR_INTEGER_BOUND_CHECK("recv_buff", inst->recv_buff, >=, inst->max_packet_size);
+		FR_INTEGER_BOUND_CHECK("recv_buff", inst->recv_buff, <=, (1 << 30));
+	}
+
+	if (inst->send_buff_is_set) {
+		FR_INTEGER_BOUND_CHECK("send_buff", inst->send_buff, >=, inst->max_packet_size);
+		FR_INTEGER_BOUND_CHECK("send_buff", inst->send_buff, <=, (1 << 30));
+	}
+
+	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, >=, 64);
+	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, <=, 65535);
+
+	/*
+	 *	Every packet we send or receive has a
+	 *	Message-Authenticator, or may have one.
+	 */
+	inst->secret_hmac = fr_hmac_md5_key_alloc(inst, (uint8_t const *) inst->secret,
+						  talloc_array_length(inst->secret) - 1);
+	if (!inst->secret_hmac) {
+		cf_log_err(conf, "Failed pre-computing 'secret'");
+		return -1;
+	}
+
+	inst->health = talloc_zero(inst, rlm_radius_health_t);
+	if (!inst->health) return -1;
+
+	return 0;
+}
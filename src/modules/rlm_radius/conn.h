@@ -0,0 +1,288 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * $Id$
+ *
+ * @file conn.h
+ * @brief Connection handling shared by the RADIUS client transports
+ *
+ * @copyright 2017  Network RADIUS SARL
+ */
+RCSIDH(rlm_radius_conn_h, "$Id$")
+
+#include <freeradius-devel/server/connection.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/heap.h>
+
+#include "rlm_radius.h"
+#include "track.h"
+
+typedef enum {
+	HEALTH_ALIVE = 0,				//!< Responding to packets.
+	HEALTH_ZOMBIE,					//!< Not responding, status checks in progress.
+	HEALTH_DEAD,					//!< Didn't respond to status checks.
+} rlm_radius_home_state_t;
+
+/** Home server state shared by all threads
+ *
+ *  Only atomic operations are used, so no thread ever waits for
+ *  another.  The thread which claims "checker" is the only one which
+ *  sends status checks.  The other threads wait for it to decide
+ *  whether the home server is alive or dead.
+ */
+typedef struct {
+	atomic_uint32_t		state;			//!< rlm_radius_home_state_t.
+	atomic_uint32_t		checker;		//!< ID of the thread doing status checks, or 0.
+	atomic_uint32_t		num_threads;		//!< For allocating thread IDs.
+
+	atomic_int64_t		last_reply;		//!< When any thread last received a reply.
+	atomic_int64_t		dead_until;		//!< Fail requests until this time.
+} rlm_radius_health_t;
+
+typedef struct fr_io_connection_t fr_io_connection_t;
+typedef struct fr_io_request_t fr_io_request_t;
+
+/** Callbacks which a transport provides to the common connection code
+ *
+ */
+typedef struct {
+	fr_connection_init_t	init;			//!< Open the socket.
+	fr_connection_open_t	open;			//!< The socket is connected.
+	fr_connection_close_t	close;			//!< Close the socket.
+
+	int			(*alloc)(fr_io_connection_t *c);	//!< Allocate c->ctx.
+
+	fr_event_fd_cb_t	read;			//!< Read replies from the socket.
+	fr_event_fd_cb_t	writable;		//!< Write queued packets to the socket.
+
+	/** Encode and send one packet
+	 *
+	 * @return
+	 *	- <0 on error
+	 *	- 0 should retry the write later
+	 *	- 1 the packet was written, and we wait for a reply
+	 *	- 2 the packet was replicated, and should be resumed immediately.
+	 */
+	int			(*write)(fr_io_connection_t *c, fr_io_request_t *u);
+	int			(*flush)(fr_io_connection_t *c);	//!< Push out buffered data.  May be NULL.
+
+	fr_event_cb_t		response_timeout;	//!< Per-request timer.
+
+	rlm_radius_request_t	*(*id_alloc)(fr_io_connection_t *c, fr_io_request_t *u);
+	void			(*id_free)(fr_io_connection_t *c, fr_io_request_t *u);
+} fr_io_connection_funcs_t;
+
+/** Static configuration common to all transports
+ *
+ *  This is the first member of each transport's instance data.
+ */
+typedef struct {
+	rlm_radius_t		*parent;		//!< rlm_radius instance.
+	CONF_SECTION		*config;
+
+	fr_ipaddr_t		dst_ipaddr;		//!< IP of the home server.
+	fr_ipaddr_t		src_ipaddr;		//!< IP we open our socket on.
+	uint16_t		dst_port;		//!< Port of the home server.
+	char const		*secret;		//!< Shared secret.
+	fr_hmac_md5_key_t const	*secret_hmac;		//!< Secret pre-computed for the Message-Authenticator.
+
+	uint32_t		recv_buff;		//!< How big the kernel's receive buffer should be.
+	uint32_t		send_buff;		//!< How big the kernel's send buffer should be.
+
+	uint32_t		max_packet_size;	//!< Maximum packet size.
+
+	bool			recv_buff_is_set;	//!< Whether we were provided with a recv_buf
+	bool			send_buff_is_set;	//!< Whether we were provided with a send_buf
+	bool			replicate;		//!< Copied from parent->replicate
+
+	fr_io_connection_funcs_t const *funcs;		//!< Transport callbacks.
+	rlm_radius_health_t	*health;		//!< Shared by all threads.
+} fr_io_connection_inst_t;
+
+/** Per-thread configuration for the module.
+ *
+ *  This data structure holds the connections, etc. for this IO submodule.
+ */
+typedef struct {
+	fr_event_list_t		*el;			//!< Event list.
+	uint32_t		id;			//!< Unique non-zero ID of this thread.
+
+	fr_heap_t		*queued;		//!< Queued requests for some new connection.
+
+	fr_heap_t		*active;   		//!< Active connections.
+	fr_dlist_head_t		blocked;      		//!< blocked connections, waiting for writable
+	fr_dlist_head_t		full;      		//!< Full connections.
+	fr_dlist_head_t		zombie;      		//!< Zombie connections.
+	fr_dlist_head_t		opening;      		//!< Opening connections.
+
+	uint32_t		max_connections;  //!< maximum number of open connections
+	struct timeval		connection_timeout;
+	struct timeval		reconnection_delay;
+	struct timeval		idle_timeout;
+	struct timeval		zombie_period;
+} fr_io_connection_thread_t;
+
+typedef enum fr_io_connection_state_t {
+	CONN_INIT = 0,					//!< Configured but not started.
+	CONN_OPENING,					//!< Trying to connect.
+	CONN_ACTIVE,					//!< has free IDs
+	CONN_BLOCKED,					//!< blocked, but can't write to the socket
+	CONN_FULL,					//!< Live, but has no more IDs to use.
+	CONN_ZOMBIE,					//!< Has had a retransmit timeout.
+} fr_io_connection_state_t;
+
+/** Represents a generic connection
+ *
+ */
+struct fr_io_connection_t {
+	char const     		*name;			//!< From IP PORT to IP PORT.
+	char const		*module_name;		//!< the module that opened the connection
+	fr_io_connection_state_t state;			//!< State of the connection.
+
+	int			fd;			//!< File descriptor.
+
+	fr_io_connection_inst_t const *inst;		//!< Our module instance.
+	fr_io_connection_thread_t *thread;       	//!< Our thread-specific data.
+	fr_connection_t		*conn;			//!< Connection to our destination.
+
+	fr_dlist_t		entry;			//!< In the linked list of connections.
+	int32_t			heap_id;		//!< For the active heap.
+
+	fr_event_timer_t const	*idle_ev;		//!< Idle timeout event.
+	struct timeval		idle_timeout;		//!< When the idle timeout will fire.
+
+	struct timeval		mrs_time;		//!< Most recent sent time which had a reply.
+	struct timeval		last_reply;		//!< When we last received a reply.
+
+	fr_event_timer_t const	*zombie_ev;		//!< Zombie timeout.
+	struct timeval		zombie_start;		//!< When the zombie period started.
+	fr_time_t		zombie_time;		//!< When the connection became zombie.
+
+	fr_dlist_head_t		sent;			//!< List of sent packets.
+
+	uint32_t		max_packet_size;	//!< Our max packet size. may be different from the parent.
+
+	fr_ipaddr_t		dst_ipaddr;		//!< IP of the home server. stupid 'const' issues.
+	uint16_t		dst_port;		//!< Port of the home server.
+	fr_ipaddr_t		src_ipaddr;		//!< Our source IP.
+	uint16_t	       	src_port;		//!< Our source port.
+
+	uint8_t			*buffer;		//!< Encoding and receive buffer.
+	size_t			buflen;			//!< Buffer length.
+
+	fr_io_request_t		*status_u;    		//!< For Status-Server checks.
+	bool			status_check_blocked;	//!< if we blocked writing status check packets
+	bool			status_checker;		//!< if we're doing status checks for all threads
+
+	int			slots_free;    		//!< larger is better
+	void			*ctx;			//!< transport-specific context
+};
+
+typedef enum fr_io_request_state_t {
+	REQUEST_IO_STATE_INIT = 0,
+	REQUEST_IO_STATE_QUEUED,				//!< in the thread queue
+	REQUEST_IO_STATE_WRITTEN,				//!< in the connection "sent" heap
+	REQUEST_IO_STATE_REPLIED,      			//!< timed out, or received a reply
+	REQUEST_IO_STATE_DONE,				//!< and done
+} fr_io_request_state_t;
+
+/** Tracking for a REQUEST that is associated with the connection.
+ *
+ */
+struct fr_io_request_t {
+	fr_io_request_state_t	state;			//!< state of this request
+
+	REQUEST			*request;		//!< the request we are for, so we can find it from the link
+
+	fr_time_t		time_sent;		//!< when we sent the packet
+	fr_time_t		time_recv;		//!< when we received the reply
+
+	rlm_rcode_t		rcode;			//!< from the transport
+
+	fr_dlist_t		entry;			//!< in the connection list of packets.
+	int32_t			heap_id;		//!< for the "to be sent" queue.
+
+	fr_io_connection_t	*c;			//!< The outbound connection
+	fr_io_connection_thread_t *thread;		//!< the thread data for this request
+
+	bool			yielded;		//!< whether it yielded
+
+	/*
+	 *	The rest of the entries are RADIUS-specific
+	 */
+	bool			manual_delay_time;	//!< Whether or not we manually added an Acct-Delay-Time.
+	VALUE_PAIR		*extra;			//!< VPs for debugging, like Proxy-State.
+
+	uint8_t			*acct_delay_time;	//!< in the encoded packet.
+	uint32_t		initial_delay_time;	//!< Initial value of Acct-Delay-Time.
+
+	int			code;			//!< Packet code.
+
+	uint8_t			*packet;		//!< Packet we write to the network.
+	size_t			packet_len;		//!< Length of the packet.
+
+	rlm_radius_request_t	*rr;			//!< ID tracking, resend count, etc.
+	void			*io_ctx;		//!< Transport-specific, e.g. the source port which owns the ID.
+	rlm_radius_retransmit_t timer;			//!< retransmission data structures
+};
+
+extern fr_dict_t *dict_radius;
+
+extern fr_dict_attr_t const *attr_acct_delay_time;
+extern fr_dict_attr_t const *attr_error_cause;
+extern fr_dict_attr_t const *attr_event_timestamp;
+extern fr_dict_attr_t const *attr_extended_attribute_1;
+extern fr_dict_attr_t const *attr_message_authenticator;
+extern fr_dict_attr_t const *attr_nas_identifier;
+extern fr_dict_attr_t const *attr_original_packet_code;
+extern fr_dict_attr_t const *attr_proxy_state;
+extern fr_dict_attr_t const *attr_response_length;
+extern fr_dict_attr_t const *attr_user_password;
+
+/*
+ *	Home server health, shared across threads.
+ */
+bool		health_alive_since(fr_io_connection_t const *c, fr_time_t when);
+
+/*
+ *	Connection and request state machines.
+ */
+void		fd_idle(fr_io_connection_t *c);
+void		fd_active(fr_io_connection_t *c);
+void		conn_error(fr_event_list_t *el, int fd, int flags, int fd_errno, void *uctx);
+void		conn_set_buffers(fr_io_connection_t *c, int fd);
+void		conn_transition(fr_io_connection_t *c, fr_io_connection_state_t state);
+void		state_transition(fr_io_request_t *u, fr_io_request_state_t state, fr_io_connection_t *c);
+void		conn_finished_request(fr_io_connection_t *c, fr_io_request_t *u);
+void		conn_ready(fr_io_connection_t *c);
+
+/*
+ *	RADIUS encoding and decoding.
+ */
+ssize_t		conn_encode(fr_io_connection_t *c, fr_io_request_t *u);
+bool		conn_process_reply(fr_io_connection_t *c, rlm_radius_id_t *id, uint8_t *data, size_t data_len);
+
+/*
+ *	Module methods.
+ */
+int		conn_instantiate(fr_io_connection_inst_t *inst, fr_io_connection_funcs_t const *funcs,
+				 rlm_radius_t *parent, CONF_SECTION *conf);
+int		conn_thread_instantiate(CONF_SECTION const *cs, void *instance, fr_event_list_t *el, void *thread);
+int		conn_thread_detach(fr_event_list_t *el, void *thread);
+rlm_rcode_t	conn_request_push(void *instance, REQUEST *request, void *request_io_ctx, void *thread);
+rlm_rcode_t	conn_request_resume(REQUEST *request, void *instance, void *thread, void *ctx);
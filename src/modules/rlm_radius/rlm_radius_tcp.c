@@ -0,0 +1,1414 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_radius_tcp.c
+ * @brief RADIUS TCP and TLS transport
+ *
+ * Many requests are multiplexed over one connection.  Packets are
+ * encoded into a per-connection output buffer, so that everything
+ * which is ready to go is written with one system call, and replies
+ * are reassembled from however the stream happens to be split.
+ *
+ * The stream is reliable, so packets are never retransmitted on the
+ * same connection (RFC 6613).  If a connection fails, the packets
+ * which were sent on it are moved back to the thread queue, and sent
+ * again on another connection.
+ *
+ * The connection state machine, status checks, and the RADIUS
+ * encoding are in conn.c.
+ *
+ * @copyright 2017  Network RADIUS SARL
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/io/application.h>
+#include <freeradius-devel/util/heap.h>
+#include <freeradius-devel/server/connection.h>
+#include <freeradius-devel/io/listen.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/server/rad_assert.h>
+#include <freeradius-devel/unlang/base.h>
+
+#ifdef WITH_TLS
+#  include <freeradius-devel/tls/base.h>
+#  include <openssl/x509v3.h>
+#endif
+
+#include <netinet/tcp.h>
+
+#include "conn.h"
+
+/*
+ *	How much encoded data we buffer for each connection, before
+ *	we stop writing packets to it.
+ */
+#define TCP_SEND_BUFFER_SIZE	(65536)
+
+/** Static configuration for the module.
+ *
+ */
+typedef struct {
+	fr_io_connection_inst_t	common;			//!< Configuration shared with the other transports.
+
+	char const		*server_name;		//!< Name to check the home server certificate against.
+
+#ifdef WITH_TLS
+	fr_tls_conf_t		*tls;			//!< TLS configuration.  NULL for plain TCP.
+#endif
+} rlm_radius_tcp_t;
+
+/** Represents TCP-specific things for a connection
+ *
+ */
+typedef struct {
+	rlm_radius_id_t		*id;			//!< RADIUS ID tracking structure.
+
+	uint8_t			*send_buf;		//!< Encoded packets waiting to be written.
+	size_t			send_len;		//!< How much data is waiting to be written.
+
+	uint8_t			*recv_buf;		//!< Partial packets read from the stream.
+	size_t			recv_len;		//!< How much data is in the receive buffer.
+
+#ifdef WITH_TLS
+	SSL			*ssl;			//!< TLS session, if we're doing TLS.
+	bool			tls_open;		//!< Whether the TLS handshake has finished.
+	fr_event_timer_t const	*handshake_ev;		//!< Handshake timeout.
+
+	bool			read_wants_write;	//!< SSL_read() needs the socket to be writable.
+	bool			write_wants_read;	//!< SSL_write() needs the socket to be readable.
+#endif
+} rlm_radius_tcp_connection_t;
+
+
+static const CONF_PARSER module_config[] = {
+	{ FR_CONF_OFFSET("ipaddr", FR_TYPE_COMBO_IP_ADDR, rlm_radius_tcp_t, common.dst_ipaddr), },
+	{ FR_CONF_OFFSET("ipv4addr", FR_TYPE_IPV4_ADDR, rlm_radius_tcp_t, common.dst_ipaddr) },
+	{ FR_CONF_OFFSET("ipv6addr", FR_TYPE_IPV6_ADDR, rlm_radius_tcp_t, common.dst_ipaddr) },
+
+	{ FR_CONF_OFFSET("port", FR_TYPE_UINT16, rlm_radius_tcp_t, common.dst_port) },
+
+	{ FR_CONF_OFFSET("secret", FR_TYPE_STRING, rlm_radius_tcp_t, common.secret) },
+
+	{ FR_CONF_OFFSET("server_name", FR_TYPE_STRING, rlm_radius_tcp_t, server_name) },
+
+	{ FR_CONF_OFFSET_IS_SET("recv_buff", FR_TYPE_UINT32, rlm_radius_tcp_t, common.recv_buff) },
+	{ FR_CONF_OFFSET_IS_SET("send_buff", FR_TYPE_UINT32, rlm_radius_tcp_t, common.send_buff) },
+
+	{ FR_CONF_OFFSET("max_packet_size", FR_TYPE_UINT32, rlm_radius_tcp_t, common.max_packet_size), .dflt = "4096" },
+
+	{ FR_CONF_OFFSET("src_ipaddr", FR_TYPE_COMBO_IP_ADDR, rlm_radius_tcp_t, common.src_ipaddr) },
+	{ FR_CONF_OFFSET("src_ipv4addr", FR_TYPE_IPV4_ADDR, rlm_radius_tcp_t, common.src_ipaddr) },
+	{ FR_CONF_OFFSET("src_ipv6addr", FR_TYPE_IPV6_ADDR, rlm_radius_tcp_t, common.src_ipaddr) },
+
+	CONF_PARSER_TERMINATOR
+};
+
+extern fr_dict_autoload_t rlm_radius_tcp_dict[];
+fr_dict_autoload_t rlm_radius_tcp_dict[] = {
+	{ .out = &dict_radius, .proto = "radius" },
+	{ NULL }
+};
+
+extern fr_dict_attr_autoload_t rlm_radius_tcp_dict_attr[];
+fr_dict_attr_autoload_t rlm_radius_tcp_dict_attr[] = {
+	{ .out = &attr_acct_delay_time, .name = "Acct-Delay-Time", .type = FR_TYPE_UINT32, .dict = &dict_radius},
+	{ .out = &attr_error_cause, .name = "Error-Cause", .type = FR_TYPE_UINT32, .dict = &dict_radius },
+	{ .out = &attr_event_timestamp, .name = "Event-Timestamp", .type = FR_TYPE_DATE, .dict = &dict_radius},
+	{ .out = &attr_extended_attribute_1, .name = "Extended-Attribute-1", .type = FR_TYPE_EXTENDED, .dict = &dict_radius},
+	{ .out = &attr_message_authenticator, .name = "Message-Authenticator", .type = FR_TYPE_OCTETS, .dict = &dict_radius},
+	{ .out = &attr_nas_identifier, .name = "NAS-Identifier", .type = FR_TYPE_STRING, .dict = &dict_radius},
+	{ .out = &attr_original_packet_code, .name = "Original-Packet-Code", .type = FR_TYPE_UINT32, .dict = &dict_radius},
+	{ .out = &attr_proxy_state, .name = "Proxy-State", .type = FR_TYPE_OCTETS, .dict = &dict_radius},
+	{ .out = &attr_response_length, .name = "Response-Length", .type = FR_TYPE_UINT32, .dict = &dict_radius },
+	{ .out = &attr_user_password, .name = "User-Password", .type = FR_TYPE_STRING, .dict = &dict_radius},
+	{ NULL }
+};
+
+static void conn_read(fr_event_list_t *el, int fd, int flags, void *uctx);
+static void conn_writable(fr_event_list_t *el, int fd, int flags, void *uctx);
+
+/** Read data from the stream
+ *
+ * @return
+ *	- >0 the amount of data read.
+ *	- 0 there's no more data to read right now.
+ *	- <0 the connection failed, or was closed by the other end.
+ */
+static ssize_t conn_recv(fr_io_connection_t *c, uint8_t *buffer, size_t buflen)
+{
+	ssize_t data_len;
+
+#ifdef WITH_TLS
+	rlm_radius_tcp_connection_t *tcp = c->ctx;
+
+	if (tcp->ssl) {
+		int ret;
+
+		ret = SSL_read(tcp->ssl, buffer, buflen);
+		if (ret > 0) return ret;
+
+		switch (SSL_get_error(tcp->ssl, ret)) {
+		case SSL_ERROR_WANT_READ:
+			return 0;
+
+		/*
+		 *	e.g. renegotiation.  Wait for the socket to
+		 *	become writable, and then read again.
+		 */
+		case SSL_ERROR_WANT_WRITE:
+			tcp->read_wants_write = true;
+			fd_active(c);
+			return 0;
+
+		case SSL_ERROR_ZERO_RETURN:
+			DEBUG("%s - Connection closed by home server - %s", c->module_name, c->name);
+			return -1;
+
+		default:
+			tls_log_error(NULL, "%s - Failed reading from connection %s", c->module_name, c->name);
+			return -1;
+		}
+	}
+#endif
+
+	data_len = read(c->fd, buffer, buflen);
+	if (data_len > 0) return data_len;
+
+	if (data_len == 0) {
+		DEBUG("%s - Connection closed by home server - %s", c->module_name, c->name);
+		return -1;
+	}
+
+	if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return 0;
+
+	ERROR("%s - Failed reading from connection %s: %s", c->module_name, c->name, fr_syserror(errno));
+	return -1;
+}
+
+
+/** Write as much of the output buffer as the socket will take
+ *
+ * @return
+ *	- 1 everything was written.
+ *	- 0 some data is still waiting to be written.
+ *	- <0 the connection failed.
+ */
+static int conn_flush(fr_io_connection_t *c)
+{
+	rlm_radius_tcp_connection_t	*tcp = c->ctx;
+	ssize_t				written;
+
+	if (!tcp->send_len) return 1;
+
+#ifdef WITH_TLS
+	if (tcp->ssl) {
+		int ret;
+
+		ret = SSL_write(tcp->ssl, tcp->send_buf, tcp->send_len);
+		if (ret <= 0) {
+			switch (SSL_get_error(tcp->ssl, ret)) {
+			/*
+			 *	Wait for the socket to become
+			 *	readable, and then write again.
+			 */
+			case SSL_ERROR_WANT_READ:
+				tcp->write_wants_read = true;
+				return 0;
+
+			case SSL_ERROR_WANT_WRITE:
+				return 0;
+
+			default:
+				tls_log_error(NULL, "%s - Failed writing to connection %s", c->module_name, c->name);
+				return -1;
+			}
+		}
+
+		written = ret;
+	} else
+#endif
+	{
+		written = write(c->fd, tcp->send_buf, tcp->send_len);
+		if (written < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return 0;
+
+			ERROR("%s - Failed writing to connection %s: %s",
+			      c->module_name, c->name, fr_syserror(errno));
+			return -1;
+		}
+	}
+
+	DEBUG3("%s - Wrote %zd of %zu bytes to connection %s", c->module_name, written, tcp->send_len, c->name);
+
+	/*
+	 *	Short write.  Keep the rest for when the socket is
+	 *	writable again.
+	 */
+	if ((size_t) written < tcp->send_len) {
+		memmove(tcp->send_buf, tcp->send_buf + written, tcp->send_len - written);
+		tcp->send_len -= written;
+		return 0;
+	}
+
+	tcp->send_len = 0;
+	return 1;
+}
+
+
+/** Wait until the output buffer can be flushed
+ *
+ *  Usually that's when the socket is writable.  But a TLS session may
+ *  need to read data before it can write any more, and waiting for
+ *  "writable" would then just spin.
+ */
+static void conn_flush_wait(fr_io_connection_t *c)
+{
+#ifdef WITH_TLS
+	rlm_radius_tcp_connection_t *tcp = c->ctx;
+
+	if (tcp->write_wants_read) {
+		fd_idle(c);
+		return;
+	}
+#endif
+
+	fd_active(c);
+}
+
+
+/** Add an encoded packet to the output buffer
+ *
+ *  The packet is written when the buffer is flushed.  Packets are
+ *  only added when they fit completely, so the stream always
+ *  contains whole packets.
+ *
+ * @return
+ *	- 1 the packet was added.
+ *	- 0 the buffer is full, the caller should try again later.
+ *	- -1 the connection failed.
+ */
+static int conn_queue(fr_io_connection_t *c, uint8_t const *packet, size_t packet_len)
+{
+	rlm_radius_tcp_connection_t *tcp = c->ctx;
+
+	if ((tcp->send_len + packet_len) > talloc_array_length(tcp->send_buf)) {
+		/*
+		 *	Try to make room before giving up.
+		 */
+		if (conn_flush(c) < 0) return -1;
+
+		if ((tcp->send_len + packet_len) > talloc_array_length(tcp->send_buf)) return 0;
+	}
+
+	memcpy(tcp->send_buf + tcp->send_len, packet, packet_len);
+	tcp->send_len += packet_len;
+
+	return 1;
+}
+
+
+/** Flush the output buffer, and wait for the socket to become writable if necessary
+ *
+ *  May free the connection!
+ *
+ * @return
+ *	- 0 on success.
+ *	- <0 if the connection failed, and is being reconnected.
+ */
+static int conn_send_pending(fr_io_connection_t *c)
+{
+	int rcode;
+
+	rcode = conn_flush(c);
+	if (rcode < 0) {
+		fr_connection_signal_reconnect(c->conn);
+		return -1;
+	}
+
+	if (rcode == 0) conn_flush_wait(c);
+
+	return 0;
+}
+
+
+/** Shutdown/close a file descriptor
+ *
+ */
+static void _conn_close(int fd, void *uctx)
+{
+	fr_io_connection_t		*c = talloc_get_type_abort(uctx, fr_io_connection_t);
+	rlm_radius_tcp_connection_t	*tcp = c->ctx;
+
+	if (c->idle_ev) fr_event_timer_delete(c->thread->el, &c->idle_ev);
+
+#ifdef WITH_TLS
+	if (tcp->handshake_ev) fr_event_timer_delete(c->thread->el, &tcp->handshake_ev);
+
+	if (tcp->ssl) {
+		if (tcp->tls_open) (void) SSL_shutdown(tcp->ssl);
+		SSL_free(tcp->ssl);
+		tcp->ssl = NULL;
+	}
+	tcp->tls_open = false;
+	tcp->read_wants_write = false;
+	tcp->write_wants_read = false;
+#endif
+
+	if (shutdown(fd, SHUT_RDWR) < 0) {
+		DEBUG3("%s - Failed shutting down connection %s: %s",
+		       c->module_name, c->name, fr_syserror(errno));
+	}
+
+	if (close(fd) < 0) {
+		DEBUG3("%s - Failed closing connection %s: %s",
+		       c->module_name, c->name, fr_syserror(errno));
+	}
+
+	c->fd = -1;
+
+	/*
+	 *	Anything left in the buffers belongs to the old
+	 *	stream.  The packets are re-encoded when they're sent
+	 *	on the new one.
+	 */
+	tcp->send_len = 0;
+	tcp->recv_len = 0;
+
+	/*
+	 *	Reset our state back to init
+	 */
+	conn_transition(c, CONN_INIT);
+
+	DEBUG("%s - Connection closed - %s", c->module_name, c->name);
+}
+
+
+/** Initialise a new outbound connection
+ *
+ * @param[out] fd_out	Where to write the new file descriptor.
+ * @param[in] uctx	A #fr_io_connection_thread_t.
+ */
+static fr_connection_state_t _conn_init(int *fd_out, void *uctx)
+{
+	int				fd;
+	fr_io_connection_t		*c = talloc_get_type_abort(uctx, fr_io_connection_t);
+	rlm_radius_tcp_connection_t	*tcp = c->ctx;
+
+	/*
+	 *	Open the outgoing socket.  The connect completes in
+	 *	the background, and _conn_open() is called when the
+	 *	socket becomes writable.
+	 */
+	fd = fr_socket_client_tcp(&c->src_ipaddr, &c->dst_ipaddr, c->dst_port, true);
+	if (fd < 0) {
+		PERROR("%s - Failed opening socket", c->module_name);
+		return FR_CONNECTION_STATE_FAILED;
+	}
+
+	/*
+	 *	Set the connection name.
+	 */
+	talloc_const_free(c->name);
+	c->name = fr_asprintf(c, "connecting from %pV to %pV port %u",
+			      fr_box_ipaddr(c->src_ipaddr),
+			      fr_box_ipaddr(c->dst_ipaddr), c->dst_port);
+
+#ifdef TCP_NODELAY
+	/*
+	 *	We do our own coalescing of packets, so Nagle only
+	 *	adds latency.
+	 */
+	{
+		int on = 1;
+
+		if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0) {
+			WARN("Failed setting TCP_NODELAY: %s", fr_syserror(errno));
+		}
+	}
+#endif
+
+	conn_set_buffers(c, fd);
+
+	/*
+	 *	Insert the connection into the opening list
+	 */
+	conn_transition(c, CONN_OPENING);
+	c->fd = fd;
+	tcp->send_len = 0;
+	tcp->recv_len = 0;
+
+	*fd_out = fd;
+
+	return FR_CONNECTION_STATE_CONNECTING;
+}
+
+#ifdef WITH_TLS
+/** Free the TLS session with the connection
+ *
+ */
+static int _tcp_connection_free(rlm_radius_tcp_connection_t *tcp)
+{
+	if (tcp->ssl) {
+		SSL_free(tcp->ssl);
+		tcp->ssl = NULL;
+	}
+
+	return 0;
+}
+#endif
+
+/** Allocate the buffers and ID tracking for a new connection
+ *
+ *  Each connection can have AT MOST 256 packets outstanding, as
+ *  that's all the RADIUS ID allows for.  We use a common ID space for
+ *  all packet codes sent on this connection.
+ */
+static int tcp_alloc(fr_io_connection_t *c)
+{
+	rlm_radius_tcp_connection_t *tcp;
+
+	c->ctx = tcp = talloc_zero(c, rlm_radius_tcp_connection_t);
+	if (!tcp) return -1;
+
+	tcp->send_buf = talloc_array(tcp, uint8_t, TCP_SEND_BUFFER_SIZE);
+	tcp->recv_buf = talloc_array(tcp, uint8_t, c->max_packet_size);
+	if (!tcp->send_buf || !tcp->recv_buf) return -1;
+
+	tcp->id = rr_track_create(tcp);
+	if (!tcp->id) return -1;
+
+	c->slots_free = tcp->id->num_free;
+
+#ifdef WITH_TLS
+	talloc_set_destructor(tcp, _tcp_connection_free);
+#endif
+
+	return 0;
+}
+
+/** Allocate an ID for a packet
+ *
+ */
+static rlm_radius_request_t *tcp_id_alloc(fr_io_connection_t *c, fr_io_request_t *u)
+{
+	rlm_radius_tcp_connection_t	*tcp = c->ctx;
+	rlm_radius_request_t		*rr;
+
+	rr = rr_track_alloc(tcp->id, u->request, u->code, u, &u->timer);
+	c->slots_free = tcp->id->num_free;
+
+	return rr;
+}
+
+/** Return an ID to the connection
+ *
+ */
+static void tcp_id_free(fr_io_connection_t *c, fr_io_request_t *u)
+{
+	rlm_radius_tcp_connection_t	*tcp = c->ctx;
+
+	(void) rr_track_delete(tcp->id, u->rr);
+	c->slots_free = tcp->id->num_free;
+}
+
+#ifdef WITH_TLS
+/** Check if the connection is still usable after processing events
+ *
+ */
+static bool conn_is_open(fr_io_connection_t const *c)
+{
+	switch (c->state) {
+	case CONN_ACTIVE:
+	case CONN_BLOCKED:
+	case CONN_FULL:
+	case CONN_ZOMBIE:
+		return true;
+
+	default:
+		return false;
+	}
+}
+#endif
+
+/** Read reply packets.
+ *
+ *  The stream may contain many packets, or only part of one.  Whole
+ *  packets are processed as they arrive, and anything left over is
+ *  kept until the rest of it is read.
+ */
+static void conn_read(fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	fr_io_connection_t		*c = talloc_get_type_abort(uctx, fr_io_connection_t);
+	rlm_radius_tcp_connection_t	*tcp = c->ctx;
+	ssize_t				data_len;
+	bool				activate = false;
+
+	DEBUG3("%s - Reading data for connection %s", c->module_name, c->name);
+
+	/*
+	 *	Drain the socket of all data.  If we're busy, this
+	 *	saves a round through the event loop.
+	 */
+	for (;;) {
+		uint8_t		*p, *end;
+
+		data_len = conn_recv(c, tcp->recv_buf + tcp->recv_len, talloc_array_length(tcp->recv_buf) - tcp->recv_len);
+		if (data_len == 0) break;
+
+		if (data_len < 0) {
+			fr_connection_signal_reconnect(c->conn);
+			return;
+		}
+
+		tcp->recv_len += data_len;
+
+		p = tcp->recv_buf;
+		end = tcp->recv_buf + tcp->recv_len;
+
+		/*
+		 *	Process all of the whole packets we have.
+		 */
+		while ((end - p) >= 4) {
+			size_t packet_len;
+
+			packet_len = (p[2] << 8) | p[3];
+
+			/*
+			 *	There's no way to resynchronise a
+			 *	stream with a bad length, so all we
+			 *	can do is close the connection.
+			 */
+			if (packet_len < 20) {
+				ERROR("%s - Invalid packet length %zu read from connection %s, reconnecting",
+				      c->module_name, packet_len, c->name);
+				fr_connection_signal_reconnect(c->conn);
+				return;
+			}
+
+			/*
+			 *	The packet is bigger than our buffer.
+			 *	Grow the buffer, and read the rest.
+			 */
+			if (packet_len > talloc_array_length(tcp->recv_buf)) {
+				uint8_t *buffer;
+				size_t offset = p - tcp->recv_buf;
+
+				MEM(buffer = talloc_realloc(tcp, tcp->recv_buf, uint8_t, packet_len));
+				tcp->recv_buf = buffer;
+				p = tcp->recv_buf + offset;
+				end = tcp->recv_buf + tcp->recv_len;
+			}
+
+			if ((size_t) (end - p) < packet_len) break;
+
+			/*
+			 *	Replicating?  Drain the socket, but
+			 *	ignore all responses.
+			 */
+			if (!c->inst->replicate && conn_process_reply(c, tcp->id, p, packet_len)) {
+				/*
+				 *	Transition to active on any one
+				 *	reply.  We activate the socket
+				 *	only when we're exiting, as
+				 *	fd_active() can close the
+				 *	connection.
+				 */
+				if (c->state != CONN_ACTIVE) {
+					conn_transition(c, CONN_ACTIVE);
+					activate = true;
+				}
+			}
+
+			p += packet_len;
+		}
+
+		/*
+		 *	Keep the partial packet for the next read.
+		 */
+		tcp->recv_len = end - p;
+		if (tcp->recv_len && (p != tcp->recv_buf)) memmove(tcp->recv_buf, p, tcp->recv_len);
+	}
+
+#ifdef WITH_TLS
+	/*
+	 *	SSL_write() was waiting for data from the home
+	 *	server.  Now that we've read it, carry on writing.
+	 */
+	if (tcp->write_wants_read) {
+		tcp->write_wants_read = false;
+		conn_writable(el, fd, 0, c);
+		return;
+	}
+#endif
+
+	if (activate && (fr_heap_num_elements(c->thread->queued) > 0)) fd_active(c);
+}
+
+/** Deal with per-request timeouts
+ *
+ *  The stream is reliable, so packets which were written to a
+ *  connection are not retransmitted.  The timers only limit how long
+ *  we wait for a reply, and how long we wait for a connection to send
+ *  the packet on.
+ */
+static void response_timeout(fr_event_list_t *el, struct timeval *now, void *uctx)
+{
+	int				rcode;
+	fr_io_request_t			*u = uctx;
+	fr_io_connection_t		*c = u->c;
+	REQUEST				*request;
+
+	rad_assert(u->timer.ev == NULL);
+	rad_assert(!c || !c->inst->parent->synchronous);
+
+	request = u->request;
+
+	RDEBUG("TIMER - response timeout reached for try (%d/%d)",
+	       u->timer.count, u->timer.retry->mrc);
+
+	/*
+	 *	Have we waited long enough?  If so, then maybe the
+	 *	connection is zombie.
+	 */
+	rcode = rr_track_retry(&u->timer, now);
+	if (rcode == 0) {
+		if (c) {
+			REDEBUG("No response to proxied request ID %d on connection %s",
+				u->rr->id, c->name);
+
+			/*
+			 *	Another thread has had a reply since
+			 *	we sent this packet, so the home
+			 *	server is still alive.
+			 */
+			if (!health_alive_since(c, u->time_sent)) conn_transition(c, CONN_ZOMBIE);
+		} else {
+			REDEBUG("No response to proxied request");
+		}
+
+		conn_finished_request(c, u);
+		return;
+	}
+
+	/*
+	 *	Insert the next timer.
+	 */
+	if (fr_event_timer_insert(u, el, &u->timer.ev, &u->timer.next, response_timeout, u) < 0) {
+		RDEBUG("Failed inserting retransmission timer");
+		conn_finished_request(c, u);
+		return;
+	}
+
+	/*
+	 *	The packet is on a live connection.  Keep waiting.
+	 */
+	if (c) {
+		RDEBUG("Waiting %d.%06ds more for a response on connection %s",
+		       u->timer.rt / USEC, u->timer.rt % USEC, c->name);
+		return;
+	}
+
+	/*
+	 *	There was no connection for the packet.  Try to wake
+	 *	up an active connection, which will drain the queue.
+	 */
+	rad_assert(u->state == REQUEST_IO_STATE_QUEUED);
+	c = fr_heap_peek(u->thread->active);
+	if (!c) {
+		RDEBUG("No available connections.  Waiting %d.%06ds for retry",
+		       u->timer.rt / USEC, u->timer.rt % USEC);
+		return;
+	}
+
+	conn_writable(el, c->fd, 0, c);
+}
+
+
+/** Encode a packet, and add it to the connection's output buffer
+ *
+ * @param c the conneciton
+ * @param u the fr_io_request_t connecting everything
+ * @return
+ *	- <0 on error
+ *	- 0 should retry the write later
+ *	- 1 the packet was successfully written to the socket, and we wait for a reply
+ *	- 2 the packet was replicated to the socket, and should be resumed immediately.
+ */
+static int conn_write(fr_io_connection_t *c, fr_io_request_t *u)
+{
+	ssize_t			packet_len;
+	REQUEST			*request = u->request;
+	int			rcode;
+
+	packet_len = conn_encode(c, u);
+	if (packet_len < 0) return -1;
+
+	/*
+	 *	Add the packet to the output buffer.  If the buffer
+	 *	is full, stop dequeueing packets.  The packet will be
+	 *	re-encoded when there's room.
+	 */
+	rcode = conn_queue(c, c->buffer, packet_len);
+	if (rcode == 0) return 0;
+
+	/*
+	 *	The connection failed.  The packet is sent again
+	 *	when the connection has been re-opened.
+	 */
+	if (rcode < 0) {
+		fr_connection_signal_reconnect(c->conn);
+		return 0;
+	}
+
+	/*
+	 *	We're replicating, so we don't care about the
+	 *	responses.  Don't do any retransmission timers, don't
+	 *	look for replies to status checks, etc.
+	 *
+	 *	Instead, just set the return code to OK, and return.
+	 */
+	if (c->inst->replicate) {
+		u->rcode = RLM_MODULE_OK;
+		return 2;
+	}
+
+	/*
+	 *	Print out helpful debugging messages for non-status
+	 *	checks.
+	 */
+	if (u != c->status_u) {
+		if (!c->inst->parent->synchronous) {
+			RDEBUG("Proxying request.  Expecting response within %d.%06ds",
+			       u->timer.rt / USEC, u->timer.rt % USEC);
+
+		} else {
+			RDEBUG("Proxying request.  Relying on the connection for delivery");
+		}
+
+		/*
+		 *	Status-Server only checks.
+		 */
+	} else {
+		RDEBUG("Sending %s status check.  Expecting response within %d.%06ds for connection %s",
+		       fr_packet_codes[u->code],
+		       u->timer.rt / USEC, u->timer.rt % USEC,
+			c->name);
+	}
+
+	return 1;
+}
+
+/** There's space available to write data, so do that...
+ *
+ *  All of the queued packets are encoded into the output buffer, and
+ *  then written with as few system calls as possible.
+ */
+static void conn_writable(fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	fr_io_connection_t		*c = talloc_get_type_abort(uctx, fr_io_connection_t);
+	fr_io_request_t			*u;
+	bool				pending = false;
+	fr_io_connection_t		*next;
+	int				rcode;
+#ifdef WITH_TLS
+	rlm_radius_tcp_connection_t	*tcp = c->ctx;
+#endif
+
+	DEBUG3("%s - Writing packets for connection %s", c->module_name, c->name);
+
+#ifdef WITH_TLS
+	/*
+	 *	Still doing the TLS handshake.  We'll be called again
+	 *	when the connection is ready.
+	 */
+	if (tcp->ssl && !tcp->tls_open) return;
+
+	/*
+	 *	SSL_read() was waiting for the socket to become
+	 *	writable.  Carry on reading.
+	 */
+	if (tcp->read_wants_write) {
+		tcp->read_wants_write = false;
+		conn_read(el, fd, flags, c);
+		if (!conn_is_open(c)) return;
+	}
+#endif
+
+	/*
+	 *	Write out anything left over from last time.
+	 */
+	rcode = conn_flush(c);
+	if (rcode < 0) {
+		fr_connection_signal_reconnect(c->conn);
+		return;
+	}
+
+	/*
+	 *	Still can't write everything.  Wait until we can.
+	 */
+	if (rcode == 0) {
+		if (c->state == CONN_ACTIVE) conn_transition(c, CONN_BLOCKED);
+		conn_flush_wait(c);
+		return;
+	}
+
+	/*
+	 *	The output buffer is empty, so we're no longer blocked.
+	 */
+	if (c->state == CONN_BLOCKED) conn_transition(c, CONN_ACTIVE);
+
+	/*
+	 *	If we have a pending status check packet, write that
+	 *	first.
+	 */
+	if (c->status_check_blocked) {
+		c->status_check_blocked = false;
+		rcode = conn_write(c, c->status_u);
+
+		/*
+		 *	Error, close the connection.
+		 */
+		if (rcode < 0) {
+			talloc_free(c);
+			return;
+		}
+
+		/*
+		 *	The connection failed, and is being re-opened.
+		 */
+		if (c->fd < 0) return;
+
+		/*
+		 *	The output buffer is still full.  Try again
+		 *	when the socket is writable.
+		 */
+		if (rcode == 0) {
+			c->status_check_blocked = true;
+			conn_flush_wait(c);
+			return;
+		}
+
+		/*
+		 *	Written successfully, go write more packets.
+		 */
+	}
+
+	/*
+	 *	Empty the global queue of packets to send.  Zombie
+	 *	connections only send status checks.
+	 */
+	while ((c->state != CONN_ZOMBIE) && ((u = fr_heap_peek(c->thread->queued)) != NULL)) {
+		rad_assert(u->state == REQUEST_IO_STATE_QUEUED);
+
+		/*
+		 *	Transition the packet to the connection.  If
+		 *	we can't do that, leave it where it is.
+		 */
+		state_transition(u, REQUEST_IO_STATE_WRITTEN, c);
+		if (!u->c) {
+			pending = true;
+			break;
+		}
+
+		/*
+		 *	Encode the packet, and add it to the output
+		 *	buffer.  Packets which were sent on a failed
+		 *	connection are sent again immediately.
+		 */
+		rcode = conn_write(c, u);
+
+		/*
+		 *	The packet was buffered, and we should wait
+		 *	for the reply.
+		 */
+		if (rcode == 1) {
+			continue;
+		}
+
+		/*
+		 *	The output buffer is full.  We re-insert the
+		 *	packet back onto the main thread queue, and
+		 *	stop writing packets to this connection.
+		 */
+		if (rcode == 0) {
+			pending = true;
+			state_transition(u, REQUEST_IO_STATE_QUEUED, NULL);
+
+			/*
+			 *	The connection failed, and is being
+			 *	re-opened.
+			 */
+			if (c->fd < 0) return;
+
+			conn_transition(c, CONN_BLOCKED);
+			break;
+		}
+
+		/*
+		 *	Can't write a packet to this connection, so we
+		 *	close it.
+		 *
+		 *	We still wake up the "next" connection, as we
+		 *	hope that it may be writable.
+		 */
+		if (rcode < 0) {
+			fr_io_connection_thread_t *t = c->thread;
+
+			talloc_free(c);
+
+			next = fr_heap_peek(t->active);
+			if (!next) return;
+
+			conn_writable(el, next->fd, 0, next);
+			return;
+		}
+
+		/*
+		 *	The packet was replicated, we don't care about
+		 *	the reply.  Just mark the request as finished.
+		 */
+		else {
+			rad_assert(rcode == 2);
+			state_transition(u, REQUEST_IO_STATE_REPLIED, NULL);
+		}
+	}
+
+	/*
+	 *	Write everything we've buffered in one go.
+	 */
+	rcode = conn_flush(c);
+	if (rcode < 0) {
+		fr_connection_signal_reconnect(c->conn);
+		return;
+	}
+
+	/*
+	 *	There's nothing more to write.  Set ourselves to idle.
+	 */
+	if ((rcode == 1) && !pending) {
+		fd_idle(c);
+		return;
+	}
+
+	/*
+	 *	The kernel didn't take everything.  We're blocked
+	 *	until the socket is writable.
+	 */
+	if (rcode == 0) {
+		if (c->state == CONN_ACTIVE) conn_transition(c, CONN_BLOCKED);
+		conn_flush_wait(c);
+	} else if (c->state == CONN_FULL) {
+		fd_idle(c);
+	}
+
+	if (!pending) return;
+
+	/*
+	 *	Wake up the next connection, and see if it can drain
+	 *	the input queue.
+	 */
+	next = fr_heap_peek(c->thread->active);
+	if (!next || (next == c)) return;
+
+	conn_writable(el, next->fd, 0, next);
+}
+
+#ifdef WITH_TLS
+static void conn_tls_handshake(fr_event_list_t *el, int fd, int flags, void *uctx);
+
+/** The TLS handshake took too long
+ *
+ */
+static void conn_tls_handshake_timeout(UNUSED fr_event_list_t *el, UNUSED struct timeval *now, void *uctx)
+{
+	fr_io_connection_t *c = talloc_get_type_abort(uctx, fr_io_connection_t);
+
+	ERROR("%s - TLS handshake timed out - %s", c->module_name, c->name);
+
+	fr_connection_signal_reconnect(c->conn);
+}
+
+/** Continue the TLS handshake
+ *
+ */
+static void conn_tls_handshake(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	fr_io_connection_t		*c = talloc_get_type_abort(uctx, fr_io_connection_t);
+	rlm_radius_tcp_connection_t	*tcp = c->ctx;
+	int				ret;
+
+	ret = SSL_connect(tcp->ssl);
+	if (ret == 1) {
+		DEBUG("%s - TLS handshake finished using %s - %s", c->module_name,
+		      SSL_get_cipher_name(tcp->ssl), c->name);
+
+		if (tcp->handshake_ev) (void) fr_event_timer_delete(c->thread->el, &tcp->handshake_ev);
+		tcp->tls_open = true;
+
+		conn_ready(c);
+		return;
+	}
+
+	switch (SSL_get_error(tcp->ssl, ret)) {
+	case SSL_ERROR_WANT_READ:
+		if (fr_event_fd_insert(c->conn, c->thread->el, c->fd,
+				       conn_tls_handshake, NULL, conn_error, c) < 0) break;
+		return;
+
+	case SSL_ERROR_WANT_WRITE:
+		if (fr_event_fd_insert(c->conn, c->thread->el, c->fd,
+				       NULL, conn_tls_handshake, conn_error, c) < 0) break;
+		return;
+
+	default:
+		tls_log_error(NULL, "%s - TLS handshake failed - %s", c->module_name, c->name);
+		break;
+	}
+
+	fr_connection_signal_reconnect(c->conn);
+}
+
+/** Set the name which the home server certificate must have
+ *
+ *  If "server_name" is set, the certificate must match it, and it's
+ *  also sent as SNI.  Otherwise the certificate must match the IP
+ *  address we're connecting to.  Without this check, any certificate
+ *  signed by our CA would be accepted, including one issued to a
+ *  different server.
+ */
+static int conn_tls_verify_name(fr_io_connection_t *c, SSL *ssl)
+{
+	rlm_radius_tcp_t const	*inst = (rlm_radius_tcp_t const *) c->inst;
+	X509_VERIFY_PARAM	*param = SSL_get0_param(ssl);
+
+	if (inst->server_name) {
+		X509_VERIFY_PARAM_set_hostflags(param, X509_CHECK_FLAG_NO_PARTIAL_WILDCARDS);
+
+		if (X509_VERIFY_PARAM_set1_host(param, inst->server_name, 0) != 1) {
+			tls_log_error(NULL, "%s - Failed setting server_name \"%s\"",
+				      c->module_name, inst->server_name);
+			return -1;
+		}
+
+		if (SSL_set_tlsext_host_name(ssl, inst->server_name) != 1) {
+			tls_log_error(NULL, "%s - Failed setting SNI \"%s\"",
+				      c->module_name, inst->server_name);
+			return -1;
+		}
+
+		return 0;
+	}
+
+	switch (c->dst_ipaddr.af) {
+	case AF_INET:
+		if (X509_VERIFY_PARAM_set1_ip(param, (uint8_t const *) &c->dst_ipaddr.addr.v4,
+					      sizeof(c->dst_ipaddr.addr.v4)) == 1) return 0;
+		break;
+
+	case AF_INET6:
+		if (X509_VERIFY_PARAM_set1_ip(param, (uint8_t const *) &c->dst_ipaddr.addr.v6,
+					      sizeof(c->dst_ipaddr.addr.v6)) == 1) return 0;
+		break;
+
+	default:
+		break;
+	}
+
+	tls_log_error(NULL, "%s - Failed setting the expected certificate IP address",
+		      c->module_name);
+	return -1;
+}
+
+/** Start the TLS handshake on a newly connected socket
+ *
+ */
+static int conn_tls_start(fr_io_connection_t *c)
+{
+	rlm_radius_tcp_t const		*inst = (rlm_radius_tcp_t const *) c->inst;
+	rlm_radius_tcp_connection_t	*tcp = c->ctx;
+	fr_tls_conf_t			*conf = inst->tls;
+	SSL_CTX				*ctx;
+	struct timeval			when;
+
+	ctx = conf->ctx[(conf->ctx_count == 1) ? 0 : conf->ctx_next++ % conf->ctx_count];	/* mutex not needed */
+
+	tcp->ssl = SSL_new(ctx);
+	if (!tcp->ssl) {
+		tls_log_error(NULL, "%s - Failed creating TLS session", c->module_name);
+		return -1;
+	}
+
+	/*
+	 *	The context callbacks expect an EAP style session.
+	 *	We only need the standard certificate checks, plus a
+	 *	check that the certificate is for this home server.
+	 */
+	SSL_set_info_callback(tcp->ssl, NULL);
+	SSL_set_verify(tcp->ssl, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, NULL);
+	SSL_set_mode(tcp->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE);
+
+	if (conn_tls_verify_name(c, tcp->ssl) < 0) return -1;
+
+	if (SSL_set_fd(tcp->ssl, c->fd) != 1) {
+		tls_log_error(NULL, "%s - Failed associating TLS session with socket", c->module_name);
+		return -1;
+	}
+	SSL_set_connect_state(tcp->ssl);
+	tcp->tls_open = false;
+
+	gettimeofday(&when, NULL);
+	fr_timeval_add(&when, &when, &c->thread->connection_timeout);
+	if (fr_event_timer_insert(tcp, c->thread->el, &tcp->handshake_ev, &when,
+				  conn_tls_handshake_timeout, c) < 0) {
+		ERROR("%s - Failed inserting TLS handshake timeout for connection %s",
+		      c->module_name, c->name);
+		return -1;
+	}
+
+	DEBUG("%s - Starting TLS handshake - %s", c->module_name, c->name);
+
+	/*
+	 *	The handshake starts with us writing the ClientHello.
+	 *	Do that from the event loop, so that errors don't
+	 *	re-enter the connection state machine while it's
+	 *	still calling us.
+	 */
+	if (fr_event_fd_insert(c->conn, c->thread->el, c->fd,
+			       NULL, conn_tls_handshake, conn_error, c) < 0) {
+		PERROR("Failed inserting FD event");
+		return -1;
+	}
+
+	return 0;
+}
+#endif
+
+/** Process notification that fd is open
+ *
+ */
+static fr_connection_state_t _conn_open(UNUSED fr_event_list_t *el, int fd, void *uctx)
+{
+	fr_io_connection_t		*c = talloc_get_type_abort(uctx, fr_io_connection_t);
+#ifdef WITH_TLS
+	rlm_radius_tcp_t const		*inst = (rlm_radius_tcp_t const *) c->inst;
+#endif
+	int				error = 0;
+	socklen_t			len = sizeof(error);
+	struct sockaddr_storage		src;
+	socklen_t			src_len = sizeof(src);
+
+	/*
+	 *	The socket is writable, but that may be because the
+	 *	connect failed.
+	 */
+	if ((getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0) || error) {
+		fr_strerror_printf("Failed connecting to %pV port %u: %s",
+				   fr_box_ipaddr(c->dst_ipaddr), c->dst_port, fr_syserror(error ? error : errno));
+		return FR_CONNECTION_STATE_FAILED;
+	}
+
+	/*
+	 *	Find out which port we're using.
+	 */
+	if ((getsockname(fd, (struct sockaddr *) &src, &src_len) < 0) ||
+	    (fr_ipaddr_from_sockaddr(&src, src_len, &c->src_ipaddr, &c->src_port) < 0)) {
+		c->src_port = 0;
+	}
+
+	talloc_const_free(c->name);
+	c->name = fr_asprintf(c, "proto %s local %pV port %u remote %pV port %u",
+#ifdef WITH_TLS
+			      inst->tls ? "tls" :
+#endif
+			      "tcp",
+			      fr_box_ipaddr(c->src_ipaddr), c->src_port,
+			      fr_box_ipaddr(c->dst_ipaddr), c->dst_port);
+
+	DEBUG("%s - Connection open - %s", c->module_name, c->name);
+
+	rad_assert(c->state == CONN_OPENING);
+
+#ifdef WITH_TLS
+	/*
+	 *	The connection isn't usable until the handshake has
+	 *	finished.  It stays in the "opening" state until then.
+	 */
+	if (inst->tls) {
+		if (conn_tls_start(c) < 0) return FR_CONNECTION_STATE_FAILED;
+
+		return FR_CONNECTION_STATE_CONNECTED;
+	}
+#endif
+
+	conn_ready(c);
+
+	return FR_CONNECTION_STATE_CONNECTED;
+}
+
+static fr_io_connection_funcs_t const tcp_funcs = {
+	.init			= _conn_init,
+	.open			= _conn_open,
+	.close			= _conn_close,
+
+	.alloc			= tcp_alloc,
+
+	.read			= conn_read,
+	.writable		= conn_writable,
+
+	.write			= conn_write,
+	.flush			= conn_send_pending,
+
+	.response_timeout	= response_timeout,
+
+	.id_alloc		= tcp_id_alloc,
+	.id_free		= tcp_id_free,
+};
+
+static void mod_signal(REQUEST *request, void *instance, UNUSED void *thread, UNUSED void *request_io_ctx,
+		       fr_state_signal_t action)
+{
+	rlm_radius_tcp_t *inst = talloc_get_type_abort(instance, rlm_radius_tcp_t);
+
+	if (action != FR_SIGNAL_DUP) return;
+
+	if (!inst->common.parent->synchronous) return;
+
+	/*
+	 *	The packet is either in the output buffer, or has
+	 *	already been delivered.  Sending it again would only
+	 *	confuse the home server.
+	 */
+	RDEBUG("Ignoring retransmission from the NAS, the connection will deliver the proxied request");
+}
+
+
+/** Bootstrap the module
+ *
+ * Bootstrap I/O and type submodules.
+ *
+ * @param[in] instance	Ctx data for this module
+ * @param[in] conf    our configuration section parsed to give us instance.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_bootstrap(void *instance, CONF_SECTION *conf)
+{
+	rlm_radius_tcp_t *inst = talloc_get_type_abort(instance, rlm_radius_tcp_t);
+
+	(void) talloc_set_type(inst, rlm_radius_tcp_t);
+	inst->common.config = conf;
+
+	return 0;
+}
+
+
+/** Instantiate the module
+ *
+ * Instantiate I/O and type submodules.
+ *
+ * @param[in] parent    rlm_radius_t
+ * @param[in] instance	Ctx data for this module
+ * @param[in] conf	our configuration section parsed to give us instance.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_instantiate(rlm_radius_t *parent, void *instance, CONF_SECTION *conf)
+{
+	rlm_radius_tcp_t	*inst = talloc_get_type_abort(instance, rlm_radius_tcp_t);
+	bool			use_tls = false;
+	CONF_SECTION		*tls_cs;
+
+	/*
+	 *	RADIUS over TLS.
+	 */
+	tls_cs = cf_section_find(conf, "tls", NULL);
+	if (tls_cs) {
+#ifdef WITH_TLS
+		inst->tls = tls_conf_parse_client(tls_cs);
+		if (!inst->tls) {
+			cf_log_err(tls_cs, "Failed parsing TLS configuration");
+			return -1;
+		}
+		use_tls = true;
+#else
+		cf_log_err(tls_cs, "TLS requires the server to be built with OpenSSL");
+		return -1;
+#endif
+	}
+
+	if (inst->server_name && !use_tls) {
+		cf_log_err(conf, "'server_name' can only be used with 'tls'");
+		return -1;
+	}
+
+	/*
+	 *	RFC 6614 Section 2.3 - RADIUS/TLS uses a fixed secret.
+	 */
+	if (!inst->common.secret) {
+		if (!use_tls) {
+			cf_log_err(conf, "A value must be given for 'secret'");
+			return -1;
+		}
+
+		inst->common.secret = talloc_typed_strdup(inst, "radsec");
+	}
+
+	/*
+	 *	RFC 6614 Section 2.1 - RADIUS/TLS has its own port.
+	 */
+	if (!inst->common.dst_port) {
+		if (!use_tls) {
+			cf_log_err(conf, "A value must be given for 'port'");
+			return -1;
+		}
+
+		inst->common.dst_port = 2083;
+	}
+
+	return conn_instantiate(&inst->common, &tcp_funcs, parent, conf);
+}
+
+
+/*
+ *	The module name should be the only globally exported symbol.
+ *	That is, everything else should be 'static'.
+ */
+extern fr_radius_client_io_t rlm_radius_tcp;
+fr_radius_client_io_t rlm_radius_tcp = {
+	.magic			= RLM_MODULE_INIT,
+	.name			= "radius_tcp",
+	.inst_size		= sizeof(rlm_radius_tcp_t),
+
+	.request_inst_size 	= sizeof(fr_io_request_t),
+	.request_inst_type	= "fr_io_request_t",
+
+	.thread_inst_size	= sizeof(fr_io_connection_thread_t),
+	.thread_inst_type	= "fr_io_connection_thread_t",
+
+	.config			= module_config,
+	.bootstrap		= mod_bootstrap,
+	.instantiate		= mod_instantiate,
+	.thread_instantiate 	= conn_thread_instantiate,
+	.thread_detach		= conn_thread_detach,
+
+	.push			= conn_request_push,
+	.signal			= mod_signal,
+	.resume			= conn_request_resume,
+};
@@ -26,11 +26,13 @@ RCSID("$Id$")
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/io/listen.h>
-#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/metrics.h>
 #include <freeradius-devel/server/rad_assert.h>
 
 #include <freeradius-devel/protocol/radius/freeradius.h>
 
+#include <ctype.h>
+
 /*
  *	@todo - also get the statistics from the network side for
  *		that, though, we need a way to find other network
@@ -38,37 +40,33 @@ RCSID("$Id$")
  *		statistics.
  */
 
-#include <pthread.h>
-
+/*
+ *	Each thread counts packets in its own shard of the metrics,
+ *	which are summed when they're read.  So threads never lock,
+ *	or write to memory which other threads write to.
+ */
 typedef struct {
-	pthread_mutex_t		mutex;
-	fr_dict_attr_t const	*type_da;			//!< FreeRADIUS-Stats4-Type
-	fr_dict_attr_t const	*ipv4_da;			//!< FreeRADIUS-Stats4-IPv4-Address
-	fr_dict_attr_t const	*ipv6_da;			//!< FreeRADIUS-Stats4-IPv6-Address
-	fr_dlist_head_t		list;				//!< for threads to know about each other
-
-	uint64_t		stats[FR_MAX_PACKET_CODE];
+	char const		*name;				//!< of the module instance
+	char			*labels;			//!< instance="<name>"
+	fr_metric_def_t		*defs;				//!< one counter per packet code
 } rlm_stats_t;
 
 typedef struct {
 	fr_ipaddr_t		ipaddr;				//!< IP address of this thing
 	fr_time_t		created;			//!< when it was created
 	fr_time_t		last_packet;			//!< when we last saw a packet
-	uint64_t		stats[FR_MAX_PACKET_CODE];	//!< actual statistic
+	fr_metrics_shard_t	*metrics;			//!< actual statistic
 } rlm_stats_data_t;
 
 typedef struct {
 	rlm_stats_t		*inst;
 
-	fr_time_t		last_global_update;
-	fr_dlist_t		entry;				//!< for threads to know about each other
-
 	fr_time_t		last_manage;			//!< when we deleted old things
 
 	rbtree_t		*src;				//!< stats by source
 	rbtree_t		*dst;				//!< stats by destination
 
-	uint64_t		stats[FR_MAX_PACKET_CODE];
+	fr_metrics_shard_t	*metrics;			//!< global statistics
 } rlm_stats_thread_t;
 
 static const CONF_PARSER module_config[] = {
@@ -95,52 +93,48 @@ fr_dict_attr_autoload_t rlm_stats_dict_attr[] = {
 	{ NULL }
 };
 
-static void coalesce(uint64_t final_stats[FR_MAX_PACKET_CODE], rlm_stats_thread_t *t,
-		     size_t tree_offset, rlm_stats_data_t *mydata)
+/** Print the labels for the statistics of one IP address
+ *
+ */
+static char *stats_labels(TALLOC_CTX *ctx, rlm_stats_t const *inst, fr_ipaddr_t const *ipaddr)
 {
-	rlm_stats_data_t *stats;
-	rlm_stats_thread_t *other;
-	rbtree_t **tree;
-	uint64_t local_stats[FR_MAX_PACKET_CODE];
+	char buffer[FR_IPADDR_STRLEN];
 
-	tree = (rbtree_t **) (((uint8_t *) t) + tree_offset);
+	fr_inet_ntop(buffer, sizeof(buffer), ipaddr);
 
-	/*
-	 *	Bootstrap with my statistics, where we don't need a
-	 *	lock.
-	 */
-	stats = rbtree_finddata(*tree, mydata);
-	if (!stats) {
-		memset(final_stats, 0, sizeof(uint64_t) * FR_MAX_PACKET_CODE);
-	} else {
-		memcpy(final_stats, stats->stats, sizeof(stats->stats));
-	}
-
-	/*
-	 *	Loop over all of the other thread instances, locking
-	 *	them, and adding their statistics in.
-	 */
-	for (other = fr_dlist_head(&t->inst->list);
-	     other != NULL;
-	     other = fr_dlist_next(&t->inst->list, other)) {
-		int i;
+	return talloc_asprintf(ctx, "%s,address=\"%s\"", inst->labels, buffer);
+}
 
-		if (other == t) continue;
+/** Find or create this thread's statistics for an IP address
+ *
+ */
+static rlm_stats_data_t *stats_data_find(rlm_stats_thread_t *t, rbtree_t *tree, char const *set_name,
+					 fr_ipaddr_t const *ipaddr, fr_time_t now)
+{
+	rlm_stats_data_t	mydata, *stats;
+	char			*labels;
+
+	mydata.ipaddr = *ipaddr;
+	stats = rbtree_finddata(tree, &mydata);
+	if (stats) return stats;
+
+	MEM(stats = talloc_zero(t, rlm_stats_data_t));
+	stats->ipaddr = *ipaddr;
+	stats->created = now;
+
+	MEM(labels = stats_labels(NULL, t->inst, ipaddr));
+	stats->metrics = fr_metrics_shard_alloc(stats, set_name, labels, t->inst->defs, FR_MAX_PACKET_CODE);
+	talloc_free(labels);
+	if (!stats->metrics) {
+		talloc_free(stats);
+		return NULL;
+	}
 
-		tree = (rbtree_t **) (((uint8_t *) other) + tree_offset);
-		stats = rbtree_finddata(*tree, mydata);
-		if (!stats) {
-			continue;
-		}
-		memcpy(&local_stats, stats->stats, sizeof(stats->stats));
+	(void) rbtree_insert(tree, stats);
 
-		for (i = 0; i < FR_MAX_PACKET_CODE; i++) {
-			final_stats[i] += local_stats[i];
-		}
-	}
+	return stats;
 }
 
-
 /*
  *	Do the statistics
  */
@@ -151,10 +145,11 @@ static rlm_rcode_t CC_HINT(nonnull) mod_stats(void *instance, void *thread, REQU
 	rlm_stats_thread_t *t = thread;
 	rlm_stats_t *inst = instance;
 	VALUE_PAIR *vp;
-	rlm_stats_data_t mydata, *stats;
+	rlm_stats_data_t *stats;
 	fr_cursor_t cursor;
 	char buffer[64];
-	uint64_t local_stats[sizeof(inst->stats) / sizeof(inst->stats[0])];
+	char *labels;
+	uint64_t local_stats[FR_MAX_PACKET_CODE];
 
 	/*
 	 *	Increment counters only in "send foo" sections.
@@ -170,62 +165,35 @@ static rlm_rcode_t CC_HINT(nonnull) mod_stats(void *instance, void *thread, REQU
 		dst_code = request->reply->code;
 		if (dst_code >= FR_MAX_PACKET_CODE) dst_code = 0;
 
-		t->stats[src_code]++;
-		t->stats[dst_code]++;
+		fr_metrics_inc(t->metrics, src_code);
+		fr_metrics_inc(t->metrics, dst_code);
 
 		/*
 		 *	Update source statistics
 		 */
-		mydata.ipaddr = request->packet->src_ipaddr;
-		stats = rbtree_finddata(t->src, &mydata);
-		if (!stats) {
-			MEM(stats = talloc_zero(t, rlm_stats_data_t));
-
-			stats->ipaddr = request->packet->src_ipaddr;
-			stats->created = request->async->recv_time;
-
-			(void) rbtree_insert(t->src, stats);
+		stats = stats_data_find(t, t->src, "stats_client", &request->packet->src_ipaddr,
+					request->async->recv_time);
+		if (stats) {
+			stats->last_packet = request->async->recv_time;
+			fr_metrics_inc(stats->metrics, src_code);
+			fr_metrics_inc(stats->metrics, dst_code);
 		}
 
-		stats->last_packet = request->async->recv_time;
-		stats->stats[src_code]++;
-		stats->stats[dst_code]++;
-
 		/*
 		 *	Update destination statistics
 		 */
-		mydata.ipaddr = request->packet->dst_ipaddr;
-		stats = rbtree_finddata(t->dst, &mydata);
-		if (!stats) {
-			MEM(stats = talloc_zero(t, rlm_stats_data_t));
-
-			stats->ipaddr = request->packet->dst_ipaddr;
-			stats->created = request->async->recv_time;
-
-			(void) rbtree_insert(t->dst, stats);
+		stats = stats_data_find(t, t->dst, "stats_listener", &request->packet->dst_ipaddr,
+					request->async->recv_time);
+		if (stats) {
+			stats->last_packet = request->async->recv_time;
+			fr_metrics_inc(stats->metrics, src_code);
+			fr_metrics_inc(stats->metrics, dst_code);
 		}
 
-		stats->last_packet = request->async->recv_time;
-		stats->stats[src_code]++;
-		stats->stats[dst_code]++;
-
 		/*
 		 *	@todo - periodically clean up old entries.
 		 */
 
-		if ((t->last_global_update + NANOSEC) > request->async->recv_time) {
-			return RLM_MODULE_UPDATED;
-		}
-
-		t->last_global_update = request->async->recv_time;
-
-		pthread_mutex_lock(&inst->mutex);
-		for (i = 0; i < FR_MAX_PACKET_CODE; i++) {
-			inst->stats[i] += t->stats[i];
-			t->stats[i] = 0;
-		}
-		pthread_mutex_unlock(&inst->mutex);
-
 		return RLM_MODULE_UPDATED;
 	}
 
@@ -252,40 +220,31 @@ static rlm_rcode_t CC_HINT(nonnull) mod_stats(void *instance, void *thread, REQU
 	MEM(pair_update_reply(&vp, attr_freeradius_stats4_type) >= 0);
 	vp->vp_uint32 = stats_type;
 
+	/*
+	 *	The statistics are summed across all of the threads,
+	 *	without locking any of them.
+	 */
 	switch (stats_type) {
 	case FR_FREERADIUS_STATS4_TYPE_VALUE_GLOBAL:			/* global */
-		/*
-		 *	Merge our stats with the global stats, and then copy
-		 *	the global stats to a thread-local variable.
-		 *
-		 *	The copy helps minimize mutex contention.
-		 */
-		pthread_mutex_lock(&inst->mutex);
-		for (i = 0; i < FR_MAX_PACKET_CODE; i++) {
-			inst->stats[i] += t->stats[i];
-			t->stats[i] = 0;
+		if (fr_metrics_read(local_stats, "stats", inst->labels, FR_MAX_PACKET_CODE) < 0) {
+			memset(local_stats, 0, sizeof(local_stats));
 		}
-		memcpy(&local_stats, inst->stats, sizeof(inst->stats));
-		pthread_mutex_unlock(&inst->mutex);
 		vp = NULL;
 		break;
 
 	case FR_FREERADIUS_STATS4_TYPE_VALUE_CLIENT:			/* src */
-		vp = fr_pair_find_by_da(request->packet->vps, attr_freeradius_stats4_ipv4_address, TAG_ANY);
-		if (!vp) vp = fr_pair_find_by_da(request->packet->vps, attr_freeradius_stats4_ipv6_address, TAG_ANY);
-		if (!vp) return RLM_MODULE_NOOP;
-
-		mydata.ipaddr = vp->vp_ip;
-		coalesce(local_stats, t, offsetof(rlm_stats_thread_t, src), &mydata);
-		break;
-
 	case FR_FREERADIUS_STATS4_TYPE_VALUE_LISTENER:			/* dst */
 		vp = fr_pair_find_by_da(request->packet->vps, attr_freeradius_stats4_ipv4_address, TAG_ANY);
 		if (!vp) vp = fr_pair_find_by_da(request->packet->vps, attr_freeradius_stats4_ipv6_address, TAG_ANY);
 		if (!vp) return RLM_MODULE_NOOP;
 
-		mydata.ipaddr = vp->vp_ip;
-		coalesce(local_stats, t, offsetof(rlm_stats_thread_t, dst), &mydata);
+		MEM(labels = stats_labels(request, inst, &vp->vp_ip));
+		if (fr_metrics_read(local_stats,
+				    (stats_type == FR_FREERADIUS_STATS4_TYPE_VALUE_CLIENT) ? "stats_client" : "stats_listener",
+				    labels, FR_MAX_PACKET_CODE) < 0) {
+			memset(local_stats, 0, sizeof(local_stats));
+		}
+		talloc_free(labels);
 		break;
 
 	default:
@@ -345,12 +304,17 @@ static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance,
 
 	t->inst = inst;
 
-	t->src = rbtree_talloc_create(t, data_cmp, rlm_stats_data_t, NULL, RBTREE_FLAG_LOCK);
-	t->dst = rbtree_talloc_create(t, data_cmp, rlm_stats_data_t, NULL, RBTREE_FLAG_LOCK);
+	t->metrics = fr_metrics_shard_alloc(t, "stats", inst->labels, inst->defs, FR_MAX_PACKET_CODE);
+	if (!t->metrics) {
+		PERROR("Failed allocating statistics");
+		return -1;
+	}
 
-	pthread_mutex_lock(&inst->mutex);
-	fr_dlist_insert_head(&inst->list, t);
-	pthread_mutex_unlock(&inst->mutex);
+	/*
+	 *	Only this thread uses the trees, so they don't need locks.
+	 */
+	t->src = rbtree_talloc_create(t, data_cmp, rlm_stats_data_t, NULL, RBTREE_FLAG_NONE);
+	t->dst = rbtree_talloc_create(t, data_cmp, rlm_stats_data_t, NULL, RBTREE_FLAG_NONE);
 
 	return 0;
 }
@@ -358,44 +322,50 @@ static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance,
 
 /** Destroy thread data for the submodule.
  *
+ * The counters are added to the totals when the shards are freed.
  */
 static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
 {
 	rlm_stats_thread_t *t = talloc_get_type_abort(thread, rlm_stats_thread_t);
-	rlm_stats_t *inst = t->inst;
-	int i;
 
-	pthread_mutex_lock(&inst->mutex);
-	for (i = 0; i < FR_MAX_PACKET_CODE; i++) {
-		inst->stats[i] += t->stats[i];
-	}
-	fr_dlist_remove(&inst->list, t);
-	pthread_mutex_unlock(&inst->mutex);
+	TALLOC_FREE(t->src);
+	TALLOC_FREE(t->dst);
+	TALLOC_FREE(t->metrics);
 
 	return 0;
 }
 
-static int mod_instantiate(void *instance, UNUSED CONF_SECTION *conf)
+static int mod_instantiate(void *instance, CONF_SECTION *conf)
 {
 	rlm_stats_t	*inst = instance;
+	int		i;
 
-	pthread_mutex_init(&inst->mutex, NULL);
-	fr_dlist_init(&inst->list, rlm_stats_thread_t, entry);
+	inst->name = cf_section_name2(conf);
+	if (!inst->name) inst->name = cf_section_name1(conf);
 
-	return 0;
-}
+	MEM(inst->labels = talloc_asprintf(inst, "instance=\"%s\"", inst->name));
 
-/*
- *	Only free memory we allocated.  The strings allocated via
- *	cf_section_parse() do not need to be freed.
- */
-static int mod_detach(void *instance)
-{
-	rlm_stats_t *inst = talloc_get_type_abort(instance, rlm_stats_t);
+	/*
+	 *	One counter per packet code, named after the code,
+	 *	e.g. "access_request".
+	 */
+	MEM(inst->defs = talloc_zero_array(inst, fr_metric_def_t, FR_MAX_PACKET_CODE));
+	for (i = 0; i < FR_MAX_PACKET_CODE; i++) {
+		char *name, *p;
 
-	pthread_mutex_destroy(&inst->mutex);
+		if (!fr_packet_codes[i] || !*fr_packet_codes[i]) {
+			MEM(name = talloc_asprintf(inst->defs, "code_%i", i));
+		} else {
+			MEM(name = talloc_strdup(inst->defs, fr_packet_codes[i]));
+		}
+
+		for (p = name; *p; p++) *p = (*p == '-') ? '_' : tolower((uint8_t) *p);
+
+		inst->defs[i].name = name;
+		inst->defs[i].help = name;
+		inst->defs[i].type = FR_METRIC_COUNTER;
+	}
 
-	/* free things here */
 	return 0;
 }
 
@@ -417,7 +387,6 @@ rad_module_t rlm_stats = {
 	.thread_inst_size	= sizeof(rlm_stats_thread_t),
 	.config			= module_config,
 	.instantiate		= mod_instantiate,
-	.detach			= mod_detach,
 	.thread_instantiate	= mod_thread_instantiate,
 	.thread_detach		= mod_thread_detach,
 	.methods = {
@@ -332,6 +332,24 @@ invalid:
  */
 int fr_radius_sign(uint8_t *packet, uint8_t const *original,
 		   uint8_t const *secret, size_t secret_len)
+{
+	return fr_radius_sign_precomputed(packet, original, secret, secret_len, NULL);
+}
+
+/** Sign a previously encoded packet, using a pre-computed HMAC key for the Message-Authenticator
+ *
+ * @param packet the raw RADIUS packet (request or response)
+ * @param original the raw original request (if this is a response)
+ * @param secret the shared secret
+ * @param secret_len the length of the secret
+ * @param hmac_key the shared secret pre-computed by #fr_hmac_md5_key_alloc.
+ *	If NULL, the HMAC is calculated from the secret.
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int fr_radius_sign_precomputed(uint8_t *packet, uint8_t const *original,
+			       uint8_t const *secret, size_t secret_len, fr_hmac_md5_key_t const *hmac_key)
 {
 	uint8_t		*msg, *end;
 	size_t		packet_len = (packet[2] << 8) | packet[3];
@@ -417,7 +435,11 @@ int fr_radius_sign(uint8_t *packet, uint8_t const *original,
 		 *	Message-Authenticator attribute.
 		 */
 		memset(msg + 2, 0, RADIUS_AUTH_VECTOR_LENGTH);
-		fr_hmac_md5(msg + 2, packet, packet_len, secret, secret_len);
+		if (hmac_key) {
+			fr_hmac_md5_precomputed(msg + 2, packet, packet_len, hmac_key);
+		} else {
+			fr_hmac_md5(msg + 2, packet, packet_len, secret, secret_len);
+		}
 		break;
 	}
 
@@ -761,6 +783,24 @@ finish:
  */
 int fr_radius_verify(uint8_t *packet, uint8_t const *original,
 		     uint8_t const *secret, size_t secret_len)
+{
+	return fr_radius_verify_precomputed(packet, original, secret, secret_len, NULL);
+}
+
+/** Verify a request / response packet, using a pre-computed HMAC key for the Message-Authenticator
+ *
+ * @param packet the raw RADIUS packet (request or response)
+ * @param original the raw original request (if this is a response)
+ * @param secret the shared secret
+ * @param secret_len the length of the secret
+ * @param hmac_key the shared secret pre-computed by #fr_hmac_md5_key_alloc.
+ *	If NULL, the HMAC is calculated from the secret.
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int fr_radius_verify_precomputed(uint8_t *packet, uint8_t const *original,
+				 uint8_t const *secret, size_t secret_len, fr_hmac_md5_key_t const *hmac_key)
 {
 	int rcode;
 	uint8_t *msg, *end;
@@ -816,7 +856,7 @@ int fr_radius_verify(uint8_t *packet, uint8_t const *original,
 	 *	slightly more CPU work than having verify-specific
 	 *	functions, but it ends up being cleaner in the code.
 	 */
-	rcode = fr_radius_sign(packet, original, secret, secret_len);
+	rcode = fr_radius_sign_precomputed(packet, original, secret, secret_len, hmac_key);
 	if (rcode < 0) {
 		fr_strerror_printf_push("Failed calculating correct authenticator");
 		return -1;
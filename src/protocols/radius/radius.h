@@ -27,6 +27,7 @@
 #include <freeradius-devel/util/cursor.h>
 #include <freeradius-devel/util/packet.h>
 #include <freeradius-devel/util/log.h>
+#include <freeradius-devel/util/md5.h>
 
 #define RADIUS_HEADER_LENGTH			20
 #define RADIUS_MAX_STRING_LENGTH		253
@@ -86,6 +87,12 @@ int		fr_radius_sign(uint8_t *packet, uint8_t const *original,
 			       uint8_t const *secret, size_t secret_len) CC_HINT(nonnull (1,3));
 int		fr_radius_verify(uint8_t *packet, uint8_t const *original,
 				 uint8_t const *secret, size_t secret_len) CC_HINT(nonnull (1,3));
+int		fr_radius_sign_precomputed(uint8_t *packet, uint8_t const *original,
+					   uint8_t const *secret, size_t secret_len,
+					   fr_hmac_md5_key_t const *hmac_key) CC_HINT(nonnull (1,3));
+int		fr_radius_verify_precomputed(uint8_t *packet, uint8_t const *original,
+					     uint8_t const *secret, size_t secret_len,
+					     fr_hmac_md5_key_t const *hmac_key) CC_HINT(nonnull (1,3));
 bool		fr_radius_ok(uint8_t const *packet, size_t *packet_len_p,
 			     uint32_t max_attributes, bool require_ma, decode_fail_t *reason) CC_HINT(nonnull (1,2));
 
@@ -1,8 +1,15 @@
 FILES  := \
 	atomic_queue_test 	\
 	control_test 		\
+	crc32_test		\
+	detail_binary_test	\
 	dhcpclient		\
+	file_index_test	\
+	hmac_md5_test	\
+	log_async_test	\
 	message_set_test	\
+	metrics_test		\
+	network_overload_test	\
 	radclient		\
 	radict 			\
 	radmin			\
@@ -13,10 +20,17 @@ FILES  := \
 	ring_buffer_test 	\
 	rlm_redis_ippool_tool 	\
 	smbencrypt 		\
+	trace_test		\
 	unit_test_attribute 	\
 	unit_test_map 		\
 	unit_test_module
 
+#
+#  These require OpenSSL.
+#
+ifneq "$(OPENSSL_LIBS)" ""
+FILES += vector_cache_test
+endif
 
 DICT_DIR := $(top_srcdir)/share/dictionary
 
@@ -0,0 +1,16 @@
+#
+#  Test the "cache_shm" driver
+#
+
+#  MODULE.test is the main target for this module.
+cache_shm.test:
+
+#
+#  The cache file persists between runs.  Remove it before running the
+#  tests, so that they start with an empty cache.
+#
+$(BUILD_DIR)/tests/modules/cache_shm/cache-shm: | cache_shm.clean
+
+.PHONY: cache_shm.clean
+cache_shm.clean:
+	${Q}rm -f src/tests/modules/cache_shm/cache.shm
@@ -1,3 +1,18 @@
 #
 #  Test the "files" module
 #
+
+#
+#  All of the tests instantiate "files_reload", which reads reload_users.
+#  Create it before the tests start.  reload.unlang rewrites it, so run
+#  that test after all of the others.
+#
+FILES_TESTS := $(patsubst src/tests/modules/files/%.unlang,$(BUILD_DIR)/tests/modules/files/%,$(wildcard src/tests/modules/files/*.unlang))
+
+$(FILES_TESTS): | files.reload_users
+
+$(BUILD_DIR)/tests/modules/files/reload: $(filter-out %/reload,$(FILES_TESTS))
+
+.PHONY: files.reload_users
+files.reload_users:
+	${Q}cp src/tests/modules/files/reload_users_1 src/tests/modules/files/reload_users
@@ -0,0 +1,7 @@
+#
+#  Test the "radius" module
+#
+
+#  MODULE.test is the main target for this module.
+radius.test:
+	${Q}echo OK: radius.test
@@ -1,4 +1,12 @@
-SUBMAKEFILES := ring_buffer_test.mk message_set_test.mk atomic_queue_test.mk control_test.mk 
+SUBMAKEFILES := ring_buffer_test.mk message_set_test.mk atomic_queue_test.mk control_test.mk file_index_test.mk hmac_md5_test.mk log_async_test.mk \
+		crc32_test.mk detail_binary_test.mk metrics_test.mk network_overload_test.mk trace_test.mk
+
+#
+#  These require OpenSSL.
+#
+ifneq "$(OPENSSL_LIBS)" ""
+SUBMAKEFILES += vector_cache_test.mk
+endif
 
 #
 #  These require pthread.
@@ -0,0 +1,135 @@
+/*
+ * crc32_test.c	Tests for CRC-32
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * @copyright 2019 The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/util/crc32.h>
+#include <freeradius-devel/server/rad_assert.h>
+#include <string.h>
+
+#ifdef HAVE_GETOPT_H
+#  include <getopt.h>
+#endif
+
+static int		debug_lvl = 0;
+
+/**********************************************************************/
+typedef struct rad_request REQUEST;
+REQUEST *request_alloc(UNUSED TALLOC_CTX *ctx);
+void request_verify(UNUSED char const *file, UNUSED int line, UNUSED REQUEST *request);
+void talloc_const_free(void const *ptr);
+
+REQUEST *request_alloc(UNUSED TALLOC_CTX *ctx)
+{
+	return NULL;
+}
+
+void request_verify(UNUSED char const *file, UNUSED int line, UNUSED REQUEST *request)
+{
+}
+
+void talloc_const_free(void const *ptr)
+{
+	void *tmp;
+	if (!ptr) return;
+
+	memcpy(&tmp, &ptr, sizeof(tmp));
+	talloc_free(tmp);
+}
+/**********************************************************************/
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: crc32_test [OPTS]\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(EXIT_SUCCESS);
+}
+
+#define CHECK(_x) do { \
+	if (!(_x)) { \
+		fprintf(stderr, "%s[%d]: Check failed: %s\n", __FILE__, __LINE__, #_x); \
+		exit(EXIT_FAILURE); \
+	} \
+} while (0)
+
+/** The check values from the CRC catalogue, for CRC-32 (ISO-HDLC)
+ *
+ */
+static void test_check_value(void)
+{
+	uint8_t const check[] = "123456789";
+
+	CHECK(fr_crc32(0, check, sizeof(check) - 1) == 0xcbf43926);
+	CHECK(fr_crc32(0, check, 0) == 0);
+	CHECK(fr_crc32(0, (uint8_t const *) "a", 1) == 0xe8b7be43);
+
+	if (debug_lvl) printf("Check value passed\n");
+}
+
+/** Feeding the data in pieces gives the same CRC as all at once
+ *
+ */
+static void test_incremental(void)
+{
+	uint8_t		data[1024];
+	uint32_t	expected, crc;
+	size_t		i, split;
+
+	for (i = 0; i < sizeof(data); i++) data[i] = (i * 7) ^ (i >> 3);
+
+	expected = fr_crc32(0, data, sizeof(data));
+
+	for (split = 0; split <= sizeof(data); split += 31) {
+		crc = fr_crc32(0, data, split);
+		crc = fr_crc32(crc, data + split, sizeof(data) - split);
+		CHECK(crc == expected);
+	}
+
+	/*
+	 *	A single bit flip changes the CRC.
+	 */
+	data[100] ^= 0x01;
+	CHECK(fr_crc32(0, data, sizeof(data)) != expected);
+
+	if (debug_lvl) printf("Incremental checks passed\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "hx")) != -1) switch (c) {
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	test_check_value();
+	test_incremental();
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,6 @@
+TARGET := crc32_test
+
+SOURCES		:= crc32_test.c
+
+TGT_PREREQS	:= $(LIBFREERADIUS_SERVER) libfreeradius-io.a libfreeradius-util.a
+TGT_LDLIBS	:= $(LIBS)
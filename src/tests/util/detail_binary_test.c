@@ -0,0 +1,305 @@
+/*
+ * detail_binary_test.c	Tests for binary detail records
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * @copyright 2019 The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/detail.h>
+#include <freeradius-devel/server/rad_assert.h>
+#include <string.h>
+
+#ifdef HAVE_GETOPT_H
+#  include <getopt.h>
+#endif
+
+static int		debug_lvl = 0;
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: detail_binary_test [OPTS]\n");
+	fprintf(stderr, "  -D <dir>               Dictionary directory (default " DICTDIR ").\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(EXIT_SUCCESS);
+}
+
+#define CHECK(_x) do { \
+	if (!(_x)) { \
+		fprintf(stderr, "%s[%d]: Check failed: %s\n", __FILE__, __LINE__, #_x); \
+		exit(EXIT_FAILURE); \
+	} \
+} while (0)
+
+static struct {
+	char const	*name;
+	char const	*value;
+} const attrs[] = {
+	{ "Tmp-String-0",	"bob" },
+	{ "Tmp-Integer-0",	"123456" },
+	{ "Tmp-IP-Address-0",	"192.0.2.99" },
+	{ "Tmp-Octets-0",	"0x00010203fffe" },
+	{ "Tmp-String-1",	"" },
+};
+
+#define NUM_ATTRS (sizeof(attrs) / sizeof(attrs[0]))
+
+static struct timeval const timestamp = { .tv_sec = 1546300800, .tv_usec = 123456 };
+
+/** Build a record from a packet with the test attributes
+ *
+ */
+static uint8_t *record_alloc(TALLOC_CTX *ctx, size_t *len, VALUE_PAIR **vps)
+{
+	RADIUS_PACKET	*packet;
+	uint8_t		*record;
+	size_t		i;
+	fr_cursor_t	cursor;
+
+	packet = fr_radius_alloc(ctx, false);
+	CHECK(packet != NULL);
+
+	packet->src_ipaddr.af = packet->dst_ipaddr.af = AF_INET;
+	CHECK(inet_pton(AF_INET, "192.0.2.1", &packet->src_ipaddr.addr.v4) == 1);
+	CHECK(inet_pton(AF_INET, "192.0.2.2", &packet->dst_ipaddr.addr.v4) == 1);
+	packet->src_port = 1645;
+	packet->dst_port = 1813;
+
+	record = fr_detail_binary_alloc(ctx, len, packet, &timestamp);
+	CHECK(record != NULL);
+	CHECK(*len == FR_DETAIL_BINARY_HDR_LEN);
+
+	*vps = NULL;
+	fr_cursor_init(&cursor, vps);
+	for (i = 0; i < NUM_ATTRS; i++) {
+		fr_dict_attr_t const	*da;
+		VALUE_PAIR		*vp;
+
+		da = fr_dict_attr_by_name(fr_dict_internal, attrs[i].name);
+		CHECK(da != NULL);
+
+		vp = fr_pair_afrom_da(ctx, da);
+		CHECK(vp != NULL);
+		CHECK(fr_pair_value_from_str(vp, attrs[i].value, -1, '\0', false) == 0);
+
+		CHECK(fr_detail_binary_encode_pair(&record, len, vp) == 0);
+		fr_cursor_append(&cursor, vp);
+	}
+
+	fr_detail_binary_finalise(record, *len);
+	talloc_free(packet);
+
+	return record;
+}
+
+/** Decode a record into a new request
+ *
+ */
+static int record_decode(TALLOC_CTX *ctx, REQUEST **out, time_t *when, uint8_t const *record, size_t len)
+{
+	REQUEST		*request;
+	fr_cursor_t	cursor;
+
+	request = request_alloc(ctx);
+	CHECK(request != NULL);
+	request->packet = fr_radius_alloc(request, false);
+	CHECK(request->packet != NULL);
+
+	fr_cursor_init(&cursor, &request->packet->vps);
+	*out = request;
+
+	return fr_detail_binary_decode(request, &cursor, when, record, len);
+}
+
+/** Records decode to the same header fields and attributes they were encoded from
+ *
+ */
+static void test_round_trip(void)
+{
+	TALLOC_CTX	*ctx = talloc_init("test_round_trip");
+	uint8_t		*record;
+	size_t		len;
+	VALUE_PAIR	*vps, *a, *b;
+	REQUEST		*request;
+	time_t		when;
+	fr_cursor_t	ca, cb;
+
+	record = record_alloc(ctx, &len, &vps);
+
+	CHECK(fr_detail_binary_check(record, len));
+	CHECK(fr_detail_binary_length(record, len) == (ssize_t) len);
+	CHECK(fr_detail_binary_length(record, FR_DETAIL_BINARY_HDR_LEN - 1) == 0);
+	CHECK(!fr_detail_binary_is_done(record));
+
+	CHECK(record_decode(ctx, &request, &when, record, len) == 0);
+	CHECK(when == timestamp.tv_sec);
+
+	CHECK(request->packet->src_ipaddr.af == AF_INET);
+	CHECK(request->packet->src_ipaddr.addr.v4.s_addr == htonl(0xc0000201));
+	CHECK(request->packet->dst_ipaddr.addr.v4.s_addr == htonl(0xc0000202));
+	CHECK(request->packet->src_port == 1645);
+	CHECK(request->packet->dst_port == 1813);
+
+	for (a = fr_cursor_init(&ca, &vps), b = fr_cursor_init(&cb, &request->packet->vps);
+	     a && b;
+	     a = fr_cursor_next(&ca), b = fr_cursor_next(&cb)) {
+		CHECK(a->da == b->da);
+		CHECK(fr_value_box_cmp(&a->data, &b->data) == 0);
+
+		if (debug_lvl) printf("%s round tripped\n", a->da->name);
+	}
+	CHECK(!a && !b);
+
+	/*
+	 *	Readers mark records as done in place.  That
+	 *	mustn't invalidate the CRC.
+	 */
+	memcpy(record + FR_DETAIL_BINARY_DONE_OFFSET, "Done", 4);
+	CHECK(fr_detail_binary_is_done(record));
+	CHECK(record_decode(ctx, &request, &when, record, len) == 0);
+
+	talloc_free(ctx);
+
+	if (debug_lvl) printf("Round trip checks passed\n");
+}
+
+/** Any change to the protected part of the record is detected
+ *
+ */
+static void test_corrupt(void)
+{
+	TALLOC_CTX	*ctx = talloc_init("test_corrupt");
+	uint8_t		*record;
+	size_t		len, i;
+	VALUE_PAIR	*vps;
+	REQUEST		*request;
+	time_t		when;
+
+	record = record_alloc(ctx, &len, &vps);
+
+	/*
+	 *	Flip a bit in every byte covered by the CRC, and in
+	 *	the CRC itself.
+	 */
+	for (i = 12; i < len; i++) {
+		record[i] ^= 0x10;
+		CHECK(record_decode(ctx, &request, &when, record, len) < 0);
+		CHECK(strstr(fr_strerror(), "CRC") != NULL);
+		record[i] ^= 0x10;
+	}
+
+	CHECK(record_decode(ctx, &request, &when, record, len) == 0);
+
+	/*
+	 *	Bad magic.
+	 */
+	record[1] ^= 0xff;
+	CHECK(fr_detail_binary_length(record, len) < 0);
+	CHECK(record_decode(ctx, &request, &when, record, len) < 0);
+	record[1] ^= 0xff;
+
+	/*
+	 *	An attribute which claims to be longer than the
+	 *	record, with a valid CRC.
+	 */
+	record[FR_DETAIL_BINARY_HDR_LEN + 1 + strlen(attrs[0].name)] = 0xff;
+	fr_detail_binary_finalise(record, len);
+	CHECK(record_decode(ctx, &request, &when, record, len) < 0);
+	CHECK(strstr(fr_strerror(), "overflows") != NULL);
+
+	talloc_free(ctx);
+
+	if (debug_lvl) printf("Corruption checks passed\n");
+}
+
+/** Partially written records are rejected
+ *
+ */
+static void test_truncated(void)
+{
+	TALLOC_CTX	*ctx = talloc_init("test_truncated");
+	uint8_t		*record;
+	size_t		len, i;
+	VALUE_PAIR	*vps;
+	REQUEST		*request;
+	time_t		when;
+
+	record = record_alloc(ctx, &len, &vps);
+
+	for (i = 0; i < len; i++) {
+		CHECK(record_decode(ctx, &request, &when, record, i) < 0);
+		if (i < FR_DETAIL_BINARY_HDR_LEN) {
+			CHECK(fr_detail_binary_length(record, i) == 0);
+		} else {
+			CHECK(strstr(fr_strerror(), "truncated") != NULL);
+		}
+	}
+
+	/*
+	 *	The length field is shorter than the header.
+	 */
+	record[8] = record[9] = record[10] = 0;
+	record[11] = FR_DETAIL_BINARY_HDR_LEN - 1;
+	CHECK(fr_detail_binary_length(record, len) < 0);
+	CHECK(record_decode(ctx, &request, &when, record, len) < 0);
+
+	talloc_free(ctx);
+
+	if (debug_lvl) printf("Truncation checks passed\n");
+}
+
+int main(int argc, char *argv[])
+{
+	TALLOC_CTX	*autofree = talloc_autofree_context();
+	char const	*dict_dir = DICTDIR;
+	fr_dict_t	*dict = NULL;
+	int		c;
+
+	while ((c = getopt(argc, argv, "D:hx")) != -1) switch (c) {
+		case 'D':
+			dict_dir = optarg;
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	if (fr_dict_global_init(autofree, dict_dir) < 0) {
+		fr_perror("detail_binary_test");
+		exit(EXIT_FAILURE);
+	}
+
+	if (fr_dict_internal_afrom_file(&dict, FR_DICTIONARY_INTERNAL_DIR) < 0) {
+		fr_perror("detail_binary_test");
+		exit(EXIT_FAILURE);
+	}
+
+	test_round_trip();
+	test_corrupt();
+	test_truncated();
+
+	exit(EXIT_SUCCESS);
+}
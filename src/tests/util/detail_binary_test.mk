@@ -0,0 +1,6 @@
+TARGET := detail_binary_test
+
+SOURCES		:= detail_binary_test.c
+
+TGT_PREREQS	:= $(LIBFREERADIUS_SERVER) libfreeradius-io.a libfreeradius-util.a
+TGT_LDLIBS	:= $(LIBS)
@@ -0,0 +1,353 @@
+/*
+ * file_index_test.c	Tests for memory mapped file indexes
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * @copyright 2019 The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/server/rad_assert.h>
+#include <freeradius-devel/util/file_index.h>
+#include <freeradius-devel/util/strerror.h>
+#include <freeradius-devel/util/syserror.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_GETOPT_H
+#  include <getopt.h>
+#endif
+
+/*
+ *	Offsets of fields in the on-disk format, so that we can
+ *	corrupt them.
+ */
+#define HEADER_NUM_KEYS		(24)
+#define HEADER_KEYS_OFFSET	(40)
+#define HEADER_FILE_SIZE	(56)
+#define KEY_KEY_OFFSET		(0)
+#define KEY_RECORD_OFFSET	(8)
+
+static int		debug_lvl = 0;
+
+/**********************************************************************/
+typedef struct rad_request REQUEST;
+REQUEST *request_alloc(UNUSED TALLOC_CTX *ctx);
+void request_verify(UNUSED char const *file, UNUSED int line, UNUSED REQUEST *request);
+void talloc_const_free(void const *ptr);
+
+REQUEST *request_alloc(UNUSED TALLOC_CTX *ctx)
+{
+	return NULL;
+}
+
+void request_verify(UNUSED char const *file, UNUSED int line, UNUSED REQUEST *request)
+{
+}
+
+void talloc_const_free(void const *ptr)
+{
+	void *tmp;
+	if (!ptr) return;
+
+	memcpy(&tmp, &ptr, sizeof(tmp));
+	talloc_free(tmp);
+}
+/**********************************************************************/
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: file_index_test [OPTS]\n");
+	fprintf(stderr, "  -d <dir>               Directory to write the index to (default /tmp).\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(EXIT_SUCCESS);
+}
+
+#define CHECK(_x) do { \
+	if (!(_x)) { \
+		fprintf(stderr, "%s[%d]: Check failed: %s\n", __FILE__, __LINE__, #_x); \
+		exit(EXIT_FAILURE); \
+	} \
+} while (0)
+
+/** Build an index with duplicate keys, and absent fields
+ *
+ */
+static void index_build(char const *filename)
+{
+	fr_file_index_writer_t	*w;
+	int64_t			record;
+	size_t			i;
+	static char const	*records[][3] = {
+		{ "bob", "hello", "1" },
+		{ "alice", NULL, "2" },
+		{ "bob", "goodbye", "3" },
+		{ "", "empty", "4" },
+	};
+
+	w = fr_file_index_writer_alloc(NULL, 3, 0);
+	CHECK(w != NULL);
+
+	for (i = 0; i < (sizeof(records) / sizeof(records[0])); i++) {
+		record = fr_file_index_record_add(w, records[i]);
+		CHECK(record >= 0);
+		CHECK(fr_file_index_key_add(w, records[i][0], record) == 0);
+	}
+
+	if (fr_file_index_write(w, filename) < 0) {
+		fr_perror("file_index_test");
+		exit(EXIT_FAILURE);
+	}
+
+	talloc_free(w);
+}
+
+static uint64_t index_read(char const *filename, off_t offset)
+{
+	int		fd;
+	uint64_t	value;
+
+	fd = open(filename, O_RDONLY);
+	CHECK(fd >= 0);
+	CHECK(pread(fd, &value, sizeof(value), offset) == sizeof(value));
+	close(fd);
+
+	return value;
+}
+
+static void index_write(char const *filename, off_t offset, void const *value, size_t len)
+{
+	int fd;
+
+	fd = open(filename, O_WRONLY);
+	CHECK(fd >= 0);
+	CHECK(pwrite(fd, value, len, offset) == (ssize_t)len);
+	close(fd);
+}
+
+static void index_write64(char const *filename, off_t offset, uint64_t value)
+{
+	index_write(filename, offset, &value, sizeof(value));
+}
+
+/** Offset of the key table entry for the first key
+ *
+ */
+static off_t index_first_key(char const *filename)
+{
+	return index_read(filename, HEADER_KEYS_OFFSET);
+}
+
+/** Lookups in a valid index return the records in the order they were added
+ *
+ */
+static void test_valid(char const *filename)
+{
+	fr_file_index_t	*idx;
+	size_t		first, num;
+	char const	*fields[3];
+
+	index_build(filename);
+
+	idx = fr_file_index_open(NULL, filename);
+	if (!idx) {
+		fr_perror("file_index_test");
+		exit(EXIT_FAILURE);
+	}
+
+	CHECK(fr_file_index_num_fields(idx) == 3);
+	CHECK(fr_file_index_key_field(idx) == 0);
+
+	num = fr_file_index_find(&first, idx, "bob", 3);
+	CHECK(num == 2);
+	CHECK(fr_file_index_fields(fields, idx, first) == 0);
+	CHECK(strcmp(fields[0], "bob") == 0);
+	CHECK(strcmp(fields[1], "hello") == 0);
+	CHECK(strcmp(fields[2], "1") == 0);
+	CHECK(fr_file_index_fields(fields, idx, first + 1) == 0);
+	CHECK(strcmp(fields[1], "goodbye") == 0);
+	CHECK(strcmp(fields[2], "3") == 0);
+
+	num = fr_file_index_find(&first, idx, "alice", 5);
+	CHECK(num == 1);
+	CHECK(fr_file_index_fields(fields, idx, first) == 0);
+	CHECK(fields[1] == NULL);
+	CHECK(strcmp(fields[2], "2") == 0);
+
+	num = fr_file_index_find(&first, idx, "", 0);
+	CHECK(num == 1);
+	CHECK(fr_file_index_fields(fields, idx, first) == 0);
+	CHECK(strcmp(fields[1], "empty") == 0);
+
+	CHECK(fr_file_index_find(&first, idx, "bo", 2) == 0);
+	CHECK(fr_file_index_find(&first, idx, "carol", 5) == 0);
+	CHECK(fr_file_index_fields(fields, idx, 4) < 0);
+
+	talloc_free(idx);
+
+	if (debug_lvl) printf("Valid index checks passed\n");
+}
+
+/** Truncated indexes, or indexes with bad headers, can't be opened
+ *
+ */
+static void test_truncated(char const *filename)
+{
+	uint64_t size;
+
+	index_build(filename);
+	size = index_read(filename, HEADER_FILE_SIZE);
+
+	CHECK(truncate(filename, size - 1) == 0);
+	CHECK(fr_file_index_open(NULL, filename) == NULL);
+
+	CHECK(truncate(filename, 16) == 0);
+	CHECK(fr_file_index_open(NULL, filename) == NULL);
+
+	CHECK(truncate(filename, 0) == 0);
+	CHECK(fr_file_index_open(NULL, filename) == NULL);
+
+	index_build(filename);
+	index_write(filename, 0, "XXXXXXX", 7);
+	CHECK(fr_file_index_open(NULL, filename) == NULL);
+
+	index_build(filename);
+	index_write64(filename, HEADER_NUM_KEYS, UINT64_MAX / 2);
+	CHECK(fr_file_index_open(NULL, filename) == NULL);
+
+	index_build(filename);
+	index_write64(filename, HEADER_KEYS_OFFSET, size + 8);
+	CHECK(fr_file_index_open(NULL, filename) == NULL);
+
+	if (debug_lvl) printf("Truncated index checks passed\n");
+}
+
+/** Corrupt offsets in the key table or records fail lookups, instead of reading outside the file
+ *
+ */
+static void test_corrupt(char const *filename)
+{
+	fr_file_index_t	*idx;
+	uint64_t	size, record;
+	off_t		key;
+	size_t		first;
+	char const	*fields[3];
+	uint32_t	offset;
+	static uint64_t const bad_records[] = { 8, 1 << 20, UINT64_MAX - 3 };
+	size_t		i;
+
+	/*
+	 *	Record offsets outside the file.  "" is the first key.
+	 */
+	for (i = 0; i < (sizeof(bad_records) / sizeof(bad_records[0])); i++) {
+		index_build(filename);
+		key = index_first_key(filename);
+
+		index_write64(filename, key + KEY_RECORD_OFFSET, bad_records[i]);
+
+		idx = fr_file_index_open(NULL, filename);
+		CHECK(idx != NULL);
+		CHECK(fr_file_index_find(&first, idx, "", 0) == 1);
+		CHECK(fr_file_index_fields(fields, idx, first) < 0);
+		talloc_free(idx);
+	}
+
+	/*
+	 *	A record offset so close to the end of the file there's
+	 *	no room for the field offsets.
+	 */
+	index_build(filename);
+	size = index_read(filename, HEADER_FILE_SIZE);
+	key = index_first_key(filename);
+	index_write64(filename, key + KEY_RECORD_OFFSET, (size - sizeof(uint32_t)) & ~((uint64_t)sizeof(uint32_t) - 1));
+
+	idx = fr_file_index_open(NULL, filename);
+	CHECK(idx != NULL);
+	CHECK(fr_file_index_find(&first, idx, "", 0) == 1);
+	CHECK(fr_file_index_fields(fields, idx, first) < 0);
+	talloc_free(idx);
+
+	/*
+	 *	A field offset outside the file.
+	 */
+	index_build(filename);
+	key = index_first_key(filename);
+	record = index_read(filename, key + KEY_RECORD_OFFSET);
+	offset = UINT32_MAX;
+	index_write(filename, record + sizeof(uint32_t), &offset, sizeof(offset));
+
+	idx = fr_file_index_open(NULL, filename);
+	CHECK(idx != NULL);
+	CHECK(fr_file_index_find(&first, idx, "", 0) == 1);
+	CHECK(fr_file_index_fields(fields, idx, first) < 0);
+	talloc_free(idx);
+
+	/*
+	 *	A key offset outside the file.  The key can't be found.
+	 */
+	index_build(filename);
+	key = index_first_key(filename);
+	index_write64(filename, key + KEY_KEY_OFFSET, UINT64_MAX);
+
+	idx = fr_file_index_open(NULL, filename);
+	CHECK(idx != NULL);
+	CHECK(fr_file_index_find(&first, idx, "", 0) == 0);
+	talloc_free(idx);
+
+	if (debug_lvl) printf("Corrupt index checks passed\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int			c;
+	char const		*dir = "/tmp";
+	char			*tmpdir, *filename;
+	TALLOC_CTX		*autofree = talloc_autofree_context();
+
+	while ((c = getopt(argc, argv, "d:hx")) != -1) switch (c) {
+		case 'd':
+			dir = optarg;
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	tmpdir = talloc_asprintf(autofree, "%s/file_index_test.XXXXXX", dir);
+	if (!mkdtemp(tmpdir)) {
+		fprintf(stderr, "Failed creating directory in %s: %s\n", dir, fr_syserror(errno));
+		exit(EXIT_FAILURE);
+	}
+	filename = talloc_asprintf(autofree, "%s/index", tmpdir);
+
+	test_valid(filename);
+	test_truncated(filename);
+	test_corrupt(filename);
+
+	unlink(filename);
+	rmdir(tmpdir);
+
+	exit(EXIT_SUCCESS);
+}
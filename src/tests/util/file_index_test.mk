@@ -0,0 +1,6 @@
+TARGET := file_index_test
+
+SOURCES		:= file_index_test.c
+
+TGT_PREREQS	:= $(LIBFREERADIUS_SERVER) libfreeradius-io.a libfreeradius-util.a
+TGT_LDLIBS	:= $(LIBS)
@@ -0,0 +1,213 @@
+/*
+ * hmac_md5_test.c	Tests for HMAC-MD5 with pre-computed keys
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * @copyright 2019 The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/util/md5.h>
+#include <freeradius-devel/server/rad_assert.h>
+#include <string.h>
+
+#ifdef HAVE_GETOPT_H
+#  include <getopt.h>
+#endif
+
+static int		debug_lvl = 0;
+
+/**********************************************************************/
+typedef struct rad_request REQUEST;
+REQUEST *request_alloc(UNUSED TALLOC_CTX *ctx);
+void request_verify(UNUSED char const *file, UNUSED int line, UNUSED REQUEST *request);
+void talloc_const_free(void const *ptr);
+
+REQUEST *request_alloc(UNUSED TALLOC_CTX *ctx)
+{
+	return NULL;
+}
+
+void request_verify(UNUSED char const *file, UNUSED int line, UNUSED REQUEST *request)
+{
+}
+
+void talloc_const_free(void const *ptr)
+{
+	void *tmp;
+	if (!ptr) return;
+
+	memcpy(&tmp, &ptr, sizeof(tmp));
+	talloc_free(tmp);
+}
+/**********************************************************************/
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: hmac_md5_test [OPTS]\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(EXIT_SUCCESS);
+}
+
+#define CHECK(_x) do { \
+	if (!(_x)) { \
+		fprintf(stderr, "%s[%d]: Check failed: %s\n", __FILE__, __LINE__, #_x); \
+		exit(EXIT_FAILURE); \
+	} \
+} while (0)
+
+typedef struct {
+	uint8_t		key[80];
+	size_t		key_len;
+	uint8_t		key_fill;		//!< If set, the key is key_len copies of this.
+	uint8_t		data[64];
+	size_t		data_len;
+	uint8_t		data_fill;		//!< If set, the data is data_len copies of this.
+	uint8_t		digest[MD5_DIGEST_LENGTH];
+} hmac_vector_t;
+
+/*
+ *	The first three are from RFC 2104 Appendix.  The last is from
+ *	RFC 2202 Section 2, and has a key longer than the MD5 block size,
+ *	which is hashed before use.
+ */
+static hmac_vector_t const vectors[] = {
+	{
+		.key = { 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b,
+			 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b },
+		.key_len = 16,
+		.data = "Hi There",
+		.data_len = 8,
+		.digest = { 0x92, 0x94, 0x72, 0x7a, 0x36, 0x38, 0xbb, 0x1c,
+			    0x13, 0xf4, 0x8e, 0xf8, 0x15, 0x8b, 0xfc, 0x9d }
+	},
+	{
+		.key = "Jefe",
+		.key_len = 4,
+		.data = "what do ya want for nothing?",
+		.data_len = 28,
+		.digest = { 0x75, 0x0c, 0x78, 0x3e, 0x6a, 0xb0, 0xb5, 0x03,
+			    0xea, 0xa8, 0x6e, 0x31, 0x0a, 0x5d, 0xb7, 0x38 }
+	},
+	{
+		.key_fill = 0xaa,
+		.key_len = 16,
+		.data_fill = 0xdd,
+		.data_len = 50,
+		.digest = { 0x56, 0xbe, 0x34, 0x52, 0x1d, 0x14, 0x4c, 0x88,
+			    0xdb, 0xb8, 0xc7, 0x33, 0xf0, 0xe8, 0xb3, 0xf6 }
+	},
+	{
+		.key_fill = 0xaa,
+		.key_len = 80,
+		.data = "Test Using Larger Than Block-Size Key - Hash Key First",
+		.data_len = 54,
+		.digest = { 0x6b, 0x1a, 0xb7, 0xfe, 0x4b, 0xd7, 0xbf, 0x8f,
+			    0x0b, 0x62, 0xe6, 0xce, 0x61, 0xb9, 0xd0, 0xcd }
+	},
+};
+
+/** Both implementations give the published digests
+ *
+ */
+static void test_vectors(void)
+{
+	size_t			i;
+	uint8_t			digest[MD5_DIGEST_LENGTH];
+	fr_hmac_md5_key_t	*key;
+
+	for (i = 0; i < (sizeof(vectors) / sizeof(vectors[0])); i++) {
+		hmac_vector_t v = vectors[i];
+
+		if (v.key_fill) memset(v.key, v.key_fill, v.key_len);
+		if (v.data_fill) memset(v.data, v.data_fill, v.data_len);
+
+		fr_hmac_md5(digest, v.data, v.data_len, v.key, v.key_len);
+		CHECK(memcmp(digest, v.digest, sizeof(digest)) == 0);
+
+		key = fr_hmac_md5_key_alloc(NULL, v.key, v.key_len);
+		CHECK(key != NULL);
+
+		memset(digest, 0, sizeof(digest));
+		fr_hmac_md5_precomputed(digest, v.data, v.data_len, key);
+		CHECK(memcmp(digest, v.digest, sizeof(digest)) == 0);
+
+		/*
+		 *	The key is re-used for every message, so it
+		 *	mustn't be changed by using it.
+		 */
+		memset(digest, 0, sizeof(digest));
+		fr_hmac_md5_precomputed(digest, v.data, v.data_len, key);
+		CHECK(memcmp(digest, v.digest, sizeof(digest)) == 0);
+
+		talloc_free(key);
+
+		if (debug_lvl) printf("Vector %zu passed\n", i + 1);
+	}
+}
+
+/** The same key gives the same digests as fr_hmac_md5() for other messages
+ *
+ */
+static void test_messages(void)
+{
+	uint8_t			data[256];
+	uint8_t			expected[MD5_DIGEST_LENGTH], digest[MD5_DIGEST_LENGTH];
+	uint8_t const		secret[] = "testing123";
+	fr_hmac_md5_key_t	*key;
+	size_t			i, len;
+
+	for (i = 0; i < sizeof(data); i++) data[i] = i;
+
+	key = fr_hmac_md5_key_alloc(NULL, secret, sizeof(secret) - 1);
+	CHECK(key != NULL);
+
+	/*
+	 *	Lengths either side of the MD5 block boundaries.
+	 */
+	for (len = 0; len <= sizeof(data); len++) {
+		fr_hmac_md5(expected, data, len, secret, sizeof(secret) - 1);
+		fr_hmac_md5_precomputed(digest, data, len, key);
+		CHECK(memcmp(digest, expected, sizeof(digest)) == 0);
+	}
+
+	talloc_free(key);
+
+	if (debug_lvl) printf("Message checks passed\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "hx")) != -1) switch (c) {
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	test_vectors();
+	test_messages();
+
+	exit(EXIT_SUCCESS);
+}
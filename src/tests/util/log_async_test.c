@@ -0,0 +1,207 @@
+/*
+ * log_async_test.c	Tests for the asynchronous log writer
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * @copyright 2019 The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/server/rad_assert.h>
+#include <freeradius-devel/util/log.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_GETOPT_H
+#  include <getopt.h>
+#endif
+
+static int		debug_lvl = 0;
+
+/**********************************************************************/
+typedef struct rad_request REQUEST;
+REQUEST *request_alloc(UNUSED TALLOC_CTX *ctx);
+void request_verify(UNUSED char const *file, UNUSED int line, UNUSED REQUEST *request);
+void talloc_const_free(void const *ptr);
+
+REQUEST *request_alloc(UNUSED TALLOC_CTX *ctx)
+{
+	return NULL;
+}
+
+void request_verify(UNUSED char const *file, UNUSED int line, UNUSED REQUEST *request)
+{
+}
+
+void talloc_const_free(void const *ptr)
+{
+	void *tmp;
+	if (!ptr) return;
+
+	memcpy(&tmp, &ptr, sizeof(tmp));
+	talloc_free(tmp);
+}
+/**********************************************************************/
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: log_async_test [OPTS]\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(EXIT_SUCCESS);
+}
+
+#define CHECK(_x) do { \
+	if (!(_x)) { \
+		fprintf(stderr, "%s[%d]: Check failed: %s\n", __FILE__, __LINE__, #_x); \
+		exit(EXIT_FAILURE); \
+	} \
+} while (0)
+
+/*
+ *	The smallest ring, so that it wraps many times.
+ */
+#define RING_SIZE	4096
+#define NUM_MESSAGES	20000
+#define MAX_MESSAGE	600
+
+static char const dropped_notice[] = "Log buffer full";
+
+/** Format message number i
+ *
+ * Lengths vary so that messages end at every offset in the ring, and so
+ * that each message wraps at a different place to the last one.
+ */
+static size_t message_make(char *buffer, int i)
+{
+	size_t	len = 8 + ((i * 13) % (MAX_MESSAGE - 8));
+	size_t	j;
+
+	snprintf(buffer, len, "%06d:", i);
+	for (j = 7; j < (len - 1); j++) buffer[j] = 'a' + ((i + j) % 26);
+	buffer[len - 1] = '\n';
+
+	return len;
+}
+
+/** Messages of mixed lengths fill and wrap the ring, and all arrive intact and in order
+ *
+ */
+static void test_wrap(void)
+{
+	FILE		*fp;
+	fr_log_t	log = { .dst = L_DST_FILES };
+	char		buffer[MAX_MESSAGE];
+	char		*line = NULL;
+	size_t		line_size = 0, len;
+	ssize_t		slen;
+	uint64_t	written, dropped;
+	int		i, found = 0;
+
+	fp = tmpfile();
+	CHECK(fp != NULL);
+	log.fd = fileno(fp);
+
+	CHECK(fr_log_async_start(RING_SIZE) == 0);
+	CHECK(fr_log_async_enabled());
+
+	for (i = 0; i < NUM_MESSAGES; i++) {
+		len = message_make(buffer, i);
+
+		/*
+		 *	If the ring is full, wait for the writer
+		 *	thread to drain it.
+		 */
+		while ((slen = fr_log_async_write(&log, buffer, len)) == 0) usleep(100);
+		CHECK(slen == (ssize_t) len);
+	}
+
+	fr_log_async_stop();
+	CHECK(!fr_log_async_enabled());
+
+	fr_log_async_stats(&written, &dropped);
+	CHECK(written == NUM_MESSAGES);
+
+	if (debug_lvl) printf("Wrote %d messages, %" PRIu64 " dropped and retried\n", NUM_MESSAGES, dropped);
+
+	/*
+	 *	The writer thread may have told us about the dropped
+	 *	messages.  Everything else must be exactly what we wrote.
+	 */
+	CHECK(fseek(fp, 0, SEEK_SET) == 0);
+	while ((slen = getline(&line, &line_size, fp)) > 0) {
+		if (strncmp(line, dropped_notice, sizeof(dropped_notice) - 1) == 0) continue;
+
+		CHECK(found < NUM_MESSAGES);
+		len = message_make(buffer, found);
+		CHECK((size_t) slen == len);
+		CHECK(memcmp(line, buffer, len) == 0);
+		found++;
+	}
+	CHECK(found == NUM_MESSAGES);
+
+	free(line);
+	fclose(fp);
+
+	if (debug_lvl) printf("Wrap checks passed\n");
+}
+
+/** Messages too big for the ring are written synchronously
+ *
+ */
+static void test_large(void)
+{
+	FILE		*fp;
+	fr_log_t	log = { .dst = L_DST_FILES };
+	char		buffer[RING_SIZE];
+
+	fp = tmpfile();
+	CHECK(fp != NULL);
+	log.fd = fileno(fp);
+
+	memset(buffer, 'x', sizeof(buffer));
+
+	CHECK(fr_log_async_start(RING_SIZE) == 0);
+	CHECK(fr_log_async_write(&log, buffer, sizeof(buffer)) == sizeof(buffer));
+	CHECK(ftell(fp) == sizeof(buffer));
+	fr_log_async_stop();
+
+	fclose(fp);
+
+	if (debug_lvl) printf("Large message checks passed\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "hx")) != -1) switch (c) {
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	test_wrap();
+	test_large();
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,6 @@
+TARGET := log_async_test
+
+SOURCES		:= log_async_test.c
+
+TGT_PREREQS	:= $(LIBFREERADIUS_SERVER) libfreeradius-io.a libfreeradius-util.a
+TGT_LDLIBS	:= $(LIBS)
@@ -0,0 +1,306 @@
+/*
+ * metrics_test.c	Tests for the per-thread metrics registry
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * @copyright 2019 The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/util/metrics.h>
+#include <freeradius-devel/server/rad_assert.h>
+#include <string.h>
+#include <pthread.h>
+
+#ifdef HAVE_GETOPT_H
+#  include <getopt.h>
+#endif
+
+static int		debug_lvl = 0;
+
+/**********************************************************************/
+typedef struct rad_request REQUEST;
+REQUEST *request_alloc(UNUSED TALLOC_CTX *ctx);
+void request_verify(UNUSED char const *file, UNUSED int line, UNUSED REQUEST *request);
+void talloc_const_free(void const *ptr);
+
+REQUEST *request_alloc(UNUSED TALLOC_CTX *ctx)
+{
+	return NULL;
+}
+
+void request_verify(UNUSED char const *file, UNUSED int line, UNUSED REQUEST *request)
+{
+}
+
+void talloc_const_free(void const *ptr)
+{
+	void *tmp;
+	if (!ptr) return;
+
+	memcpy(&tmp, &ptr, sizeof(tmp));
+	talloc_free(tmp);
+}
+/**********************************************************************/
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: metrics_test [OPTS]\n");
+	fprintf(stderr, "  -n <threads>           Number of updating threads.\n");
+	fprintf(stderr, "  -m <updates>           Updates per thread.\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(EXIT_SUCCESS);
+}
+
+#define CHECK(_x) do { \
+	if (!(_x)) { \
+		fprintf(stderr, "%s[%d]: Check failed: %s\n", __FILE__, __LINE__, #_x); \
+		exit(EXIT_FAILURE); \
+	} \
+} while (0)
+
+#define MAX_THREADS	64
+
+typedef enum {
+	TEST_COUNTER = 0,
+	TEST_GAUGE,
+	TEST_HISTOGRAM,
+	TEST_MAX
+} test_metric_t;
+
+static fr_metric_def_t const defs[] = {
+	[TEST_COUNTER]		= { .name = "requests", .help = "Requests processed.", .type = FR_METRIC_COUNTER },
+	[TEST_GAUGE]		= { .name = "active", .help = "Threads running.", .type = FR_METRIC_GAUGE },
+	[TEST_HISTOGRAM]	= { .name = "time", .help = "Processing time.", .type = FR_METRIC_HISTOGRAM },
+};
+
+/*
+ *	Times, and the bucket each one goes in.  Buckets count times
+ *	<= 2^N microseconds, with times rounded up to whole microseconds.
+ */
+static struct {
+	uint64_t	ns;
+	unsigned int	bucket;
+} const times[] = {
+	{ 0,			0 },
+	{ 500,			0 },
+	{ 1000,			0 },
+	{ 1500,			1 },
+	{ 3000,			2 },
+	{ 4000,			2 },
+	{ 4001,			3 },
+	{ 1000000,		10 },
+	{ (uint64_t) 1 << 40,	FR_METRICS_HIST_BUCKETS - 1 },
+};
+
+#define NUM_TIMES (sizeof(times) / sizeof(times[0]))
+
+static int			num_threads = 8;
+static int			num_updates = 100000;
+
+static fr_metrics_shard_t	*shards[MAX_THREADS];
+static atomic_int		running;
+
+/** Update a shard, and free half of them before the thread exits
+ *
+ */
+static void *metrics_worker(void *arg)
+{
+	intptr_t		id = (intptr_t) arg;
+	fr_metrics_shard_t	*shard;
+	int			i;
+
+	shard = fr_metrics_shard_alloc(NULL, "test", "instance=\"a\"", defs, TEST_MAX);
+	CHECK(shard != NULL);
+	shards[id] = shard;
+
+	fr_metrics_inc(shard, TEST_GAUGE);
+
+	for (i = 0; i < num_updates; i++) {
+		fr_metrics_inc(shard, TEST_COUNTER);
+		fr_metrics_observe(shard, TEST_HISTOGRAM, times[i % NUM_TIMES].ns);
+	}
+
+	CHECK(fr_metrics_value(shard, TEST_COUNTER) == (uint64_t) num_updates);
+
+	fr_metrics_dec(shard, TEST_GAUGE);
+
+	if (id & 0x01) {
+		talloc_free(shard);
+		shards[id] = NULL;
+	}
+
+	atomic_fetch_sub(&running, 1);
+
+	return NULL;
+}
+
+/** Sum the buckets of the histogram
+ *
+ */
+static void metrics_hist_sum(char const *set_name, char const *labels, fr_metric_def_t const *def,
+			     uint64_t const *value, void *uctx)
+{
+	uint64_t *hist = uctx;
+
+	if ((strcmp(set_name, "test") != 0) || (def->type != FR_METRIC_HISTOGRAM)) return;
+	if (!labels || (strcmp(labels, "instance=\"a\"") != 0)) return;
+
+	memcpy(hist, value, sizeof(uint64_t) * FR_METRICS_HIST_SLOTS);
+}
+
+/** Threads update their own shards, while the values are read
+ *
+ */
+static void test_threads(void)
+{
+	pthread_t	tid[MAX_THREADS];
+	uint64_t	out[TEST_MAX], last = 0, total;
+	uint64_t	hist[FR_METRICS_HIST_SLOTS], expected[FR_METRICS_HIST_SLOTS];
+	uint64_t	sum_ns = 0;
+	int		i, reads = 0;
+	char		*text;
+
+	atomic_store(&running, num_threads);
+	for (i = 0; i < num_threads; i++) {
+		CHECK(pthread_create(&tid[i], NULL, metrics_worker, (void *) (intptr_t) i) == 0);
+	}
+
+	/*
+	 *	Counters never go backwards, even when shards are
+	 *	freed while they're being read.
+	 */
+	while (atomic_load(&running) > 0) {
+		if (fr_metrics_read(out, "test", "instance=\"a\"", TEST_MAX) < 0) continue;
+
+		CHECK(out[TEST_COUNTER] >= last);
+		CHECK(out[TEST_COUNTER] <= (uint64_t) num_threads * num_updates);
+		CHECK(out[TEST_GAUGE] <= (uint64_t) num_threads);
+		last = out[TEST_COUNTER];
+		reads++;
+	}
+
+	for (i = 0; i < num_threads; i++) pthread_join(tid[i], NULL);
+
+	if (debug_lvl) printf("Read the metrics %d times while updating\n", reads);
+
+	/*
+	 *	Freed shards are added to the set.
+	 */
+	CHECK(fr_metrics_read(out, "test", "instance=\"a\"", TEST_MAX) == 0);
+	CHECK(out[TEST_COUNTER] == (uint64_t) num_threads * num_updates);
+	CHECK(out[TEST_GAUGE] == 0);
+	CHECK(out[TEST_HISTOGRAM] == (uint64_t) num_threads * num_updates);
+
+	/*
+	 *	The wrong number of metrics is an error.
+	 */
+	CHECK(fr_metrics_read(out, "test", "instance=\"a\"", TEST_MAX - 1) < 0);
+	CHECK(fr_metrics_read(out, "test", NULL, TEST_MAX) < 0);
+
+	memset(expected, 0, sizeof(expected));
+	for (i = 0; i < num_updates; i++) {
+		expected[times[i % NUM_TIMES].bucket] += num_threads;
+		sum_ns += times[i % NUM_TIMES].ns;
+	}
+	expected[FR_METRICS_HIST_BUCKETS] = (uint64_t) num_threads * num_updates;
+	expected[FR_METRICS_HIST_BUCKETS + 1] = sum_ns * num_threads;
+
+	memset(hist, 0, sizeof(hist));
+	fr_metrics_walk(metrics_hist_sum, hist);
+
+	for (i = 0, total = 0; i < FR_METRICS_HIST_SLOTS; i++) {
+		if (debug_lvl && (i < FR_METRICS_HIST_BUCKETS) && hist[i]) {
+			printf("Bucket %d: %" PRIu64 "\n", i, hist[i]);
+		}
+		CHECK(hist[i] == expected[i]);
+		if (i < FR_METRICS_HIST_BUCKETS) total += hist[i];
+	}
+	CHECK(total == hist[FR_METRICS_HIST_BUCKETS]);
+
+	text = fr_metrics_openmetrics(NULL, "freeradius_");
+	CHECK(text != NULL);
+	if (debug_lvl > 1) printf("%s", text);
+
+	CHECK(strstr(text, "# TYPE freeradius_test_requests counter\n") != NULL);
+	CHECK(strstr(text, "freeradius_test_active{instance=\"a\"} 0\n") != NULL);
+	CHECK(strstr(text, "freeradius_test_time_bucket{instance=\"a\",le=\"+Inf\"}") != NULL);
+	CHECK(strcmp(text + strlen(text) - 6, "# EOF\n") == 0);
+	talloc_free(text);
+
+	/*
+	 *	The set goes away with its last shard.
+	 */
+	for (i = 0; i < num_threads; i++) talloc_free(shards[i]);
+	CHECK(fr_metrics_read(out, "test", "instance=\"a\"", TEST_MAX) < 0);
+}
+
+/** Histogram bounds and quantiles
+ *
+ */
+static void test_quantile(void)
+{
+	uint64_t	value[FR_METRICS_HIST_SLOTS];
+
+	CHECK(fr_metrics_bucket_bound(0) == 1000);
+	CHECK(fr_metrics_bucket_bound(10) == 1024000);
+	CHECK(fr_metrics_bucket_bound(FR_METRICS_HIST_BUCKETS - 1) == UINT64_MAX);
+
+	memset(value, 0, sizeof(value));
+	CHECK(fr_metrics_quantile(value, 0.5) == 0);
+
+	value[2] = 90;
+	value[5] = 9;
+	value[FR_METRICS_HIST_BUCKETS - 1] = 1;
+	value[FR_METRICS_HIST_BUCKETS] = 100;
+
+	CHECK(fr_metrics_quantile(value, 0.5) == fr_metrics_bucket_bound(2));
+	CHECK(fr_metrics_quantile(value, 0.95) == fr_metrics_bucket_bound(5));
+	CHECK(fr_metrics_quantile(value, 1.0) == UINT64_MAX);
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "hm:n:x")) != -1) switch (c) {
+		case 'm':
+			num_updates = atoi(optarg);
+			if (num_updates <= 0) usage();
+			break;
+
+		case 'n':
+			num_threads = atoi(optarg);
+			if ((num_threads <= 0) || (num_threads > MAX_THREADS)) usage();
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	test_quantile();
+	test_threads();
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,6 @@
+TARGET := metrics_test
+
+SOURCES		:= metrics_test.c
+
+TGT_PREREQS	:= $(LIBFREERADIUS_SERVER) libfreeradius-io.a libfreeradius-util.a
+TGT_LDLIBS	:= $(LIBS)
@@ -0,0 +1,198 @@
+/*
+ * network_overload_test.c	Tests for detecting overloaded workers, and shedding packets
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * @copyright 2019 The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/io/network.h>
+#include <freeradius-devel/server/request.h>
+#include <freeradius-devel/server/rad_assert.h>
+#include <string.h>
+
+#ifdef HAVE_GETOPT_H
+#  include <getopt.h>
+#endif
+
+static int		debug_lvl = 0;
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: network_overload_test [OPTS]\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(EXIT_SUCCESS);
+}
+
+#define CHECK(_x) do { \
+	if (!(_x)) { \
+		fprintf(stderr, "%s[%d]: Check failed: %s\n", __FILE__, __LINE__, #_x); \
+		exit(EXIT_FAILURE); \
+	} \
+} while (0)
+
+#define MSEC ((fr_time_t) (NANOSEC / 1000))
+
+static fr_network_overload_t const overload = {
+	.shed = true,
+	.target = 5 * MSEC,
+	.interval = 100 * MSEC,
+	.priority = PRIORITY_LOW
+};
+
+static fr_time_t const start = 1000 * (fr_time_t) NANOSEC;
+
+/** Workers are only overloaded when the queue time stays above target for an interval
+ *
+ */
+static void test_update(void)
+{
+	fr_network_overload_state_t	state = { 0 };
+	fr_time_t			now = start;
+
+	/*
+	 *	Below target.
+	 */
+	CHECK(fr_network_overload_update(&state, &overload, 1 * MSEC, now) == 0);
+	CHECK(!state.overloaded);
+	CHECK(state.first_above == 0);
+
+	/*
+	 *	A short burst above target doesn't count.
+	 */
+	CHECK(fr_network_overload_update(&state, &overload, 10 * MSEC, now) == 0);
+	CHECK(state.first_above == now + overload.interval);
+
+	now += 50 * MSEC;
+	CHECK(fr_network_overload_update(&state, &overload, 20 * MSEC, now) == 0);
+	CHECK(!state.overloaded);
+
+	now += 10 * MSEC;
+	CHECK(fr_network_overload_update(&state, &overload, 4 * MSEC, now) == 0);
+	CHECK(state.first_above == 0);
+
+	/*
+	 *	The interval starts again after a packet gets through
+	 *	in less than target.
+	 */
+	now += 10 * MSEC;
+	CHECK(fr_network_overload_update(&state, &overload, 10 * MSEC, now) == 0);
+
+	now += overload.interval - 1;
+	CHECK(fr_network_overload_update(&state, &overload, 10 * MSEC, now) == 0);
+	CHECK(!state.overloaded);
+
+	/*
+	 *	A standing queue for a whole interval.
+	 */
+	now += 1;
+	CHECK(fr_network_overload_update(&state, &overload, 10 * MSEC, now) == 1);
+	CHECK(state.overloaded);
+
+	now += 500 * MSEC;
+	CHECK(fr_network_overload_update(&state, &overload, 50 * MSEC, now) == 0);
+	CHECK(state.overloaded);
+	CHECK(state.last_sample == now);
+
+	/*
+	 *	One packet below target is enough to recover.
+	 */
+	now += 1 * MSEC;
+	CHECK(fr_network_overload_update(&state, &overload, overload.target - 1, now) == -1);
+	CHECK(!state.overloaded);
+	CHECK(state.first_above == 0);
+
+	CHECK(fr_network_overload_update(&state, &overload, 0, now) == 0);
+
+	if (debug_lvl) printf("Update checks passed\n");
+}
+
+/** Only sheddable packets sent to overloaded workers are discarded
+ *
+ */
+static void test_shed(void)
+{
+	fr_network_overload_state_t	state = { 0 };
+	fr_network_overload_t		no_shed = overload;
+	fr_time_t			now = start;
+
+	no_shed.shed = false;
+
+	CHECK(!fr_network_overload_shed(&state, &overload, PRIORITY_LOW, now));
+
+	CHECK(fr_network_overload_update(&state, &overload, 10 * MSEC, now) == 0);
+	now += overload.interval;
+	CHECK(fr_network_overload_update(&state, &overload, 10 * MSEC, now) == 1);
+
+	/*
+	 *	Shedding is off, or the packet has a higher priority.
+	 */
+	CHECK(!fr_network_overload_shed(&state, &no_shed, PRIORITY_LOW, now));
+	CHECK(!fr_network_overload_shed(&state, &overload, PRIORITY_NORMAL, now));
+	CHECK(!fr_network_overload_shed(&state, &overload, PRIORITY_HIGH, now));
+	CHECK(!fr_network_overload_shed(&state, &overload, PRIORITY_NOW, now));
+
+	/*
+	 *	Packets at or below the priority are shed.
+	 */
+	CHECK(fr_network_overload_shed(&state, &overload, PRIORITY_LOW, now));
+	CHECK(fr_network_overload_shed(&state, &overload, PRIORITY_LOW - 1, now));
+
+	now += overload.interval;
+	CHECK(fr_network_overload_shed(&state, &overload, PRIORITY_LOW, now));
+
+	/*
+	 *	Nothing has been heard from the worker for an
+	 *	interval, so one packet is let through.
+	 */
+	now += 1;
+	CHECK(!fr_network_overload_shed(&state, &overload, PRIORITY_LOW, now));
+	CHECK(state.last_sample == now);
+	CHECK(fr_network_overload_shed(&state, &overload, PRIORITY_LOW, now));
+
+	/*
+	 *	Its reply shows the queue has drained.
+	 */
+	now += 1 * MSEC;
+	CHECK(fr_network_overload_update(&state, &overload, 1 * MSEC, now) == -1);
+	CHECK(!fr_network_overload_shed(&state, &overload, PRIORITY_LOW, now));
+
+	if (debug_lvl) printf("Shed checks passed\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "hx")) != -1) switch (c) {
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	test_update();
+	test_shed();
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,6 @@
+TARGET := network_overload_test
+
+SOURCES		:= network_overload_test.c
+
+TGT_PREREQS	:= $(LIBFREERADIUS_SERVER) libfreeradius-io.a libfreeradius-util.a
+TGT_LDLIBS	:= $(LIBS)
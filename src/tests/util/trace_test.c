@@ -0,0 +1,324 @@
+/*
+ * trace_test.c	Tests for the per-thread trace rings
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * @copyright 2019 The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/util/trace.h>
+#include <freeradius-devel/server/rad_assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+
+#ifdef HAVE_GETOPT_H
+#  include <getopt.h>
+#endif
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+static int		debug_lvl = 0;
+
+/**********************************************************************/
+typedef struct rad_request REQUEST;
+REQUEST *request_alloc(UNUSED TALLOC_CTX *ctx);
+void request_verify(UNUSED char const *file, UNUSED int line, UNUSED REQUEST *request);
+void talloc_const_free(void const *ptr);
+
+REQUEST *request_alloc(UNUSED TALLOC_CTX *ctx)
+{
+	return NULL;
+}
+
+void request_verify(UNUSED char const *file, UNUSED int line, UNUSED REQUEST *request)
+{
+}
+
+void talloc_const_free(void const *ptr)
+{
+	void *tmp;
+	if (!ptr) return;
+
+	memcpy(&tmp, &ptr, sizeof(tmp));
+	talloc_free(tmp);
+}
+/**********************************************************************/
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: trace_test [OPTS]\n");
+	fprintf(stderr, "  -n <dumps>             Number of times to dump while events are written.\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(EXIT_SUCCESS);
+}
+
+#define CHECK(_x) do { \
+	if (!(_x)) { \
+		fprintf(stderr, "%s[%d]: Check failed: %s\n", __FILE__, __LINE__, #_x); \
+		exit(EXIT_FAILURE); \
+	} \
+} while (0)
+
+static int			num_dumps = 50;
+
+static atomic_uint_fast64_t	written;
+static atomic_bool		stop;
+
+/** Record an event whose name is its ID, so torn events can be spotted
+ *
+ */
+static void trace_test_event(uint64_t id, uint64_t when)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), "%" PRIu64, id);
+	fr_trace_event(id, when, FR_TRACE_INSTANT, "test", name);
+}
+
+/** Dump the events, and check they're the ones we recorded
+ *
+ * Events from each thread must have consecutive IDs, with no gaps, and
+ * each one must be intact.
+ *
+ * @return the number of events dumped.
+ */
+static size_t trace_test_check(uint64_t *first, uint64_t *last)
+{
+	char		*buff = NULL;
+	size_t		len = 0, count = 0;
+	FILE		*fp;
+	char		*line, *next;
+	uint64_t	prev = 0;
+
+	fp = open_memstream(&buff, &len);
+	CHECK(fp != NULL);
+	CHECK(fr_trace_dump(fp, FR_TRACE_FORMAT_PERF) == 0);
+	fclose(fp);
+
+	for (line = buff; line && *line; line = next) {
+		unsigned int	pid, tid;
+		uint64_t	id, name;
+
+		next = strchr(line, '\n');
+		if (next) *next++ = '\0';
+
+		CHECK(sscanf(line, "radiusd %u/%u [000] %*[0-9.]: freeradius:test_event: request=%" SCNu64
+			     " name=\"%" SCNu64 "\"", &pid, &tid, &id, &name) == 4);
+		CHECK(id == name);
+		if (count) CHECK(id == (prev + 1));
+
+		if (!count) *first = id;
+		prev = id;
+		count++;
+	}
+	*last = prev;
+
+	free(buff);
+
+	return count;
+}
+
+/** Old events are overwritten, and events before the start time are ignored
+ *
+ */
+static void test_wrap(void)
+{
+	uint64_t	i, first = 0, last = 0;
+	size_t		count;
+
+	fr_trace_start(1, 1);
+
+	/*
+	 *	Less than a ring's worth.
+	 */
+	for (i = 0; i < 100; i++) trace_test_event(i, i + 1);
+
+	count = trace_test_check(&first, &last);
+	CHECK(count == 100);
+	CHECK(first == 0);
+	CHECK(last == 99);
+
+	/*
+	 *	Once the ring has wrapped, only the newest events
+	 *	are printed.  The slot after the head may be being
+	 *	written, so it's never printed.
+	 */
+	for (; i < (FR_TRACE_RING_SIZE * 2) + 100; i++) trace_test_event(i, i + 1);
+
+	count = trace_test_check(&first, &last);
+	CHECK(count == FR_TRACE_RING_SIZE - 1);
+	CHECK(first == i - FR_TRACE_RING_SIZE + 1);
+	CHECK(last == i - 1);
+
+	/*
+	 *	Restarting hides everything recorded before.  The
+	 *	tests which follow rely on this.
+	 */
+	fr_trace_start(i + 1, 1);
+	count = trace_test_check(&first, &last);
+	CHECK(count == 0);
+
+	if (debug_lvl) printf("Ring wrap checks passed\n");
+}
+
+static void *trace_writer(void *arg)
+{
+	uint64_t	start = *(uint64_t *) arg;
+	uint64_t	i;
+
+	for (i = 0; !atomic_load(&stop); i++) {
+		trace_test_event(i, start + i);
+		atomic_store(&written, i + 1);
+	}
+
+	return NULL;
+}
+
+/** Dump the ring while the owning thread is overwriting it
+ *
+ */
+static void test_concurrent(void)
+{
+	pthread_t	tid;
+	uint64_t	start = (FR_TRACE_RING_SIZE * 4), first, last, prev_last = 0;
+	size_t		count;
+	int		i;
+
+	fr_trace_start(start, 1);
+
+	atomic_store(&written, 0);
+	atomic_store(&stop, false);
+	CHECK(pthread_create(&tid, NULL, trace_writer, &start) == 0);
+
+	for (i = 0; i < num_dumps; i++) {
+		/*
+		 *	Make sure the ring wraps between dumps.
+		 */
+		while (atomic_load(&written) < prev_last + (FR_TRACE_RING_SIZE * 2)) sched_yield();
+
+		/*
+		 *	If the writer laps the ring while we're
+		 *	copying it, every event is discarded.
+		 */
+		count = trace_test_check(&first, &last);
+		CHECK(count < FR_TRACE_RING_SIZE);
+		if (!count) {
+			if (debug_lvl) printf("Dumped no events\n");
+			continue;
+		}
+		CHECK(last >= prev_last);
+		prev_last = last;
+
+		if (debug_lvl) printf("Dumped %zu events, %" PRIu64 " to %" PRIu64 "\n", count, first, last);
+	}
+
+	atomic_store(&stop, true);
+	pthread_join(tid, NULL);
+
+	if (debug_lvl) printf("Concurrent dump checks passed\n");
+}
+
+#define CHROME_START	((uint64_t) 1 << 40)
+
+static atomic_int	chrome_state;
+
+static void *trace_chrome_writer(UNUSED void *arg)
+{
+	fr_trace_event(1, CHROME_START + 1, FR_TRACE_BEGIN, "test", "request");
+	atomic_store(&chrome_state, 1);
+
+	while (atomic_load(&chrome_state) == 1) sched_yield();
+
+	return NULL;
+}
+
+/** The same ID on two threads is two different async events
+ *
+ */
+static void test_chrome_id(void)
+{
+	pthread_t	tid;
+	char		*buff = NULL, *p, *q;
+	size_t		len = 0;
+	FILE		*fp;
+
+	/*
+	 *	After everything the other tests recorded.
+	 */
+	fr_trace_start(CHROME_START, 1);
+	fr_trace_event(1, CHROME_START, FR_TRACE_BEGIN, "test", "request");
+
+	atomic_store(&chrome_state, 0);
+	CHECK(pthread_create(&tid, NULL, trace_chrome_writer, NULL) == 0);
+	while (atomic_load(&chrome_state) == 0) sched_yield();
+
+	fp = open_memstream(&buff, &len);
+	CHECK(fp != NULL);
+	CHECK(fr_trace_dump(fp, FR_TRACE_FORMAT_CHROME) == 0);
+	fclose(fp);
+
+	atomic_store(&chrome_state, 2);
+	pthread_join(tid, NULL);
+
+	if (debug_lvl > 1) printf("%s", buff);
+
+	p = strstr(buff, "\"id\":\"");
+	CHECK(p != NULL);
+	q = strstr(p + 1, "\"id\":\"");
+	CHECK(q != NULL);
+	CHECK(strstr(q + 1, "\"id\":\"") == NULL);
+	CHECK(strncmp(p, q, strcspn(p + 6, "\"") + 7) != 0);
+
+	free(buff);
+
+	if (debug_lvl) printf("Chrome ID checks passed\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "hn:x")) != -1) switch (c) {
+		case 'n':
+			num_dumps = atoi(optarg);
+			if (num_dumps <= 0) usage();
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	test_wrap();
+	test_concurrent();
+	test_chrome_id();
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,263 @@
+/*
+ * vector_cache_test.c	Tests for the EAP-SIM/AKA vector cache
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * @copyright 2019 The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/server/rad_assert.h>
+#include <freeradius-devel/sim/base.h>
+#include <string.h>
+#include <pthread.h>
+
+#ifdef HAVE_GETOPT_H
+#  include <getopt.h>
+#endif
+
+static int		debug_lvl = 0;
+
+/**********************************************************************/
+typedef struct rad_request REQUEST;
+REQUEST *request_alloc(UNUSED TALLOC_CTX *ctx);
+void request_verify(UNUSED char const *file, UNUSED int line, UNUSED REQUEST *request);
+void talloc_const_free(void const *ptr);
+
+REQUEST *request_alloc(UNUSED TALLOC_CTX *ctx)
+{
+	return NULL;
+}
+
+void request_verify(UNUSED char const *file, UNUSED int line, UNUSED REQUEST *request)
+{
+}
+
+void talloc_const_free(void const *ptr)
+{
+	void *tmp;
+	if (!ptr) return;
+
+	memcpy(&tmp, &ptr, sizeof(tmp));
+	talloc_free(tmp);
+}
+/**********************************************************************/
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: vector_cache_test [OPTS]\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(EXIT_SUCCESS);
+}
+
+#define CHECK(_x) do { \
+	if (!(_x)) { \
+		fprintf(stderr, "%s[%d]: Check failed: %s\n", __FILE__, __LINE__, #_x); \
+		exit(EXIT_FAILURE); \
+	} \
+} while (0)
+
+#define BATCH_SIZE	4
+#define THREADS		8
+#define PER_THREAD	1024
+
+static uint8_t const ki[] = { 0x46, 0x5b, 0x5c, 0xe8, 0xb1, 0x99, 0xb4, 0x9f,
+			      0xaa, 0x5f, 0x0a, 0x2e, 0xe2, 0x38, 0xa6, 0xbc };
+static uint8_t const opc[] = { 0xcd, 0x63, 0xcb, 0x71, 0x95, 0x4a, 0x9f, 0x4e,
+			       0x48, 0xa5, 0x99, 0x4e, 0x37, 0xa0, 0x2b, 0xaf };
+static uint8_t const amf[] = { 0xb9, 0xb9 };
+
+/** Get a quintuplet, and check the SQN in the AUTN is the one we were told
+ *
+ * AUTN is (SQN ^ AK) || AMF || MAC-A.
+ */
+static uint64_t vector_get(fr_sim_vector_cache_t *vc, uint64_t sqn)
+{
+	fr_sim_vector_umts_t	v;
+	uint64_t		sqn_out;
+	uint64_t		autn_sqn = 0;
+	size_t			i;
+
+	CHECK(fr_sim_vector_cache_umts(&v, &sqn_out, vc, ki, opc, amf, sqn) == 0);
+
+	for (i = 0; i < SIM_VECTOR_UMTS_AK_SIZE; i++) autn_sqn = (autn_sqn << 8) | (v.autn[i] ^ v.ak[i]);
+	CHECK(autn_sqn == sqn_out);
+	CHECK(memcmp(v.autn + SIM_VECTOR_UMTS_AK_SIZE, amf, sizeof(amf)) == 0);
+
+	if (debug_lvl) printf("SQN %" PRIu64 " -> %" PRIu64 "\n", sqn, sqn_out);
+
+	return sqn_out;
+}
+
+/** Increasing SQNs are served from one entry, and never go backwards
+ *
+ */
+static void test_sqn_increasing(void)
+{
+	fr_sim_vector_cache_t	*vc;
+	uint64_t		sqn, last, entries, hits, misses, evictions;
+	int			i;
+
+	vc = fr_sim_vector_cache_alloc(NULL, BATCH_SIZE, 16, 60);
+	CHECK(vc != NULL);
+
+	/*
+	 *	The SQN the caller has grows by one for each
+	 *	authentication.  Every vector in a batch is
+	 *	used before a new batch is generated.
+	 */
+	last = vector_get(vc, 32);
+	CHECK(last == 32);
+	for (i = 1; i < (BATCH_SIZE * 3); i++) {
+		sqn = vector_get(vc, 32 + i);
+		CHECK(sqn == (32 + (uint64_t)i));
+		CHECK(sqn > last);
+		last = sqn;
+	}
+
+	fr_sim_vector_cache_stats(vc, &entries, &hits, &misses, &evictions);
+	CHECK(entries == 1);
+	CHECK(misses == 3);
+	CHECK(hits == ((BATCH_SIZE * 3) - 3));
+
+	/*
+	 *	A caller which doesn't track the SQN gets the
+	 *	rest of the sequence, not a replay.
+	 */
+	sqn = vector_get(vc, 0);
+	CHECK(sqn > last);
+	last = sqn;
+
+	/*
+	 *	The SQN moves past the cached vectors, e.g. after
+	 *	a resync.  They'd be rejected by the SIM, so a new
+	 *	batch starts at the SQN we were given.
+	 */
+	sqn = vector_get(vc, last + 100);
+	CHECK(sqn == (last + 100));
+	last = sqn;
+
+	sqn = vector_get(vc, last + 1);
+	CHECK(sqn == (last + 1));
+
+	fr_sim_vector_cache_stats(vc, &entries, &hits, &misses, &evictions);
+	CHECK(entries == 1);
+
+	talloc_free(vc);
+
+	if (debug_lvl) printf("Increasing SQN checks passed\n");
+}
+
+/** A lower SQN than the cache has reached never rewinds the sequence
+ *
+ */
+static void test_sqn_exhausted(void)
+{
+	fr_sim_vector_cache_t	*vc;
+	uint64_t		sqn, last = 0;
+	int			i;
+
+	vc = fr_sim_vector_cache_alloc(NULL, BATCH_SIZE, 16, 60);
+	CHECK(vc != NULL);
+
+	for (i = 0; i < (BATCH_SIZE * 2) + 1; i++) {
+		sqn = vector_get(vc, 1);
+		if (i > 0) CHECK(sqn == (last + 1));
+		last = sqn;
+	}
+
+	talloc_free(vc);
+
+	if (debug_lvl) printf("Exhausted batch checks passed\n");
+}
+
+typedef struct {
+	fr_sim_vector_cache_t	*vc;
+	uint64_t		sqn[PER_THREAD];
+} sqn_thread_t;
+
+static void *sqn_thread(void *arg)
+{
+	sqn_thread_t	*t = arg;
+	int		i;
+
+	for (i = 0; i < PER_THREAD; i++) t->sqn[i] = vector_get(t->vc, 0);
+
+	return NULL;
+}
+
+static int sqn_cmp(void const *one, void const *two)
+{
+	uint64_t const *a = one, *b = two;
+
+	return (*a > *b) - (*a < *b);
+}
+
+/** Concurrent misses for the same subscriber never hand out the same SQN
+ *
+ */
+static void test_sqn_concurrent(void)
+{
+	fr_sim_vector_cache_t	*vc;
+	pthread_t		tid[THREADS];
+	sqn_thread_t		t[THREADS];
+	uint64_t		all[THREADS * PER_THREAD];
+	int			i;
+
+	vc = fr_sim_vector_cache_alloc(NULL, BATCH_SIZE, 16, 60);
+	CHECK(vc != NULL);
+
+	for (i = 0; i < THREADS; i++) {
+		t[i].vc = vc;
+		CHECK(pthread_create(&tid[i], NULL, sqn_thread, &t[i]) == 0);
+	}
+
+	for (i = 0; i < THREADS; i++) {
+		CHECK(pthread_join(tid[i], NULL) == 0);
+		memcpy(&all[i * PER_THREAD], t[i].sqn, sizeof(t[i].sqn));
+	}
+
+	qsort(all, NUM_ELEMENTS(all), sizeof(all[0]), sqn_cmp);
+	for (i = 1; i < (int)NUM_ELEMENTS(all); i++) CHECK(all[i] != all[i - 1]);
+
+	talloc_free(vc);
+
+	if (debug_lvl) printf("Concurrent SQN checks passed\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "hx")) != -1) switch (c) {
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	test_sqn_increasing();
+	test_sqn_exhausted();
+	test_sqn_concurrent();
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,8 @@
+TARGET := vector_cache_test
+
+SOURCES		:= vector_cache_test.c
+
+SRC_INCDIRS	:= ${top_srcdir}/src/modules/rlm_eap/ ${top_srcdir}/src/modules/rlm_eap/lib/base/
+
+TGT_PREREQS	:= $(LIBFREERADIUS_SERVER) libfreeradius-io.a libfreeradius-util.a libfreeradius-eap.a libfreeradius-eap-sim.a
+TGT_LDLIBS	:= $(LIBS) $(OPENSSL_LIBS)